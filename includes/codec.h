@@ -0,0 +1,91 @@
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include <util.h>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace rds
+{
+    /* written next to compressed bytes, the values never change */
+    enum class CodecId : char
+    {
+        NONE = 0,
+        LZFSE = 1
+    };
+
+    /* scratch buffers taken for one call and given back, so a codec allocates
+       one per call running at the same time instead of one per call */
+    class ScratchPool
+    {
+    public:
+        constexpr static std::size_t IDLE_MAX = 64;
+
+        class Lease
+        {
+        private:
+            ScratchPool *pool_;
+            std::vector<std::uint8_t> buffer_;
+
+        public:
+            auto Data() -> std::uint8_t *
+            {
+                return buffer_.data();
+            }
+
+            Lease(ScratchPool *pool, std::vector<std::uint8_t> buffer) : pool_(pool), buffer_(std::move(buffer)) {}
+            ~Lease();
+            Lease(const Lease &) = delete;
+            auto operator=(const Lease &) -> Lease & = delete;
+        };
+
+    private:
+        std::size_t size_;
+        std::mutex mtx_;
+        std::vector<std::vector<std::uint8_t>> idle_;
+        std::size_t allocated_{0};
+
+    public:
+        auto Take() -> Lease;
+        /* buffers ever allocated, those in use included */
+        auto Allocated() -> std::size_t;
+
+        explicit ScratchPool(std::size_t size) : size_(size) {}
+    };
+
+    class Codec
+    {
+    public:
+        virtual auto Id() const -> CodecId = 0;
+        virtual auto Name() const -> const char * = 0;
+        /* at most capacity bytes into dst, 0 when they do not fit */
+        virtual auto Encode(std::uint8_t *dst, std::size_t capacity, const std::uint8_t *src, std::size_t size) const -> std::size_t = 0;
+        /* at most capacity bytes into dst, how many were written */
+        virtual auto Decode(std::uint8_t *dst, std::size_t capacity, const std::uint8_t *src, std::size_t size) const -> std::size_t = 0;
+        virtual ~Codec() = default;
+    };
+
+    /* nothing for an id no codec has */
+    auto GetCodec(CodecId id) -> const Codec *;
+
+    /* what a compressed result must achieve to be kept */
+    struct CompressPolicy
+    {
+        std::size_t min_size_{1};   // smaller inputs are not tried
+        double max_ratio_{1};       // compressed size over the original, kept only below
+        CodecId codec_{CodecId::LZFSE};
+    };
+
+    /* nothing when data is too small or does not shrink enough. Only the
+       compressed bytes are returned, the caller keeps the original size */
+    auto Compress(std::string_view data, const CompressPolicy &policy = {}) -> std::optional<std::string>;
+
+    /* nothing unless data inflates to exactly size bytes */
+    auto Decompress(std::string_view data, std::size_t size, CodecId codec = CodecId::LZFSE) -> std::optional<std::string>;
+} // namespace rds
+
+#endif
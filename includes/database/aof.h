@@ -3,10 +3,164 @@
 
 #include <database/db.h>
 #include <database/rdb.h>
+#include <database/disk.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string_view>
+#include <thread>
 
 namespace rds
 {
-    auto AOFLoad(std::deque<char> *source) -> std::list<std::unique_ptr<Db>>;
+    /*
+    "AOF" {[varint db][varint len][request]}
+    "AOP" [a whole v2 rdb] {[varint db][varint len][request]}
+    "AOP" [varint n][n databases as in a v1 rdb] {...}, written before rdb v2
+    a request is the json array of a write command as the client sent it, or
+    the form it was rewritten to when its effect depends on time or chance.
+    The second form is what BGREWRITEAOF leaves, the databases it starts with
+    go to databases. Each record is handed to apply, a truncated last record
+    is left out. Returns how many bytes hold whole records, 0 when the magic
+    is missing or the databases are corrupted
+     */
+    auto AOFLoad(Cursor *source, std::list<std::unique_ptr<Db>> *databases,
+                 const std::function<void(int, std::string_view)> &apply) -> std::size_t;
+
+    /* appends the records of write commands to the aof. Feed and Commit are
+       called by the executor only: Feed buffers a record, Commit writes the
+       buffer once for all the writes of a batch, before any of their replies
+       leave. ALWAYS fsyncs in Commit, EVERYSEC from a thread of its own once
+       a second, NO leaves it to the kernel.
+       While a rewrite runs, every record Commit writes is also kept for the
+       rewritten file, which replaces the aof once it has them all */
+    class AofWriter
+    {
+    private:
+        int fd_{-1};
+        std::string filename_;
+        AppendFsync policy_;
+        std::string buffer_;
+        std::size_t mark_{0}; // where the record of the running command goes
+        std::atomic_bool failing_{false};     // the last Commit could not write the buffer
+        std::atomic_bool sync_failed_{false}; // an fsync failed, until a rewrite replaces the file
+
+        mutable std::mutex mtx_; // fd_, buffer_ and the rewrite, against Commit
+        std::size_t files_{0};
+        bool rewriting_{false};
+        std::string rewrite_buffer_;
+        std::size_t rewrite_from_{0}; // buffer_ up to here was fed before the fork, or is kept already
+
+        std::atomic<std::size_t> size_{0};
+        std::atomic<std::size_t> synced_{0};
+        std::atomic<std::size_t> fsyncs_{0};
+
+        std::mutex sync_mtx_;
+        std::condition_variable sync_condv_;
+        bool stopping_{false};
+        std::thread sync_thread_;
+
+        void SyncEverySecond();
+        auto SyncLocked() -> bool;
+        void SyncFailed();
+
+    public:
+        /* before each command */
+        void Begin();
+        /* the record of the running command, ahead of what it fed while running */
+        void FeedCommand(int db, std::string_view request);
+        /* a write made on the side, such as a pop served to a blocked client */
+        void Feed(int db, std::string_view request);
+        /* false when the buffer could not be written, it is kept for the next
+           Commit, or when ALWAYS could not fsync it */
+        auto Commit() -> bool;
+        /* the last Commit wrote everything and no fsync ever failed on this
+           file. Writes are refused until it is so again: a failed fsync may
+           have dropped pages the kernel no longer holds as dirty, only a
+           rewritten file is trusted again */
+        auto Healthy() const -> bool;
+        auto Pending() const -> bool;
+        /* bytes in the file, bytes known to be on disk */
+        auto Size() const -> std::size_t;
+        auto Synced() const -> std::size_t;
+        auto Fsyncs() const -> std::size_t;
+        auto Policy() const -> AppendFsync;
+        auto FileName() const -> const std::string &;
+
+        /* right before the fork, with ForkFence held so no command is halfway.
+           The records fed after it are kept */
+        void StartRewrite();
+        /* the records kept so far, they leave the writer */
+        auto TakeRewriteBuffer() -> std::string;
+        /* with ForkFence held: appends the rest to fd, open on the rewritten
+           file at path, and renames it over the aof, the writer goes on with
+           fd. false when the aof was left as it was */
+        auto FinishRewrite(int fd, const std::string &path) -> bool;
+        void AbortRewrite();
+
+        /* opens filename for appending, writing the magic into an empty file */
+        AofWriter(const std::string &filename, AppendFsync policy);
+        ~AofWriter();
+        CLASS_DECLARE_uncopyable(AofWriter);
+    };
+
+    /* BGREWRITEAOF: a forked child writes the databases as the preamble of a
+       new aof, the writer keeps what is committed meanwhile, and a thread of
+       its own appends that to the new file in passes, the last one with
+       commands held, before it takes the place of the aof */
+    class AofRewriter
+    {
+    public:
+        constexpr static std::size_t TAIL_BYTES = 1 << 16; // left for the pass that holds commands
+        constexpr static int DRAIN_PASSES = 16;
+        constexpr static std::int64_t REWRITE_RETRY_SEC = 5;
+
+    private:
+        DatabaseEncoder encode_;
+        AofWriter *aof_;
+        std::size_t min_size_;
+        std::size_t percent_;
+
+        std::mutex mtx_;
+        std::condition_variable condv_;
+        bool requested_{false};
+        bool stopping_{false};
+
+        std::atomic_bool in_progress_{false};
+        std::atomic_bool last_ok_{true};
+        std::atomic<std::int64_t> last_try_{0};
+        std::atomic<std::int64_t> last_duration_ms_{-1};
+        std::atomic<std::size_t> rewrites_{0};
+        std::atomic<std::size_t> base_size_;
+
+        std::thread thread_;
+
+        void Run();
+        auto ForkAndRewrite() -> bool;
+        auto Swap(const std::string &path) -> bool;
+
+    public:
+        /* false when a rewrite is already running or waiting */
+        auto Request() -> bool;
+        /* the aof is at least min_size and grew by percent since the last rewrite */
+        auto Due() const -> bool;
+        auto InProgress() const -> bool;
+        auto LastOk() const -> bool;
+        auto LastDurationMs() const -> std::int64_t;
+        auto Rewrites() const -> std::size_t;
+        /* size of the aof after the last rewrite, or at start */
+        auto BaseSize() const -> std::size_t;
+
+        /* encode streams the databases as the preamble, percent 0 rewrites only on request */
+        AofRewriter(DatabaseEncoder encode, AofWriter *aof, std::size_t min_size, std::size_t percent);
+        ~AofRewriter();
+        CLASS_DECLARE_uncopyable(AofRewriter);
+    };
+
+    /* the aof of the running server, nothing when it is off */
+    void SetGlobalAof(AofWriter *aof);
+    auto GetGlobalAof() -> AofWriter *;
 } // namespace rds
 
-#endif
\ No newline at end of file
+#endif
@@ -4,11 +4,17 @@
 #include <util.h>
 #include <objects/object.h>
 #include <objects/str.h>
+#include <atomic>
 #include <map>
 #include <unordered_map>
+#include <vector>
+#include <functional>
 
 namespace rds
 {
+    /* coarse clock in seconds behind the access time of keys, advanced by the idle sweeps */
+    auto AccessClock() -> std::atomic<std::uint32_t> &;
+
     class KeyValue
     {
     private:
@@ -16,13 +22,14 @@ namespace rds
         Str key_;
         std::shared_ptr<Object> value_;
         std::optional<std::size_t> expire_time_us_;
+        mutable std::atomic<std::uint32_t> last_access_{AccessClock().load(std::memory_order_relaxed)};
 
         auto InternalPrefixEncode() const -> std::string;
 
     public:
         auto Encode() const -> std::string;
 
-        void Decode(std::deque<char> *);
+        void Decode(Cursor *);
 
         auto MakeExpireAt(std::size_t time_stamp)
         {
@@ -50,6 +57,18 @@ namespace rds
 
         auto GetValue() const -> std::weak_ptr<Object>;
 
+        void Touch() const
+        {
+            last_access_.store(AccessClock().load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+
+        auto IdleSeconds() const -> std::uint32_t
+        {
+            return AccessClock().load(std::memory_order_relaxed) - last_access_.load(std::memory_order_relaxed);
+        }
+
+        void SetValue(std::shared_ptr<Object>);
+
         auto GetKey() const -> Str;
 
         KeyValue(const Str &, std::shared_ptr<Object>);
@@ -63,7 +82,22 @@ namespace rds
         KeyValue &operator=(const KeyValue &);
     };
 
-    auto ExpireDecode(std::deque<char> &) -> std::optional<std::size_t>;
+    /* what precedes the chunks of a database in the rdb */
+    struct DbSectionHeader
+    {
+        int number_;
+        std::size_t keys_;
+        std::size_t chunks_;
+        bool varint_; // sizes are varints, not fixed width
+    };
+
+    /* one database of the rdb split in chunks of keys, each decodes on its own */
+    struct DbSection
+    {
+        int number_;
+        std::size_t keys_;
+        std::vector<std::pair<std::size_t, Cursor>> chunks_; // key count and bytes of each chunk
+    };
 
     class Timer;
 
@@ -77,8 +111,13 @@ namespace rds
         mutable std::shared_mutex latch_;
         static int number;
         constexpr static char SELECT_DB_ = 's';
+        constexpr static char SELECT_DB_CHUNKED_ = 'S';
+        constexpr static char SELECT_DB_VARINT_ = 'V';
+        constexpr static std::size_t CHUNK_KEYS_ = 4096;
         int number_;
         std::unordered_map<Str, std::shared_ptr<KeyValue>, decltype(&StrHash)> key_value_map_{0xff, StrHash};
+        std::atomic<std::size_t> dirty_{0};
+        std::size_t compress_cursor_{0}; // the bucket CompressIdle goes on from
 
     public:
         auto NewStr(const Str &) -> std::shared_ptr<Object>;
@@ -86,20 +125,67 @@ namespace rds
         auto NewSet(const Str &) -> std::shared_ptr<Object>;
         auto NewZSet(const Str &) -> std::shared_ptr<Object>;
         auto NewHash(const Str &) -> std::shared_ptr<Object>;
+        auto NewHyperLogLog(const Str &) -> std::shared_ptr<Object>;
+        auto NewBloom(const Str &) -> std::shared_ptr<Object>;
+        auto NewStream(const Str &) -> std::shared_ptr<Object>;
+        auto NewTimeSeries(const Str &) -> std::shared_ptr<Object>;
+        auto NewVectorSet(const Str &) -> std::shared_ptr<Object>;
+        auto NewCountMinSketch(const Str &) -> std::shared_ptr<Object>;
+        auto NewTopK(const Str &) -> std::shared_ptr<Object>;
 
         auto Del(const Str &) -> std::size_t;
         auto Get(const Str &) const -> std::weak_ptr<Object>;
+        /* replace (or create) the value but keep the expire time, used to swap shared integers in and out */
+        void SetValue(const Str &, std::shared_ptr<Object>);
 
         auto Expire(const Str &, std::size_t) -> std::unique_ptr<Timer>;
 
+        /* keys a CompressIdle call looks at, the sweep goes on where it stopped */
+        constexpr static std::size_t COMPRESS_SCAN_KEYS = 1024;
+
+        /* compresses the string values of at least min_len bytes nobody read
+           or wrote for idle_sec, looking at about budget keys from where the
+           previous call stopped. returns how many were compressed */
+        auto CompressIdle(std::size_t min_len, std::size_t idle_sec, std::size_t budget = COMPRESS_SCAN_KEYS) -> std::size_t;
+
         auto WhenExpire(const Str &) -> std::string;
 
         auto Save() const -> std::string;
 
-        void Load(std::deque<char> *);
+        /* encodes a chunk of keys at a time into out, never the whole database */
+        void Save(const std::function<void(std::string_view)> &out) const;
+
+        void Load(Cursor *);
+
+        /* whether the database at source was saved with a chunk index */
+        static auto IsChunked(const Cursor &source) -> bool;
+
+        /* the header and chunk index of a chunked database, source is left past its chunks */
+        static auto ReadSection(Cursor *source) -> DbSection;
+        /* the same read in pieces, for a source that is not all in memory:
+           the header, then before each chunk its key count and byte length */
+        static auto ReadSectionHeader(Cursor *source) -> DbSectionHeader;
+        static auto ReadChunkHeader(Cursor *source, const DbSectionHeader &header) -> std::pair<std::size_t, std::size_t>;
+
+        /* decodes keys on any thread without touching a Db, those expired before now_us are dropped */
+        static auto DecodeChunk(Cursor *source, std::size_t keys, std::size_t now_us) -> std::vector<std::shared_ptr<KeyValue>>;
+
+        /* takes the decoded chunks of a database, the map is sized once for all of them */
+        void Adopt(int number, std::size_t keys, std::vector<std::vector<std::shared_ptr<KeyValue>>> parts);
 
         auto Size() const -> std::size_t;
 
+        /* writes made to this database since it was created, never reset */
+        void MarkDirty(std::size_t n = 1)
+        {
+            dirty_.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        auto Dirty() const -> std::size_t
+        {
+            return dirty_.load(std::memory_order_relaxed);
+        }
+
         auto Number() const -> int;
 
         Db();
@@ -1,28 +1,140 @@
 #ifndef __DISK_H__
 #define __DISK_H__
 
-#include <deque>
-#include <fstream>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <string_view>
+#include <memory>
+#include <functional>
 #include <configure.h>
 
 namespace rds
 {
+    /* where the bytes of a save go, in order */
+    using ByteSink = std::function<void(std::string_view)>;
+
+    /* read-only mapping of a whole file, advised for one sequential pass */
+    class MappedFile
+    {
+    private:
+        void *addr_{nullptr};
+        std::size_t size_{0};
+
+    public:
+        auto Bytes() const -> std::string_view;
+        explicit MappedFile(const std::string &filename);
+        ~MappedFile();
+        MappedFile(const MappedFile &) = delete;
+        auto operator=(const MappedFile &) -> MappedFile & = delete;
+    };
+
+    /* makes a rename of or into path durable */
+    void SyncDirectory(const std::string &path);
+
+    /* what a writer did, for logs and INFO-like replies */
+    struct WriterStats
+    {
+        std::size_t bytes_{0};
+        std::size_t flushes_{0};      // buffers handed to the kernel
+        std::size_t syncs_{0};        // fdatasync calls
+        std::int64_t write_us_{0};    // spent in write and fdatasync by the flusher
+        std::int64_t stall_us_{0};    // Append waited for the flusher
+        std::int64_t started_us_{0};
+
+        /* bytes per second since the writer was made */
+        auto Throughput() const -> double;
+    };
+
+    /* writes to a temporary file next to the target through two page aligned
+       buffers: Append fills one while a thread of the writer's own hands the
+       other to the kernel, so encoding and compressing go on during the I/O.
+       Commit flushes, fdatasyncs and renames it over the target, so readers
+       see either the old file or the whole new one. Dropped without Commit,
+       the temporary file is removed. Write errors throw std::system_error,
+       from the Append or Commit after them */
+    class FileWriter
+    {
+    public:
+        constexpr static std::size_t BUFFER_BYTES = 1 << 20;
+        constexpr static std::size_t BUFFER_ALIGN = 4096;
+
+    private:
+        struct FreeBuffer
+        {
+            void operator()(char *p) const;
+        };
+        using Buffer = std::unique_ptr<char[], FreeBuffer>;
+
+        int fd_{-1};
+        std::string target_;
+        std::string path_;
+        Buffer front_; // filled by Append
+        std::size_t front_size_{0};
+        Buffer back_; // written by the flusher
+        std::size_t back_size_{0};
+        bool committed_{false};
+
+        std::mutex mtx_;
+        std::condition_variable condv_;
+        bool back_full_{false};
+        bool stopping_{false};
+        int error_{0}; // errno of the first failed write
+        WriterStats stats_;
+        std::thread flusher_;
+
+        void Flusher();
+        /* gives the front buffer to the flusher once the back one is written */
+        void Handoff();
+        /* everything appended is in the file */
+        void Drain();
+        void Stop();
+        void ThrowIfFailed(const char *what);
+
+    public:
+        void Append(std::string_view bytes);
+        /* what was appended reaches the disk, the file stays temporary */
+        void Sync();
+        void Commit();
+        /* bytes appended so far */
+        auto Written() const -> std::size_t;
+        auto Stats() -> WriterStats;
+
+        explicit FileWriter(const std::string &target);
+        ~FileWriter();
+        FileWriter(const FileWriter &) = delete;
+        auto operator=(const FileWriter &) -> FileWriter & = delete;
+    };
+
+    /* the file of the databases. Write appends through a descriptor kept open
+       for the life of the manager */
     class FileManager
     {
     private:
         std::string filename_;
+        int fd_{-1};
+
+        void Open();
 
     public:
-        void Write(const std::string &bytes);
-        void Write(std::string &&bytes);
-        auto LoadAndExport() -> std::deque<char>;
+        /* write errors throw std::system_error */
+        void Write(std::string_view bytes);
+        /* fdatasync of what was written */
+        void Sync();
+        /* empty bytes when the file is empty or can not be mapped */
+        auto Map() const -> std::unique_ptr<MappedFile>;
         void Truncate();
+        /* a writer whose Commit replaces this file */
+        auto Rewrite() const -> std::unique_ptr<FileWriter>;
         auto Name() const -> std::string;
         auto Size() const -> std::size_t;
         void Change(const std::string &filename);
         FileManager(const std::string &filename = "dump.db");
         ~FileManager();
+        FileManager(const FileManager &) = delete;
+        auto operator=(const FileManager &) -> FileManager & = delete;
     };
 
 } // namespace rds
@@ -5,13 +5,157 @@
 #include <optional>
 #include <util.h>
 #include <list>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <database/disk.h>
+#include <codec.h>
 
 namespace rds
 {
-    auto RDBLoad(std::deque<char> *source) -> std::list<std::unique_ptr<Db>>;
+    /* streams every database into the sink */
+    using DatabaseEncoder = std::function<void(const ByteSink &)>;
 
-    void RDBSave(std::vector<std::string> database_sources, FileManager *dump_file);
+    constexpr char RDB_VERSION = 2;
+    constexpr std::size_t RDB_BLOCK_BYTES = 64 << 10;
+
+    /*
+    v2: "RDB" [RDB_VERSION] {[varint raw len][CodecId][varint stored len][stored][crc64 of stored]} [varint 0]
+    the payload, the databases one after the other, is cut into blocks of
+    RDB_BLOCK_BYTES compressed on their own. v1: "RDB" followed by the
+    payload as it is, read until the end of the file
+    Empty databases for an empty file. ok, when given, tells an empty or
+    whole file from a corrupted one, which also gives empty databases
+     */
+    auto RDBLoad(Cursor *source, bool *ok = nullptr) -> std::list<std::unique_ptr<Db>>;
+
+    /* the databases after the magic in either version, a v2 rdb ends with
+       its last block. Throws when they are corrupted */
+    auto RDBDecodeStream(Cursor *source) -> std::list<std::unique_ptr<Db>>;
+
+    /* at most count databases of a payload, throws when they are corrupted */
+    auto RDBDecode(Cursor *source, std::size_t count = SIZE_MAX) -> std::list<std::unique_ptr<Db>>;
+
+    /* the payload of the blocks after the version byte, checked and inflated */
+    auto RDBReadBlocks(Cursor *source) -> std::string;
+
+    /* the payload of a v2 rdb read as it is consumed: a batch of blocks at a
+       time is checked and inflated on a few threads, and only the bytes not
+       consumed yet stay in memory. source is left past the end mark once
+       the payload is all consumed */
+    class RdbBlockReader
+    {
+    public:
+        constexpr static std::size_t BATCH_BLOCKS = 64;
+
+    private:
+        Cursor *source_;
+        bool end_{false};
+        std::string window_;
+        std::size_t pos_{0};
+
+        /* inflates the next batch of blocks after what is left of the window */
+        void Fill();
+
+    public:
+        /* at least n bytes ahead, fewer only at the end of the payload */
+        auto Peek(std::size_t n) -> Cursor;
+        void Skip(std::size_t n);
+        /* every byte of the payload consumed */
+        auto Done() -> bool;
+
+        explicit RdbBlockReader(Cursor *source) : source_(source) {}
+        CLASS_DECLARE_uncopyable(RdbBlockReader);
+    };
+
+    /* cuts a payload into blocks, each one goes to out once full */
+    class RdbBlockWriter
+    {
+    private:
+        ByteSink out_;
+        CompressPolicy policy_;
+        std::string raw_;
+
+        void Flush();
+
+    public:
+        void Append(std::string_view bytes);
+        /* the last block and the end mark */
+        void Finish();
+
+        /* blocks that miss the policy are stored raw */
+        explicit RdbBlockWriter(ByteSink out, CompressPolicy policy = {});
+        CLASS_DECLARE_uncopyable(RdbBlockWriter);
+    };
+
+    /* a whole v2 rdb of what encode gives */
+    void RDBWrite(const ByteSink &out, const DatabaseEncoder &encode);
+
+    /* forks with ForkFence held so no command or timer is halfway, at_fork runs
+       just before. The child runs child and exits with its result, the parent
+       waits for it. what names the job in the log */
+    auto ForkAndWait(const std::string &what, const std::function<void()> &at_fork, const std::function<bool()> &child) -> bool;
+
+    /* encode streams the databases into a temporary file that replaces dump_file
+       once complete, false when the save failed and the old file was kept */
+    auto RDBSave(const DatabaseEncoder &encode, FileManager *dump_file) -> bool;
+
+    /* snapshots written by a forked child from its copy-on-write image of the
+       databases. A thread of its own forks under ForkFence, so commands and
+       timers wait only for the fork, then reaps the child */
+    class RdbSaver
+    {
+    public:
+        constexpr static std::int64_t SAVE_RETRY_SEC = 5;
+
+    private:
+        DatabaseEncoder encode_;
+        std::function<std::size_t()> dirty_;
+        FileManager *dump_file_;
+        std::vector<std::pair<std::size_t, std::size_t>> rules_;
+
+        std::mutex mtx_;
+        std::condition_variable condv_;
+        bool requested_{false};
+        bool stopping_{false};
+
+        std::atomic_bool in_progress_{false};
+        std::atomic_bool last_ok_{true};
+        std::atomic<std::int64_t> last_save_;
+        std::atomic<std::int64_t> last_duration_ms_{-1};
+        std::atomic<std::size_t> saves_{0};
+        std::atomic<std::int64_t> last_try_{0};
+        std::atomic<std::size_t> dirty_at_fork_{0};
+        std::atomic<std::size_t> dirty_saved_{0};
+
+        std::thread thread_;
+
+        void Run();
+        auto ForkAndSave() -> bool;
+
+    public:
+        /* false when a save is already running or waiting */
+        auto Request() -> bool;
+        /* whether one of the save rules is met, a failed save is retried after SAVE_RETRY_SEC */
+        auto Due() const -> bool;
+        /* writes made since the last successful save started */
+        auto Changes() const -> std::size_t;
+        auto InProgress() const -> bool;
+        /* unix time of the last successful save, the start time before any */
+        auto LastSave() const -> std::int64_t;
+        auto LastOk() const -> bool;
+        auto LastDurationMs() const -> std::int64_t;
+        auto Saves() const -> std::size_t;
+
+        /* dirty counts every write so far, it is read while forking */
+        RdbSaver(DatabaseEncoder encode, std::function<std::size_t()> dirty, FileManager *dump_file,
+                 std::vector<std::pair<std::size_t, std::size_t>> rules = {});
+        ~RdbSaver();
+        CLASS_DECLARE_uncopyable(RdbSaver);
+    };
 } // namespace rds
 
 #endif
\ No newline at end of file
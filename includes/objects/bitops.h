@@ -0,0 +1,37 @@
+#ifndef __BITOPS_H__
+#define __BITOPS_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace rds
+{
+    enum class BitOperation
+    {
+        AND,
+        OR,
+        XOR,
+        NOT
+    };
+
+    /* byte kernels behind the bitmap commands, the AVX2/POPCNT versions are
+       chosen once at first use when the cpu supports them */
+    auto PopCount(const std::uint8_t *data, std::size_t len) -> std::size_t;
+
+    /* index of the first byte that differs from skip, len if there is none */
+    auto FindFirstByteNot(const std::uint8_t *data, std::size_t len, std::uint8_t skip) -> std::size_t;
+
+    /* shorter sources are zero padded, the result has the length of the longest one */
+    auto BitOp(BitOperation op, const std::vector<std::string_view> &sources) -> std::string;
+
+    /* dst[i] = max(dst[i], src[i]), the register merge of HyperLogLog */
+    void MaxBytes(std::uint8_t *dst, const std::uint8_t *src, std::size_t len);
+
+    auto BitOpsImplementation() -> const char *;
+
+} // namespace rds
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef __BLOOM_H__
+#define __BLOOM_H__
+
+#include <objects/object.h>
+#include <util.h>
+#include <cstdint>
+#include <vector>
+
+namespace rds
+{
+    /* a scalable bloom filter: once the newest layer holds its capacity another
+       one is stacked with expansion times the capacity and half the error rate.
+       every layer is cache blocked, an element only touches one 64-byte block */
+    class BloomFilter final : public Object
+    {
+    public:
+        constexpr static double DEFAULT_ERROR_RATE = 0.01;
+        constexpr static std::size_t DEFAULT_CAPACITY = 100;
+        constexpr static std::uint32_t DEFAULT_EXPANSION = 2;
+
+        struct alignas(64) Block
+        {
+            std::uint64_t words_[8];
+        };
+
+    private:
+        struct Layer
+        {
+            std::size_t capacity_;
+            std::size_t count_;
+            int hashes_;
+            std::vector<Block> blocks_;
+        };
+
+        double error_rate_{DEFAULT_ERROR_RATE};
+        std::uint32_t expansion_{DEFAULT_EXPANSION};
+        bool scaling_{true};
+        std::vector<Layer> layers_;
+
+        static auto MakeLayer(std::size_t capacity, double error_rate) -> Layer;
+        static auto LayerTest(const Layer &layer, std::uint64_t hash) -> bool;
+        static void LayerSet(Layer *layer, std::uint64_t hash);
+        auto Contains(std::uint64_t hash) const -> bool;
+        auto Insert(std::uint64_t hash) -> int; // 1 added, 0 present, -1 full
+
+    public:
+        /* false if the filter already holds elements */
+        auto Reserve(double error_rate, std::size_t capacity, std::uint32_t expansion, bool scaling) -> bool;
+        /* hashes the whole batch before touching the layers, 1 added, 0 maybe present, -1 full */
+        auto Add(const std::vector<std::string> &elements) -> std::vector<int>;
+        auto Exists(const std::vector<std::string> &elements) const -> std::vector<bool>;
+        auto Capacity() const -> std::size_t;
+        auto Size() const -> std::size_t;
+        auto Layers() const -> std::size_t;
+        auto Bytes() const -> std::size_t;
+
+        auto GetObjectType() const -> ObjectType override;
+        auto EncodeValue() const -> std::string override;
+        void DecodeValue(Cursor *) override;
+
+        CLASS_DECLARE_special_copy_move(BloomFilter);
+    };
+
+} // namespace rds
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef __CMS_H__
+#define __CMS_H__
+
+#include <objects/object.h>
+#include <util.h>
+#include <cstdint>
+#include <vector>
+
+namespace rds
+{
+    /* a count-min sketch: depth rows of width saturating counters, an item
+       bumps one counter per row and its estimate is the smallest of them */
+    class CountMinSketch final : public Object
+    {
+    private:
+        std::uint32_t width_{0};
+        std::uint32_t depth_{0};
+        std::uint64_t total_{0};
+        std::vector<std::uint32_t> counters_; // row major
+
+        auto Cell(std::uint32_t row, std::uint64_t hash) const -> std::size_t;
+
+    public:
+        void InitByDim(std::uint32_t width, std::uint32_t depth);
+        /* overestimates stay under error * total with the given probability of failing */
+        void InitByProb(double error, double probability);
+        /* hashes the whole batch before touching the rows, the estimates after the update */
+        auto IncrBy(const std::vector<std::pair<std::string, std::uint32_t>> &items) -> std::vector<std::uint32_t>;
+        auto Query(const std::vector<std::string> &items) const -> std::vector<std::uint32_t>;
+        /* this = sum(weight * source), false if the dimensions differ */
+        auto Merge(const std::vector<const CountMinSketch *> &sources, const std::vector<std::int64_t> &weights) -> bool;
+        auto Width() const -> std::uint32_t;
+        auto Depth() const -> std::uint32_t;
+        auto Total() const -> std::uint64_t;
+
+        auto GetObjectType() const -> ObjectType override;
+        auto EncodeValue() const -> std::string override;
+        void DecodeValue(Cursor *) override;
+
+        CLASS_DECLARE_special_copy_move(CountMinSketch);
+    };
+
+} // namespace rds
+
+#endif
@@ -3,18 +3,94 @@
 
 #include <unordered_map>
 #include <vector>
+#include <functional>
+#include <atomic>
+#include <string_view>
 #include <objects/object.h>
 #include <objects/str.h>
 #include <util.h>
 
 namespace rds
 {
+    /* a field name stored once for every hash that uses it */
+    struct FieldName
+    {
+        std::string name_;
+        std::atomic<std::uint32_t> refs_{0};
+    };
+
+    /* counted reference into the shared field names, the name is dropped with its last reference */
+    class FieldRef
+    {
+    private:
+        FieldName *field_{nullptr};
+
+    public:
+        /* nothing when the name is too long or the table is full */
+        static auto Intern(std::string_view name) -> std::optional<FieldRef>;
+        /* number of distinct shared names */
+        static auto Names() -> std::size_t;
+
+        auto Name() const -> const std::string &
+        {
+            return field_->name_;
+        }
+
+        auto operator==(const FieldRef &rhs) const -> bool
+        {
+            return field_ == rhs.field_;
+        }
+
+        auto Key() const -> const void *
+        {
+            return field_;
+        }
+
+        FieldRef() = default;
+        ~FieldRef();
+        FieldRef(const FieldRef &);
+        FieldRef(FieldRef &&) noexcept;
+        auto operator=(const FieldRef &) -> FieldRef &;
+        auto operator=(FieldRef &&) noexcept -> FieldRef &;
+    };
+
+    constexpr std::size_t FIELD_NAME_MAX_LEN = 64;
+    constexpr std::size_t FIELD_NAMES_MAX = 1 << 20;
+
+    /* field names written once per database in the rdb and referenced by index
+       afterwards. Db::Save and Db::Load keep one open on their thread, a hash
+       encoded without it carries its own names */
+    class HashFieldSession
+    {
+    private:
+        HashFieldSession *outer_;
+
+    public:
+        std::unordered_map<const void *, std::size_t> written_;
+        std::vector<std::pair<FieldRef, std::string>> read_; // the name is kept when it could not be shared
+
+        static auto Current() -> HashFieldSession *;
+
+        HashFieldSession();
+        ~HashFieldSession();
+        HashFieldSession(const HashFieldSession &) = delete;
+        auto operator=(const HashFieldSession &) -> HashFieldSession & = delete;
+    };
 
     class Hash final : public Object
     {
+    public:
+        /* a hash keeps at most this many fields by shared name, the rest go to data_map_ */
+        constexpr static std::size_t SHARED_FIELDS_MAX = 64;
+
     private:
+        std::vector<std::pair<FieldRef, Str>> shared_fields_;
         std::unordered_map<Str, Str, decltype(&StrHash)> data_map_{0xff, StrHash};
 
+        auto FindShared(std::string_view name) -> std::vector<std::pair<FieldRef, Str>>::iterator;
+        auto Find(const Str &key) -> Str *;
+        void Insert(std::string_view name, const Str &key, Str value);
+
     public:
         void Set(const Str &key, Str value);
         auto Get(const Str &) -> Str;
@@ -22,16 +98,20 @@ namespace rds
         void Del(const Str &);
         auto Len() -> std::size_t;
         auto GetAll() -> std::vector<std::pair<Str, Str>>;
+        /* every field and value in place under the read latch */
+        void ForEach(const std::function<void(std::string_view, const Str &)> &f) const;
         auto IncrBy(const Str &key, int delta) -> std::string;
         auto DecrBy(const Str &key, int delta) -> std::string;
+        /* fields kept by shared name */
+        auto SharedFields() const -> std::size_t;
 
         auto GetObjectType() const -> ObjectType override;
         auto EncodeValue() const -> std::string override;
-        void DecodeValue(std::deque<char> *) override;
+        void DecodeValue(Cursor *) override;
 
         CLASS_DECLARE_special_copy_move(Hash);
     };
 
 } // namespace rds
 
-#endif
\ No newline at end of file
+#endif
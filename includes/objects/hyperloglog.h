@@ -0,0 +1,58 @@
+#ifndef __HYPERLOGLOG_H__
+#define __HYPERLOGLOG_H__
+
+#include <objects/object.h>
+#include <util.h>
+#include <cstdint>
+#include <vector>
+#include <array>
+
+namespace rds
+{
+    /* 2^14 registers of 6 bits. sparse keeps only the non-zero registers as
+       sorted (index << 8 | value) words and turns dense past HLL_SPARSE_MAX_BYTES */
+    class HyperLogLog final : public Object
+    {
+    public:
+        constexpr static int P = 14;
+        constexpr static int Q = 64 - P;
+        constexpr static std::size_t REGISTERS = 1 << P;
+        constexpr static int REGISTER_BITS = 6;
+        constexpr static std::size_t DENSE_BYTES = REGISTERS * REGISTER_BITS / 8;
+        constexpr static std::size_t HLL_SPARSE_MAX_BYTES = 3000;
+
+        /* one byte per register, the layout used for merging */
+        using Registers = std::array<std::uint8_t, REGISTERS>;
+
+    private:
+        EncodingType encoding_type_{EncodingType::HLL_SPARSE};
+        std::vector<std::uint32_t> sparse_;
+        std::vector<std::uint8_t> dense_; // DENSE_BYTES + 1, the last byte keeps the reads in bounds
+        mutable std::optional<std::uint64_t> cached_card_;
+
+        auto DenseGet(std::size_t index) const -> std::uint8_t;
+        void DenseSet(std::size_t index, std::uint8_t value);
+        auto SetRegister(std::size_t index, std::uint8_t value) -> bool;
+        void Promote();
+
+    public:
+        auto Add(const std::string &element) -> bool; // true if a register changed
+        auto Count() const -> std::uint64_t;
+        void MergeInto(Registers *registers) const;
+        void Import(const Registers &registers);
+
+        auto GetEncodingType() const -> EncodingType;
+
+        auto GetObjectType() const -> ObjectType override;
+        auto EncodeValue() const -> std::string override;
+        void DecodeValue(Cursor *) override;
+
+        CLASS_DECLARE_special_copy_move(HyperLogLog);
+    };
+
+    /* estimated cardinality of the union, a null source counts as empty */
+    auto HyperLogLogCount(const std::vector<const HyperLogLog *> &sources) -> std::uint64_t;
+
+} // namespace rds
+
+#endif
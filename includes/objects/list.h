@@ -27,7 +27,7 @@ namespace rds
 
         auto GetObjectType() const -> ObjectType override;
         auto EncodeValue() const -> std::string override;
-        void DecodeValue(std::deque<char> *) override;
+        void DecodeValue(Cursor *) override;
 
         CLASS_DECLARE_special_copy_move(List);
     };
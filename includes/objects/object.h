@@ -17,6 +17,13 @@ namespace rds
         SET,
         ZSET,
         EXPIRE_ENTRY,
+        HYPERLOGLOG,
+        BLOOM,
+        STREAM,
+        TIMESERIES,
+        VECTORSET,
+        CMS,
+        TOPK,
         UNKNOWN
     };
 
@@ -46,6 +53,27 @@ namespace rds
         case ObjectType::EXPIRE_ENTRY:
             ret = 6;
             break;
+        case ObjectType::HYPERLOGLOG:
+            ret = 7;
+            break;
+        case ObjectType::BLOOM:
+            ret = 8;
+            break;
+        case ObjectType::STREAM:
+            ret = 9;
+            break;
+        case ObjectType::TIMESERIES:
+            ret = 10;
+            break;
+        case ObjectType::VECTORSET:
+            ret = 11;
+            break;
+        case ObjectType::CMS:
+            ret = 12;
+            break;
+        case ObjectType::TOPK:
+            ret = 13;
+            break;
         case ObjectType::UNKNOWN:
             assert(0);
             break;
@@ -79,6 +107,27 @@ namespace rds
         case 6:
             ret_typ = ObjectType::EXPIRE_ENTRY;
             break;
+        case 7:
+            ret_typ = ObjectType::HYPERLOGLOG;
+            break;
+        case 8:
+            ret_typ = ObjectType::BLOOM;
+            break;
+        case 9:
+            ret_typ = ObjectType::STREAM;
+            break;
+        case 10:
+            ret_typ = ObjectType::TIMESERIES;
+            break;
+        case 11:
+            ret_typ = ObjectType::VECTORSET;
+            break;
+        case 12:
+            ret_typ = ObjectType::CMS;
+            break;
+        case 13:
+            ret_typ = ObjectType::TOPK;
+            break;
         default:
             assert(0);
             break;
@@ -95,6 +144,8 @@ namespace rds
         ARRAY,   // zip list
         HASHMAP, // ht
         RBTREE,  // skip list
+        HLL_SPARSE,
+        HLL_DENSE,
         UNKNOWN
     };
 
@@ -124,6 +175,12 @@ namespace rds
         case EncodingType::RBTREE:
             ret = 6;
             break;
+        case EncodingType::HLL_SPARSE:
+            ret = 7;
+            break;
+        case EncodingType::HLL_DENSE:
+            ret = 8;
+            break;
         case EncodingType::UNKNOWN:
             assert(0);
             break;
@@ -157,6 +214,12 @@ namespace rds
         case 6:
             etyp = EncodingType::RBTREE;
             break;
+        case 7:
+            etyp = EncodingType::HLL_SPARSE;
+            break;
+        case 8:
+            etyp = EncodingType::HLL_DENSE;
+            break;
         default:
             assert(0);
             break;
@@ -181,7 +244,7 @@ namespace rds
             return {};
         };
 
-        virtual void DecodeValue(std::deque<char> *){};
+        virtual void DecodeValue(Cursor *){};
 
         virtual auto GetObjectType() const -> ObjectType
         {
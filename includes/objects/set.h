@@ -5,6 +5,8 @@
 #include <util.h>
 #include <objects/str.h>
 #include <unordered_set>
+#include <functional>
+#include <vector>
 
 namespace rds
 {
@@ -20,6 +22,8 @@ namespace rds
         auto Card() const -> std::size_t;
         auto IsMember(const Str &) const -> bool;
         auto Members() const -> std::vector<Str>;
+        /* every member in place under the read latch */
+        void ForEach(const std::function<void(const Str &)> &f) const;
         auto RandMember() const -> Str;
         auto Pop() -> Str;
         auto Rem(const Str &) -> bool; // number of removed-members
@@ -28,7 +32,7 @@ namespace rds
 
         auto GetObjectType() const -> ObjectType override;
         auto EncodeValue() const -> std::string override;
-        void DecodeValue(std::deque<char> *) override;
+        void DecodeValue(Cursor *) override;
 
         CLASS_DECLARE_special_copy_move(Set);
     };
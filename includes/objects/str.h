@@ -2,11 +2,27 @@
 #define __STR_H__
 
 #include <objects/object.h>
+#include <objects/bitops.h>
 #include <string>
+#include <string_view>
+#include <cstdint>
 #include <configure.h>
 
 namespace rds
 {
+    class Str;
+
+    /* preallocated, immutable objects for 0 <= value < SHARED_INTEGERS, nullptr otherwise */
+    constexpr std::int64_t SHARED_INTEGERS = 10000;
+
+    auto SharedInteger(std::int64_t value) -> std::shared_ptr<Str>;
+
+    /* bytes kept by the cache of inflated STR_COMPRESS values */
+    constexpr std::size_t STR_INFLATE_CACHE_BYTES = 8 * 1024 * 1024;
+
+    /* BITOP over the bytes of every source, missing keys are passed as nullptr */
+    auto StrBitOp(BitOperation op, const std::vector<const Str *> &sources) -> std::string;
+
     class Str final : public Object
     {
         friend auto operator==(const Str &a, const Str &b) -> bool;
@@ -19,24 +35,65 @@ namespace rds
 
         friend auto StrLess(const Str &a, const Str &b) -> bool;
 
+        friend auto SharedInteger(std::int64_t value) -> std::shared_ptr<Str>;
+
+        friend auto StrBitOp(BitOperation op, const std::vector<const Str *> &sources) -> std::string;
+
     private:
-        std::string data_;
-        EncodingType encoding_type_;
+        /* what View points into when the bytes are not in data_ */
+        struct ViewBuf
+        {
+            char digits_[24];
+            std::shared_ptr<const std::string> inflated_;
+        };
+
+        std::string data_;          // STR_RAW, lzfse output for STR_COMPRESS
+        std::int64_t int_data_{0};  // INT, data_ stays empty; the original size for STR_COMPRESS
+        EncodingType encoding_type_{EncodingType::STR_RAW};
+        bool shared_{false};
+
+        void InternalSet(std::string);
+        auto View(ViewBuf *buf) const -> std::string_view;
+        void ToRaw();
+        void Normalize(); // short strings may have become canonical integers
 
     public:
         auto GetRaw() const -> std::string;
+        /* hands f the bytes under the latch instead of a copy */
+        template <typename F>
+        void Visit(F &&f) const
+        {
+            ReadGuard rg(latch_);
+            ViewBuf buf;
+            f(View(&buf));
+        }
+        auto GetInt() const -> std::optional<std::int64_t>;
         void Set(std::string);
         auto Append(std::string) -> std::size_t;
-        auto IncrBy(int) -> std::string;
-        auto DecrBy(int) -> std::string;
+        auto IncrBy(std::int64_t) -> std::string;
+        auto DecrBy(std::int64_t) -> std::string;
+        auto IncrByFloat(long double) -> std::string;
         auto Len() const -> std::size_t;
         auto Empty() const -> bool;
+        auto IsShared() const -> bool;
+
+        /* bitmap access, bit 0 is the most significant bit of the first byte */
+        auto SetBit(std::size_t offset, bool bit) -> int;
+        auto GetBit(std::size_t offset) const -> int;
+        auto BitCount(std::int64_t start, std::int64_t end, bool bit_unit) const -> std::size_t;
+        auto BitPos(bool bit, std::int64_t start, std::optional<std::int64_t> end, bool bit_unit) const -> std::int64_t;
+        auto GetBits(std::size_t offset, int width, bool is_signed) const -> std::int64_t;
+        void SetBits(std::size_t offset, int width, std::uint64_t value);
 
         auto GetEncodingType() const -> EncodingType;
 
+        /* keeps a raw value of at least min_len bytes compressed in memory, reads
+           inflate it through a small shared cache and writes turn it raw again */
+        auto CompressInPlace(std::size_t min_len) -> bool;
+
         auto GetObjectType() const -> ObjectType override;
         auto EncodeValue() const -> std::string override;
-        void DecodeValue(std::deque<char> *) override;
+        void DecodeValue(Cursor *) override;
 
         CLASS_DECLARE_special_copy_move(Str);
 
@@ -49,45 +106,62 @@ namespace rds
         {
             ReadGuard(a.ExposeLatch());
             ReadGuard(b.ExposeLatch());
-            return a.data_ == b.data_;
         }
         else if (&a > &b)
         {
             ReadGuard(b.ExposeLatch());
             ReadGuard(a.ExposeLatch());
-            return a.data_ == b.data_;
         }
-        return true;
+        else
+        {
+            return true;
+        }
+        if (a.encoding_type_ != b.encoding_type_)
+        {
+            if (a.encoding_type_ != EncodingType::STR_COMPRESS && b.encoding_type_ != EncodingType::STR_COMPRESS)
+            {
+                return false;
+            }
+            Str::ViewBuf abuf, bbuf;
+            return a.View(&abuf) == b.View(&bbuf);
+        }
+        if (a.encoding_type_ == EncodingType::INT)
+        {
+            return a.int_data_ == b.int_data_;
+        }
+        return a.data_ == b.data_;
     }
     inline auto operator<(const Str &a, const Str &b) -> bool
     {
+        Str::ViewBuf abuf, bbuf;
         if (&a < &b)
         {
             ReadGuard(a.ExposeLatch());
             ReadGuard(b.ExposeLatch());
-            return a.data_ < b.data_;
+            return a.View(&abuf) < b.View(&bbuf);
         }
         else if (&a > &b)
         {
             ReadGuard(b.ExposeLatch());
             ReadGuard(a.ExposeLatch());
-            return a.data_ < b.data_;
+            return a.View(&abuf) < b.View(&bbuf);
         }
         return false;
     }
     inline auto operator<=(const Str &a, const Str &b) -> bool
     {
+        Str::ViewBuf abuf, bbuf;
         if (&a < &b)
         {
             ReadGuard(a.ExposeLatch());
             ReadGuard(b.ExposeLatch());
-            return a.data_ <= b.data_;
+            return a.View(&abuf) <= b.View(&bbuf);
         }
         else if (&a > &b)
         {
             ReadGuard(b.ExposeLatch());
             ReadGuard(a.ExposeLatch());
-            return a.data_ <= b.data_;
+            return a.View(&abuf) <= b.View(&bbuf);
         }
         return true;
     }
@@ -105,13 +179,24 @@ namespace rds
         return a < b;
     }
 
+    /* an INT Str never equals a STR_RAW one, so each encoding hashes its own representation */
     inline auto StrHash(const Str &s) -> std::size_t
     {
         static std::hash<std::string> hash_;
+        static std::hash<std::int64_t> int_hash_;
         ReadGuard rg(s.ExposeLatch());
+        if (s.encoding_type_ == EncodingType::INT)
+        {
+            return int_hash_(s.int_data_);
+        }
+        if (s.encoding_type_ == EncodingType::STR_COMPRESS)
+        {
+            Str::ViewBuf buf;
+            return std::hash<std::string_view>{}(s.View(&buf));
+        }
         return hash_(s.data_);
     }
 
 } // namespace rds
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,88 @@
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include <objects/object.h>
+#include <util.h>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <vector>
+
+namespace rds
+{
+    struct StreamID
+    {
+        std::uint64_t ms_{0};
+        std::uint64_t seq_{0};
+
+        auto ToString() const -> std::string;
+        /* "ms-seq" or "ms", a missing seq is 0 or max depending on which end of a range it is */
+        static auto Parse(const std::string &raw, bool range_end) -> std::optional<StreamID>;
+        static auto Max() -> StreamID;
+    };
+
+    inline auto operator<(const StreamID &a, const StreamID &b) -> bool
+    {
+        return a.ms_ < b.ms_ || (a.ms_ == b.ms_ && a.seq_ < b.seq_);
+    }
+    inline auto operator==(const StreamID &a, const StreamID &b) -> bool
+    {
+        return a.ms_ == b.ms_ && a.seq_ == b.seq_;
+    }
+    inline auto operator<=(const StreamID &a, const StreamID &b) -> bool
+    {
+        return !(b < a);
+    }
+
+    struct StreamEntry
+    {
+        StreamID id_;
+        std::vector<std::string> fields_; // field, value, field, value ...
+    };
+
+    /* entries are packed into blocks of varints, the blocks are ordered by
+       their first id so a range read is a tree lookup plus one block scan */
+    class Stream final : public Object
+    {
+    public:
+        constexpr static std::size_t BLOCK_MAX_ENTRIES = 128;
+        constexpr static std::size_t BLOCK_MAX_BYTES = 4096;
+
+    private:
+        struct Block
+        {
+            StreamID last_;
+            std::size_t count_;
+            std::string data_;
+        };
+
+        std::map<StreamID, Block> blocks_;
+        std::size_t length_{0};
+        StreamID last_id_;
+
+        static void AppendEntry(const StreamID &first, const StreamID &id, const std::vector<std::string> &fields, std::string *data);
+        static auto UnpackBlock(const StreamID &first, const Block &block) -> std::vector<StreamEntry>;
+
+    public:
+        /* id must be greater than the last one, a missing id is generated from the clock */
+        auto Add(std::optional<StreamID> id, const std::vector<std::string> &fields) -> std::optional<StreamID>;
+        auto Range(const StreamID &start, const StreamID &end,
+                   std::size_t count = std::numeric_limits<std::size_t>::max()) const -> std::vector<StreamEntry>;
+        auto RevRange(const StreamID &end, const StreamID &start,
+                      std::size_t count = std::numeric_limits<std::size_t>::max()) const -> std::vector<StreamEntry>;
+        auto Len() const -> std::size_t;
+        auto LastID() const -> StreamID;
+        /* approx only drops whole blocks, number of entries removed */
+        auto Trim(std::size_t max_len, bool approx) -> std::size_t;
+        auto Blocks() const -> std::size_t;
+
+        auto GetObjectType() const -> ObjectType override;
+        auto EncodeValue() const -> std::string override;
+        void DecodeValue(Cursor *) override;
+
+        CLASS_DECLARE_special_copy_move(Stream);
+    };
+
+} // namespace rds
+
+#endif
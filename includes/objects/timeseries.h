@@ -0,0 +1,79 @@
+#ifndef __TIMESERIES_H__
+#define __TIMESERIES_H__
+
+#include <objects/object.h>
+#include <util.h>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <vector>
+
+namespace rds
+{
+    enum class Aggregation
+    {
+        AVG,
+        MIN,
+        MAX,
+        SUM
+    };
+
+    /* samples are appended in time order into gorilla compressed chunks:
+       delta-of-delta timestamps and xor'ed float bits, a regular series
+       with a steady value costs about two bits per sample */
+    class TimeSeries final : public Object
+    {
+    public:
+        constexpr static std::size_t CHUNK_MAX_BITS = 4096 * 8;
+
+        using Sample = std::pair<std::int64_t, double>;
+
+        struct Chunk
+        {
+            std::int64_t first_ts_{0};
+            std::int64_t last_ts_{0};
+            std::size_t count_{0};
+            // encoder state, needed to append the next sample
+            std::int64_t last_delta_{0};
+            std::uint64_t last_value_{0};
+            std::uint8_t leading_{64};
+            std::uint8_t trailing_{0};
+            std::size_t bits_{0};
+            std::vector<std::uint64_t> words_;
+        };
+
+    private:
+        std::int64_t retention_ms_{0}; // 0 keeps everything
+        std::deque<Chunk> chunks_;
+        std::size_t total_{0};
+
+        static void ChunkAppend(Chunk *chunk, std::int64_t ts, double value);
+        template <typename F>
+        static void ChunkScan(const Chunk &chunk, std::int64_t from, std::int64_t to, F &&f);
+        /* decodes the samples in [from, to] chunk by chunk, the caller holds the latch */
+        template <typename F>
+        void Scan(std::int64_t from, std::int64_t to, F &&f) const;
+        void DropExpired();
+
+    public:
+        /* timestamps must grow, false for an older or duplicate one */
+        auto Add(std::int64_t ts, double value) -> bool;
+        auto Range(std::int64_t from, std::int64_t to) const -> std::vector<Sample>;
+        /* buckets are aligned to multiples of bucket_ms and keyed by their start */
+        auto Aggregate(std::int64_t from, std::int64_t to, Aggregation agg, std::int64_t bucket_ms) const -> std::vector<Sample>;
+        void SetRetention(std::int64_t retention_ms);
+        auto Retention() const -> std::int64_t;
+        auto Size() const -> std::size_t;
+        auto Chunks() const -> std::size_t;
+        auto Bytes() const -> std::size_t;
+
+        auto GetObjectType() const -> ObjectType override;
+        auto EncodeValue() const -> std::string override;
+        void DecodeValue(Cursor *) override;
+
+        CLASS_DECLARE_special_copy_move(TimeSeries);
+    };
+
+} // namespace rds
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef __TOPK_H__
+#define __TOPK_H__
+
+#include <objects/object.h>
+#include <util.h>
+#include <cstdint>
+#include <vector>
+
+namespace rds
+{
+    /* HeavyKeeper: every row bucket holds a fingerprint and a count, a colliding
+       item decays the count with probability decay^count so small flows are
+       evicted and heavy ones stay. the k heaviest items are kept in a min-heap */
+    class TopK final : public Object
+    {
+    public:
+        constexpr static std::uint32_t DEFAULT_WIDTH = 8;
+        constexpr static std::uint32_t DEFAULT_DEPTH = 7;
+        constexpr static double DEFAULT_DECAY = 0.9;
+        constexpr static std::uint32_t MAX_K = 1 << 24;
+
+        using Item = std::pair<std::string, std::uint32_t>;
+
+    private:
+        struct Bucket
+        {
+            std::uint32_t fingerprint_;
+            std::uint32_t count_;
+        };
+
+        std::uint32_t k_{0};
+        std::uint32_t width_{0};
+        std::uint32_t depth_{0};
+        double decay_{DEFAULT_DECAY};
+        std::vector<Bucket> buckets_;  // row major
+        std::vector<double> decay_table_; // decay^count for small counts
+        std::vector<Item> heap_;       // min-heap on count
+        std::uint64_t rng_{0x9e3779b97f4a7c15ULL};
+
+        auto Random() -> double;
+        auto DecayProbability(std::uint32_t count) const -> double;
+        auto Insert(const std::string &item, std::uint64_t hash, std::uint32_t incr) -> std::optional<std::string>;
+
+    public:
+        void Reserve(std::uint32_t k, std::uint32_t width, std::uint32_t depth, double decay);
+        /* hashes the whole batch first, for each item the one it pushed out of the top k */
+        auto Add(const std::vector<std::string> &items) -> std::vector<std::optional<std::string>>;
+        auto Query(const std::vector<std::string> &items) const -> std::vector<bool>;
+        /* heaviest first */
+        auto List() const -> std::vector<Item>;
+        auto K() const -> std::uint32_t;
+
+        auto GetObjectType() const -> ObjectType override;
+        auto EncodeValue() const -> std::string override;
+        void DecodeValue(Cursor *) override;
+
+        CLASS_DECLARE_special_copy_move(TopK);
+    };
+
+} // namespace rds
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef __VECOPS_H__
+#define __VECOPS_H__
+
+#include <cstdint>
+#include <cstddef>
+
+namespace rds
+{
+    /* distance kernels behind the vector set, the AVX-512/AVX2 versions are
+       chosen once at first use when the cpu supports them */
+    auto DotF32(const float *a, const float *b, std::size_t dim) -> float;
+
+    /* squared euclidean distance */
+    auto L2F32(const float *a, const float *b, std::size_t dim) -> float;
+
+    auto DotI8(const std::int8_t *a, const std::int8_t *b, std::size_t dim) -> std::int32_t;
+
+    auto VecOpsImplementation() -> const char *;
+
+} // namespace rds
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef __VECTORSET_H__
+#define __VECTORSET_H__
+
+#include <objects/object.h>
+#include <util.h>
+#include <cstdint>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+namespace rds
+{
+    enum class VectorMetric
+    {
+        COSINE,
+        L2,
+        IP
+    };
+
+    enum class VectorQuant
+    {
+        FP32,
+        Q8
+    };
+
+    /* named vectors searched by similarity. small sets are scanned with the
+       simd kernels, larger ones go through an HNSW graph. removed elements
+       stay in the graph as tombstones until they are half of it */
+    class VectorSet final : public Object
+    {
+    public:
+        constexpr static std::size_t M = 16;
+        constexpr static std::size_t M0 = 2 * M;
+        constexpr static std::size_t EF_CONSTRUCTION = 200;
+        constexpr static std::size_t EF_SEARCH = 64;
+        constexpr static std::size_t BRUTE_FORCE_MAX = 1024;
+
+        using Result = std::pair<std::string, float>;
+
+    private:
+        struct Node
+        {
+            std::string name_;
+            bool deleted_{false};
+            float scale_{1}; // q8 only, value = q * scale
+            float norm2_{0};
+            std::vector<std::vector<std::uint32_t>> links_; // one list per level
+        };
+
+        /* a query or a stored vector in the layout of this set */
+        struct Probe
+        {
+            const float *f32_;
+            const std::int8_t *q8_;
+            float scale_;
+            float norm2_;
+        };
+
+        using Candidate = std::pair<float, std::uint32_t>;
+
+        std::uint32_t dim_{0};
+        VectorMetric metric_{VectorMetric::COSINE};
+        VectorQuant quant_{VectorQuant::Q8};
+        std::vector<Node> nodes_;
+        std::vector<float> f32_;
+        std::vector<std::int8_t> q8_;
+        std::unordered_map<std::string, std::uint32_t> index_;
+        std::uint32_t entry_{0};
+        int max_level_{-1};
+        std::size_t deleted_{0};
+        std::mt19937_64 rng_{0x5eed};
+
+        /* normalizes for cosine and quantizes for q8 into the buffers */
+        void Prepare(const std::vector<float> &vec, std::vector<float> *f32, std::vector<std::int8_t> *q8, float *scale, float *norm2) const;
+        auto NodeProbe(std::uint32_t id) const -> Probe;
+        /* smaller is closer */
+        auto Distance(const Probe &probe, std::uint32_t id) const -> float;
+        auto SearchLayer(const Probe &probe, std::uint32_t entry, std::size_t ef, int level) const -> std::vector<Candidate>;
+        auto SelectNeighbors(const std::vector<Candidate> &candidates, std::size_t m) const -> std::vector<std::uint32_t>;
+        void Link(std::uint32_t id);
+        void Compact();
+        auto Score(float distance) const -> float;
+        auto SearchProbe(const Probe &probe, std::size_t k, std::size_t ef, bool exact) const -> std::vector<Result>;
+
+    public:
+        /* only before the first element is added */
+        void Configure(VectorMetric metric, VectorQuant quant);
+        /* 1 added, 0 replaced the vector of an existing element, -1 wrong dimension */
+        auto Add(const std::string &name, const std::vector<float> &vec) -> int;
+        auto Remove(const std::string &name) -> bool;
+        /* the k most similar elements with their score: cosine similarity,
+           inner product or euclidean distance. exact skips the graph */
+        auto Search(const std::vector<float> &query, std::size_t k, std::size_t ef = EF_SEARCH, bool exact = false) const -> std::vector<Result>;
+        /* uses the stored vector of an element as the query */
+        auto SearchElement(const std::string &name, std::size_t k, std::size_t ef = EF_SEARCH) const -> std::optional<std::vector<Result>>;
+        auto Card() const -> std::size_t;
+        auto Dim() const -> std::size_t;
+        auto Metric() const -> VectorMetric;
+        auto Quant() const -> VectorQuant;
+        auto Bytes() const -> std::size_t;
+
+        auto GetObjectType() const -> ObjectType override;
+        auto EncodeValue() const -> std::string override;
+        void DecodeValue(Cursor *) override;
+
+        CLASS_DECLARE_special_copy_move(VectorSet);
+    };
+
+} // namespace rds
+
+#endif
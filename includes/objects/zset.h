@@ -4,18 +4,149 @@
 #include <objects/object.h>
 #include <util.h>
 #include <objects/str.h>
-#include <map>
-#include <list>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include <limits>
+#include <optional>
+#include <functional>
+#include <string_view>
 
 namespace rds
 {
+    struct ZSkipListNode
+    {
+        struct Level
+        {
+            ZSkipListNode *forward_;
+            std::size_t span_; // number of nodes skipped by forward_
+        };
+        const Str *member_;
+        int score_;
+        ZSkipListNode *backward_;
+        std::vector<Level> level_;
+
+        ZSkipListNode(int level, int score, const Str *member);
+    };
+
+    /* ordered by (score, member), every forward link records its span so that
+       rank and index lookups are O(log n) */
+    class ZSkipList
+    {
+    private:
+        constexpr static int MAX_LEVEL_ = 32;
+        ZSkipListNode *header_;
+        ZSkipListNode *tail_;
+        std::size_t length_;
+        int level_;
+
+        static auto RandomLevel() -> int;
+
+    public:
+        auto Insert(int score, const Str *member) -> ZSkipListNode *;
+        auto Delete(int score, const Str &member) -> bool;
+        auto Rank(int score, const Str &member) const -> std::size_t; // 1-based, 0 if absent
+        auto ByRank(std::size_t rank) const -> ZSkipListNode *;       // 1-based
+        auto FirstGreaterEqual(int score) const -> ZSkipListNode *;
+        auto CountLess(int score) const -> std::size_t;
+        auto CountLessEqual(int score) const -> std::size_t;
+        auto First() const -> ZSkipListNode *;
+        auto Last() const -> ZSkipListNode *;
+        auto Size() const -> std::size_t;
+        void Clear();
+
+        ZSkipList();
+        ~ZSkipList();
+        ZSkipList(const ZSkipList &) = delete;
+        ZSkipList(ZSkipList &&) noexcept;
+        auto operator=(const ZSkipList &) -> ZSkipList & = delete;
+        auto operator=(ZSkipList &&) noexcept -> ZSkipList &;
+    };
+
+    /* orders the members the skiplist points at, for lex ranges */
+    struct ZMemberLess
+    {
+        using is_transparent = void;
+        auto operator()(const Str *a, const Str *b) const -> bool
+        {
+            return *a < *b;
+        }
+        auto operator()(const Str *a, const Str &b) const -> bool
+        {
+            return *a < b;
+        }
+        auto operator()(const Str &a, const Str *b) const -> bool
+        {
+            return a < *b;
+        }
+    };
+
+    struct ZArrayEntry
+    {
+        int score_;
+        std::string member_;
+    };
+
+    /* small zsets are kept as a sorted array and promoted to the skiplist
+       once they grow past either limit */
+    void SetZSetArrayLimit(std::size_t max_entries, std::size_t max_value_len);
+
+    auto ZSetArrayMaxEntries() -> std::size_t;
+
+    auto ZSetArrayMaxValueLen() -> std::size_t;
+
+    enum class ZStoreOp
+    {
+        UNION,
+        INTER,
+        DIFF
+    };
+
+    enum class ZAggregate
+    {
+        SUM,
+        MIN,
+        MAX
+    };
+
+    class ZSet;
+
+    /* called with each member of a range in order, the view lives for the call only */
+    using ZSetVisitor = std::function<void(std::string_view member, int score)>;
+
+    /* result of ZUNIONSTORE/ZINTERSTORE/ZDIFFSTORE ordered by (score, member), ready for BulkLoad.
+       a null source is treated as an empty zset */
+    auto ZSetCombine(ZStoreOp op, const std::vector<const ZSet *> &sources,
+                     const std::vector<int> &weights, ZAggregate aggregate) -> std::vector<ZArrayEntry>;
 
     class ZSet final : public Object
     {
     private:
-        std::list<std::pair<const Str *, int>> sequence_list_;
-        std::map<Str, decltype(sequence_list_)::iterator> member_map_;
-        std::multimap<int, decltype(member_map_)::iterator> rank_map_;
+        EncodingType encoding_type_{EncodingType::ARRAY};
+        /* ARRAY: ordered by (score, member) */
+        std::vector<ZArrayEntry> array_;
+        /* RBTREE: the skiplist nodes point at the keys of this map */
+        ZSkipList zsl_;
+        std::unordered_map<Str, ZSkipListNode *, decltype(&StrHash)> member_map_{0xff, StrHash};
+        /* RBTREE: the keys of member_map_ in member order, lex ranges seek in it */
+        std::set<const Str *, ZMemberLess> lex_index_;
+
+        void InternalAdd(int, Str);
+        /* RBTREE: a member with its score into the map, the index and the skiplist */
+        void LinkMember(int score, Str member);
+        void UnlinkMember(std::unordered_map<Str, ZSkipListNode *, decltype(&StrHash)>::iterator pos);
+        void InternalClear();
+        void Promote();
+        /* ARRAY: the entries are ordered by score, a member alone is a linear scan */
+        auto FindInArray(const std::string &member) -> std::vector<ZArrayEntry>::iterator;
+        auto FindInArray(const std::string &member) const -> std::vector<ZArrayEntry>::const_iterator;
+        /* ARRAY: binary search for the exact entry when its score is known */
+        auto FindInArray(int score, const std::string &member) -> std::vector<ZArrayEntry>::iterator;
+        void InsertIntoArray(int score, std::string member);
+        /* inclusive 0-based ranks of a redis style index range, false if empty */
+        auto RankRange(int beg, int end, std::size_t *lbeg, std::size_t *lend) const -> bool;
+        /* ranks already checked against the size, under the latch of the caller */
+        void VisitRanks(std::size_t lbeg, std::size_t lend, bool rev, const ZSetVisitor &f) const;
 
     public:
         auto Add(int, Str) -> bool; // number of new (except update)
@@ -26,18 +157,38 @@ namespace rds
         auto IncrBy(int, const Str &) -> std::string;
         auto DecrBy(int, const Str &) -> std::string;
         auto Range(int, int) const -> std::vector<std::pair<Str, int>>;
-        auto RangeByScore(int, int) const -> std::vector<std::pair<Str, int>>;
-        auto RangeByLex(const Str &, const Str &) const -> std::vector<std::pair<Str, int>>;
+        auto RevRange(int, int) const -> std::vector<std::pair<Str, int>>;
+        /* LIMIT offset count: iteration stops once count members are collected */
+        auto RangeByScore(int, int, std::size_t offset = 0,
+                          std::size_t count = std::numeric_limits<std::size_t>::max()) const -> std::vector<std::pair<Str, int>>;
+        auto RangeByLex(const Str &, const Str &, std::size_t offset = 0,
+                        std::size_t count = std::numeric_limits<std::size_t>::max()) const -> std::vector<std::pair<Str, int>>;
+        /* the ranges above without copying, the read latch is held across the visits */
+        void Range(int, int, const ZSetVisitor &) const;
+        void RevRange(int, int, const ZSetVisitor &) const;
+        void RangeByScore(int, int, std::size_t offset, std::size_t count, const ZSetVisitor &) const;
+        void RangeByLex(const Str &, const Str &, std::size_t offset, std::size_t count, const ZSetVisitor &) const;
+        /* the inclusive 0-based ranks a redis style index range covers, empty if none */
+        auto Ranks(int beg, int end) const -> std::optional<std::pair<std::size_t, std::size_t>>;
+        /* inclusive 0-based ranks clipped to the current size, from the top when rev.
+           a resumed range goes on from here, returns how many were visited */
+        auto RangeByRank(std::size_t lbeg, std::size_t lend, bool rev, const ZSetVisitor &) const -> std::size_t;
+        auto PopMin(std::size_t count) -> std::vector<std::pair<Str, int>>;
+        auto PopMax(std::size_t count) -> std::vector<std::pair<Str, int>>;
         auto Rank(const Str &member) const -> std::string;
         auto Score(const Str &member) const -> std::string;
+        auto Snapshot() const -> std::vector<ZArrayEntry>;
+        void BulkLoad(std::vector<ZArrayEntry> sorted_entries);
+
+        auto GetEncodingType() const -> EncodingType;
 
         auto GetObjectType() const -> ObjectType override;
         auto EncodeValue() const -> std::string override;
-        void DecodeValue(std::deque<char> *) override;
+        void DecodeValue(Cursor *) override;
 
         CLASS_DECLARE_special_copy_move(ZSet);
     };
 
 } // namespace rds
 
-#endif
\ No newline at end of file
+#endif
@@ -3,10 +3,12 @@
 
 #include <util.h>
 #include <objects/str.h>
+#include <objects/stream.h>
 #include <database/db.h>
 #include <json11.hpp>
 #include <condition_variable>
 #include <queue>
+#include <list>
 
 namespace rds
 {
@@ -16,6 +18,12 @@ namespace rds
 
     auto RawCommandToRequest(const std::string &) -> json11::Json::array;
 
+    /* commands that may change the dataset */
+    auto IsWriteCommand(const std::string &command) -> bool;
+
+    /* a write that did not fail marks the database of its client dirty and is fed to the aof */
+    void PropagateWrite(const CommandBase &cmd, const std::optional<json11::Json::array> &respond);
+
     /* ensure that if ret-val is not null, then it can be execed  */
     auto RequestToCommandExec(std::shared_ptr<ClientInfo> client, json11::Json::array *req) -> std::unique_ptr<CommandBase>;
 
@@ -26,7 +34,11 @@ namespace rds
         std::string obj_name_;
         std::shared_ptr<Object> obj_;
         std::weak_ptr<ClientInfo> cli_;
+        json11::Json::array request_;                    // kept for writes while the aof is on
+        std::optional<json11::Json::array> aof_request_; // recorded instead when the effect depends on time or chance, empty records nothing
         virtual auto Exec() -> std::optional<json11::Json::array> = 0;
+        /* request_ with one argument replaced for the aof */
+        void RewriteArg(std::size_t i, std::string value);
         CLASS_DEFAULT_DECLARE(CommandBase);
     };
 
@@ -48,6 +60,7 @@ namespace rds
     struct StrCommand : CommandBase
     {
         std::optional<std::string> value_;
+        std::vector<std::string> args_; // bitmap commands: everything after the key
         auto Exec() -> std::optional<json11::Json::array> override;
         CLASS_DEFAULT_DECLARE(StrCommand);
     };
@@ -80,6 +93,121 @@ namespace rds
         CLASS_DEFAULT_DECLARE(ZSetCommand);
     };
 
+    struct HyperLogLogCommand : CommandBase
+    {
+        std::vector<std::string> values_;
+        auto Exec() -> std::optional<json11::Json::array> override;
+        CLASS_DEFAULT_DECLARE(HyperLogLogCommand);
+    };
+
+    struct BloomCommand : CommandBase
+    {
+        std::vector<std::string> values_;
+        auto Exec() -> std::optional<json11::Json::array> override;
+        CLASS_DEFAULT_DECLARE(BloomCommand);
+    };
+
+    struct StreamCommand : CommandBase
+    {
+        std::vector<std::string> values_; // XREAD: every argument, the first is not a key
+        auto Exec() -> std::optional<json11::Json::array> override;
+        CLASS_DEFAULT_DECLARE(StreamCommand);
+    };
+
+    struct TimeSeriesCommand : CommandBase
+    {
+        std::vector<std::string> values_; // TS.MADD: every argument, key ts value triples
+        auto Exec() -> std::optional<json11::Json::array> override;
+        CLASS_DEFAULT_DECLARE(TimeSeriesCommand);
+    };
+
+    struct VectorSetCommand : CommandBase
+    {
+        std::vector<std::string> values_;
+        auto Exec() -> std::optional<json11::Json::array> override;
+        CLASS_DEFAULT_DECLARE(VectorSetCommand);
+    };
+
+    struct CountMinSketchCommand : CommandBase
+    {
+        std::vector<std::string> values_;
+        auto Exec() -> std::optional<json11::Json::array> override;
+        CLASS_DEFAULT_DECLARE(CountMinSketchCommand);
+    };
+
+    struct TopKCommand : CommandBase
+    {
+        std::vector<std::string> values_;
+        auto Exec() -> std::optional<json11::Json::array> override;
+        CLASS_DEFAULT_DECLARE(TopKCommand);
+    };
+
+    class ZSet;
+
+    /* clients blocked by BZPOPMIN/BZPOPMAX, served in FIFO order when ZADD, ZINCRBY or a *STORE fills one of their keys */
+    class ZPopWaitList
+    {
+    private:
+        struct Waiter
+        {
+            std::size_t id_;
+            std::weak_ptr<ClientInfo> cli_;
+            Db *database_;
+            std::vector<std::string> keys_;
+            bool pop_max_;
+        };
+        std::mutex mtx_;
+        std::size_t next_id_{0};
+        std::list<Waiter> waiters_;
+        std::vector<std::pair<std::weak_ptr<ClientInfo>, json11::Json::array>> served_;
+
+    public:
+        auto Block(std::weak_ptr<ClientInfo> cli, Db *database, std::vector<std::string> keys, bool pop_max) -> std::size_t;
+        /* pops for the waiters on key, their replies are kept for TakeServed */
+        void Serve(Db *database, const std::string &key, ZSet *zset);
+        /* the replies of the pops served by the running command, they leave
+           with its own reply, once their records are in the aof */
+        auto TakeServed() -> std::vector<std::pair<std::weak_ptr<ClientInfo>, json11::Json::array>>;
+        void Timeout(std::size_t id);
+        ZPopWaitList() = default;
+        ~ZPopWaitList() = default;
+    };
+
+    auto GetZPopWaitList() -> ZPopWaitList &;
+
+    /* clients blocked by XREAD BLOCK, every waiter on a key is answered when XADD appends to it */
+    class XReadWaitList
+    {
+    private:
+        struct Waiter
+        {
+            std::size_t id_;
+            std::weak_ptr<ClientInfo> cli_;
+            Db *database_;
+            std::vector<std::string> keys_;
+            std::vector<StreamID> after_;
+            std::size_t count_;
+        };
+        std::mutex mtx_;
+        std::size_t next_id_{0};
+        std::list<Waiter> waiters_;
+        std::vector<std::pair<std::weak_ptr<ClientInfo>, json11::Json::array>> served_;
+
+    public:
+        auto Block(std::weak_ptr<ClientInfo> cli, Db *database, std::vector<std::string> keys,
+                   std::vector<StreamID> after, std::size_t count) -> std::size_t;
+        /* reads for the waiters on key, their replies are kept for TakeServed */
+        void Serve(Db *database, const std::string &key, const Stream *stream);
+        /* the replies of the reads served by the running XADD, they leave
+           with its own reply, once its record is in the aof */
+        auto TakeServed() -> std::vector<std::pair<std::weak_ptr<ClientInfo>, json11::Json::array>>;
+        void Timeout(std::size_t id);
+        XReadWaitList() = default;
+        ~XReadWaitList() = default;
+    };
+
+    auto GetXReadWaitList() -> XReadWaitList &;
+
     class CommandQue
     {
     private:
@@ -95,6 +223,20 @@ namespace rds
             que_.push(std::move(cmd));
             condv_.notify_all();
         }
+        /* at least one command, at most max of them */
+        auto BlockPopBatch(std::size_t max) -> std::vector<std::unique_ptr<CommandBase>>
+        {
+            std::unique_lock<std::mutex> ul(mtx_);
+            condv_.wait(ul, [&que = que_]()
+                        { return !que.empty(); });
+            std::vector<std::unique_ptr<CommandBase>> ret;
+            while (!que_.empty() && ret.size() < max)
+            {
+                ret.push_back(std::move(que_.front()));
+                que_.pop();
+            }
+            return ret;
+        }
         auto BlockPop() -> std::unique_ptr<CommandBase>
         {
             std::unique_lock<std::mutex> ul(mtx_);
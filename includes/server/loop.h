@@ -6,6 +6,7 @@
 #include <database/db.h>
 #include <database/disk.h>
 #include <database/rdb.h>
+#include <database/aof.h>
 #include <thread>
 namespace rds
 {
@@ -23,10 +24,26 @@ namespace rds
         FileManager file_manager_;
 
         std::unique_ptr<std::thread> save_thread_;
+        std::unique_ptr<RdbSaver> saver_;
+        std::size_t dirty_dropped_{0}; // writes made to databases since dropped
+        std::unique_ptr<AofWriter> aof_;
+        std::unique_ptr<AofRewriter> rewriter_;
+
+        /* the database number, made when the aof is the first to name it */
+        auto ReplayDB(int number) -> Db *;
+        /* runs one aof record against database number, created when missing */
+        void Replay(const std::shared_ptr<ClientInfo> &replay, int number, std::string_view record);
 
     public:
         void Run();
-        auto DatabaseFork() const -> std::vector<std::string>;
+        /* streams every database into out */
+        void DatabaseFork(const ByteSink &out) const;
+        /* nothing when the databases are kept in the aof */
+        auto Saver() -> RdbSaver *;
+        /* nothing when the aof is off */
+        auto Rewriter() -> AofRewriter *;
+        /* writes made to all databases so far */
+        auto Dirty() -> std::size_t;
 
         auto GetDB(int db_number) -> Db *;
         auto CreateDB() -> int;
@@ -0,0 +1,76 @@
+#ifndef __REPLY_H__
+#define __REPLY_H__
+
+#include <util.h>
+#include <string>
+#include <string_view>
+#include <memory>
+#include <functional>
+
+namespace rds
+{
+    class ClientInfo;
+    class Str;
+
+    /* writes a json array reply element by element straight into the output
+       buffer of a client, byte for byte what json11 would dump, a full chunk
+       is handed over at once. the elements come from a producer called step by
+       step on the executor until SEND_HIGH_WATER bytes wait for the client,
+       the rest of the reply is parked on the client and its sender resumes it
+       once fewer than SEND_LOW_WATER bytes wait. nothing waits on a slow reader
+       but that reader.
+       a producer goes on from a cursor of its own, so a resumed reply shows the
+       writes made in between. bytes pushed past the high water within a step,
+       as by a visitor that can not stop, are kept aside until their turn */
+    class ReplyStream
+    {
+    public:
+        constexpr static std::size_t CHUNK_BYTES = 16 * 1024;
+        constexpr static std::size_t SEND_HIGH_WATER = 1024 * 1024;
+        constexpr static std::size_t SEND_LOW_WATER = 256 * 1024;
+        /* elements a producer pushes at most in one step */
+        constexpr static std::size_t STEP_ELEMENTS = 256;
+
+        /* pushes the next step of the reply, false once nothing is left */
+        using Producer = std::function<bool(ReplyStream *)>;
+
+    private:
+        std::weak_ptr<ClientInfo> client_;
+        Producer producer_;
+        bool produced_{false};
+        std::string chunk_;
+        std::size_t elements_{0};
+        std::size_t queued_{0}; // waiting for the client after the last hand over
+        std::string aside_;     // serialized past the high water, sent before chunk_
+        std::size_t aside_sent_{0};
+
+        void Escape(std::string_view value);
+        void Next();
+        void Flush();
+        void HandOver(std::string bytes);
+
+    public:
+        void Push(std::string_view element);
+        void Push(const Str &element);
+        void Push(std::int64_t element);
+        /* the element wrapped in literal quotes, as SMEMBERS and HGETALL reply */
+        void PushQuoted(const Str &element);
+        void PushQuoted(std::string_view element);
+        auto Count() const -> std::size_t;
+        /* whether the client holds enough for now, a producer should stop here */
+        auto Full() const -> bool;
+        /* goes on until the client is full, true once the whole reply, closed
+           (an empty one as ["(nil)"]), is handed over or the client is gone */
+        auto Run() -> bool;
+
+        /* makes the reply of a command, behind the replies the client still waits for */
+        static void Start(const std::shared_ptr<ClientInfo> &client, Producer producer);
+
+        ReplyStream(std::weak_ptr<ClientInfo> client, Producer producer);
+        ~ReplyStream() = default;
+        CLASS_DECLARE_uncopyable(ReplyStream);
+    };
+
+} // namespace rds
+
+#endif
@@ -8,12 +8,14 @@
 #include <sys/epoll.h>
 #include <database/db.h>
 #include <list>
+#include <variant>
 
 namespace rds
 {
 
     class Server;
     class Handler;
+    class ReplyStream;
     class MainLoop;
 
     class ClientInfo
@@ -30,8 +32,15 @@ namespace rds
         std::deque<char> recv_buffer_;
         std::vector<json11::Json::array> recv_messages_;
 
-        std::deque<char> send_buffer_;
+        /* replies waiting for the socket, the first chunk is sent from send_offset_ */
+        std::deque<std::string> send_chunks_;
+        std::size_t send_offset_{0};
+        std::size_t send_bytes_{0};
         std::vector<json11::Json::array> send_messages_;
+        /* a streamed reply resumed as the socket drains, what the client is
+           answered meanwhile waits behind it in order */
+        std::shared_ptr<ReplyStream> parked_;
+        std::deque<std::variant<std::string, std::shared_ptr<ReplyStream>>> backlog_;
 
         std::shared_mutex latch_;
 
@@ -42,6 +51,17 @@ namespace rds
         void SetDB(Db *database);
         auto GetDB() -> Db *;
         void Append(json11::Json::array to_send_message);
+        /* already serialized bytes, returns how many are waiting to be sent */
+        auto AppendChunk(std::string chunk) -> std::size_t;
+        /* the bytes of a streamed reply, never held behind a parked one */
+        auto AppendStreamed(std::string chunk) -> std::size_t;
+        auto SendBytes() -> std::size_t;
+        /* true when the stream may run now, else it waits behind the parked reply */
+        auto Queue(std::shared_ptr<ReplyStream> stream) -> bool;
+        void Park(std::shared_ptr<ReplyStream> stream);
+        auto IsParked() -> bool;
+        /* goes on with the parked reply once the socket drained, on the sender */
+        void Resume();
         auto IsSendOut() -> bool;
         auto ExportMessages() -> std::vector<json11::Json::array>;
         void EnableSend();
@@ -75,6 +95,10 @@ namespace rds
 
     class Handler
     {
+    public:
+        /* commands taken from the queue at once, their aof records are committed together */
+        constexpr static std::size_t COMMAND_BATCH = 64;
+
     private:
         std::atomic_bool running_{false};
 
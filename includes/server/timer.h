@@ -8,6 +8,7 @@
 #include <database/aof.h>
 #include <database/disk.h>
 #include <condition_variable>
+#include <functional>
 #include <queue>
 
 namespace rds
@@ -27,23 +28,50 @@ namespace rds
         CLASS_DEFAULT_DECLARE(DbExpireTimer);
     };
 
+    struct ZPopTimeoutTimer : Timer
+    {
+        std::size_t waiter_id_;
+        void Exec() override;
+        CLASS_DEFAULT_DECLARE(ZPopTimeoutTimer);
+    };
+
+    struct XReadTimeoutTimer : Timer
+    {
+        std::size_t waiter_id_;
+        void Exec() override;
+        CLASS_DEFAULT_DECLARE(XReadTimeoutTimer);
+    };
+
     class Handler;
 
+    /* asks for a background save when a save rule is met, checks again after after_ us */
     struct RdbTimer : Timer
     {
-        std::function<std::vector<std::string>()> generator_;
-        FileManager *fm_;
+        RdbSaver *saver_;
         Handler *hdlr_;
         std::size_t after_;
         void Exec() override;
         CLASS_DEFAULT_DECLARE(RdbTimer);
     };
 
-    struct AofTimer : Timer
+    /* asks for an aof rewrite once the aof grew enough, checks again after after_ us */
+    struct AofRewriteTimer : Timer
     {
+        AofRewriter *rewriter_;
         Handler *hdlr_;
-        FileManager *dm_;
-        void Exec();
+        std::size_t after_;
+        void Exec() override;
+        CLASS_DEFAULT_DECLARE(AofRewriteTimer);
+    };
+
+    /* runs the idle string compression over every database, then again after after_ us */
+    struct StrCompressTimer : Timer
+    {
+        std::function<void()> sweep_;
+        Handler *hdlr_;
+        std::size_t after_;
+        void Exec() override;
+        CLASS_DEFAULT_DECLARE(StrCompressTimer);
     };
 
     class ClientInfo;
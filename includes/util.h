@@ -18,9 +18,13 @@
 #include <sys/time.h>
 #include <string>
 #include <cstring>
+#include <cstdint>
 #include <cassert>
 #include <deque>
 #include <iostream>
+#include <vector>
+#include <string_view>
+#include <stdexcept>
 #define Panic()                         \
     std::cout << __FILE__ << std::endl; \
     std::abort();
@@ -127,6 +131,10 @@ namespace rds
         }
     };
 
+    /* commands and timers run holding it shared, a fork takes it exclusively
+       so the child starts with no latch held for writing */
+    auto ForkFence() -> std::shared_mutex &;
+
     class SpinMutex
     {
     private:
@@ -153,15 +161,90 @@ namespace rds
         return ret;
     }
 
-    auto PeekInt(std::deque<char> *source) -> int;
+    /* LEB128, 7 bits per byte with the high bit as continuation */
+    inline void PutVarint(std::string *dst, std::uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            dst->push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        dst->push_back(static_cast<char>(value));
+    }
+
+    inline auto GetVarint(const char **cursor) -> std::uint64_t
+    {
+        std::uint64_t ret = 0;
+        int shift = 0;
+        while (true)
+        {
+            auto b = static_cast<std::uint8_t>(*(*cursor)++);
+            ret |= static_cast<std::uint64_t>(b & 0x7f) << shift;
+            if (!(b & 0x80))
+            {
+                return ret;
+            }
+            shift += 7;
+        }
+    }
+
+    /* bounds checked reader over encoded bytes owned elsewhere, a mapped rdb
+       file or a string. front, pop_front and empty mirror the deque it replaced,
+       reading past the end throws std::out_of_range */
+    class Cursor
+    {
+    private:
+        const char *pos_{nullptr};
+        const char *end_{nullptr};
+
+    public:
+        auto front() const -> char
+        {
+            if (pos_ == end_)
+            {
+                throw std::out_of_range("decode past the end");
+            }
+            return *pos_;
+        }
+
+        void pop_front()
+        {
+            Take(1);
+        }
+
+        auto empty() const -> bool
+        {
+            return pos_ == end_;
+        }
 
-    auto PeekSize(std::deque<char> *source) -> std::size_t;
+        auto size() const -> std::size_t
+        {
+            return end_ - pos_;
+        }
 
-    auto PeekString(std::deque<char> *source, std::size_t size) -> std::string;
+        /* the next n bytes, valid as long as the underlying buffer */
+        auto Take(std::size_t n) -> const char *
+        {
+            if (n > size())
+            {
+                throw std::out_of_range("decode past the end");
+            }
+            const char *ret = pos_;
+            pos_ += n;
+            return ret;
+        }
 
-    auto Decompress(const std::string &data) -> std::string;
+        Cursor() = default;
+        explicit Cursor(std::string_view bytes) : pos_(bytes.data()), end_(bytes.data() + bytes.size()) {}
+    };
+
+    auto PeekInt(Cursor *source) -> int;
+
+    auto PeekSize(Cursor *source) -> std::size_t;
 
-    auto Compress(const std::string &data) -> std::string;
+    auto PeekString(Cursor *source, std::size_t size) -> std::string;
+
+    auto PeekVarint(Cursor *source) -> std::uint64_t;
 
     auto DefineCompress() -> bool;
 
@@ -169,6 +252,14 @@ namespace rds
 
     void DisCompress();
 
+    auto MurmurHash64A(const void *key, std::size_t len, std::uint64_t seed) -> std::uint64_t;
+
+    /* CRC-64/XZ (ECMA-182), crc is the value of the bytes before, 0 to start */
+    auto Crc64(std::uint64_t crc, const void *data, std::size_t len) -> std::uint64_t;
+
+    /* strict: rejects leading zeros, "-0" and values outside int64 */
+    auto StringToInt64(const std::string &raw) -> std::optional<std::int64_t>;
+
     class Str;
     auto RedisStrToInt(const Str &value) -> std::optional<int>;
 
@@ -195,20 +286,47 @@ namespace rds
         }
     }
 
+    enum class AppendFsync
+    {
+        ALWAYS,
+        EVERYSEC,
+        NO
+    };
+
+    /* "always", "everysec" or "no" */
+    auto ParseAppendFsync(const std::string &raw) -> std::optional<AppendFsync>;
+
     struct RedisConf
     {
         std::string file_name_;
         std::string ip_;
         short port_;
         bool compress_;
-        bool enable_aof_;
+        bool enable_aof_; // the aof is replayed at start instead of the rdb, and no snapshots are taken
+        std::string aof_file_name_;
+        AppendFsync aof_fsync_;
+        /* the aof is rewritten once it grew by percent since the last rewrite
+           and is at least min_size bytes, percent 0 only on BGREWRITEAOF */
         struct
         {
-            std::size_t every_n_sec_;
-            std::size_t save_n_times_;
-        } frequence_;
+            std::size_t percent_;
+            std::size_t min_size_;
+        } aof_rewrite_;
+        /* a snapshot is taken once first seconds passed since the last one and
+           at least second writes were made, empty saves only on BGSAVE */
+        std::vector<std::pair<std::size_t, std::size_t>> save_rules_;
         std::size_t mem_size_mbytes_;
         int cpu_num_;
+        struct
+        {
+            std::size_t max_entries_;
+            std::size_t max_value_len_;
+        } zset_array_;
+        struct
+        {
+            std::size_t min_len_; // 0 keeps every string raw
+            std::size_t idle_sec_;
+        } str_compress_;
     };
 
     auto DefaultConf() -> RedisConf;
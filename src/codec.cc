@@ -0,0 +1,158 @@
+#include <codec.h>
+#include <lzfse.h>
+#include <cstring>
+
+namespace rds
+{
+    ScratchPool::Lease::~Lease()
+    {
+        std::lock_guard lg(pool_->mtx_);
+        if (pool_->idle_.size() < IDLE_MAX)
+        {
+            pool_->idle_.push_back(std::move(buffer_));
+        }
+    }
+
+    auto ScratchPool::Take() -> Lease
+    {
+        {
+            std::lock_guard lg(mtx_);
+            if (!idle_.empty())
+            {
+                auto buffer = std::move(idle_.back());
+                idle_.pop_back();
+                return Lease(this, std::move(buffer));
+            }
+            allocated_++;
+        }
+        return Lease(this, std::vector<std::uint8_t>(size_));
+    }
+
+    auto ScratchPool::Allocated() -> std::size_t
+    {
+        std::lock_guard lg(mtx_);
+        return allocated_;
+    }
+
+    namespace
+    {
+        class NoneCodec final : public Codec
+        {
+        public:
+            auto Id() const -> CodecId override
+            {
+                return CodecId::NONE;
+            }
+
+            auto Name() const -> const char * override
+            {
+                return "none";
+            }
+
+            auto Encode(std::uint8_t *dst, std::size_t capacity, const std::uint8_t *src, std::size_t size) const -> std::size_t override
+            {
+                if (size > capacity)
+                {
+                    return 0;
+                }
+                std::memcpy(dst, src, size);
+                return size;
+            }
+
+            auto Decode(std::uint8_t *dst, std::size_t capacity, const std::uint8_t *src, std::size_t size) const -> std::size_t override
+            {
+                std::size_t n = std::min(capacity, size);
+                std::memcpy(dst, src, n);
+                return n;
+            }
+        };
+
+        class LzfseCodec final : public Codec
+        {
+        private:
+            mutable ScratchPool encode_scratch_{lzfse_encode_scratch_size()};
+            mutable ScratchPool decode_scratch_{lzfse_decode_scratch_size()};
+
+        public:
+            auto Id() const -> CodecId override
+            {
+                return CodecId::LZFSE;
+            }
+
+            auto Name() const -> const char * override
+            {
+                return "lzfse";
+            }
+
+            auto Encode(std::uint8_t *dst, std::size_t capacity, const std::uint8_t *src, std::size_t size) const -> std::size_t override
+            {
+                auto scratch = encode_scratch_.Take();
+                return lzfse_encode_buffer(dst, capacity, src, size, scratch.Data());
+            }
+
+            auto Decode(std::uint8_t *dst, std::size_t capacity, const std::uint8_t *src, std::size_t size) const -> std::size_t override
+            {
+                auto scratch = decode_scratch_.Take();
+                return lzfse_decode_buffer(dst, capacity, src, size, scratch.Data());
+            }
+        };
+    } // namespace
+
+    auto GetCodec(CodecId id) -> const Codec *
+    {
+        static const NoneCodec none;
+        static const LzfseCodec lzfse;
+        switch (id)
+        {
+        case CodecId::NONE:
+            return &none;
+        case CodecId::LZFSE:
+            return &lzfse;
+        }
+        return nullptr;
+    }
+
+    auto Compress(std::string_view data, const CompressPolicy &policy) -> std::optional<std::string>
+    {
+        auto codec = GetCodec(policy.codec_);
+        if (codec == nullptr || data.empty() || data.size() < policy.min_size_)
+        {
+            return {};
+        }
+        // the codec gives up once the output would miss the ratio
+        auto capacity = static_cast<std::size_t>(static_cast<double>(data.size()) * policy.max_ratio_);
+        capacity = std::min(capacity, data.size() - 1);
+        if (capacity == 0)
+        {
+            return {};
+        }
+        std::string ret(capacity, '\0');
+        auto len = codec->Encode(reinterpret_cast<std::uint8_t *>(ret.data()), capacity,
+                                 reinterpret_cast<const std::uint8_t *>(data.data()), data.size());
+        if (len == 0)
+        {
+            return {};
+        }
+        ret.resize(len);
+        return ret;
+    }
+
+    auto Decompress(std::string_view data, std::size_t size, CodecId id) -> std::optional<std::string>
+    {
+        auto codec = GetCodec(id);
+        if (codec == nullptr)
+        {
+            return {};
+        }
+        // one spare byte tells a complete decode from a truncated one
+        std::string ret(size + 1, '\0');
+        auto len = codec->Decode(reinterpret_cast<std::uint8_t *>(ret.data()), ret.size(),
+                                 reinterpret_cast<const std::uint8_t *>(data.data()), data.size());
+        if (len != size)
+        {
+            return {};
+        }
+        ret.resize(size);
+        return ret;
+    }
+} // namespace rds
@@ -1,14 +1,540 @@
 #include <database/aof.h>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace rds
 {
-    auto AOFLoad(std::deque<char> *source) -> std::list<std::unique_ptr<Db>>
+    namespace
     {
-        auto rdb_str = PeekString(source, 3);
-        if (rdb_str != "AOF")
+        auto WriteAll(int fd, std::string_view bytes) -> bool
         {
-            throw std::runtime_error("RDBLoad: wrong file");
+            while (!bytes.empty())
+            {
+                auto n = write(fd, bytes.data(), bytes.size());
+                if (n == -1)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    return false;
+                }
+                bytes.remove_prefix(n);
+            }
+            return true;
         }
-        return {};
+    } // namespace
+
+    auto AOFLoad(Cursor *source, std::list<std::unique_ptr<Db>> *databases,
+                 const std::function<void(int, std::string_view)> &apply) -> std::size_t
+    {
+        Log("Loading aof...");
+        std::size_t total = source->size();
+        if (total == 0)
+        {
+            return 0;
+        }
+        std::string magic = total < 3 ? "" : PeekString(source, 3);
+        if (magic != "AOF" && magic != "AOP")
+        {
+            Log("AOF file loading error, nothing replayed");
+            return 0;
+        }
+        if (magic == "AOP")
+        {
+            try
+            {
+                // a whole v2 rdb, or before it the number of databases and their sections
+                Cursor probe = *source;
+                if (source->size() >= 3 && PeekString(&probe, 3) == "RDB")
+                {
+                    *source = probe;
+                    if (source->empty() || source->front() != RDB_VERSION)
+                    {
+                        throw std::runtime_error("unknown rdb version");
+                    }
+                    *databases = RDBDecodeStream(source);
+                }
+                else
+                {
+                    std::size_t n = PeekVarint(source);
+                    *databases = RDBDecode(source, n);
+                }
+            }
+            catch (const std::exception &e)
+            {
+                Log("AOF preamble is corrupted (", e.what(), "), nothing replayed");
+                databases->clear();
+                return 0;
+            }
+            Log("Loaded", databases->size(), "databases from the aof preamble");
+        }
+        std::size_t records = 0;
+        std::size_t good = total - source->size();
+        try
+        {
+            while (!source->empty())
+            {
+                int db = static_cast<int>(PeekVarint(source));
+                std::size_t len = PeekVarint(source);
+                const char *request = source->Take(len);
+                apply(db, {request, len});
+                records++;
+                good = total - source->size();
+            }
+        }
+        catch (const std::out_of_range &)
+        {
+            // a write cut short by a crash, everything before it is whole
+            Log("AOF ends with a truncated record at", good, "of", total, "bytes, it is dropped");
+        }
+        Log("Replayed", records, "aof records");
+        return good;
+    }
+
+    AofWriter::AofWriter(const std::string &filename, AppendFsync policy) : filename_(filename), policy_(policy)
+    {
+        fd_ = open(filename_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        Assert(fd_ != -1, "open aof");
+        struct stat st;
+        Assert(fstat(fd_, &st) == 0, "stat aof");
+        size_ = st.st_size;
+        if (size_ == 0)
+        {
+            buffer_ = "AOF";
+            Commit();
+        }
+        synced_ = size_.load();
+        if (policy_ == AppendFsync::EVERYSEC)
+        {
+            sync_thread_ = std::thread(&AofWriter::SyncEverySecond, this);
+        }
+    }
+
+    AofWriter::~AofWriter()
+    {
+        {
+            std::lock_guard lg(sync_mtx_);
+            stopping_ = true;
+        }
+        sync_condv_.notify_one();
+        if (sync_thread_.joinable())
+        {
+            sync_thread_.join();
+        }
+        Commit();
+        std::lock_guard lg(mtx_);
+        SyncLocked();
+        close(fd_);
+    }
+
+    void AofWriter::Begin()
+    {
+        mark_ = buffer_.size();
+    }
+
+    void AofWriter::FeedCommand(int db, std::string_view request)
+    {
+        std::string record;
+        PutVarint(&record, static_cast<std::uint64_t>(db));
+        PutVarint(&record, request.size());
+        record.append(request);
+        buffer_.insert(std::min(mark_, buffer_.size()), record);
+    }
+
+    void AofWriter::Feed(int db, std::string_view request)
+    {
+        PutVarint(&buffer_, static_cast<std::uint64_t>(db));
+        PutVarint(&buffer_, request.size());
+        buffer_.append(request);
+    }
+
+    auto AofWriter::Commit() -> bool
+    {
+        std::lock_guard lg(mtx_);
+        if (rewriting_ && rewrite_from_ < buffer_.size())
+        {
+            rewrite_buffer_.append(buffer_, rewrite_from_);
+        }
+        std::size_t done = 0;
+        while (done < buffer_.size())
+        {
+            auto n = write(fd_, buffer_.data() + done, buffer_.size() - done);
+            if (n == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (!failing_)
+                {
+                    Log("Can not write the aof: ", strerror(errno));
+                    failing_ = true;
+                }
+                buffer_.erase(0, done);
+                size_ += done;
+                rewrite_from_ = buffer_.size();
+                return false;
+            }
+            done += n;
+        }
+        if (failing_)
+        {
+            Log("AOF writes are back to normal");
+            failing_ = false;
+        }
+        size_ += done;
+        buffer_.clear();
+        rewrite_from_ = 0;
+        if (policy_ == AppendFsync::ALWAYS)
+        {
+            return SyncLocked();
+        }
+        return true;
+    }
+
+    auto AofWriter::SyncLocked() -> bool
+    {
+        std::size_t size = size_;
+        if (sync_failed_)
+        {
+            return false;
+        }
+        if (synced_ == size)
+        {
+            return true;
+        }
+        if (fdatasync(fd_) != 0)
+        {
+            SyncFailed();
+            return false;
+        }
+        synced_ = size;
+        fsyncs_++;
+        return true;
+    }
+
+    void AofWriter::SyncFailed()
+    {
+        if (!sync_failed_.exchange(true))
+        {
+            Log("Can not fsync the aof: ", strerror(errno), ", writes are refused until BGREWRITEAOF succeeds");
+        }
+    }
+
+    auto AofWriter::Healthy() const -> bool
+    {
+        return !failing_ && !sync_failed_;
+    }
+
+    void AofWriter::SyncEverySecond()
+    {
+        std::unique_lock ul(sync_mtx_);
+        while (!stopping_)
+        {
+            sync_condv_.wait_for(ul, std::chrono::seconds(1));
+            // synced on a descriptor of its own, Commit goes on meanwhile
+            int fd;
+            std::size_t size;
+            std::size_t files;
+            {
+                std::lock_guard lg(mtx_);
+                size = size_;
+                if (synced_ == size || sync_failed_)
+                {
+                    continue;
+                }
+                fd = dup(fd_);
+                files = files_;
+            }
+            if (fd == -1)
+            {
+                continue;
+            }
+            bool ok = fdatasync(fd) == 0;
+            int err = errno;
+            close(fd);
+            std::lock_guard lg(mtx_);
+            if (files != files_)
+            {
+                continue;
+            }
+            if (!ok)
+            {
+                errno = err;
+                SyncFailed();
+                continue;
+            }
+            synced_ = size;
+            fsyncs_++;
+        }
+    }
+
+    void AofWriter::StartRewrite()
+    {
+        std::lock_guard lg(mtx_);
+        rewriting_ = true;
+        rewrite_buffer_.clear();
+        rewrite_from_ = buffer_.size();
+    }
+
+    auto AofWriter::TakeRewriteBuffer() -> std::string
+    {
+        std::lock_guard lg(mtx_);
+        return std::exchange(rewrite_buffer_, {});
+    }
+
+    auto AofWriter::FinishRewrite(int fd, const std::string &path) -> bool
+    {
+        std::lock_guard lg(mtx_);
+        struct stat st;
+        if (!WriteAll(fd, rewrite_buffer_) || fdatasync(fd) != 0 || fstat(fd, &st) != 0 ||
+            rename(path.c_str(), filename_.c_str()) != 0)
+        {
+            return false;
+        }
+        SyncDirectory(filename_);
+        close(fd_);
+        fd_ = fd;
+        files_++;
+        // fed before the fork or kept already, the new file has them
+        buffer_.erase(0, rewrite_from_);
+        rewrite_from_ = 0;
+        rewriting_ = false;
+        rewrite_buffer_.clear();
+        size_ = st.st_size;
+        synced_ = size_.load();
+        // every byte of the new file went through a successful fsync
+        sync_failed_ = false;
+        return true;
+    }
+
+    void AofWriter::AbortRewrite()
+    {
+        std::lock_guard lg(mtx_);
+        rewriting_ = false;
+        rewrite_buffer_.clear();
+        rewrite_buffer_.shrink_to_fit();
+    }
+
+    auto AofWriter::Pending() const -> bool
+    {
+        // FinishRewrite trims the buffer from the rewriter's thread
+        std::lock_guard lg(mtx_);
+        return !buffer_.empty();
+    }
+
+    auto AofWriter::Size() const -> std::size_t
+    {
+        return size_;
+    }
+
+    auto AofWriter::Synced() const -> std::size_t
+    {
+        return synced_;
+    }
+
+    auto AofWriter::Fsyncs() const -> std::size_t
+    {
+        return fsyncs_;
+    }
+
+    auto AofWriter::Policy() const -> AppendFsync
+    {
+        return policy_;
+    }
+
+    auto AofWriter::FileName() const -> const std::string &
+    {
+        return filename_;
+    }
+
+    AofRewriter::AofRewriter(DatabaseEncoder encode, AofWriter *aof, std::size_t min_size, std::size_t percent)
+        : encode_(std::move(encode)),
+          aof_(aof),
+          min_size_(min_size),
+          percent_(percent),
+          base_size_(aof->Size())
+    {
+        thread_ = std::thread(&AofRewriter::Run, this);
+    }
+
+    AofRewriter::~AofRewriter()
+    {
+        {
+            std::lock_guard lg(mtx_);
+            stopping_ = true;
+        }
+        condv_.notify_one();
+        thread_.join();
+    }
+
+    auto AofRewriter::Request() -> bool
+    {
+        std::lock_guard lg(mtx_);
+        if (requested_ || in_progress_)
+        {
+            return false;
+        }
+        requested_ = true;
+        condv_.notify_one();
+        return true;
+    }
+
+    auto AofRewriter::Due() const -> bool
+    {
+        if (in_progress_ || percent_ == 0)
+        {
+            return false;
+        }
+        if (!last_ok_ && time(nullptr) - last_try_ < REWRITE_RETRY_SEC)
+        {
+            return false;
+        }
+        std::size_t size = aof_->Size();
+        std::size_t base = base_size_;
+        return size >= min_size_ && size > base && (size - base) * 100 >= base * percent_;
+    }
+
+    void AofRewriter::Run()
+    {
+        while (true)
+        {
+            {
+                std::unique_lock ul(mtx_);
+                condv_.wait(ul, [this]()
+                            { return requested_ || stopping_; });
+                if (stopping_)
+                {
+                    return;
+                }
+                requested_ = false;
+                in_progress_ = true;
+            }
+            auto start_us = UsTime();
+            bool ok = ForkAndRewrite();
+            last_duration_ms_ = (UsTime() - start_us) / 1000;
+            last_ok_ = ok;
+            if (ok)
+            {
+                base_size_ = aof_->Size();
+                rewrites_++;
+            }
+            in_progress_ = false;
+        }
+    }
+
+    auto AofRewriter::ForkAndRewrite() -> bool
+    {
+        std::string path = aof_->FileName() + ".rewrite";
+        bool ok = ForkAndWait(
+            "append only file rewriting", [this]()
+            {
+                last_try_ = time(nullptr);
+                aof_->StartRewrite(); },
+            [this, &path]()
+            {
+                try
+                {
+                    FileWriter out(path);
+                    out.Append("AOP");
+                    RDBWrite([&out](std::string_view bytes)
+                             { out.Append(bytes); },
+                             encode_);
+                    out.Commit();
+                    return true;
+                }
+                catch (const std::exception &e)
+                {
+                    Log("AOF rewrite failed (", e.what(), ")");
+                    return false;
+                }
+            });
+        if (ok)
+        {
+            ok = Swap(path);
+        }
+        if (!ok)
+        {
+            aof_->AbortRewrite();
+            unlink(path.c_str());
+        }
+        return ok;
+    }
+
+    auto AofRewriter::Swap(const std::string &path) -> bool
+    {
+        int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd == -1)
+        {
+            return false;
+        }
+        // what was committed while the child wrote goes in while commands run
+        for (int pass = 0; pass < DRAIN_PASSES; pass++)
+        {
+            auto kept = aof_->TakeRewriteBuffer();
+            if (!WriteAll(fd, kept))
+            {
+                close(fd);
+                return false;
+            }
+            if (kept.size() < TAIL_BYTES)
+            {
+                break;
+            }
+        }
+        fdatasync(fd);
+        bool ok;
+        {
+            std::unique_lock fence(ForkFence());
+            ok = aof_->FinishRewrite(fd, path);
+        }
+        if (!ok)
+        {
+            Log("Can not replace the aof with the rewritten one: ", strerror(errno));
+            close(fd);
+        }
+        return ok;
+    }
+
+    auto AofRewriter::InProgress() const -> bool
+    {
+        return in_progress_;
+    }
+
+    auto AofRewriter::LastOk() const -> bool
+    {
+        return last_ok_;
+    }
+
+    auto AofRewriter::LastDurationMs() const -> std::int64_t
+    {
+        return last_duration_ms_;
+    }
+
+    auto AofRewriter::Rewrites() const -> std::size_t
+    {
+        return rewrites_;
+    }
+
+    auto AofRewriter::BaseSize() const -> std::size_t
+    {
+        return base_size_;
+    }
+
+    static std::atomic<AofWriter *> g_aof_{nullptr};
+
+    void SetGlobalAof(AofWriter *aof)
+    {
+        g_aof_ = aof;
+    }
+
+    auto GetGlobalAof() -> AofWriter *
+    {
+        return g_aof_;
     }
 } // namespace rds
@@ -3,6 +3,13 @@
 #include <objects/set.h>
 #include <objects/zset.h>
 #include <objects/hash.h>
+#include <objects/hyperloglog.h>
+#include <objects/bloom.h>
+#include <objects/stream.h>
+#include <objects/timeseries.h>
+#include <objects/vectorset.h>
+#include <objects/cms.h>
+#include <objects/topk.h>
 #include <cstring>
 #include <util.h>
 #include <server/timer.h>
@@ -10,6 +17,12 @@
 
 namespace rds
 {
+    auto AccessClock() -> std::atomic<std::uint32_t> &
+    {
+        static std::atomic<std::uint32_t> clock{static_cast<std::uint32_t>(UsTime() / 1000'000)};
+        return clock;
+    }
+
     KeyValue::KeyValue(const Str &k, std::shared_ptr<Object> v) : key_(k), value_(std::move(v)) {}
 
     KeyValue::KeyValue(const KeyValue &lhs)
@@ -64,7 +77,7 @@ namespace rds
         return ret;
     }
 
-    void KeyValue::Decode(std::deque<char> *source)
+    void KeyValue::Decode(Cursor *source)
     {
         ObjectType otyp = CharToObjectType(source->front());
         source->pop_front();
@@ -91,9 +104,21 @@ namespace rds
         switch (otyp)
         {
         case ObjectType::STR:
-            value_ = std::make_unique<Str>();
-            value_->DecodeValue(source);
+        {
+            auto str = std::make_shared<Str>();
+            str->DecodeValue(source);
+            auto intval = str->GetInt();
+            auto shared = intval.has_value() ? SharedInteger(intval.value()) : nullptr;
+            if (shared)
+            {
+                value_ = std::move(shared);
+            }
+            else
+            {
+                value_ = std::move(str);
+            }
             break;
+        }
         case ObjectType::LIST:
             value_ = std::make_unique<List>();
             value_->DecodeValue(source);
@@ -110,6 +135,34 @@ namespace rds
             value_ = std::make_unique<ZSet>();
             value_->DecodeValue(source);
             break;
+        case ObjectType::HYPERLOGLOG:
+            value_ = std::make_unique<HyperLogLog>();
+            value_->DecodeValue(source);
+            break;
+        case ObjectType::BLOOM:
+            value_ = std::make_unique<BloomFilter>();
+            value_->DecodeValue(source);
+            break;
+        case ObjectType::STREAM:
+            value_ = std::make_unique<Stream>();
+            value_->DecodeValue(source);
+            break;
+        case ObjectType::TIMESERIES:
+            value_ = std::make_unique<TimeSeries>();
+            value_->DecodeValue(source);
+            break;
+        case ObjectType::VECTORSET:
+            value_ = std::make_unique<VectorSet>();
+            value_->DecodeValue(source);
+            break;
+        case ObjectType::CMS:
+            value_ = std::make_unique<CountMinSketch>();
+            value_->DecodeValue(source);
+            break;
+        case ObjectType::TOPK:
+            value_ = std::make_unique<TopK>();
+            value_->DecodeValue(source);
+            break;
         default:
             assert(0);
             break;
@@ -122,6 +175,12 @@ namespace rds
         return value_;
     }
 
+    void KeyValue::SetValue(std::shared_ptr<Object> value)
+    {
+        WriteGuard wg(latch_);
+        value_ = std::move(value);
+    }
+
     auto KeyValue::GetKey() const -> Str
     {
         ReadGuard rg(latch_);
@@ -184,6 +243,42 @@ namespace rds
         return st;
     }
 
+    auto Db::NewTimeSeries(const Str &key) -> std::shared_ptr<Object>
+    {
+        auto ts = std::make_shared<TimeSeries>();
+        auto kv = std::make_shared<KeyValue>(key, ts);
+        WriteGuard wg(latch_);
+        key_value_map_.insert({key, std::move(kv)});
+        return ts;
+    }
+
+    auto Db::NewVectorSet(const Str &key) -> std::shared_ptr<Object>
+    {
+        auto vs = std::make_shared<VectorSet>();
+        auto kv = std::make_shared<KeyValue>(key, vs);
+        WriteGuard wg(latch_);
+        key_value_map_.insert({key, std::move(kv)});
+        return vs;
+    }
+
+    auto Db::NewCountMinSketch(const Str &key) -> std::shared_ptr<Object>
+    {
+        auto cms = std::make_shared<CountMinSketch>();
+        auto kv = std::make_shared<KeyValue>(key, cms);
+        WriteGuard wg(latch_);
+        key_value_map_.insert({key, std::move(kv)});
+        return cms;
+    }
+
+    auto Db::NewTopK(const Str &key) -> std::shared_ptr<Object>
+    {
+        auto tk = std::make_shared<TopK>();
+        auto kv = std::make_shared<KeyValue>(key, tk);
+        WriteGuard wg(latch_);
+        key_value_map_.insert({key, std::move(kv)});
+        return tk;
+    }
+
     auto Db::NewZSet(const Str &key) -> std::shared_ptr<Object>
     {
         auto zst = std::make_shared<ZSet>();
@@ -193,6 +288,33 @@ namespace rds
         return zst;
     }
 
+    auto Db::NewHyperLogLog(const Str &key) -> std::shared_ptr<Object>
+    {
+        auto hll = std::make_shared<HyperLogLog>();
+        auto kv = std::make_shared<KeyValue>(key, hll);
+        WriteGuard wg(latch_);
+        key_value_map_.insert({key, std::move(kv)});
+        return hll;
+    }
+
+    auto Db::NewBloom(const Str &key) -> std::shared_ptr<Object>
+    {
+        auto bf = std::make_shared<BloomFilter>();
+        auto kv = std::make_shared<KeyValue>(key, bf);
+        WriteGuard wg(latch_);
+        key_value_map_.insert({key, std::move(kv)});
+        return bf;
+    }
+
+    auto Db::NewStream(const Str &key) -> std::shared_ptr<Object>
+    {
+        auto st = std::make_shared<Stream>();
+        auto kv = std::make_shared<KeyValue>(key, st);
+        WriteGuard wg(latch_);
+        key_value_map_.insert({key, std::move(kv)});
+        return st;
+    }
+
     auto Db::NewHash(const Str &key) -> std::shared_ptr<Object>
     {
         auto hs = std::make_shared<Hash>();
@@ -216,9 +338,51 @@ namespace rds
         {
             return {};
         }
+        it->second->Touch();
         return it->second->GetValue();
     }
 
+    auto Db::CompressIdle(std::size_t min_len, std::size_t idle_sec, std::size_t budget) -> std::size_t
+    {
+        AccessClock().store(static_cast<std::uint32_t>(UsTime() / 1000'000), std::memory_order_relaxed);
+        ReadGuard rg(latch_);
+        std::size_t ret = 0;
+        // walked bucket by bucket, a rehash in between may only skip or revisit some keys for a lap
+        std::size_t buckets = key_value_map_.bucket_count();
+        std::size_t seen = 0;
+        for (std::size_t i = 0; i < buckets && seen < budget; i++)
+        {
+            std::size_t bucket = compress_cursor_++ % buckets;
+            for (auto it = key_value_map_.begin(bucket); it != key_value_map_.end(bucket); it++, seen++)
+            {
+                if (it->second->IdleSeconds() < idle_sec)
+                {
+                    continue;
+                }
+                auto value = it->second->GetValue().lock();
+                if (value && value->GetObjectType() == ObjectType::STR &&
+                    std::static_pointer_cast<Str>(value)->CompressInPlace(min_len))
+                {
+                    ret++;
+                }
+            }
+        }
+        compress_cursor_ %= buckets;
+        return ret;
+    }
+
+    void Db::SetValue(const Str &key, std::shared_ptr<Object> value)
+    {
+        WriteGuard wg(latch_);
+        auto it = key_value_map_.find(key);
+        if (it == key_value_map_.end())
+        {
+            key_value_map_.insert({key, std::make_shared<KeyValue>(key, std::move(value))});
+            return;
+        }
+        it->second->SetValue(std::move(value));
+    }
+
     auto Db::Expire(const Str &key, std::size_t time_period_us) -> std::unique_ptr<Timer>
     {
         ReadGuard wg(latch_);
@@ -252,46 +416,171 @@ namespace rds
         return "never";
     }
 
-    auto Db::Save() const -> std::string
+    /*
+    ['V'][varint number][varint keys][varint chunks]{[varint keys][varint bytes][chunk]}
+    a chunk holds up to CHUNK_KEYS_ entries and its own hash field names, so
+    the chunks of every database can be decoded at once. 'S' sections, saved
+    before, have the same layout with int and size_t in place of the varints
+     */
+    void Db::Save(const std::function<void(std::string_view)> &out) const
     {
         ReadGuard rg(latch_);
-        std::string ret;
-        ret.push_back(SELECT_DB_);
-        ret.append(BitsToString(number_));
-        ret.append(BitsToString(key_value_map_.size()));
-        for (auto &kv : key_value_map_)
+        std::string header;
+        header.push_back(SELECT_DB_VARINT_);
+        PutVarint(&header, static_cast<std::uint32_t>(number_));
+        PutVarint(&header, key_value_map_.size());
+        PutVarint(&header, (key_value_map_.size() + CHUNK_KEYS_ - 1) / CHUNK_KEYS_);
+        out(header);
+
+        std::string chunk;
+        auto it = key_value_map_.cbegin();
+        while (it != key_value_map_.cend())
         {
-            std::string v = kv.second->Encode();
-            ret.append(v);
+            HashFieldSession session;
+            std::size_t keys = 0;
+            chunk.clear();
+            for (; it != key_value_map_.cend() && keys < CHUNK_KEYS_; ++it, ++keys)
+            {
+                chunk.append(it->second->Encode());
+            }
+            header.clear();
+            PutVarint(&header, keys);
+            PutVarint(&header, chunk.size());
+            out(header);
+            out(chunk);
         }
+    }
+
+    auto Db::Save() const -> std::string
+    {
+        std::string ret;
+        Save([&ret](std::string_view bytes)
+             { ret.append(bytes); });
         return ret;
     }
 
-    void Db::Load(std::deque<char> *source)
+    void Db::Load(Cursor *source)
     {
-        WriteGuard wg(latch_);
+        auto now_us = UsTime();
+        if (IsChunked(*source))
+        {
+            auto section = ReadSection(source);
+            std::vector<std::vector<std::shared_ptr<KeyValue>>> parts;
+            for (auto &[keys, chunk] : section.chunks_)
+            {
+                parts.push_back(DecodeChunk(&chunk, keys, now_us));
+            }
+            Adopt(section.number_, section.keys_, std::move(parts));
+            return;
+        }
+
+        // saved before the chunk index, one run of entries
         char s = source->front();
         source->pop_front();
         if (s != SELECT_DB_)
         {
             throw std::runtime_error("Err loading db");
         }
-        number_ = PeekInt(source);
+        int number = PeekInt(source);
         std::size_t n = PeekSize(source);
-        for (std::size_t i = 0; i < n; i++)
+        std::vector<std::vector<std::shared_ptr<KeyValue>>> parts;
+        parts.push_back(DecodeChunk(source, n, now_us));
+        Adopt(number, n, std::move(parts));
+    }
+
+    auto Db::IsChunked(const Cursor &source) -> bool
+    {
+        return !source.empty() && (source.front() == SELECT_DB_CHUNKED_ || source.front() == SELECT_DB_VARINT_);
+    }
+
+    auto Db::ReadSectionHeader(Cursor *source) -> DbSectionHeader
+    {
+        char s = source->front();
+        source->pop_front();
+        if (s != SELECT_DB_CHUNKED_ && s != SELECT_DB_VARINT_)
+        {
+            throw std::runtime_error("Err loading db");
+        }
+        DbSectionHeader ret;
+        ret.varint_ = s == SELECT_DB_VARINT_;
+        ret.number_ = ret.varint_ ? static_cast<int>(PeekVarint(source)) : PeekInt(source);
+        ret.keys_ = ret.varint_ ? PeekVarint(source) : PeekSize(source);
+        ret.chunks_ = ret.varint_ ? PeekVarint(source) : PeekSize(source);
+        return ret;
+    }
+
+    auto Db::ReadChunkHeader(Cursor *source, const DbSectionHeader &header) -> std::pair<std::size_t, std::size_t>
+    {
+        std::size_t keys = header.varint_ ? PeekVarint(source) : PeekSize(source);
+        std::size_t bytes = header.varint_ ? PeekVarint(source) : PeekSize(source);
+        return {keys, bytes};
+    }
+
+    auto Db::ReadSection(Cursor *source) -> DbSection
+    {
+        auto header = ReadSectionHeader(source);
+        DbSection ret;
+        ret.number_ = header.number_;
+        ret.keys_ = header.keys_;
+        std::size_t total = 0;
+        ret.chunks_.reserve(std::min(header.chunks_, source->size() / 2));
+        for (std::size_t i = 0; i < header.chunks_; i++)
+        {
+            auto [keys, bytes] = ReadChunkHeader(source, header);
+            total += keys;
+            ret.chunks_.emplace_back(keys, Cursor({source->Take(bytes), bytes}));
+        }
+        if (total != ret.keys_)
+        {
+            throw std::runtime_error("Err loading db");
+        }
+        return ret;
+    }
+
+    auto Db::DecodeChunk(Cursor *source, std::size_t keys, std::size_t now_us) -> std::vector<std::shared_ptr<KeyValue>>
+    {
+        HashFieldSession session;
+        std::vector<std::shared_ptr<KeyValue>> ret;
+        ret.reserve(keys);
+        for (std::size_t i = 0; i < keys; i++)
         {
             auto kv = std::make_shared<KeyValue>();
             kv->Decode(source);
             auto expire_time_us = kv->GetExpire();
-            if (expire_time_us.has_value())
+            if (expire_time_us.has_value() && expire_time_us.value() < now_us)
+            {
+                continue;
+            }
+            ret.push_back(std::move(kv));
+        }
+        return ret;
+    }
+
+    void Db::Adopt(int number, std::size_t keys, std::vector<std::vector<std::shared_ptr<KeyValue>>> parts)
+    {
+        WriteGuard wg(latch_);
+        number_ = number;
+        if (number >= Db::number)
+        {
+            // databases created later must not take a loaded number
+            Db::number = number + 1;
+        }
+        key_value_map_.reserve(key_value_map_.size() + keys);
+        for (auto &part : parts)
+        {
+            for (auto &kv : part)
             {
-                auto exp_tmr = std::make_unique<DbExpireTimer>();
-                exp_tmr->database_ = this;
-                exp_tmr->obj_name_ = kv->GetKey().GetRaw();
-                exp_tmr->expire_time_us_ = expire_time_us.value();
-                GetGlobalLoop().EncounterTimer(std::move(exp_tmr));
+                auto expire_time_us = kv->GetExpire();
+                if (expire_time_us.has_value())
+                {
+                    auto exp_tmr = std::make_unique<DbExpireTimer>();
+                    exp_tmr->database_ = this;
+                    exp_tmr->obj_name_ = kv->GetKey().GetRaw();
+                    exp_tmr->expire_time_us_ = expire_time_us.value();
+                    GetGlobalLoop().EncounterTimer(std::move(exp_tmr));
+                }
+                key_value_map_.insert({kv->GetKey(), std::move(kv)});
             }
-            key_value_map_.insert({kv->GetKey(), std::move(kv)});
         }
     }
 }
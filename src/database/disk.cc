@@ -1,18 +1,36 @@
 #include <database/disk.h>
+#include <util.h>
+#include <cstdlib>
+#include <cstring>
 #include <filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <system_error>
 
 namespace rds
 {
     FileManager::~FileManager()
     {
+        if (fd_ != -1)
+        {
+            close(fd_);
+        }
     }
 
     FileManager::FileManager(const std::string &filename) : filename_(filename)
     {
-        if (!std::filesystem::exists(filename))
+        Open();
+    }
+
+    void FileManager::Open()
+    {
+        fd_ = open(filename_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ == -1)
         {
-            std::ofstream ofile_strm;
-            ofile_strm.open(filename, std::ios::out);
+            throw std::system_error(errno, std::generic_category(), "open " + filename_);
         }
     }
 
@@ -21,40 +39,274 @@ namespace rds
         std::filesystem::resize_file(filename_, 0);
     }
 
-    auto FileManager::LoadAndExport() -> std::deque<char>
+    auto FileManager::Rewrite() const -> std::unique_ptr<FileWriter>
+    {
+        return std::make_unique<FileWriter>(filename_);
+    }
+
+    auto WriterStats::Throughput() const -> double
+    {
+        auto us = static_cast<std::int64_t>(UsTime()) - started_us_;
+        return us <= 0 ? 0 : static_cast<double>(bytes_) * 1e6 / static_cast<double>(us);
+    }
+
+    void FileWriter::FreeBuffer::operator()(char *p) const
+    {
+        std::free(p);
+    }
+
+    namespace
     {
-        if (std::filesystem::is_empty(filename_))
+        auto WriteAll(int fd, std::string_view bytes) -> int
         {
-            return {};
+            while (!bytes.empty())
+            {
+                auto n = write(fd, bytes.data(), bytes.size());
+                if (n == -1)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    return errno;
+                }
+                bytes.remove_prefix(n);
+            }
+            return 0;
+        }
+    } // namespace
+
+    FileWriter::FileWriter(const std::string &target) : target_(target), path_(target + ".tmp")
+    {
+        fd_ = open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ == -1)
+        {
+            throw std::system_error(errno, std::generic_category(), "open " + path_);
+        }
+        front_.reset(static_cast<char *>(std::aligned_alloc(BUFFER_ALIGN, BUFFER_BYTES)));
+        back_.reset(static_cast<char *>(std::aligned_alloc(BUFFER_ALIGN, BUFFER_BYTES)));
+        if (front_ == nullptr || back_ == nullptr)
+        {
+            close(fd_);
+            unlink(path_.c_str());
+            throw std::bad_alloc();
         }
-        std::ifstream ifile_strm;
-        ifile_strm.open(filename_, std::ios::in | std::ios::binary);
+        stats_.started_us_ = UsTime();
+        flusher_ = std::thread(&FileWriter::Flusher, this);
+    }
 
-        std::deque<char> ret;
-        while (!ifile_strm.eof())
+    FileWriter::~FileWriter()
+    {
+        Stop();
+        if (fd_ != -1)
         {
-            char c;
-            ifile_strm.read(&c, sizeof(c));
-            if (!ifile_strm.eof())
+            close(fd_);
+        }
+        if (!committed_)
+        {
+            unlink(path_.c_str());
+        }
+    }
+
+    void FileWriter::Flusher()
+    {
+        std::unique_lock ul(mtx_);
+        while (true)
+        {
+            condv_.wait(ul, [this]()
+                        { return back_full_ || stopping_; });
+            if (!back_full_)
             {
-                ret.push_back(c);
+                return;
             }
+            // Append only touches the front buffer meanwhile
+            ul.unlock();
+            auto start_us = UsTime();
+            int err = WriteAll(fd_, {back_.get(), back_size_});
+            auto took_us = static_cast<std::int64_t>(UsTime() - start_us);
+            ul.lock();
+            if (err != 0 && error_ == 0)
+            {
+                error_ = err;
+            }
+            stats_.flushes_++;
+            stats_.write_us_ += took_us;
+            back_full_ = false;
+            condv_.notify_all();
+        }
+    }
+
+    void FileWriter::ThrowIfFailed(const char *what)
+    {
+        if (error_ != 0)
+        {
+            throw std::system_error(error_, std::generic_category(), what + (" " + path_));
         }
-        return ret;
     }
 
-    void FileManager::Write(const std::string &bytes)
+    void FileWriter::Handoff()
     {
-        std::ofstream ofile_strm;
-        ofile_strm.open(filename_, std::ios::out | std::ios::app);
-        ofile_strm << bytes;
+        std::unique_lock ul(mtx_);
+        if (back_full_)
+        {
+            auto start_us = UsTime();
+            condv_.wait(ul, [this]()
+                        { return !back_full_; });
+            stats_.stall_us_ += static_cast<std::int64_t>(UsTime() - start_us);
+        }
+        ThrowIfFailed("write");
+        std::swap(front_, back_);
+        back_size_ = std::exchange(front_size_, 0);
+        back_full_ = true;
+        condv_.notify_all();
     }
 
-    void FileManager::Write(std::string &&bytes)
+    void FileWriter::Drain()
     {
-        std::ofstream ofile_strm;
-        ofile_strm.open(filename_, std::ios::out | std::ios::app);
-        ofile_strm << std::move(bytes);
+        if (front_size_ != 0)
+        {
+            Handoff();
+        }
+        std::unique_lock ul(mtx_);
+        condv_.wait(ul, [this]()
+                    { return !back_full_; });
+        ThrowIfFailed("write");
+    }
+
+    void FileWriter::Stop()
+    {
+        {
+            std::lock_guard lg(mtx_);
+            stopping_ = true;
+        }
+        condv_.notify_all();
+        if (flusher_.joinable())
+        {
+            flusher_.join();
+        }
+    }
+
+    void FileWriter::Append(std::string_view bytes)
+    {
+        while (!bytes.empty())
+        {
+            auto n = std::min(bytes.size(), BUFFER_BYTES - front_size_);
+            std::memcpy(front_.get() + front_size_, bytes.data(), n);
+            front_size_ += n;
+            bytes.remove_prefix(n);
+            stats_.bytes_ += n;
+            if (front_size_ == BUFFER_BYTES)
+            {
+                Handoff();
+            }
+        }
+    }
+
+    auto FileWriter::Written() const -> std::size_t
+    {
+        return stats_.bytes_;
+    }
+
+    auto FileWriter::Stats() -> WriterStats
+    {
+        std::lock_guard lg(mtx_);
+        return stats_;
+    }
+
+    void FileWriter::Sync()
+    {
+        Drain();
+        auto start_us = UsTime();
+        if (fdatasync(fd_) == -1)
+        {
+            throw std::system_error(errno, std::generic_category(), "fdatasync " + path_);
+        }
+        std::lock_guard lg(mtx_);
+        stats_.syncs_++;
+        stats_.write_us_ += static_cast<std::int64_t>(UsTime() - start_us);
+    }
+
+    void FileWriter::Commit()
+    {
+        // fdatasync covers the size too, which is all the rename needs
+        Sync();
+        Stop();
+        close(fd_);
+        fd_ = -1;
+        if (rename(path_.c_str(), target_.c_str()) == -1)
+        {
+            throw std::system_error(errno, std::generic_category(), "rename " + path_);
+        }
+        committed_ = true;
+        SyncDirectory(target_);
+    }
+
+    void SyncDirectory(const std::string &path)
+    {
+        auto dir = std::filesystem::path(path).parent_path();
+        int dir_fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir_fd != -1)
+        {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+
+    auto FileManager::Map() const -> std::unique_ptr<MappedFile>
+    {
+        return std::make_unique<MappedFile>(filename_);
+    }
+
+    MappedFile::MappedFile(const std::string &filename)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1)
+        {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED)
+            {
+                addr_ = addr;
+                size_ = st.st_size;
+                madvise(addr_, size_, MADV_SEQUENTIAL);
+            }
+        }
+        // the mapping outlives the descriptor
+        close(fd);
+    }
+
+    MappedFile::~MappedFile()
+    {
+        if (addr_ != nullptr)
+        {
+            munmap(addr_, size_);
+        }
+    }
+
+    auto MappedFile::Bytes() const -> std::string_view
+    {
+        return {static_cast<const char *>(addr_), size_};
+    }
+
+    void FileManager::Write(std::string_view bytes)
+    {
+        int err = WriteAll(fd_, bytes);
+        if (err != 0)
+        {
+            throw std::system_error(err, std::generic_category(), "write " + filename_);
+        }
+    }
+
+    void FileManager::Sync()
+    {
+        if (fdatasync(fd_) == -1)
+        {
+            throw std::system_error(errno, std::generic_category(), "fdatasync " + filename_);
+        }
     }
 
     auto FileManager::Name() const -> std::string
@@ -67,12 +319,9 @@ namespace rds
     }
     void FileManager::Change(const std::string &filename)
     {
+        close(std::exchange(fd_, -1));
         filename_ = filename;
-        if (!std::filesystem::exists(filename))
-        {
-            std::ofstream ofile_strm;
-            ofile_strm.open(filename, std::ios::out);
-        }
+        Open();
     }
 
 } // namespace rds
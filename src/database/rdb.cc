@@ -1,36 +1,581 @@
 #include <database/rdb.h>
 #include <list>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <sys/wait.h>
+#include <unistd.h>
 
 namespace rds
 {
-    auto RDBLoad(std::deque<char> *source) -> std::list<std::unique_ptr<Db>>
+    namespace
+    {
+        /* task(0) .. task(n - 1) run by a few threads taking the next one in
+           turn, the first exception stops them and is thrown here */
+        void ParallelFor(std::size_t n, const std::function<void(std::size_t)> &task)
+        {
+            std::atomic<std::size_t> next{0};
+            std::mutex error_mtx;
+            std::exception_ptr error;
+            auto work = [&]()
+            {
+                for (std::size_t t = next++; t < n; t = next++)
+                {
+                    try
+                    {
+                        task(t);
+                    }
+                    catch (...)
+                    {
+                        std::lock_guard lg(error_mtx);
+                        error = std::current_exception();
+                        next = n;
+                    }
+                }
+            };
+
+            std::size_t n_worker = std::min<std::size_t>(std::max(1u, std::thread::hardware_concurrency()), n);
+            std::vector<std::thread> workers;
+            for (std::size_t w = 1; w < n_worker; w++)
+            {
+                workers.emplace_back(work);
+            }
+            work();
+            for (auto &w : workers)
+            {
+                w.join();
+            }
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+        }
+
+        /* the chunks of all sections decoded at once, the databases adopt
+           them afterwards on this thread */
+        void DecodeSections(std::vector<std::pair<Db *, DbSection>> &sections)
+        {
+            std::vector<std::pair<std::size_t, std::size_t>> tasks;
+            std::vector<std::vector<std::vector<std::shared_ptr<KeyValue>>>> parts(sections.size());
+            for (std::size_t i = 0; i < sections.size(); i++)
+            {
+                parts[i].resize(sections[i].second.chunks_.size());
+                for (std::size_t j = 0; j < sections[i].second.chunks_.size(); j++)
+                {
+                    tasks.emplace_back(i, j);
+                }
+            }
+
+            auto now_us = UsTime();
+            ParallelFor(tasks.size(), [&](std::size_t t)
+                        {
+                            auto [i, j] = tasks[t];
+                            auto &[keys, chunk] = sections[i].second.chunks_[j];
+                            parts[i][j] = Db::DecodeChunk(&chunk, keys, now_us);
+                            if (!chunk.empty())
+                            {
+                                throw std::runtime_error("chunk size mismatch");
+                            } });
+
+            for (std::size_t i = 0; i < sections.size(); i++)
+            {
+                auto &[db, section] = sections[i];
+                db->Adopt(section.number_, section.keys_, std::move(parts[i]));
+            }
+        }
+    } // namespace
+
+    auto RDBLoad(Cursor *source, bool *ok) -> std::list<std::unique_ptr<Db>>
     {
         Log("Loading rdb databases...");
+        if (ok != nullptr)
+        {
+            *ok = true;
+        }
+        if (source->empty())
+        {
+            return {};
+        }
         std::list<std::unique_ptr<Db>> ret;
-        auto rdb_str = PeekString(source, 3);
-        if (rdb_str != "RDB")
+        try
+        {
+            if (source->size() < 3 || PeekString(source, 3) != "RDB")
+            {
+                throw std::runtime_error("no rdb magic");
+            }
+            ret = RDBDecodeStream(source);
+            if (!source->empty())
+            {
+                throw std::runtime_error("bytes after the last block");
+            }
+        }
+        catch (const std::exception &e)
         {
-            Log("RDB file loading error, return empty databases");
+            Log("RDB file is corrupted (", e.what(), ")");
+            if (ok != nullptr)
+            {
+                *ok = false;
+            }
             return {};
         }
+        return ret;
+    }
+
+    namespace
+    {
+        constexpr std::size_t SECTION_HEADER_BYTES = 32; // a mark and three varints at most
+        constexpr std::size_t CHUNK_HEADER_BYTES = 20;
+        constexpr std::size_t LOAD_BATCH_BYTES = 16 << 20;
+
+        /* the databases of a v2 payload decoded as its blocks are read: chunks
+           are copied out of the window and decoded a batch at a time, so the
+           load holds a batch of encoded keys, never the whole payload */
+        auto DecodeBlocks(RdbBlockReader *reader) -> std::list<std::unique_ptr<Db>>
+        {
+            struct Section
+            {
+                DbSectionHeader header_;
+                std::vector<std::vector<std::shared_ptr<KeyValue>>> parts_;
+            };
+            struct Chunk
+            {
+                std::string bytes_;
+                std::size_t keys_;
+                std::vector<std::shared_ptr<KeyValue>> *out_;
+            };
+            std::list<Section> sections;
+            std::vector<Chunk> batch;
+            std::size_t batch_bytes = 0;
+            auto now_us = UsTime();
+            auto decode = [&batch, &batch_bytes, now_us]()
+            {
+                ParallelFor(batch.size(), [&batch, now_us](std::size_t i)
+                            {
+                                Cursor chunk(batch[i].bytes_);
+                                *batch[i].out_ = Db::DecodeChunk(&chunk, batch[i].keys_, now_us);
+                                if (!chunk.empty())
+                                {
+                                    throw std::runtime_error("chunk size mismatch");
+                                } });
+                batch.clear();
+                batch_bytes = 0;
+            };
+
+            while (!reader->Done())
+            {
+                auto header = reader->Peek(SECTION_HEADER_BYTES);
+                std::size_t ahead = header.size();
+                auto &section = sections.emplace_back();
+                section.header_ = Db::ReadSectionHeader(&header);
+                reader->Skip(ahead - header.size());
+                // never more chunks than keys, a corrupted count is not trusted with memory
+                if (section.header_.chunks_ > section.header_.keys_)
+                {
+                    throw std::runtime_error("Err loading db");
+                }
+                section.parts_.resize(section.header_.chunks_);
+                std::size_t total = 0;
+                for (auto &part : section.parts_)
+                {
+                    auto chunk_header = reader->Peek(CHUNK_HEADER_BYTES);
+                    ahead = chunk_header.size();
+                    auto [keys, bytes] = Db::ReadChunkHeader(&chunk_header, section.header_);
+                    reader->Skip(ahead - chunk_header.size());
+                    total += keys;
+                    auto body = reader->Peek(bytes);
+                    batch.push_back({std::string(body.Take(bytes), bytes), keys, &part});
+                    reader->Skip(bytes);
+                    batch_bytes += bytes;
+                    if (batch_bytes >= LOAD_BATCH_BYTES)
+                    {
+                        decode();
+                    }
+                }
+                if (total != section.header_.keys_)
+                {
+                    throw std::runtime_error("Err loading db");
+                }
+            }
+            decode();
+
+            std::list<std::unique_ptr<Db>> ret;
+            for (auto &section : sections)
+            {
+                auto db = std::make_unique<Db>();
+                db->Adopt(section.header_.number_, section.header_.keys_, std::move(section.parts_));
+                ret.push_back(std::move(db));
+            }
+            return ret;
+        }
+    } // namespace
+
+    auto RDBDecodeStream(Cursor *source) -> std::list<std::unique_ptr<Db>>
+    {
+        // a v1 payload starts with a section mark or is empty, never with the version
+        if (source->empty() || source->front() != RDB_VERSION)
+        {
+            return RDBDecode(source);
+        }
+        source->pop_front();
+        RdbBlockReader reader(source);
+        return DecodeBlocks(&reader);
+    }
+
+    void RdbBlockReader::Fill()
+    {
+        struct Block
+        {
+            std::size_t offset_;
+            std::size_t raw_;
+            CodecId codec_;
+            std::string_view stored_;
+            std::uint64_t crc_;
+        };
+        std::vector<Block> blocks;
+        window_.erase(0, pos_);
+        pos_ = 0;
+        std::size_t total = window_.size();
+        while (!end_ && blocks.size() < BATCH_BLOCKS)
+        {
+            std::size_t raw = PeekVarint(source_);
+            if (raw == 0)
+            {
+                end_ = true;
+                break;
+            }
+            if (raw > RDB_BLOCK_BYTES)
+            {
+                throw std::runtime_error("block too large");
+            }
+            auto codec = static_cast<CodecId>(*source_->Take(1));
+            std::size_t size = PeekVarint(source_);
+            std::string_view stored(source_->Take(size), size);
+            std::uint64_t crc;
+            std::memcpy(&crc, source_->Take(sizeof(crc)), sizeof(crc));
+            if (GetCodec(codec) == nullptr || (codec == CodecId::NONE && size != raw))
+            {
+                throw std::runtime_error("bad block");
+            }
+            blocks.push_back({total, raw, codec, stored, crc});
+            total += raw;
+        }
+
+        window_.resize(total);
+        ParallelFor(blocks.size(), [this, &blocks](std::size_t i)
+                    {
+                        auto &block = blocks[i];
+                        if (Crc64(0, block.stored_.data(), block.stored_.size()) != block.crc_)
+                        {
+                            throw std::runtime_error("block checksum mismatch");
+                        }
+                        // the checksum vouches for the stored bytes, they fill the block exactly
+                        auto dst = reinterpret_cast<std::uint8_t *>(window_.data() + block.offset_);
+                        auto len = GetCodec(block.codec_)->Decode(dst, block.raw_, reinterpret_cast<const std::uint8_t *>(block.stored_.data()),
+                                                                  block.stored_.size());
+                        if (len != block.raw_)
+                        {
+                            throw std::runtime_error("block does not inflate to its size");
+                        } });
+    }
+
+    auto RdbBlockReader::Peek(std::size_t n) -> Cursor
+    {
+        while (window_.size() - pos_ < n && !end_)
+        {
+            Fill();
+        }
+        return Cursor(std::string_view(window_).substr(pos_));
+    }
+
+    void RdbBlockReader::Skip(std::size_t n)
+    {
+        pos_ += std::min(n, window_.size() - pos_);
+    }
+
+    auto RdbBlockReader::Done() -> bool
+    {
+        return Peek(1).empty();
+    }
 
-        while (!source->empty())
+    auto RDBReadBlocks(Cursor *source) -> std::string
+    {
+        RdbBlockReader reader(source);
+        std::string ret;
+        for (auto bytes = reader.Peek(RDB_BLOCK_BYTES); !bytes.empty(); bytes = reader.Peek(RDB_BLOCK_BYTES))
+        {
+            auto n = bytes.size();
+            ret.append(bytes.Take(n), n);
+            reader.Skip(n);
+        }
+        return ret;
+    }
+
+    RdbBlockWriter::RdbBlockWriter(ByteSink out, CompressPolicy policy) : out_(std::move(out)), policy_(policy)
+    {
+        raw_.reserve(RDB_BLOCK_BYTES);
+    }
+
+    void RdbBlockWriter::Append(std::string_view bytes)
+    {
+        while (!bytes.empty())
+        {
+            auto n = std::min(bytes.size(), RDB_BLOCK_BYTES - raw_.size());
+            raw_.append(bytes.substr(0, n));
+            bytes.remove_prefix(n);
+            if (raw_.size() == RDB_BLOCK_BYTES)
+            {
+                Flush();
+            }
+        }
+    }
+
+    void RdbBlockWriter::Flush()
+    {
+        if (raw_.empty())
+        {
+            return;
+        }
+        auto compressed = Compress(raw_, policy_);
+        auto codec = compressed.has_value() ? policy_.codec_ : CodecId::NONE;
+        std::string_view stored = compressed.has_value() ? std::string_view(compressed.value()) : std::string_view(raw_);
+        std::string header;
+        PutVarint(&header, raw_.size());
+        header.push_back(static_cast<char>(codec));
+        PutVarint(&header, stored.size());
+        out_(header);
+        out_(stored);
+        out_(BitsToString(Crc64(0, stored.data(), stored.size())));
+        raw_.clear();
+    }
+
+    void RdbBlockWriter::Finish()
+    {
+        Flush();
+        std::string end;
+        PutVarint(&end, 0);
+        out_(end);
+    }
+
+    void RDBWrite(const ByteSink &out, const DatabaseEncoder &encode)
+    {
+        out("RDB");
+        out(std::string_view(&RDB_VERSION, 1));
+        RdbBlockWriter blocks(out);
+        encode([&blocks](std::string_view bytes)
+               { blocks.Append(bytes); });
+        blocks.Finish();
+    }
+
+    auto RDBDecode(Cursor *source, std::size_t count) -> std::list<std::unique_ptr<Db>>
+    {
+        std::list<std::unique_ptr<Db>> ret;
+        // the index of every database is read first so their chunks decode together
+        std::vector<std::pair<Db *, DbSection>> sections;
+        while (!source->empty() && ret.size() < count)
         {
             auto db = std::make_unique<Db>();
-            db->Load(source);
+            if (Db::IsChunked(*source))
+            {
+                sections.emplace_back(db.get(), Db::ReadSection(source));
+            }
+            else
+            {
+                db->Load(source);
+            }
             ret.push_back(std::move(db));
         }
+        if (count != SIZE_MAX && ret.size() != count)
+        {
+            throw std::out_of_range("databases missing");
+        }
+        DecodeSections(sections);
         return ret;
     }
 
-    void RDBSave(std::vector<std::string> database_sources, FileManager *dump_file)
+    auto RDBSave(const DatabaseEncoder &encode, FileManager *dump_file) -> bool
+    {
+        try
+        {
+            auto out = dump_file->Rewrite();
+            RDBWrite([&out](std::string_view bytes)
+                     { out->Append(bytes); },
+                     encode);
+            out->Commit();
+            auto stats = out->Stats();
+            Log("RDB wrote", stats.bytes_, "bytes at", stats.Throughput() / 1e6, "MB/s, waited",
+                stats.stall_us_ / 1000, "ms on the disk");
+            return true;
+        }
+        catch (const std::exception &e)
+        {
+            Log("RDB save failed (", e.what(), "), the previous file is kept");
+            return false;
+        }
+    }
+
+    RdbSaver::RdbSaver(DatabaseEncoder encode, std::function<std::size_t()> dirty, FileManager *dump_file,
+                       std::vector<std::pair<std::size_t, std::size_t>> rules) : encode_(std::move(encode)),
+                                                                                  dirty_(std::move(dirty)),
+                                                                                  dump_file_(dump_file),
+                                                                                  rules_(std::move(rules)),
+                                                                                  last_save_(time(nullptr))
+    {
+        // what was loaded at start is on disk already
+        dirty_saved_ = dirty_();
+        thread_ = std::thread(&RdbSaver::Run, this);
+    }
+
+    RdbSaver::~RdbSaver()
     {
-        dump_file->Truncate();
-        dump_file->Write("RDB");
-        for (auto &db : database_sources)
         {
-            dump_file->Write(db);
+            std::lock_guard lg(mtx_);
+            stopping_ = true;
+        }
+        condv_.notify_one();
+        thread_.join();
+    }
+
+    auto RdbSaver::Request() -> bool
+    {
+        std::lock_guard lg(mtx_);
+        if (requested_ || in_progress_)
+        {
+            return false;
+        }
+        requested_ = true;
+        condv_.notify_one();
+        return true;
+    }
+
+    auto RdbSaver::Changes() const -> std::size_t
+    {
+        std::size_t now = dirty_();
+        std::size_t saved = dirty_saved_;
+        return now > saved ? now - saved : 0;
+    }
+
+    auto RdbSaver::Due() const -> bool
+    {
+        if (in_progress_)
+        {
+            return false;
+        }
+        std::int64_t now = time(nullptr);
+        if (!last_ok_ && now - last_try_ < SAVE_RETRY_SEC)
+        {
+            return false;
+        }
+        std::size_t changes = Changes();
+        for (auto [seconds, writes] : rules_)
+        {
+            if (changes >= writes && changes > 0 && now - last_save_ >= static_cast<std::int64_t>(seconds))
+            {
+                return true;
+            }
         }
+        return false;
+    }
+
+    void RdbSaver::Run()
+    {
+        while (true)
+        {
+            {
+                std::unique_lock ul(mtx_);
+                condv_.wait(ul, [this]()
+                            { return requested_ || stopping_; });
+                if (stopping_)
+                {
+                    return;
+                }
+                requested_ = false;
+                in_progress_ = true;
+            }
+            auto start_us = UsTime();
+            bool ok = ForkAndSave();
+            last_duration_ms_ = (UsTime() - start_us) / 1000;
+            last_ok_ = ok;
+            if (ok)
+            {
+                last_save_ = time(nullptr);
+                dirty_saved_ = dirty_at_fork_.load();
+                saves_++;
+            }
+            in_progress_ = false;
+        }
+    }
+
+    auto ForkAndWait(const std::string &what, const std::function<void()> &at_fork, const std::function<bool()> &child) -> bool
+    {
+        pid_t pid;
+        {
+            // every command and timer is between two runs once this is held
+            std::unique_lock fence(ForkFence());
+            at_fork();
+            pid = fork();
+        }
+        if (pid == 0)
+        {
+            // only this thread lives on in the child, it must not return into the server
+            _exit(child() ? 0 : 1);
+        }
+        if (pid == -1)
+        {
+            Log("Can not fork for a background", what, ":", strerror(errno));
+            return false;
+        }
+        Log("Background", what, "started by pid", pid);
+        int status = 0;
+        while (waitpid(pid, &status, 0) == -1)
+        {
+            if (errno != EINTR)
+            {
+                return false;
+            }
+        }
+        bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        Log("Background", what, ok ? "terminated with success" : "failed");
+        return ok;
+    }
+
+    auto RdbSaver::ForkAndSave() -> bool
+    {
+        return ForkAndWait(
+            "saving", [this]()
+            {
+                last_try_ = time(nullptr);
+                dirty_at_fork_ = dirty_(); },
+            [this]()
+            { return RDBSave(encode_, dump_file_); });
+    }
+
+    auto RdbSaver::InProgress() const -> bool
+    {
+        return in_progress_;
+    }
+
+    auto RdbSaver::LastSave() const -> std::int64_t
+    {
+        return last_save_;
+    }
+
+    auto RdbSaver::LastOk() const -> bool
+    {
+        return last_ok_;
+    }
+
+    auto RdbSaver::LastDurationMs() const -> std::int64_t
+    {
+        return last_duration_ms_;
+    }
+
+    auto RdbSaver::Saves() const -> std::size_t
+    {
+        return saves_;
     }
 
 } // namespace rds
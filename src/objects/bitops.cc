@@ -0,0 +1,264 @@
+#include <objects/bitops.h>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RDS_BITOPS_X86
+#endif
+
+namespace rds
+{
+    namespace
+    {
+        using PopCountFn = std::size_t (*)(const std::uint8_t *, std::size_t);
+        using FindFn = std::size_t (*)(const std::uint8_t *, std::size_t, std::uint8_t);
+        using CombineFn = void (*)(BitOperation, std::uint8_t *, const std::uint8_t *, std::size_t);
+        using MaxFn = void (*)(std::uint8_t *, const std::uint8_t *, std::size_t);
+
+        inline auto Load64(const std::uint8_t *p) -> std::uint64_t
+        {
+            std::uint64_t ret;
+            std::memcpy(&ret, p, sizeof(ret));
+            return ret;
+        }
+
+        inline void Store64(std::uint8_t *p, std::uint64_t v)
+        {
+            std::memcpy(p, &v, sizeof(v));
+        }
+
+        auto PopCountGeneric(const std::uint8_t *data, std::size_t len) -> std::size_t
+        {
+            std::size_t ret = 0;
+            std::size_t i = 0;
+            for (; i + 8 <= len; i += 8)
+            {
+                ret += __builtin_popcountll(Load64(data + i));
+            }
+            for (; i < len; i++)
+            {
+                ret += __builtin_popcount(data[i]);
+            }
+            return ret;
+        }
+
+        auto FindGeneric(const std::uint8_t *data, std::size_t len, std::uint8_t skip) -> std::size_t
+        {
+            std::uint64_t pattern = 0x0101010101010101ULL * skip;
+            std::size_t i = 0;
+            for (; i + 8 <= len; i += 8)
+            {
+                if (Load64(data + i) != pattern)
+                {
+                    break;
+                }
+            }
+            for (; i < len; i++)
+            {
+                if (data[i] != skip)
+                {
+                    return i;
+                }
+            }
+            return len;
+        }
+
+        void CombineGeneric(BitOperation op, std::uint8_t *dst, const std::uint8_t *src, std::size_t len)
+        {
+            std::size_t i = 0;
+            for (; i + 8 <= len; i += 8)
+            {
+                std::uint64_t a = Load64(dst + i);
+                std::uint64_t b = Load64(src + i);
+                Store64(dst + i, op == BitOperation::AND ? (a & b) : op == BitOperation::OR ? (a | b)
+                                                                                             : (a ^ b));
+            }
+            for (; i < len; i++)
+            {
+                dst[i] = op == BitOperation::AND ? (dst[i] & src[i]) : op == BitOperation::OR ? (dst[i] | src[i])
+                                                                                               : (dst[i] ^ src[i]);
+            }
+        }
+
+        void MaxGeneric(std::uint8_t *dst, const std::uint8_t *src, std::size_t len)
+        {
+            for (std::size_t i = 0; i < len; i++)
+            {
+                dst[i] = std::max(dst[i], src[i]);
+            }
+        }
+
+#ifdef RDS_BITOPS_X86
+        __attribute__((target("popcnt"))) auto PopCountPopcnt(const std::uint8_t *data, std::size_t len) -> std::size_t
+        {
+            std::size_t ret = 0;
+            std::size_t i = 0;
+            for (; i + 8 <= len; i += 8)
+            {
+                ret += _mm_popcnt_u64(Load64(data + i));
+            }
+            for (; i < len; i++)
+            {
+                ret += _mm_popcnt_u32(data[i]);
+            }
+            return ret;
+        }
+
+        /* nibble lookup through vpshufb, byte counters are folded with vpsadbw
+           before they can overflow */
+        __attribute__((target("avx2,popcnt"))) auto PopCountAvx2(const std::uint8_t *data, std::size_t len) -> std::size_t
+        {
+            const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+            const __m256i low_mask = _mm256_set1_epi8(0x0f);
+            const __m256i zero = _mm256_setzero_si256();
+            __m256i total = zero;
+            std::size_t i = 0;
+            while (i + 32 <= len)
+            {
+                __m256i local = zero;
+                for (int k = 0; k < 31 && i + 32 <= len; k++, i += 32)
+                {
+                    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+                    __m256i lo = _mm256_and_si256(v, low_mask);
+                    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+                    local = _mm256_add_epi8(local, _mm256_shuffle_epi8(lookup, lo));
+                    local = _mm256_add_epi8(local, _mm256_shuffle_epi8(lookup, hi));
+                }
+                total = _mm256_add_epi64(total, _mm256_sad_epu8(local, zero));
+            }
+            std::size_t ret = static_cast<std::size_t>(_mm256_extract_epi64(total, 0)) +
+                              static_cast<std::size_t>(_mm256_extract_epi64(total, 1)) +
+                              static_cast<std::size_t>(_mm256_extract_epi64(total, 2)) +
+                              static_cast<std::size_t>(_mm256_extract_epi64(total, 3));
+            return ret + PopCountPopcnt(data + i, len - i);
+        }
+
+        __attribute__((target("avx2"))) auto FindAvx2(const std::uint8_t *data, std::size_t len, std::uint8_t skip) -> std::size_t
+        {
+            const __m256i pattern = _mm256_set1_epi8(static_cast<char>(skip));
+            std::size_t i = 0;
+            for (; i + 32 <= len; i += 32)
+            {
+                __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+                auto mask = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pattern)));
+                if (mask != 0xffffffffU)
+                {
+                    return i + __builtin_ctz(~mask);
+                }
+            }
+            return i + FindGeneric(data + i, len - i, skip);
+        }
+
+        __attribute__((target("avx2"))) void CombineAvx2(BitOperation op, std::uint8_t *dst, const std::uint8_t *src, std::size_t len)
+        {
+            std::size_t i = 0;
+            for (; i + 32 <= len; i += 32)
+            {
+                __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+                __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+                __m256i r = op == BitOperation::AND ? _mm256_and_si256(a, b) : op == BitOperation::OR ? _mm256_or_si256(a, b)
+                                                                                                       : _mm256_xor_si256(a, b);
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), r);
+            }
+            CombineGeneric(op, dst + i, src + i, len - i);
+        }
+
+        __attribute__((target("avx2"))) void MaxAvx2(std::uint8_t *dst, const std::uint8_t *src, std::size_t len)
+        {
+            std::size_t i = 0;
+            for (; i + 32 <= len; i += 32)
+            {
+                __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+                __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_max_epu8(a, b));
+            }
+            MaxGeneric(dst + i, src + i, len - i);
+        }
+#endif
+
+        struct Kernels
+        {
+            PopCountFn popcount_;
+            FindFn find_;
+            CombineFn combine_;
+            MaxFn max_;
+            const char *name_;
+        };
+
+        auto GetKernels() -> const Kernels &
+        {
+            static const Kernels kernels = []() -> Kernels
+            {
+#ifdef RDS_BITOPS_X86
+                __builtin_cpu_init();
+                if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+                {
+                    return {PopCountAvx2, FindAvx2, CombineAvx2, MaxAvx2, "avx2"};
+                }
+                if (__builtin_cpu_supports("popcnt"))
+                {
+                    return {PopCountPopcnt, FindGeneric, CombineGeneric, MaxGeneric, "popcnt"};
+                }
+#endif
+                return {PopCountGeneric, FindGeneric, CombineGeneric, MaxGeneric, "generic"};
+            }();
+            return kernels;
+        }
+    } // namespace
+
+    auto PopCount(const std::uint8_t *data, std::size_t len) -> std::size_t
+    {
+        return GetKernels().popcount_(data, len);
+    }
+
+    auto FindFirstByteNot(const std::uint8_t *data, std::size_t len, std::uint8_t skip) -> std::size_t
+    {
+        return GetKernels().find_(data, len, skip);
+    }
+
+    auto BitOp(BitOperation op, const std::vector<std::string_view> &sources) -> std::string
+    {
+        std::size_t max_len = 0;
+        for (auto &s : sources)
+        {
+            max_len = std::max(max_len, s.size());
+        }
+        if (sources.empty() || max_len == 0)
+        {
+            return {};
+        }
+        std::string ret(max_len, '\0');
+        std::memcpy(ret.data(), sources[0].data(), sources[0].size());
+        auto dst = reinterpret_cast<std::uint8_t *>(ret.data());
+        if (op == BitOperation::NOT)
+        {
+            // NOT has a single source, xor with all ones
+            std::string ones(max_len, '\xff');
+            GetKernels().combine_(BitOperation::XOR, dst, reinterpret_cast<const std::uint8_t *>(ones.data()), max_len);
+            return ret;
+        }
+        for (std::size_t i = 1; i < sources.size(); i++)
+        {
+            auto src = reinterpret_cast<const std::uint8_t *>(sources[i].data());
+            GetKernels().combine_(op, dst, src, sources[i].size());
+            if (op == BitOperation::AND && sources[i].size() < max_len)
+            {
+                std::memset(dst + sources[i].size(), 0, max_len - sources[i].size());
+            }
+        }
+        return ret;
+    }
+
+    void MaxBytes(std::uint8_t *dst, const std::uint8_t *src, std::size_t len)
+    {
+        GetKernels().max_(dst, src, len);
+    }
+
+    auto BitOpsImplementation() -> const char *
+    {
+        return GetKernels().name_;
+    }
+
+} // namespace rds
@@ -0,0 +1,308 @@
+#include <objects/bloom.h>
+#include <database/rdb.h>
+#include <cmath>
+
+namespace rds
+{
+    namespace
+    {
+        constexpr std::uint64_t BLOOM_SEED = 0x5f3759dfULL;
+        constexpr std::size_t BLOCK_BITS = sizeof(BloomFilter::Block) * 8;
+
+        auto BlockIndex(std::uint64_t hash, std::size_t blocks) -> std::size_t
+        {
+            return static_cast<std::size_t>((static_cast<unsigned __int128>(hash) * blocks) >> 64);
+        }
+
+        /* double hashing inside the block, the step is remixed so it does not
+           follow the bits that picked the block */
+        inline auto BitInBlock(std::uint64_t hash, int i) -> std::uint32_t
+        {
+            auto h1 = static_cast<std::uint32_t>(hash);
+            auto h2 = static_cast<std::uint32_t>((hash * 0x9e3779b97f4a7c15ULL) >> 32) | 1;
+            return (h1 + i * h2) & (BLOCK_BITS - 1);
+        }
+
+        template <typename T>
+        auto PeekBits(Cursor *source) -> T
+        {
+            std::string raw = PeekString(source, sizeof(T));
+            T ret;
+            std::memcpy(&ret, raw.data(), sizeof(T));
+            return ret;
+        }
+    } // namespace
+
+    BloomFilter::BloomFilter(const BloomFilter &lhs)
+    {
+        ReadGuard rg(lhs.ExposeLatch());
+        error_rate_ = lhs.error_rate_;
+        expansion_ = lhs.expansion_;
+        scaling_ = lhs.scaling_;
+        layers_ = lhs.layers_;
+    }
+
+    BloomFilter::BloomFilter(BloomFilter &&rhs) noexcept
+    {
+        ReadGuard rg(rhs.ExposeLatch());
+        error_rate_ = rhs.error_rate_;
+        expansion_ = rhs.expansion_;
+        scaling_ = rhs.scaling_;
+        layers_ = std::move(rhs.layers_);
+    }
+
+    BloomFilter &BloomFilter::operator=(const BloomFilter &lhs)
+    {
+        ReadGuard rg(lhs.ExposeLatch());
+        error_rate_ = lhs.error_rate_;
+        expansion_ = lhs.expansion_;
+        scaling_ = lhs.scaling_;
+        layers_ = lhs.layers_;
+        return *this;
+    }
+
+    BloomFilter &BloomFilter::operator=(BloomFilter &&rhs) noexcept
+    {
+        ReadGuard rg(rhs.ExposeLatch());
+        error_rate_ = rhs.error_rate_;
+        expansion_ = rhs.expansion_;
+        scaling_ = rhs.scaling_;
+        layers_ = std::move(rhs.layers_);
+        return *this;
+    }
+
+    auto BloomFilter::MakeLayer(std::size_t capacity, double error_rate) -> Layer
+    {
+        // blocking costs some accuracy, one extra hash and 20% more bits win it back
+        const double ln2 = std::log(2.0);
+        double bits = std::ceil(-static_cast<double>(capacity) * std::log(error_rate) / (ln2 * ln2) * 1.2);
+        auto blocks = std::max<std::size_t>(1, static_cast<std::size_t>(std::ceil(bits / BLOCK_BITS)));
+        int hashes = std::max(1, static_cast<int>(std::ceil(-std::log2(error_rate)))) + 1;
+        Layer ret;
+        ret.capacity_ = capacity;
+        ret.count_ = 0;
+        ret.hashes_ = hashes;
+        ret.blocks_.assign(blocks, Block{});
+        return ret;
+    }
+
+    auto BloomFilter::LayerTest(const Layer &layer, std::uint64_t hash) -> bool
+    {
+        const Block &block = layer.blocks_[BlockIndex(hash, layer.blocks_.size())];
+        for (int i = 0; i < layer.hashes_; i++)
+        {
+            auto bit = BitInBlock(hash, i);
+            if (!(block.words_[bit >> 6] & (1ULL << (bit & 63))))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void BloomFilter::LayerSet(Layer *layer, std::uint64_t hash)
+    {
+        Block &block = layer->blocks_[BlockIndex(hash, layer->blocks_.size())];
+        for (int i = 0; i < layer->hashes_; i++)
+        {
+            auto bit = BitInBlock(hash, i);
+            block.words_[bit >> 6] |= 1ULL << (bit & 63);
+        }
+        layer->count_++;
+    }
+
+    auto BloomFilter::Contains(std::uint64_t hash) const -> bool
+    {
+        for (auto it = layers_.rbegin(); it != layers_.rend(); it++)
+        {
+            if (LayerTest(*it, hash))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    auto BloomFilter::Insert(std::uint64_t hash) -> int
+    {
+        if (layers_.empty())
+        {
+            layers_.push_back(MakeLayer(DEFAULT_CAPACITY, error_rate_));
+        }
+        if (Contains(hash))
+        {
+            return 0;
+        }
+        if (layers_.back().count_ >= layers_.back().capacity_)
+        {
+            if (!scaling_)
+            {
+                return -1;
+            }
+            std::size_t capacity = layers_.back().capacity_ * expansion_;
+            double error_rate = error_rate_ * std::pow(0.5, layers_.size());
+            layers_.push_back(MakeLayer(capacity, error_rate));
+        }
+        LayerSet(&layers_.back(), hash);
+        return 1;
+    }
+
+    auto BloomFilter::Reserve(double error_rate, std::size_t capacity, std::uint32_t expansion, bool scaling) -> bool
+    {
+        WriteGuard wg(latch_);
+        for (auto &layer : layers_)
+        {
+            if (layer.count_ != 0)
+            {
+                return false;
+            }
+        }
+        error_rate_ = error_rate;
+        expansion_ = expansion;
+        scaling_ = scaling;
+        layers_.clear();
+        layers_.push_back(MakeLayer(capacity, error_rate));
+        return true;
+    }
+
+    auto BloomFilter::Add(const std::vector<std::string> &elements) -> std::vector<int>
+    {
+        std::vector<std::uint64_t> hashes;
+        hashes.reserve(elements.size());
+        for (auto &e : elements)
+        {
+            hashes.push_back(MurmurHash64A(e.data(), e.size(), BLOOM_SEED));
+        }
+        WriteGuard wg(latch_);
+        for (auto hash : hashes)
+        {
+            for (auto &layer : layers_)
+            {
+                __builtin_prefetch(&layer.blocks_[BlockIndex(hash, layer.blocks_.size())], 1);
+            }
+        }
+        std::vector<int> ret;
+        ret.reserve(hashes.size());
+        for (auto hash : hashes)
+        {
+            ret.push_back(Insert(hash));
+        }
+        return ret;
+    }
+
+    auto BloomFilter::Exists(const std::vector<std::string> &elements) const -> std::vector<bool>
+    {
+        std::vector<std::uint64_t> hashes;
+        hashes.reserve(elements.size());
+        for (auto &e : elements)
+        {
+            hashes.push_back(MurmurHash64A(e.data(), e.size(), BLOOM_SEED));
+        }
+        ReadGuard rg(latch_);
+        for (auto hash : hashes)
+        {
+            for (auto &layer : layers_)
+            {
+                __builtin_prefetch(&layer.blocks_[BlockIndex(hash, layer.blocks_.size())], 0);
+            }
+        }
+        std::vector<bool> ret;
+        ret.reserve(hashes.size());
+        for (auto hash : hashes)
+        {
+            ret.push_back(Contains(hash));
+        }
+        return ret;
+    }
+
+    auto BloomFilter::Capacity() const -> std::size_t
+    {
+        ReadGuard rg(latch_);
+        std::size_t ret = 0;
+        for (auto &layer : layers_)
+        {
+            ret += layer.capacity_;
+        }
+        return ret;
+    }
+
+    auto BloomFilter::Size() const -> std::size_t
+    {
+        ReadGuard rg(latch_);
+        std::size_t ret = 0;
+        for (auto &layer : layers_)
+        {
+            ret += layer.count_;
+        }
+        return ret;
+    }
+
+    auto BloomFilter::Layers() const -> std::size_t
+    {
+        ReadGuard rg(latch_);
+        return layers_.size();
+    }
+
+    auto BloomFilter::Bytes() const -> std::size_t
+    {
+        ReadGuard rg(latch_);
+        std::size_t ret = 0;
+        for (auto &layer : layers_)
+        {
+            ret += layer.blocks_.size() * sizeof(Block);
+        }
+        return ret;
+    }
+
+    auto BloomFilter::GetObjectType() const -> ObjectType
+    {
+        return ObjectType::BLOOM;
+    }
+
+    /*
+    [double error_rate][uint32 expansion][char scaling][size_t layers]
+    {[size_t capacity][size_t count][int hashes][size_t blocks][blocks * 64 bytes]}
+     */
+    auto BloomFilter::EncodeValue() const -> std::string
+    {
+        ReadGuard rg(latch_);
+        std::string ret;
+        ret.append(BitsToString(error_rate_));
+        ret.append(BitsToString(expansion_));
+        ret.push_back(scaling_ ? 1 : 0);
+        ret.append(BitsToString(layers_.size()));
+        for (auto &layer : layers_)
+        {
+            ret.append(BitsToString(layer.capacity_));
+            ret.append(BitsToString(layer.count_));
+            ret.append(BitsToString(layer.hashes_));
+            ret.append(BitsToString(layer.blocks_.size()));
+            ret.append(reinterpret_cast<const char *>(layer.blocks_.data()), layer.blocks_.size() * sizeof(Block));
+        }
+        return ret;
+    }
+
+    void BloomFilter::DecodeValue(Cursor *source)
+    {
+        WriteGuard wg(latch_);
+        error_rate_ = PeekBits<double>(source);
+        expansion_ = PeekBits<std::uint32_t>(source);
+        scaling_ = source->front() != 0;
+        source->pop_front();
+        std::size_t layers = PeekSize(source);
+        layers_.clear();
+        layers_.reserve(layers);
+        for (std::size_t i = 0; i < layers; i++)
+        {
+            Layer layer;
+            layer.capacity_ = PeekSize(source);
+            layer.count_ = PeekSize(source);
+            layer.hashes_ = PeekInt(source);
+            layer.blocks_.resize(PeekSize(source));
+            std::string raw = PeekString(source, layer.blocks_.size() * sizeof(Block));
+            std::memcpy(layer.blocks_.data(), raw.data(), raw.size());
+            layers_.push_back(std::move(layer));
+        }
+    }
+
+} // namespace rds
@@ -0,0 +1,233 @@
+#include <objects/cms.h>
+#include <database/rdb.h>
+#include <algorithm>
+#include <cmath>
+
+namespace rds
+{
+    namespace
+    {
+        constexpr std::uint64_t CMS_SEED = 0x2545f4914f6cdd1dULL;
+
+        template <typename T>
+        auto PeekBits(Cursor *source) -> T
+        {
+            std::string raw = PeekString(source, sizeof(T));
+            T ret;
+            std::memcpy(&ret, raw.data(), sizeof(T));
+            return ret;
+        }
+    } // namespace
+
+    CountMinSketch::CountMinSketch(const CountMinSketch &lhs)
+    {
+        ReadGuard rg(lhs.ExposeLatch());
+        width_ = lhs.width_;
+        depth_ = lhs.depth_;
+        total_ = lhs.total_;
+        counters_ = lhs.counters_;
+    }
+
+    CountMinSketch::CountMinSketch(CountMinSketch &&rhs) noexcept
+    {
+        ReadGuard rg(rhs.ExposeLatch());
+        width_ = rhs.width_;
+        depth_ = rhs.depth_;
+        total_ = rhs.total_;
+        counters_ = std::move(rhs.counters_);
+    }
+
+    CountMinSketch &CountMinSketch::operator=(const CountMinSketch &lhs)
+    {
+        ReadGuard rg(lhs.ExposeLatch());
+        width_ = lhs.width_;
+        depth_ = lhs.depth_;
+        total_ = lhs.total_;
+        counters_ = lhs.counters_;
+        return *this;
+    }
+
+    CountMinSketch &CountMinSketch::operator=(CountMinSketch &&rhs) noexcept
+    {
+        ReadGuard rg(rhs.ExposeLatch());
+        width_ = rhs.width_;
+        depth_ = rhs.depth_;
+        total_ = rhs.total_;
+        counters_ = std::move(rhs.counters_);
+        return *this;
+    }
+
+    /* double hashing over one 64 bit hash, reduced into the row by a multiply */
+    auto CountMinSketch::Cell(std::uint32_t row, std::uint64_t hash) const -> std::size_t
+    {
+        auto h1 = static_cast<std::uint32_t>(hash);
+        auto h2 = static_cast<std::uint32_t>(hash >> 32) | 1;
+        std::uint32_t h = h1 + row * h2;
+        return static_cast<std::size_t>(row) * width_ + ((static_cast<std::uint64_t>(h) * width_) >> 32);
+    }
+
+    void CountMinSketch::InitByDim(std::uint32_t width, std::uint32_t depth)
+    {
+        WriteGuard wg(latch_);
+        width_ = width;
+        depth_ = depth;
+        total_ = 0;
+        counters_.assign(static_cast<std::size_t>(width) * depth, 0);
+    }
+
+    void CountMinSketch::InitByProb(double error, double probability)
+    {
+        auto width = static_cast<std::uint32_t>(std::ceil(std::exp(1.0) / error));
+        auto depth = static_cast<std::uint32_t>(std::ceil(std::log(1.0 / probability)));
+        InitByDim(std::max<std::uint32_t>(width, 1), std::max<std::uint32_t>(depth, 1));
+    }
+
+    auto CountMinSketch::IncrBy(const std::vector<std::pair<std::string, std::uint32_t>> &items) -> std::vector<std::uint32_t>
+    {
+        std::vector<std::uint64_t> hashes;
+        hashes.reserve(items.size());
+        for (auto &[item, incr] : items)
+        {
+            hashes.push_back(MurmurHash64A(item.data(), item.size(), CMS_SEED));
+        }
+        WriteGuard wg(latch_);
+        for (auto hash : hashes)
+        {
+            for (std::uint32_t row = 0; row < depth_; row++)
+            {
+                __builtin_prefetch(&counters_[Cell(row, hash)], 1);
+            }
+        }
+        std::vector<std::uint32_t> ret;
+        ret.reserve(items.size());
+        for (std::size_t i = 0; i < items.size(); i++)
+        {
+            std::uint32_t estimate = std::numeric_limits<std::uint32_t>::max();
+            for (std::uint32_t row = 0; row < depth_; row++)
+            {
+                auto &c = counters_[Cell(row, hashes[i])];
+                c = static_cast<std::uint32_t>(std::min<std::uint64_t>(static_cast<std::uint64_t>(c) + items[i].second,
+                                                                       std::numeric_limits<std::uint32_t>::max()));
+                estimate = std::min(estimate, c);
+            }
+            total_ += items[i].second;
+            ret.push_back(estimate);
+        }
+        return ret;
+    }
+
+    auto CountMinSketch::Query(const std::vector<std::string> &items) const -> std::vector<std::uint32_t>
+    {
+        std::vector<std::uint64_t> hashes;
+        hashes.reserve(items.size());
+        for (auto &item : items)
+        {
+            hashes.push_back(MurmurHash64A(item.data(), item.size(), CMS_SEED));
+        }
+        ReadGuard rg(latch_);
+        for (auto hash : hashes)
+        {
+            for (std::uint32_t row = 0; row < depth_; row++)
+            {
+                __builtin_prefetch(&counters_[Cell(row, hash)], 0);
+            }
+        }
+        std::vector<std::uint32_t> ret;
+        ret.reserve(items.size());
+        for (auto hash : hashes)
+        {
+            std::uint32_t estimate = std::numeric_limits<std::uint32_t>::max();
+            for (std::uint32_t row = 0; row < depth_; row++)
+            {
+                estimate = std::min(estimate, counters_[Cell(row, hash)]);
+            }
+            ret.push_back(estimate);
+        }
+        return ret;
+    }
+
+    auto CountMinSketch::Merge(const std::vector<const CountMinSketch *> &sources, const std::vector<std::int64_t> &weights) -> bool
+    {
+        // summed outside the write latch so this sketch may be one of the sources
+        std::vector<std::int64_t> sum;
+        std::int64_t total = 0;
+        std::uint32_t width = Width();
+        std::uint32_t depth = Depth();
+        for (std::size_t i = 0; i < sources.size(); i++)
+        {
+            ReadGuard rg(sources[i]->ExposeLatch());
+            if (width == 0 && depth == 0 && sum.empty())
+            {
+                width = sources[i]->width_;
+                depth = sources[i]->depth_;
+            }
+            if (sources[i]->width_ != width || sources[i]->depth_ != depth)
+            {
+                return false;
+            }
+            sum.resize(static_cast<std::size_t>(width) * depth);
+            for (std::size_t c = 0; c < sum.size(); c++)
+            {
+                sum[c] += weights[i] * sources[i]->counters_[c];
+            }
+            total += weights[i] * static_cast<std::int64_t>(sources[i]->total_);
+        }
+        WriteGuard wg(latch_);
+        width_ = width;
+        depth_ = depth;
+        total_ = std::max<std::int64_t>(total, 0);
+        counters_.resize(sum.size());
+        for (std::size_t c = 0; c < sum.size(); c++)
+        {
+            counters_[c] = static_cast<std::uint32_t>(std::clamp<std::int64_t>(sum[c], 0, std::numeric_limits<std::uint32_t>::max()));
+        }
+        return true;
+    }
+
+    auto CountMinSketch::Width() const -> std::uint32_t
+    {
+        ReadGuard rg(latch_);
+        return width_;
+    }
+
+    auto CountMinSketch::Depth() const -> std::uint32_t
+    {
+        ReadGuard rg(latch_);
+        return depth_;
+    }
+
+    auto CountMinSketch::Total() const -> std::uint64_t
+    {
+        ReadGuard rg(latch_);
+        return total_;
+    }
+
+    auto CountMinSketch::GetObjectType() const -> ObjectType
+    {
+        return ObjectType::CMS;
+    }
+
+    /* [uint32 width][uint32 depth][uint64 total][width * depth uint32 counters] */
+    auto CountMinSketch::EncodeValue() const -> std::string
+    {
+        ReadGuard rg(latch_);
+        std::string ret;
+        ret.append(BitsToString(width_));
+        ret.append(BitsToString(depth_));
+        ret.append(BitsToString(total_));
+        ret.append(reinterpret_cast<const char *>(counters_.data()), counters_.size() * sizeof(std::uint32_t));
+        return ret;
+    }
+
+    void CountMinSketch::DecodeValue(Cursor *source)
+    {
+        WriteGuard wg(latch_);
+        width_ = PeekBits<std::uint32_t>(source);
+        depth_ = PeekBits<std::uint32_t>(source);
+        total_ = PeekBits<std::uint64_t>(source);
+        counters_.resize(static_cast<std::size_t>(width_) * depth_);
+        std::string raw = PeekString(source, counters_.size() * sizeof(std::uint32_t));
+        std::memcpy(counters_.data(), raw.data(), raw.size());
+    }
+
+} // namespace rds
@@ -1,22 +1,154 @@
 #include <objects/hash.h>
+#include <mutex>
 
 namespace rds
 {
+    namespace
+    {
+        struct FieldNames
+        {
+            std::mutex mtx_;
+            std::unordered_map<std::string_view, std::unique_ptr<FieldName>> names_;
+        };
+
+        /* never destroyed, hashes with static storage may release names at exit */
+        auto GetFieldNames() -> FieldNames &
+        {
+            static auto names = new FieldNames;
+            return *names;
+        }
+
+        thread_local HashFieldSession *field_session = nullptr;
+
+        /* the high bit of the stored size marks the encoding with field tags */
+        constexpr std::size_t HASH_FIELD_TAGS = std::size_t{1} << 63;
+
+        enum FieldTag : std::uint64_t
+        {
+            OWN_FIELD = 0,   // a Str follows, kept out of the shared names
+            NEW_SHARED = 1,  // [varint len][name], the next index of the session
+            SHARED_INDEX = 2 // SHARED_INDEX + i refers to name i of the session
+        };
+    } // namespace
+
+    auto FieldRef::Intern(std::string_view name) -> std::optional<FieldRef>
+    {
+        if (name.size() > FIELD_NAME_MAX_LEN)
+        {
+            return {};
+        }
+        auto &table = GetFieldNames();
+        std::lock_guard lg(table.mtx_);
+        auto it = table.names_.find(name);
+        if (it == table.names_.end())
+        {
+            if (table.names_.size() >= FIELD_NAMES_MAX)
+            {
+                return {};
+            }
+            auto field = std::make_unique<FieldName>();
+            field->name_ = std::string(name);
+            std::string_view key = field->name_;
+            it = table.names_.emplace(key, std::move(field)).first;
+        }
+        FieldRef ret;
+        ret.field_ = it->second.get();
+        ret.field_->refs_.fetch_add(1, std::memory_order_relaxed);
+        return ret;
+    }
+
+    auto FieldRef::Names() -> std::size_t
+    {
+        auto &table = GetFieldNames();
+        std::lock_guard lg(table.mtx_);
+        return table.names_.size();
+    }
+
+    FieldRef::~FieldRef()
+    {
+        if (field_ == nullptr)
+        {
+            return;
+        }
+        // other references stay, no lock needed to drop ours
+        auto refs = field_->refs_.load(std::memory_order_relaxed);
+        while (refs > 1)
+        {
+            if (field_->refs_.compare_exchange_weak(refs, refs - 1, std::memory_order_acq_rel))
+            {
+                return;
+            }
+        }
+        // maybe the last one: dropped under the lock Intern takes, so the name
+        // is neither taken again nor freed by another release in between
+        auto &table = GetFieldNames();
+        std::lock_guard lg(table.mtx_);
+        if (field_->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            // the key points into the name, found before the entry is freed
+            table.names_.erase(table.names_.find(field_->name_));
+        }
+    }
+
+    FieldRef::FieldRef(const FieldRef &lhs) : field_(lhs.field_)
+    {
+        if (field_ != nullptr)
+        {
+            field_->refs_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    FieldRef::FieldRef(FieldRef &&rhs) noexcept : field_(rhs.field_)
+    {
+        rhs.field_ = nullptr;
+    }
+
+    auto FieldRef::operator=(const FieldRef &lhs) -> FieldRef &
+    {
+        FieldRef copy(lhs);
+        std::swap(field_, copy.field_);
+        return *this;
+    }
+
+    auto FieldRef::operator=(FieldRef &&rhs) noexcept -> FieldRef &
+    {
+        std::swap(field_, rhs.field_);
+        return *this;
+    }
+
+    HashFieldSession::HashFieldSession() : outer_(field_session)
+    {
+        field_session = this;
+    }
+
+    HashFieldSession::~HashFieldSession()
+    {
+        field_session = outer_;
+    }
+
+    auto HashFieldSession::Current() -> HashFieldSession *
+    {
+        return field_session;
+    }
+
     Hash::Hash(const Hash &lhs)
     {
         ReadGuard rg(lhs.ExposeLatch());
+        shared_fields_ = lhs.shared_fields_;
         data_map_ = lhs.data_map_;
     }
 
     Hash::Hash(Hash &&rhs) noexcept
     {
         ReadGuard rg(rhs.ExposeLatch());
+        shared_fields_ = std::move(rhs.shared_fields_);
         data_map_ = std::move(rhs.data_map_);
     }
 
     Hash &Hash::operator=(const Hash &lhs)
     {
         ReadGuard rg(lhs.ExposeLatch());
+        shared_fields_ = lhs.shared_fields_;
         data_map_ = lhs.data_map_;
         return *this;
     }
@@ -24,54 +156,119 @@ namespace rds
     Hash &Hash::operator=(Hash &&rhs) noexcept
     {
         ReadGuard rg(rhs.ExposeLatch());
+        shared_fields_ = std::move(rhs.shared_fields_);
         data_map_ = std::move(rhs.data_map_);
         return *this;
     }
 
+    auto Hash::FindShared(std::string_view name) -> std::vector<std::pair<FieldRef, Str>>::iterator
+    {
+        return std::find_if(shared_fields_.begin(), shared_fields_.end(), [name](const std::pair<FieldRef, Str> &f)
+                            { return f.first.Name() == name; });
+    }
+
+    auto Hash::Find(const Str &key) -> Str *
+    {
+        Str *ret = nullptr;
+        key.Visit([&](std::string_view name)
+                  {
+            auto it = FindShared(name);
+            if (it != shared_fields_.end())
+            {
+                ret = &it->second;
+            } });
+        if (ret != nullptr)
+        {
+            return ret;
+        }
+        auto it = data_map_.find(key);
+        return it == data_map_.end() ? nullptr : &it->second;
+    }
+
+    /* a new field, by shared name while this hash is small */
+    void Hash::Insert(std::string_view name, const Str &key, Str value)
+    {
+        if (shared_fields_.size() < SHARED_FIELDS_MAX)
+        {
+            auto ref = FieldRef::Intern(name);
+            if (ref.has_value())
+            {
+                shared_fields_.emplace_back(std::move(ref.value()), std::move(value));
+                return;
+            }
+        }
+        data_map_.insert({key, std::move(value)});
+    }
+
     auto Hash::Get(const Str &key) -> Str
     {
         ReadGuard rg(latch_);
-        auto it = data_map_.find(key);
-        if (it == data_map_.end())
+        auto value = Find(key);
+        if (value == nullptr)
         {
             return {};
         }
-        return it->second;
+        return *value;
     }
 
     auto Hash::Exist(const Str &key) -> bool
     {
         ReadGuard rg(latch_);
-        auto it = data_map_.find(key);
-        return it != data_map_.end();
+        return Find(key) != nullptr;
     }
 
     void Hash::Del(const Str &key)
     {
         WriteGuard wg(latch_);
-        auto it = data_map_.find(key);
-        if (it == data_map_.end())
+        bool erased = false;
+        key.Visit([&](std::string_view name)
+                  {
+            auto it = FindShared(name);
+            if (it != shared_fields_.end())
+            {
+                // order is not kept, the last field fills the hole
+                std::swap(*it, shared_fields_.back());
+                shared_fields_.pop_back();
+                erased = true;
+            } });
+        if (!erased)
         {
-            return;
+            data_map_.erase(key);
         }
-        data_map_.erase(it);
     }
 
     auto Hash::Len() -> std::size_t
     {
         ReadGuard rg(latch_);
-        return data_map_.size();
+        return shared_fields_.size() + data_map_.size();
     }
 
     auto Hash::GetAll() -> std::vector<std::pair<Str, Str>>
     {
         std::vector<std::pair<Str, Str>> ret;
+        ForEach([&ret](std::string_view field, const Str &value)
+                { ret.push_back({Str(std::string(field)), value}); });
+        return ret;
+    }
+
+    void Hash::ForEach(const std::function<void(std::string_view, const Str &)> &f) const
+    {
         ReadGuard rg(latch_);
+        for (auto &[field, value] : shared_fields_)
+        {
+            f(field.Name(), value);
+        }
         for (auto &element : data_map_)
         {
-            ret.push_back(element);
+            element.first.Visit([&](std::string_view field)
+                                { f(field, element.second); });
         }
-        return ret;
+    }
+
+    auto Hash::SharedFields() const -> std::size_t
+    {
+        ReadGuard rg(latch_);
+        return shared_fields_.size();
     }
 
     auto Hash::GetObjectType() const -> ObjectType
@@ -79,65 +276,131 @@ namespace rds
         return ObjectType::HASH;
     }
 
+    /*
+    [size_t n | 1 << 63]
+    {[varint tag]([field Str] | [varint len][name] | nothing)[value Str]}
+    an index refers to a name written earlier in the same session, a hash
+    encoded outside of one numbers its names from zero
+     */
     auto Hash::EncodeValue() const -> std::string
     {
         ReadGuard rg(latch_);
+        auto outer = HashFieldSession::Current();
+        HashFieldSession local;
+        auto session = outer != nullptr ? outer : &local;
         std::string ret;
-        ret.append(BitsToString(data_map_.size()));
-        std::for_each(std::cbegin(data_map_), std::cend(data_map_),
-                      [&ret](const decltype(data_map_)::value_type &kv) mutable
-                      {
-                          ret.append(kv.first.EncodeValue());
-                          ret.append(kv.second.EncodeValue());
-                      });
+        ret.append(BitsToString((shared_fields_.size() + data_map_.size()) | HASH_FIELD_TAGS));
+        for (auto &[field, value] : shared_fields_)
+        {
+            auto [it, fresh] = session->written_.emplace(field.Key(), session->written_.size());
+            if (fresh)
+            {
+                PutVarint(&ret, NEW_SHARED);
+                PutVarint(&ret, field.Name().size());
+                ret.append(field.Name());
+            }
+            else
+            {
+                PutVarint(&ret, SHARED_INDEX + it->second);
+            }
+            ret.append(value.EncodeValue());
+        }
+        for (auto &[field, value] : data_map_)
+        {
+            PutVarint(&ret, OWN_FIELD);
+            ret.append(field.EncodeValue());
+            ret.append(value.EncodeValue());
+        }
         return ret;
     }
 
-    void Hash::DecodeValue(std::deque<char> *source)
+    void Hash::DecodeValue(Cursor *source)
     {
         WriteGuard wg(latch_);
         std::size_t len = PeekSize(source);
+        if (!(len & HASH_FIELD_TAGS))
+        {
+            for (std::size_t i = 0; i < len; i++)
+            {
+                Str k, v;
+                k.DecodeValue(source);
+                v.DecodeValue(source);
+                auto name = k.GetRaw();
+                Insert(name, k, std::move(v));
+            }
+            return;
+        }
+        len &= ~HASH_FIELD_TAGS;
+        auto outer = HashFieldSession::Current();
+        HashFieldSession local;
+        auto session = outer != nullptr ? outer : &local;
         for (std::size_t i = 0; i < len; i++)
         {
-            Str k, v;
-            k.DecodeValue(source);
+            std::uint64_t tag = PeekVarint(source);
+            if (tag == OWN_FIELD)
+            {
+                Str k, v;
+                k.DecodeValue(source);
+                v.DecodeValue(source);
+                data_map_.insert({std::move(k), std::move(v)});
+                continue;
+            }
+            if (tag == NEW_SHARED)
+            {
+                std::size_t size = PeekVarint(source);
+                auto name = PeekString(source, size);
+                auto ref = FieldRef::Intern(name);
+                // the table filled up since the save, such a name is kept as a plain field
+                session->read_.emplace_back(ref.value_or(FieldRef()), ref.has_value() ? std::string() : std::move(name));
+                tag = SHARED_INDEX + session->read_.size() - 1;
+            }
+            auto &[ref, name] = session->read_.at(tag - SHARED_INDEX);
+            Str v;
             v.DecodeValue(source);
-            data_map_.insert({k, v});
+            if (ref.Key() != nullptr && shared_fields_.size() < SHARED_FIELDS_MAX)
+            {
+                shared_fields_.emplace_back(ref, std::move(v));
+            }
+            else
+            {
+                data_map_.insert({Str(ref.Key() != nullptr ? ref.Name() : name), std::move(v)});
+            }
         }
     }
 
     auto Hash::IncrBy(const Str &key, int delta) -> std::string
     {
         ReadGuard rg(latch_);
-        auto it = data_map_.find(key);
-        if (it == data_map_.end())
+        auto value = Find(key);
+        if (value == nullptr)
         {
             return {};
         }
-        return it->second.IncrBy(delta);
+        return value->IncrBy(delta);
     }
 
     auto Hash::DecrBy(const Str &key, int delta) -> std::string
     {
         ReadGuard rg(latch_);
-        auto it = data_map_.find(key);
-        if (it == data_map_.end())
+        auto value = Find(key);
+        if (value == nullptr)
         {
             return {};
         }
-        return it->second.DecrBy(delta);
+        return value->DecrBy(delta);
     }
 
     void Hash::Set(const Str &key, Str value)
     {
         WriteGuard wg(latch_);
-        auto it = data_map_.find(key);
-        if (it != data_map_.end())
+        auto found = Find(key);
+        if (found != nullptr)
         {
-            it->second = std::move(value);
+            *found = std::move(value);
             return;
         }
-        data_map_.insert({key, std::move(value)});
+        // the key is copied into data_map_ past the limit, so no Visit here
+        Insert(key.GetRaw(), key, std::move(value));
     }
 
 } // namespace rds
@@ -0,0 +1,360 @@
+#include <objects/hyperloglog.h>
+#include <objects/bitops.h>
+#include <database/rdb.h>
+#include <algorithm>
+#include <cmath>
+
+namespace rds
+{
+    namespace
+    {
+        constexpr double HLL_ALPHA_INF = 0.721347520444481703680;
+
+        auto Sigma(double x) -> double
+        {
+            if (x == 1.)
+            {
+                return INFINITY;
+            }
+            double z_prime;
+            double y = 1;
+            double z = x;
+            do
+            {
+                x *= x;
+                z_prime = z;
+                z += x * y;
+                y += y;
+            } while (z_prime != z);
+            return z;
+        }
+
+        auto Tau(double x) -> double
+        {
+            if (x == 0. || x == 1.)
+            {
+                return 0.;
+            }
+            double z_prime;
+            double y = 1.0;
+            double z = 1 - x;
+            do
+            {
+                x = std::sqrt(x);
+                z_prime = z;
+                y *= 0.5;
+                z -= std::pow(1 - x, 2) * y;
+            } while (z_prime != z);
+            return z / 3;
+        }
+
+        /* Ertl's improved estimator over the register histogram */
+        auto Estimate(const std::array<std::size_t, 64> &histogram) -> std::uint64_t
+        {
+            constexpr double m = HyperLogLog::REGISTERS;
+            double z = m * Tau((m - histogram[HyperLogLog::Q + 1]) / m);
+            for (int j = HyperLogLog::Q; j >= 1; j--)
+            {
+                z += histogram[j];
+                z *= 0.5;
+            }
+            z += m * Sigma(histogram[0] / m);
+            return static_cast<std::uint64_t>(std::llroundl(HLL_ALPHA_INF * m * m / z));
+        }
+
+        /* 4 registers in every 3 bytes, least significant bits first */
+        void Unpack(const std::uint8_t *dense, HyperLogLog::Registers *registers)
+        {
+            for (std::size_t g = 0; g < HyperLogLog::REGISTERS / 4; g++)
+            {
+                const std::uint8_t *p = dense + g * 3;
+                std::uint32_t w = p[0] | (p[1] << 8) | (p[2] << 16);
+                (*registers)[g * 4] = w & 63;
+                (*registers)[g * 4 + 1] = (w >> 6) & 63;
+                (*registers)[g * 4 + 2] = (w >> 12) & 63;
+                (*registers)[g * 4 + 3] = (w >> 18) & 63;
+            }
+        }
+
+        void Pack(const HyperLogLog::Registers &registers, std::uint8_t *dense)
+        {
+            for (std::size_t g = 0; g < HyperLogLog::REGISTERS / 4; g++)
+            {
+                std::uint32_t w = registers[g * 4] |
+                                  (registers[g * 4 + 1] << 6) |
+                                  (registers[g * 4 + 2] << 12) |
+                                  (registers[g * 4 + 3] << 18);
+                std::uint8_t *p = dense + g * 3;
+                p[0] = w & 0xff;
+                p[1] = (w >> 8) & 0xff;
+                p[2] = (w >> 16) & 0xff;
+            }
+        }
+    } // namespace
+
+    HyperLogLog::HyperLogLog(const HyperLogLog &lhs)
+    {
+        ReadGuard rg(lhs.ExposeLatch());
+        encoding_type_ = lhs.encoding_type_;
+        sparse_ = lhs.sparse_;
+        dense_ = lhs.dense_;
+    }
+
+    HyperLogLog::HyperLogLog(HyperLogLog &&rhs) noexcept
+    {
+        ReadGuard rg(rhs.ExposeLatch());
+        encoding_type_ = rhs.encoding_type_;
+        sparse_ = std::move(rhs.sparse_);
+        dense_ = std::move(rhs.dense_);
+    }
+
+    HyperLogLog &HyperLogLog::operator=(const HyperLogLog &lhs)
+    {
+        ReadGuard rg(lhs.ExposeLatch());
+        encoding_type_ = lhs.encoding_type_;
+        sparse_ = lhs.sparse_;
+        dense_ = lhs.dense_;
+        cached_card_.reset();
+        return *this;
+    }
+
+    HyperLogLog &HyperLogLog::operator=(HyperLogLog &&rhs) noexcept
+    {
+        ReadGuard rg(rhs.ExposeLatch());
+        encoding_type_ = rhs.encoding_type_;
+        sparse_ = std::move(rhs.sparse_);
+        dense_ = std::move(rhs.dense_);
+        cached_card_.reset();
+        return *this;
+    }
+
+    auto HyperLogLog::DenseGet(std::size_t index) const -> std::uint8_t
+    {
+        std::size_t byte = index * REGISTER_BITS / 8;
+        unsigned fb = index * REGISTER_BITS & 7;
+        unsigned b0 = dense_[byte];
+        unsigned b1 = dense_[byte + 1];
+        return ((b0 >> fb) | (b1 << (8 - fb))) & 63;
+    }
+
+    void HyperLogLog::DenseSet(std::size_t index, std::uint8_t value)
+    {
+        std::size_t byte = index * REGISTER_BITS / 8;
+        unsigned fb = index * REGISTER_BITS & 7;
+        unsigned v = value;
+        dense_[byte] &= ~(63 << fb);
+        dense_[byte] |= v << fb;
+        dense_[byte + 1] &= ~(63 >> (8 - fb));
+        dense_[byte + 1] |= v >> (8 - fb);
+    }
+
+    auto HyperLogLog::SetRegister(std::size_t index, std::uint8_t value) -> bool
+    {
+        if (encoding_type_ == EncodingType::HLL_DENSE)
+        {
+            if (DenseGet(index) >= value)
+            {
+                return false;
+            }
+            DenseSet(index, value);
+            return true;
+        }
+        auto it = std::lower_bound(sparse_.begin(), sparse_.end(), static_cast<std::uint32_t>(index << 8));
+        if (it != sparse_.end() && (*it >> 8) == index)
+        {
+            if ((*it & 0xff) >= value)
+            {
+                return false;
+            }
+            *it = (index << 8) | value;
+            return true;
+        }
+        sparse_.insert(it, (index << 8) | value);
+        if (sparse_.size() * sizeof(std::uint32_t) > HLL_SPARSE_MAX_BYTES)
+        {
+            Promote();
+        }
+        return true;
+    }
+
+    void HyperLogLog::Promote()
+    {
+        dense_.assign(DENSE_BYTES + 1, 0);
+        encoding_type_ = EncodingType::HLL_DENSE;
+        for (auto e : sparse_)
+        {
+            DenseSet(e >> 8, e & 0xff);
+        }
+        sparse_.clear();
+        sparse_.shrink_to_fit();
+    }
+
+    auto HyperLogLog::Add(const std::string &element) -> bool
+    {
+        WriteGuard wg(latch_);
+        std::uint64_t hash = MurmurHash64A(element.data(), element.size(), 0xadc83b19ULL);
+        std::size_t index = hash & (REGISTERS - 1);
+        hash >>= P;
+        hash |= 1ULL << Q; // the run is at most Q + 1 long
+        auto count = static_cast<std::uint8_t>(__builtin_ctzll(hash) + 1);
+        if (!SetRegister(index, count))
+        {
+            return false;
+        }
+        cached_card_.reset();
+        return true;
+    }
+
+    auto HyperLogLog::Count() const -> std::uint64_t
+    {
+        WriteGuard wg(latch_);
+        if (cached_card_.has_value())
+        {
+            return cached_card_.value();
+        }
+        std::array<std::size_t, 64> histogram{};
+        if (encoding_type_ == EncodingType::HLL_SPARSE)
+        {
+            histogram[0] = REGISTERS - sparse_.size();
+            for (auto e : sparse_)
+            {
+                histogram[e & 0xff]++;
+            }
+        }
+        else
+        {
+            Registers registers;
+            Unpack(dense_.data(), &registers);
+            for (auto r : registers)
+            {
+                histogram[r]++;
+            }
+        }
+        cached_card_ = Estimate(histogram);
+        return cached_card_.value();
+    }
+
+    void HyperLogLog::MergeInto(Registers *registers) const
+    {
+        ReadGuard rg(latch_);
+        if (encoding_type_ == EncodingType::HLL_SPARSE)
+        {
+            for (auto e : sparse_)
+            {
+                auto &r = (*registers)[e >> 8];
+                r = std::max<std::uint8_t>(r, e & 0xff);
+            }
+            return;
+        }
+        Registers mine;
+        Unpack(dense_.data(), &mine);
+        MaxBytes(registers->data(), mine.data(), REGISTERS);
+    }
+
+    void HyperLogLog::Import(const Registers &registers)
+    {
+        WriteGuard wg(latch_);
+        cached_card_.reset();
+        std::size_t non_zero = REGISTERS - std::count(registers.begin(), registers.end(), 0);
+        if (non_zero * sizeof(std::uint32_t) <= HLL_SPARSE_MAX_BYTES)
+        {
+            encoding_type_ = EncodingType::HLL_SPARSE;
+            dense_.clear();
+            dense_.shrink_to_fit();
+            sparse_.clear();
+            for (std::size_t i = 0; i < REGISTERS; i++)
+            {
+                if (registers[i] != 0)
+                {
+                    sparse_.push_back((i << 8) | registers[i]);
+                }
+            }
+            return;
+        }
+        encoding_type_ = EncodingType::HLL_DENSE;
+        sparse_.clear();
+        sparse_.shrink_to_fit();
+        dense_.assign(DENSE_BYTES + 1, 0);
+        Pack(registers, dense_.data());
+    }
+
+    auto HyperLogLog::GetEncodingType() const -> EncodingType
+    {
+        ReadGuard rg(latch_);
+        return encoding_type_;
+    }
+
+    auto HyperLogLog::GetObjectType() const -> ObjectType
+    {
+        return ObjectType::HYPERLOGLOG;
+    }
+
+    /*
+    char encoding
+    sparse: [size_t n]{[uint32 index << 8 | value]}
+    dense:  [DENSE_BYTES packed registers]
+     */
+    auto HyperLogLog::EncodeValue() const -> std::string
+    {
+        ReadGuard rg(latch_);
+        std::string ret;
+        ret.push_back(EncodingTypeToChar(encoding_type_));
+        if (encoding_type_ == EncodingType::HLL_SPARSE)
+        {
+            ret.append(BitsToString(sparse_.size()));
+            for (auto e : sparse_)
+            {
+                ret.append(BitsToString(e));
+            }
+            return ret;
+        }
+        ret.append(reinterpret_cast<const char *>(dense_.data()), DENSE_BYTES);
+        return ret;
+    }
+
+    void HyperLogLog::DecodeValue(Cursor *source)
+    {
+        WriteGuard wg(latch_);
+        cached_card_.reset();
+        encoding_type_ = CharToEncodingType(source->front());
+        source->pop_front();
+        assert(encoding_type_ == EncodingType::HLL_SPARSE || encoding_type_ == EncodingType::HLL_DENSE);
+        sparse_.clear();
+        dense_.clear();
+        if (encoding_type_ == EncodingType::HLL_SPARSE)
+        {
+            std::size_t n = PeekSize(source);
+            sparse_.reserve(n);
+            for (std::size_t i = 0; i < n; i++)
+            {
+                std::string raw = PeekString(source, sizeof(std::uint32_t));
+                std::uint32_t e;
+                std::memcpy(&e, raw.data(), sizeof(e));
+                sparse_.push_back(e);
+            }
+            return;
+        }
+        std::string raw = PeekString(source, DENSE_BYTES);
+        dense_.assign(raw.begin(), raw.end());
+        dense_.push_back(0);
+    }
+
+    auto HyperLogLogCount(const std::vector<const HyperLogLog *> &sources) -> std::uint64_t
+    {
+        HyperLogLog::Registers registers{};
+        for (auto hll : sources)
+        {
+            if (hll != nullptr)
+            {
+                hll->MergeInto(&registers);
+            }
+        }
+        std::array<std::size_t, 64> histogram{};
+        for (auto r : registers)
+        {
+            histogram[r]++;
+        }
+        return Estimate(histogram);
+    }
+
+} // namespace rds
@@ -235,7 +235,7 @@ namespace rds
         return ret;
     }
 
-    void List::DecodeValue(std::deque<char> *source)
+    void List::DecodeValue(Cursor *source)
     {
         WriteGuard wg(latch_);
         std::size_t len = PeekSize(source);
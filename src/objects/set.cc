@@ -51,13 +51,19 @@ namespace rds
 
     auto Set::Members() const -> std::vector<Str>
     {
-        ReadGuard rg(latch_);
         std::vector<Str> ret;
+        ForEach([&ret](const Str &element)
+                { ret.push_back(element); });
+        return ret;
+    }
+
+    void Set::ForEach(const std::function<void(const Str &)> &f) const
+    {
+        ReadGuard rg(latch_);
         for (auto &element : data_set_)
         {
-            ret.push_back(element);
+            f(element);
         }
-        return ret;
     }
 
     auto Set::RandMember() const -> Str
@@ -80,9 +86,9 @@ namespace rds
         {
             return {};
         }
-        Str s(std::move(*(data_set_.cbegin())));
+        Str s(*(data_set_.cbegin()));
         data_set_.erase(data_set_.cbegin());
-        return *(data_set_.cbegin());
+        return s;
     }
 
     auto Set::Rem(const Str &m) -> bool
@@ -111,7 +117,7 @@ namespace rds
         return ret;
     }
 
-    void Set::DecodeValue(std::deque<char> *source)
+    void Set::DecodeValue(Cursor *source)
     {
         WriteGuard wg(latch_);
         data_set_.clear();
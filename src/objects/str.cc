@@ -1,33 +1,130 @@
 #include <objects/str.h>
+#include <codec.h>
 #include <cstring>
 #include <database/rdb.h>
+#include <charconv>
+#include <limits>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <list>
+#include <iterator>
+#include <mutex>
+#include <unordered_map>
 
 namespace rds
 {
 
-    Str::Str(std::string data) : data_(data), encoding_type_(EncodingType::INT)
+    auto SharedInteger(std::int64_t value) -> std::shared_ptr<Str>
     {
-        for (std::size_t i = 0; i < data_.size(); i++)
+        static const std::vector<std::shared_ptr<Str>> shared = []
         {
-            if (data_[i] < '0' || data_[i] > '9')
+            std::vector<std::shared_ptr<Str>> ret;
+            ret.reserve(SHARED_INTEGERS);
+            for (std::int64_t i = 0; i < SHARED_INTEGERS; i++)
             {
-                if (i == 0 && data_[i] == '-' && data_.size() > 1)
+                auto str = std::make_shared<Str>(std::to_string(i));
+                str->shared_ = true;
+                ret.push_back(std::move(str));
+            }
+            return ret;
+        }();
+        if (value < 0 || value >= SHARED_INTEGERS)
+        {
+            return nullptr;
+        }
+        return shared[value];
+    }
+
+    namespace
+    {
+        /* inflated STR_COMPRESS values keyed by a hash of the compressed bytes,
+           so equal values share an entry. an entry keeps the bytes it was
+           inflated from and is only served when they match, a hash collision
+           inflates again and takes the slot over. least recently used entries
+           go first */
+        class InflateCache
+        {
+        private:
+            struct Entry
+            {
+                std::uint64_t key_;
+                std::string compressed_;
+                std::shared_ptr<const std::string> inflated_;
+            };
+
+            std::mutex mtx_;
+            std::list<Entry> lru_;
+            std::unordered_map<std::uint64_t, std::list<Entry>::iterator> index_;
+            std::size_t bytes_{0};
+
+            void Evict(std::list<Entry>::iterator pos)
+            {
+                bytes_ -= pos->compressed_.size() + pos->inflated_->size();
+                index_.erase(pos->key_);
+                lru_.erase(pos);
+            }
+
+        public:
+            auto Get(const std::string &compressed, std::size_t size) -> std::shared_ptr<const std::string>
+            {
+                std::uint64_t key = MurmurHash64A(compressed.data(), compressed.size(), size);
                 {
-                    continue;
+                    std::lock_guard lg(mtx_);
+                    auto it = index_.find(key);
+                    if (it != index_.end() &&
+                        it->second->inflated_->size() == size &&
+                        it->second->compressed_ == compressed)
+                    {
+                        lru_.splice(lru_.begin(), lru_, it->second);
+                        return it->second->inflated_;
+                    }
                 }
-                else
+                auto inflated = std::make_shared<const std::string>(Decompress(compressed, size).value());
+                if (compressed.size() + size > STR_INFLATE_CACHE_BYTES / 4)
                 {
-                    encoding_type_ = EncodingType::STR_RAW;
-                    break;
+                    return inflated;
                 }
+                std::lock_guard lg(mtx_);
+                auto it = index_.find(key);
+                if (it != index_.end())
+                {
+                    if (it->second->compressed_ == compressed)
+                    {
+                        return it->second->inflated_; // inflated meanwhile by another reader
+                    }
+                    Evict(it->second);
+                }
+                lru_.push_front({key, compressed, inflated});
+                index_[key] = lru_.begin();
+                bytes_ += compressed.size() + size;
+                while (bytes_ > STR_INFLATE_CACHE_BYTES)
+                {
+                    Evict(std::prev(lru_.end()));
+                }
+                return inflated;
             }
+        };
+
+        auto GetInflateCache() -> InflateCache &
+        {
+            static InflateCache cache;
+            return cache;
         }
+    } // namespace
+
+    Str::Str(std::string data)
+    {
+        InternalSet(std::move(data));
     }
 
     Str::Str(const Str &lhs)
     {
         ReadGuard rg(lhs.ExposeLatch());
         data_ = lhs.data_;
+        int_data_ = lhs.int_data_;
         encoding_type_ = lhs.encoding_type_;
     }
 
@@ -35,6 +132,7 @@ namespace rds
     {
         ReadGuard rg(rhs.ExposeLatch());
         data_ = std::move(rhs.data_);
+        int_data_ = rhs.int_data_;
         encoding_type_ = rhs.encoding_type_;
     }
 
@@ -42,6 +140,7 @@ namespace rds
     {
         ReadGuard rg(lhs.ExposeLatch());
         data_ = lhs.data_;
+        int_data_ = lhs.int_data_;
         encoding_type_ = lhs.encoding_type_;
         return *this;
     }
@@ -49,87 +148,433 @@ namespace rds
     {
         ReadGuard rg(rhs.ExposeLatch());
         data_ = std::move(rhs.data_);
+        int_data_ = rhs.int_data_;
         encoding_type_ = rhs.encoding_type_;
         return *this;
     }
 
+    void Str::InternalSet(std::string data)
+    {
+        auto intval = StringToInt64(data);
+        if (intval.has_value())
+        {
+            encoding_type_ = EncodingType::INT;
+            int_data_ = intval.value();
+            data_.clear();
+            data_.shrink_to_fit();
+            return;
+        }
+        encoding_type_ = EncodingType::STR_RAW;
+        data_ = std::move(data);
+    }
+
+    auto Str::View(ViewBuf *buf) const -> std::string_view
+    {
+        if (encoding_type_ == EncodingType::INT)
+        {
+            auto [ptr, ec] = std::to_chars(buf->digits_, buf->digits_ + 21, int_data_);
+            return std::string_view(buf->digits_, ptr - buf->digits_);
+        }
+        if (encoding_type_ == EncodingType::STR_COMPRESS)
+        {
+            buf->inflated_ = GetInflateCache().Get(data_, int_data_);
+            return *buf->inflated_;
+        }
+        return data_;
+    }
+
     auto Str::GetRaw() const -> std::string
     {
         ReadGuard rg(latch_);
+        if (encoding_type_ == EncodingType::INT)
+        {
+            return std::to_string(int_data_);
+        }
+        if (encoding_type_ == EncodingType::STR_COMPRESS)
+        {
+            return *GetInflateCache().Get(data_, int_data_);
+        }
         return data_;
     }
 
-    void Str::Set(std::string data)
+    auto Str::GetInt() const -> std::optional<std::int64_t>
     {
-        WriteGuard wg(latch_);
-        data_ = std::move(data);
-        encoding_type_ = EncodingType::INT;
-        for (std::size_t i = 0; i < data_.size(); i++)
+        ReadGuard rg(latch_);
+        if (encoding_type_ == EncodingType::INT)
         {
-            if (data_[i] < '0' || data_[i] > '9')
-            {
-                if (i == 0 && data_[i] == '-' && data_.size() > 1)
-                {
-                    continue;
-                }
-                else
-                {
-                    encoding_type_ = EncodingType::STR_RAW;
-                    return;
-                }
-            }
+            return int_data_;
         }
+        return {};
+    }
+
+    void Str::Set(std::string data)
+    {
+        WriteGuard wg(latch_);
+        assert(!shared_);
+        InternalSet(std::move(data));
     }
 
     auto Str::Append(std::string data) -> std::size_t
     {
         WriteGuard wg(latch_);
-        data_.append(std::move(data));
+        assert(!shared_);
         if (encoding_type_ == EncodingType::INT)
         {
-            auto intval = RedisStrToInt(data_);
-            if (!intval.has_value())
+            std::string raw = std::to_string(int_data_);
+            raw.append(data);
+            InternalSet(std::move(raw));
+        }
+        else
+        {
+            ToRaw();
+            data_.append(data);
+            // appending digits to digits keeps a number
+            if (!data_.empty() && data_.size() <= 20 && (data_[0] == '-' || (data_[0] >= '1' && data_[0] <= '9')))
             {
-                encoding_type_ = EncodingType::STR_RAW;
+                InternalSet(std::move(data_));
             }
         }
-        return data_.size();
+        ViewBuf buf;
+        return View(&buf).size();
     }
 
-    auto Str::IncrBy(int delta) -> std::string
+    auto Str::IncrBy(std::int64_t delta) -> std::string
     {
         WriteGuard wg(latch_);
+        assert(!shared_);
         if (encoding_type_ != EncodingType::INT)
         {
             return {};
         }
-        auto intval = RedisStrToInt(data_);
-        if (!intval.has_value())
+        std::int64_t result;
+        if (__builtin_add_overflow(int_data_, delta, &result))
         {
-            encoding_type_ = EncodingType::STR_RAW;
             return {};
         }
-        int raw_int = intval.value();
-        raw_int += delta;
-        data_ = std::to_string(raw_int);
-        return data_;
+        int_data_ = result;
+        return std::to_string(int_data_);
     }
 
-    auto Str::DecrBy(int delta) -> std::string
+    auto Str::DecrBy(std::int64_t delta) -> std::string
     {
+        if (delta == std::numeric_limits<std::int64_t>::min())
+        {
+            return {};
+        }
         return IncrBy(-delta);
     }
 
+    auto Str::IncrByFloat(long double delta) -> std::string
+    {
+        WriteGuard wg(latch_);
+        assert(!shared_);
+        long double value;
+        if (encoding_type_ == EncodingType::INT)
+        {
+            value = static_cast<long double>(int_data_);
+        }
+        else
+        {
+            ToRaw();
+            if (data_.empty() || std::isspace(static_cast<unsigned char>(data_[0])))
+            {
+                return {};
+            }
+            char *end = nullptr;
+            value = std::strtold(data_.c_str(), &end);
+            if (end != data_.c_str() + data_.size() || std::isnan(value) || std::isinf(value))
+            {
+                return {};
+            }
+        }
+        value += delta;
+        if (std::isnan(value) || std::isinf(value))
+        {
+            return {};
+        }
+        // 17 significant digits, trailing zeros trimmed
+        char buf[5 * 1024];
+        int len = std::snprintf(buf, sizeof(buf), "%.17Lf", value);
+        if (len <= 0 || static_cast<std::size_t>(len) >= sizeof(buf))
+        {
+            return {};
+        }
+        std::string ret(buf, len);
+        if (ret.find('.') != std::string::npos)
+        {
+            while (ret.back() == '0')
+            {
+                ret.pop_back();
+            }
+            if (ret.back() == '.')
+            {
+                ret.pop_back();
+            }
+        }
+        if (ret == "-0")
+        {
+            ret = "0";
+        }
+        InternalSet(ret);
+        return ret;
+    }
+
     auto Str::Len() const -> std::size_t
     {
         ReadGuard rg(latch_);
-        return data_.size();
+        if (encoding_type_ == EncodingType::STR_COMPRESS)
+        {
+            return int_data_;
+        }
+        ViewBuf buf;
+        return View(&buf).size();
     }
 
     auto Str::Empty() const -> bool
     {
         ReadGuard rg(latch_);
-        return data_.empty();
+        return encoding_type_ != EncodingType::INT && data_.empty();
+    }
+
+    auto Str::IsShared() const -> bool
+    {
+        return shared_;
+    }
+
+    void Str::ToRaw()
+    {
+        if (encoding_type_ == EncodingType::INT)
+        {
+            data_ = std::to_string(int_data_);
+            encoding_type_ = EncodingType::STR_RAW;
+        }
+        else if (encoding_type_ == EncodingType::STR_COMPRESS)
+        {
+            data_ = Decompress(data_, int_data_).value();
+            int_data_ = 0;
+            encoding_type_ = EncodingType::STR_RAW;
+        }
+    }
+
+    auto Str::CompressInPlace(std::size_t min_len) -> bool
+    {
+        WriteGuard wg(latch_);
+        if (shared_ || encoding_type_ != EncodingType::STR_RAW || data_.size() < min_len)
+        {
+            return false;
+        }
+        // not worth a decode on every read unless it saves an eighth
+        auto cprs = Compress(data_, {min_len, 0.875});
+        if (!cprs.has_value())
+        {
+            return false;
+        }
+        int_data_ = data_.size();
+        data_ = std::move(cprs.value());
+        encoding_type_ = EncodingType::STR_COMPRESS;
+        return true;
+    }
+
+    void Str::Normalize()
+    {
+        if (encoding_type_ == EncodingType::STR_RAW && data_.size() <= 20)
+        {
+            InternalSet(std::move(data_));
+        }
+    }
+
+    /* redis style inclusive range with negative indexes, false if nothing is left */
+    static auto NormalizeRange(std::int64_t *start, std::int64_t *end, std::int64_t total) -> bool
+    {
+        if (*start < 0)
+        {
+            *start += total;
+        }
+        if (*end < 0)
+        {
+            *end += total;
+        }
+        *start = std::max<std::int64_t>(*start, 0);
+        *end = std::max<std::int64_t>(*end, 0);
+        *end = std::min<std::int64_t>(*end, total - 1);
+        return total > 0 && *start <= *end;
+    }
+
+    auto Str::SetBit(std::size_t offset, bool bit) -> int
+    {
+        WriteGuard wg(latch_);
+        assert(!shared_);
+        ToRaw();
+        std::size_t byte = offset >> 3;
+        if (byte >= data_.size())
+        {
+            data_.resize(byte + 1, '\0');
+        }
+        auto mask = static_cast<std::uint8_t>(0x80 >> (offset & 7));
+        auto &c = reinterpret_cast<std::uint8_t &>(data_[byte]);
+        int old = (c & mask) != 0;
+        c = bit ? (c | mask) : (c & ~mask);
+        Normalize();
+        return old;
+    }
+
+    auto Str::GetBit(std::size_t offset) const -> int
+    {
+        ReadGuard rg(latch_);
+        ViewBuf buf;
+        auto bytes = View(&buf);
+        std::size_t byte = offset >> 3;
+        if (byte >= bytes.size())
+        {
+            return 0;
+        }
+        return (static_cast<std::uint8_t>(bytes[byte]) >> (7 - (offset & 7))) & 1;
+    }
+
+    auto Str::BitCount(std::int64_t start, std::int64_t end, bool bit_unit) const -> std::size_t
+    {
+        ReadGuard rg(latch_);
+        ViewBuf buf;
+        auto bytes = View(&buf);
+        auto data = reinterpret_cast<const std::uint8_t *>(bytes.data());
+        auto total = static_cast<std::int64_t>(bytes.size()) * (bit_unit ? 8 : 1);
+        if (!NormalizeRange(&start, &end, total))
+        {
+            return 0;
+        }
+        if (!bit_unit)
+        {
+            return PopCount(data + start, end - start + 1);
+        }
+        std::int64_t first = start >> 3;
+        std::int64_t last = end >> 3;
+        std::size_t ret = PopCount(data + first, last - first + 1);
+        // drop the bits of the edge bytes that lie outside the range
+        ret -= __builtin_popcount(data[first] >> (8 - (start & 7)));
+        ret -= __builtin_popcount(data[last] & (0xff >> ((end & 7) + 1)));
+        return ret;
+    }
+
+    auto Str::BitPos(bool bit, std::int64_t start, std::optional<std::int64_t> end, bool bit_unit) const -> std::int64_t
+    {
+        ReadGuard rg(latch_);
+        ViewBuf buf;
+        auto bytes = View(&buf);
+        auto data = reinterpret_cast<const std::uint8_t *>(bytes.data());
+        auto total = static_cast<std::int64_t>(bytes.size()) * (bit_unit ? 8 : 1);
+        std::int64_t last_index = end.value_or(-1);
+        if (!NormalizeRange(&start, &last_index, total))
+        {
+            return (bit || total != 0) ? -1 : 0;
+        }
+        std::int64_t first_bit = bit_unit ? start : start * 8;
+        std::int64_t last_bit = bit_unit ? last_index : last_index * 8 + 7;
+        std::int64_t first = first_bit >> 3;
+        std::int64_t last = last_bit >> 3;
+
+        auto scan = [&](std::int64_t i) -> std::int64_t
+        {
+            auto v = static_cast<std::uint8_t>(bit ? data[i] : ~data[i]);
+            if (i == first)
+            {
+                v &= 0xff >> (first_bit & 7);
+            }
+            if (i == last)
+            {
+                v &= static_cast<std::uint8_t>(0xff << (7 - (last_bit & 7)));
+            }
+            if (v == 0)
+            {
+                return -1;
+            }
+            return i * 8 + __builtin_clz(v) - 24;
+        };
+
+        std::int64_t ret = scan(first);
+        if (ret < 0 && last > first)
+        {
+            std::int64_t i = first + 1 + FindFirstByteNot(data + first + 1, last - first - 1, bit ? 0x00 : 0xff);
+            ret = scan(i);
+        }
+        if (ret >= 0)
+        {
+            return ret;
+        }
+        // looking for a clear bit without an explicit end, the string is padded with zeros
+        if (!bit && !end.has_value())
+        {
+            return static_cast<std::int64_t>(bytes.size()) * 8;
+        }
+        return -1;
+    }
+
+    auto Str::GetBits(std::size_t offset, int width, bool is_signed) const -> std::int64_t
+    {
+        ReadGuard rg(latch_);
+        ViewBuf buf;
+        auto bytes = View(&buf);
+        std::uint64_t v = 0;
+        for (int i = 0; i < width; i++)
+        {
+            std::size_t pos = offset + i;
+            std::size_t byte = pos >> 3;
+            int b = byte < bytes.size() ? (static_cast<std::uint8_t>(bytes[byte]) >> (7 - (pos & 7))) & 1 : 0;
+            v = (v << 1) | b;
+        }
+        if (is_signed && width < 64 && ((v >> (width - 1)) & 1))
+        {
+            v |= ~0ULL << width;
+        }
+        return static_cast<std::int64_t>(v);
+    }
+
+    void Str::SetBits(std::size_t offset, int width, std::uint64_t value)
+    {
+        WriteGuard wg(latch_);
+        assert(!shared_);
+        ToRaw();
+        std::size_t need = ((offset + width - 1) >> 3) + 1;
+        if (need > data_.size())
+        {
+            data_.resize(need, '\0');
+        }
+        for (int i = 0; i < width; i++)
+        {
+            std::size_t pos = offset + i;
+            auto mask = static_cast<std::uint8_t>(0x80 >> (pos & 7));
+            auto &c = reinterpret_cast<std::uint8_t &>(data_[pos >> 3]);
+            c = ((value >> (width - 1 - i)) & 1) ? (c | mask) : (c & ~mask);
+        }
+        Normalize();
+    }
+
+    auto StrBitOp(BitOperation op, const std::vector<const Str *> &sources) -> std::string
+    {
+        // every distinct source is read-locked once, in address order
+        std::vector<const Str *> distinct;
+        for (auto src : sources)
+        {
+            if (src != nullptr)
+            {
+                distinct.push_back(src);
+            }
+        }
+        std::sort(distinct.begin(), distinct.end());
+        distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+        std::vector<std::unique_ptr<ReadGuard>> guards;
+        for (auto src : distinct)
+        {
+            guards.push_back(std::make_unique<ReadGuard>(src->ExposeLatch()));
+        }
+
+        std::vector<Str::ViewBuf> bufs(sources.size());
+        std::vector<std::string_view> views;
+        views.reserve(sources.size());
+        for (std::size_t i = 0; i < sources.size(); i++)
+        {
+            views.push_back(sources[i] == nullptr ? std::string_view() : sources[i]->View(&bufs[i]));
+        }
+        return BitOp(op, views);
     }
 
     // template <typename T, typename =
@@ -157,36 +602,46 @@ namespace rds
 
         assert(encoding_type_ == EncodingType::STR_RAW || encoding_type_ == EncodingType::INT || encoding_type_ == EncodingType::STR_COMPRESS);
 
-        // if str [len] or [len len-before-compress]
-        if (encoding_type_ == EncodingType::STR_RAW)
+        // int: 4 bytes when it fits, otherwise written as its digits so the format is unchanged
+        if (encoding_type_ == EncodingType::INT && int_data_ >= std::numeric_limits<int>::min() && int_data_ <= std::numeric_limits<int>::max())
         {
-            if (DefineCompress())
-            {
-                t = EncodingTypeToChar(EncodingType::STR_COMPRESS);
-            }
             ret.push_back(t);
-            std::string res;
-            if (DefineCompress())
-            {
-                std::string cprs = Compress(data_);
-                std::size_t len = cprs.size();
-                ret.append(BitsToString(len));
-                res = std::move(cprs);
-            }
-            else
-            {
-                res = data_;
-            }
-            std::size_t len = data_.size();
-            ret.append(BitsToString(len));
-            ret.append(res);
+            ret.append(BitsToString(static_cast<int>(int_data_)));
+            return ret;
+        }
+
+        // kept compressed in memory, the bytes go out as they are
+        if (encoding_type_ == EncodingType::STR_COMPRESS)
+        {
+            ret.push_back(t);
+            ret.append(BitsToString(data_.size()));
+            ret.append(BitsToString(static_cast<std::size_t>(int_data_)));
+            ret.append(data_);
             return ret;
         }
 
-        // int
-        ret.push_back(t);
-        int data = std::stoi(data_);
-        ret.append(BitsToString(data));
+        // if str [len] or [len len-before-compress]
+        std::string digits;
+        if (encoding_type_ == EncodingType::INT)
+        {
+            digits = std::to_string(int_data_);
+        }
+        const std::string &data = encoding_type_ == EncodingType::INT ? digits : data_;
+        // data that lzfse can not shrink is written raw
+        auto cprs = DefineCompress() ? Compress(data) : std::nullopt;
+        if (cprs.has_value())
+        {
+            ret.push_back(EncodingTypeToChar(EncodingType::STR_COMPRESS));
+            ret.append(BitsToString(cprs->size()));
+        }
+        else
+        {
+            ret.push_back(EncodingTypeToChar(EncodingType::STR_RAW));
+        }
+        const std::string &res = cprs.has_value() ? cprs.value() : data;
+        std::size_t len = data.size();
+        ret.append(BitsToString(len));
+        ret.append(res);
         return ret;
     }
 
@@ -196,7 +651,7 @@ namespace rds
         return encoding_type_;
     }
 
-    void Str::DecodeValue(std::deque<char> *source)
+    void Str::DecodeValue(Cursor *source)
     {
         WriteGuard wg(latch_);
         EncodingType etyp = CharToEncodingType(source->front());
@@ -209,25 +664,24 @@ namespace rds
         if (etyp == EncodingType::INT)
         {
             encoding_type_ = EncodingType::INT;
-            data_ = std::to_string(PeekInt(source));
+            int_data_ = PeekInt(source);
             return;
         }
-        encoding_type_ = EncodingType::STR_RAW;
         if (etyp == EncodingType::STR_RAW)
         {
             size_t size = PeekSize(source);
-            data_ = PeekString(source, size);
+            InternalSet(PeekString(source, size));
         }
         else if (etyp == EncodingType::STR_COMPRESS)
         {
             size_t size_compress = PeekSize(source);
-#ifndef NDEBUG
             size_t size_origin = PeekSize(source);
-#else
-            PeekSize(source);
-#endif
-            data_ = Decompress(PeekString(source, size_compress));
-            assert(size_origin == data_.size());
+            auto data = Decompress(std::string_view(source->Take(size_compress), size_compress), size_origin);
+            if (!data.has_value())
+            {
+                throw std::runtime_error("compressed string does not inflate to its size");
+            }
+            InternalSet(std::move(data.value()));
         }
     }
 
@@ -0,0 +1,349 @@
+#include <objects/stream.h>
+#include <database/rdb.h>
+
+namespace rds
+{
+    auto StreamID::ToString() const -> std::string
+    {
+        return std::to_string(ms_) + "-" + std::to_string(seq_);
+    }
+
+    auto StreamID::Parse(const std::string &raw, bool range_end) -> std::optional<StreamID>
+    {
+        auto toU64 = [](const std::string &s) -> std::optional<std::uint64_t>
+        {
+            if (s.empty() || s.size() > 20)
+            {
+                return {};
+            }
+            std::uint64_t ret = 0;
+            for (auto c : s)
+            {
+                if (c < '0' || c > '9')
+                {
+                    return {};
+                }
+                std::uint64_t next = ret * 10 + (c - '0');
+                if (next / 10 != ret)
+                {
+                    return {};
+                }
+                ret = next;
+            }
+            return ret;
+        };
+        auto dash = raw.find('-');
+        auto ms = toU64(raw.substr(0, dash));
+        if (!ms.has_value())
+        {
+            return {};
+        }
+        if (dash == std::string::npos)
+        {
+            return StreamID{ms.value(), range_end ? std::numeric_limits<std::uint64_t>::max() : 0};
+        }
+        auto seq = toU64(raw.substr(dash + 1));
+        if (!seq.has_value())
+        {
+            return {};
+        }
+        return StreamID{ms.value(), seq.value()};
+    }
+
+    auto StreamID::Max() -> StreamID
+    {
+        return {std::numeric_limits<std::uint64_t>::max(), std::numeric_limits<std::uint64_t>::max()};
+    }
+
+    Stream::Stream(const Stream &lhs)
+    {
+        ReadGuard rg(lhs.ExposeLatch());
+        blocks_ = lhs.blocks_;
+        length_ = lhs.length_;
+        last_id_ = lhs.last_id_;
+    }
+
+    Stream::Stream(Stream &&rhs) noexcept
+    {
+        ReadGuard rg(rhs.ExposeLatch());
+        blocks_ = std::move(rhs.blocks_);
+        length_ = rhs.length_;
+        last_id_ = rhs.last_id_;
+    }
+
+    Stream &Stream::operator=(const Stream &lhs)
+    {
+        ReadGuard rg(lhs.ExposeLatch());
+        blocks_ = lhs.blocks_;
+        length_ = lhs.length_;
+        last_id_ = lhs.last_id_;
+        return *this;
+    }
+
+    Stream &Stream::operator=(Stream &&rhs) noexcept
+    {
+        ReadGuard rg(rhs.ExposeLatch());
+        blocks_ = std::move(rhs.blocks_);
+        length_ = rhs.length_;
+        last_id_ = rhs.last_id_;
+        return *this;
+    }
+
+    /* [varint ms - first.ms][varint seq][varint n]{[varint len][bytes]} */
+    void Stream::AppendEntry(const StreamID &first, const StreamID &id, const std::vector<std::string> &fields, std::string *data)
+    {
+        PutVarint(data, id.ms_ - first.ms_);
+        PutVarint(data, id.seq_);
+        PutVarint(data, fields.size());
+        for (auto &f : fields)
+        {
+            PutVarint(data, f.size());
+            data->append(f);
+        }
+    }
+
+    auto Stream::UnpackBlock(const StreamID &first, const Block &block) -> std::vector<StreamEntry>
+    {
+        std::vector<StreamEntry> ret;
+        ret.reserve(block.count_);
+        const char *cursor = block.data_.data();
+        for (std::size_t i = 0; i < block.count_; i++)
+        {
+            StreamEntry entry;
+            entry.id_.ms_ = first.ms_ + GetVarint(&cursor);
+            entry.id_.seq_ = GetVarint(&cursor);
+            std::size_t n = GetVarint(&cursor);
+            entry.fields_.reserve(n);
+            for (std::size_t j = 0; j < n; j++)
+            {
+                std::size_t len = GetVarint(&cursor);
+                entry.fields_.emplace_back(cursor, len);
+                cursor += len;
+            }
+            ret.push_back(std::move(entry));
+        }
+        return ret;
+    }
+
+    auto Stream::Add(std::optional<StreamID> id, const std::vector<std::string> &fields) -> std::optional<StreamID>
+    {
+        WriteGuard wg(latch_);
+        StreamID new_id;
+        if (id.has_value())
+        {
+            if (id.value() <= last_id_)
+            {
+                return {};
+            }
+            new_id = id.value();
+        }
+        else
+        {
+            std::uint64_t ms = MsTime();
+            if (ms > last_id_.ms_)
+            {
+                new_id = {ms, 0};
+            }
+            else if (last_id_.seq_ != std::numeric_limits<std::uint64_t>::max())
+            {
+                new_id = {last_id_.ms_, last_id_.seq_ + 1};
+            }
+            else
+            {
+                new_id = {last_id_.ms_ + 1, 0};
+            }
+        }
+
+        if (blocks_.empty() ||
+            blocks_.rbegin()->second.count_ >= BLOCK_MAX_ENTRIES ||
+            blocks_.rbegin()->second.data_.size() >= BLOCK_MAX_BYTES)
+        {
+            blocks_.emplace(new_id, Block{new_id, 0, {}});
+        }
+        auto &[first, block] = *blocks_.rbegin();
+        AppendEntry(first, new_id, fields, &block.data_);
+        block.last_ = new_id;
+        block.count_++;
+        length_++;
+        last_id_ = new_id;
+        return new_id;
+    }
+
+    auto Stream::Range(const StreamID &start, const StreamID &end, std::size_t count) const -> std::vector<StreamEntry>
+    {
+        ReadGuard rg(latch_);
+        std::vector<StreamEntry> ret;
+        if (count == 0 || end < start)
+        {
+            return ret;
+        }
+        auto it = blocks_.upper_bound(start);
+        if (it != blocks_.begin())
+        {
+            it--;
+        }
+        for (; it != blocks_.end() && it->first <= end; it++)
+        {
+            if (it->second.last_ < start)
+            {
+                continue;
+            }
+            for (auto &entry : UnpackBlock(it->first, it->second))
+            {
+                if (entry.id_ < start)
+                {
+                    continue;
+                }
+                if (end < entry.id_)
+                {
+                    return ret;
+                }
+                ret.push_back(std::move(entry));
+                if (ret.size() == count)
+                {
+                    return ret;
+                }
+            }
+        }
+        return ret;
+    }
+
+    auto Stream::RevRange(const StreamID &end, const StreamID &start, std::size_t count) const -> std::vector<StreamEntry>
+    {
+        ReadGuard rg(latch_);
+        std::vector<StreamEntry> ret;
+        if (count == 0 || end < start)
+        {
+            return ret;
+        }
+        auto it = blocks_.upper_bound(end);
+        while (it != blocks_.begin())
+        {
+            it--;
+            if (it->second.last_ < start)
+            {
+                break;
+            }
+            auto entries = UnpackBlock(it->first, it->second);
+            for (auto e = entries.rbegin(); e != entries.rend(); e++)
+            {
+                if (end < e->id_)
+                {
+                    continue;
+                }
+                if (e->id_ < start)
+                {
+                    return ret;
+                }
+                ret.push_back(std::move(*e));
+                if (ret.size() == count)
+                {
+                    return ret;
+                }
+            }
+        }
+        return ret;
+    }
+
+    auto Stream::Len() const -> std::size_t
+    {
+        ReadGuard rg(latch_);
+        return length_;
+    }
+
+    auto Stream::LastID() const -> StreamID
+    {
+        ReadGuard rg(latch_);
+        return last_id_;
+    }
+
+    auto Stream::Trim(std::size_t max_len, bool approx) -> std::size_t
+    {
+        WriteGuard wg(latch_);
+        std::size_t removed = 0;
+        while (!blocks_.empty() && length_ - blocks_.begin()->second.count_ >= max_len)
+        {
+            removed += blocks_.begin()->second.count_;
+            length_ -= blocks_.begin()->second.count_;
+            blocks_.erase(blocks_.begin());
+        }
+        if (approx || length_ <= max_len)
+        {
+            return removed;
+        }
+        // the oldest block is split and repacked under the id of its new first entry
+        std::size_t drop = length_ - max_len;
+        auto entries = UnpackBlock(blocks_.begin()->first, blocks_.begin()->second);
+        blocks_.erase(blocks_.begin());
+        Block block{entries.back().id_, 0, {}};
+        StreamID first = entries[drop].id_;
+        for (std::size_t i = drop; i < entries.size(); i++)
+        {
+            AppendEntry(first, entries[i].id_, entries[i].fields_, &block.data_);
+            block.count_++;
+        }
+        blocks_.emplace(first, std::move(block));
+        length_ -= drop;
+        return removed + drop;
+    }
+
+    auto Stream::Blocks() const -> std::size_t
+    {
+        ReadGuard rg(latch_);
+        return blocks_.size();
+    }
+
+    auto Stream::GetObjectType() const -> ObjectType
+    {
+        return ObjectType::STREAM;
+    }
+
+    /*
+    [size_t length][size_t last-ms][size_t last-seq][size_t blocks]
+    {[size_t first-ms][size_t first-seq][size_t last-ms][size_t last-seq][size_t count][size_t bytes][packed entries]}
+     */
+    auto Stream::EncodeValue() const -> std::string
+    {
+        ReadGuard rg(latch_);
+        std::string ret;
+        ret.append(BitsToString(length_));
+        ret.append(BitsToString(last_id_.ms_));
+        ret.append(BitsToString(last_id_.seq_));
+        ret.append(BitsToString(blocks_.size()));
+        for (auto &[first, block] : blocks_)
+        {
+            ret.append(BitsToString(first.ms_));
+            ret.append(BitsToString(first.seq_));
+            ret.append(BitsToString(block.last_.ms_));
+            ret.append(BitsToString(block.last_.seq_));
+            ret.append(BitsToString(block.count_));
+            ret.append(BitsToString(block.data_.size()));
+            ret.append(block.data_);
+        }
+        return ret;
+    }
+
+    void Stream::DecodeValue(Cursor *source)
+    {
+        WriteGuard wg(latch_);
+        blocks_.clear();
+        length_ = PeekSize(source);
+        last_id_.ms_ = PeekSize(source);
+        last_id_.seq_ = PeekSize(source);
+        std::size_t n = PeekSize(source);
+        for (std::size_t i = 0; i < n; i++)
+        {
+            StreamID first;
+            first.ms_ = PeekSize(source);
+            first.seq_ = PeekSize(source);
+            Block block;
+            block.last_.ms_ = PeekSize(source);
+            block.last_.seq_ = PeekSize(source);
+            block.count_ = PeekSize(source);
+            std::size_t bytes = PeekSize(source);
+            block.data_ = PeekString(source, bytes);
+            blocks_.emplace_hint(blocks_.end(), first, std::move(block));
+        }
+    }
+
+} // namespace rds
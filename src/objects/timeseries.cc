@@ -0,0 +1,460 @@
+#include <objects/timeseries.h>
+#include <database/rdb.h>
+#include <algorithm>
+
+namespace rds
+{
+    namespace
+    {
+        /* the low n bits of v, most significant first */
+        void PutBits(TimeSeries::Chunk *chunk, std::uint64_t v, int n)
+        {
+            if (n < 64)
+            {
+                v &= (1ULL << n) - 1;
+            }
+            int used = chunk->bits_ & 63;
+            if (used == 0)
+            {
+                chunk->words_.push_back(0);
+            }
+            int room = 64 - used;
+            if (n <= room)
+            {
+                chunk->words_.back() |= v << (room - n);
+            }
+            else
+            {
+                chunk->words_.back() |= v >> (n - room);
+                chunk->words_.push_back(v << (64 - (n - room)));
+            }
+            chunk->bits_ += n;
+        }
+
+        class BitReader
+        {
+        private:
+            const std::uint64_t *words_;
+            std::size_t pos_{0};
+
+        public:
+            explicit BitReader(const std::uint64_t *words) : words_(words) {}
+
+            auto Get(int n) -> std::uint64_t
+            {
+                const std::uint64_t *w = words_ + (pos_ >> 6);
+                int used = pos_ & 63;
+                int room = 64 - used;
+                pos_ += n;
+                if (n <= room)
+                {
+                    return (w[0] << used) >> (64 - n);
+                }
+                return ((w[0] << used) >> (64 - n)) | (w[1] >> (64 - (n - room)));
+            }
+        };
+
+        auto DoubleBits(double value) -> std::uint64_t
+        {
+            std::uint64_t ret;
+            std::memcpy(&ret, &value, sizeof(ret));
+            return ret;
+        }
+
+        auto BitsDouble(std::uint64_t bits) -> double
+        {
+            double ret;
+            std::memcpy(&ret, &bits, sizeof(ret));
+            return ret;
+        }
+
+        template <typename T>
+        auto PeekBits(Cursor *source) -> T
+        {
+            std::string raw = PeekString(source, sizeof(T));
+            T ret;
+            std::memcpy(&ret, raw.data(), sizeof(T));
+            return ret;
+        }
+    } // namespace
+
+    TimeSeries::TimeSeries(const TimeSeries &lhs)
+    {
+        ReadGuard rg(lhs.ExposeLatch());
+        retention_ms_ = lhs.retention_ms_;
+        chunks_ = lhs.chunks_;
+        total_ = lhs.total_;
+    }
+
+    TimeSeries::TimeSeries(TimeSeries &&rhs) noexcept
+    {
+        ReadGuard rg(rhs.ExposeLatch());
+        retention_ms_ = rhs.retention_ms_;
+        chunks_ = std::move(rhs.chunks_);
+        total_ = rhs.total_;
+    }
+
+    TimeSeries &TimeSeries::operator=(const TimeSeries &lhs)
+    {
+        ReadGuard rg(lhs.ExposeLatch());
+        retention_ms_ = lhs.retention_ms_;
+        chunks_ = lhs.chunks_;
+        total_ = lhs.total_;
+        return *this;
+    }
+
+    TimeSeries &TimeSeries::operator=(TimeSeries &&rhs) noexcept
+    {
+        ReadGuard rg(rhs.ExposeLatch());
+        retention_ms_ = rhs.retention_ms_;
+        chunks_ = std::move(rhs.chunks_);
+        total_ = rhs.total_;
+        return *this;
+    }
+
+    /*
+    first sample: [64 ts][64 value bits]
+    timestamp:    delta-of-delta, '0' | '10' 7 bits | '110' 9 bits | '1110' 12 bits | '1111' 64 bits
+    value:        xor with the previous one, '0' | '10' bits inside the previous window
+                  | '11' [5 leading zeros][6 length - 1] bits
+     */
+    void TimeSeries::ChunkAppend(Chunk *chunk, std::int64_t ts, double value)
+    {
+        std::uint64_t bits = DoubleBits(value);
+        if (chunk->count_ == 0)
+        {
+            PutBits(chunk, static_cast<std::uint64_t>(ts), 64);
+            PutBits(chunk, bits, 64);
+            chunk->first_ts_ = ts;
+        }
+        else
+        {
+            // unsigned arithmetic wraps the same way on both sides
+            auto delta = static_cast<std::int64_t>(static_cast<std::uint64_t>(ts) - static_cast<std::uint64_t>(chunk->last_ts_));
+            auto dod = static_cast<std::int64_t>(static_cast<std::uint64_t>(delta) - static_cast<std::uint64_t>(chunk->last_delta_));
+            if (dod == 0)
+            {
+                PutBits(chunk, 0, 1);
+            }
+            else if (dod >= -63 && dod <= 64)
+            {
+                PutBits(chunk, 0b10, 2);
+                PutBits(chunk, dod + 63, 7);
+            }
+            else if (dod >= -255 && dod <= 256)
+            {
+                PutBits(chunk, 0b110, 3);
+                PutBits(chunk, dod + 255, 9);
+            }
+            else if (dod >= -2047 && dod <= 2048)
+            {
+                PutBits(chunk, 0b1110, 4);
+                PutBits(chunk, dod + 2047, 12);
+            }
+            else
+            {
+                PutBits(chunk, 0b1111, 4);
+                PutBits(chunk, static_cast<std::uint64_t>(dod), 64);
+            }
+            chunk->last_delta_ = delta;
+
+            std::uint64_t x = bits ^ chunk->last_value_;
+            if (x == 0)
+            {
+                PutBits(chunk, 0, 1);
+            }
+            else
+            {
+                int leading = std::min(__builtin_clzll(x), 31);
+                int trailing = __builtin_ctzll(x);
+                if (leading >= chunk->leading_ && trailing >= chunk->trailing_)
+                {
+                    PutBits(chunk, 0b10, 2);
+                    PutBits(chunk, x >> chunk->trailing_, 64 - chunk->leading_ - chunk->trailing_);
+                }
+                else
+                {
+                    int significant = 64 - leading - trailing;
+                    PutBits(chunk, 0b11, 2);
+                    PutBits(chunk, leading, 5);
+                    PutBits(chunk, significant - 1, 6);
+                    PutBits(chunk, x >> trailing, significant);
+                    chunk->leading_ = leading;
+                    chunk->trailing_ = trailing;
+                }
+            }
+        }
+        chunk->last_ts_ = ts;
+        chunk->last_value_ = bits;
+        chunk->count_++;
+    }
+
+    template <typename F>
+    void TimeSeries::ChunkScan(const Chunk &chunk, std::int64_t from, std::int64_t to, F &&f)
+    {
+        BitReader reader(chunk.words_.data());
+        std::uint64_t ts = 0;
+        std::uint64_t delta = 0;
+        std::uint64_t value = 0;
+        int leading = 0;
+        int trailing = 0;
+        for (std::size_t i = 0; i < chunk.count_; i++)
+        {
+            if (i == 0)
+            {
+                ts = reader.Get(64);
+                value = reader.Get(64);
+            }
+            else
+            {
+                std::uint64_t dod;
+                if (reader.Get(1) == 0)
+                {
+                    dod = 0;
+                }
+                else if (reader.Get(1) == 0)
+                {
+                    dod = reader.Get(7) - 63;
+                }
+                else if (reader.Get(1) == 0)
+                {
+                    dod = reader.Get(9) - 255;
+                }
+                else if (reader.Get(1) == 0)
+                {
+                    dod = reader.Get(12) - 2047;
+                }
+                else
+                {
+                    dod = reader.Get(64);
+                }
+                delta += dod;
+                ts += delta;
+                if (reader.Get(1) != 0)
+                {
+                    if (reader.Get(1) == 0)
+                    {
+                        value ^= reader.Get(64 - leading - trailing) << trailing;
+                    }
+                    else
+                    {
+                        leading = reader.Get(5);
+                        int significant = reader.Get(6) + 1;
+                        trailing = 64 - leading - significant;
+                        value ^= reader.Get(significant) << trailing;
+                    }
+                }
+            }
+            auto sample_ts = static_cast<std::int64_t>(ts);
+            if (sample_ts > to)
+            {
+                return;
+            }
+            if (sample_ts >= from)
+            {
+                f(sample_ts, BitsDouble(value));
+            }
+        }
+    }
+
+    template <typename F>
+    void TimeSeries::Scan(std::int64_t from, std::int64_t to, F &&f) const
+    {
+        if (chunks_.empty())
+        {
+            return;
+        }
+        if (retention_ms_ > 0)
+        {
+            from = std::max(from, chunks_.back().last_ts_ - retention_ms_);
+        }
+        auto it = std::lower_bound(chunks_.begin(), chunks_.end(), from, [](const Chunk &c, std::int64_t ts)
+                                   { return c.last_ts_ < ts; });
+        for (; it != chunks_.end() && it->first_ts_ <= to; it++)
+        {
+            ChunkScan(*it, from, to, f);
+        }
+    }
+
+    void TimeSeries::DropExpired()
+    {
+        if (retention_ms_ <= 0)
+        {
+            return;
+        }
+        std::int64_t cutoff = chunks_.back().last_ts_ - retention_ms_;
+        while (chunks_.size() > 1 && chunks_.front().last_ts_ < cutoff)
+        {
+            total_ -= chunks_.front().count_;
+            chunks_.pop_front();
+        }
+    }
+
+    auto TimeSeries::Add(std::int64_t ts, double value) -> bool
+    {
+        WriteGuard wg(latch_);
+        if (!chunks_.empty() && ts <= chunks_.back().last_ts_)
+        {
+            return false;
+        }
+        if (chunks_.empty() || chunks_.back().bits_ >= CHUNK_MAX_BITS)
+        {
+            chunks_.emplace_back();
+        }
+        ChunkAppend(&chunks_.back(), ts, value);
+        total_++;
+        DropExpired();
+        return true;
+    }
+
+    auto TimeSeries::Range(std::int64_t from, std::int64_t to) const -> std::vector<Sample>
+    {
+        ReadGuard rg(latch_);
+        std::vector<Sample> ret;
+        Scan(from, to, [&ret](std::int64_t ts, double value)
+             { ret.emplace_back(ts, value); });
+        return ret;
+    }
+
+    auto TimeSeries::Aggregate(std::int64_t from, std::int64_t to, Aggregation agg, std::int64_t bucket_ms) const -> std::vector<Sample>
+    {
+        ReadGuard rg(latch_);
+        std::vector<Sample> ret;
+        std::int64_t bucket = 0;
+        double acc = 0;
+        std::size_t n = 0;
+        auto flush = [&]()
+        {
+            ret.emplace_back(bucket, agg == Aggregation::AVG ? acc / n : acc);
+        };
+        Scan(from, to, [&](std::int64_t ts, double value)
+             {
+                 std::int64_t start = ts - ((ts % bucket_ms) + bucket_ms) % bucket_ms;
+                 if (n != 0 && start != bucket)
+                 {
+                     flush();
+                     n = 0;
+                 }
+                 if (n == 0)
+                 {
+                     bucket = start;
+                     acc = value;
+                 }
+                 else if (agg == Aggregation::MIN)
+                 {
+                     acc = std::min(acc, value);
+                 }
+                 else if (agg == Aggregation::MAX)
+                 {
+                     acc = std::max(acc, value);
+                 }
+                 else
+                 {
+                     acc += value;
+                 }
+                 n++; });
+        if (n != 0)
+        {
+            flush();
+        }
+        return ret;
+    }
+
+    void TimeSeries::SetRetention(std::int64_t retention_ms)
+    {
+        WriteGuard wg(latch_);
+        retention_ms_ = retention_ms;
+        if (!chunks_.empty())
+        {
+            DropExpired();
+        }
+    }
+
+    auto TimeSeries::Retention() const -> std::int64_t
+    {
+        ReadGuard rg(latch_);
+        return retention_ms_;
+    }
+
+    auto TimeSeries::Size() const -> std::size_t
+    {
+        ReadGuard rg(latch_);
+        return total_;
+    }
+
+    auto TimeSeries::Chunks() const -> std::size_t
+    {
+        ReadGuard rg(latch_);
+        return chunks_.size();
+    }
+
+    auto TimeSeries::Bytes() const -> std::size_t
+    {
+        ReadGuard rg(latch_);
+        std::size_t ret = 0;
+        for (auto &chunk : chunks_)
+        {
+            ret += chunk.words_.size() * sizeof(std::uint64_t);
+        }
+        return ret;
+    }
+
+    auto TimeSeries::GetObjectType() const -> ObjectType
+    {
+        return ObjectType::TIMESERIES;
+    }
+
+    /*
+    [int64 retention][size_t samples][size_t chunks]
+    {[int64 first][int64 last][size_t count][int64 last-delta][uint64 last-value]
+     [char leading][char trailing][size_t bits][size_t words][words]}
+     */
+    auto TimeSeries::EncodeValue() const -> std::string
+    {
+        ReadGuard rg(latch_);
+        std::string ret;
+        ret.append(BitsToString(retention_ms_));
+        ret.append(BitsToString(total_));
+        ret.append(BitsToString(chunks_.size()));
+        for (auto &chunk : chunks_)
+        {
+            ret.append(BitsToString(chunk.first_ts_));
+            ret.append(BitsToString(chunk.last_ts_));
+            ret.append(BitsToString(chunk.count_));
+            ret.append(BitsToString(chunk.last_delta_));
+            ret.append(BitsToString(chunk.last_value_));
+            ret.push_back(chunk.leading_);
+            ret.push_back(chunk.trailing_);
+            ret.append(BitsToString(chunk.bits_));
+            ret.append(BitsToString(chunk.words_.size()));
+            ret.append(reinterpret_cast<const char *>(chunk.words_.data()), chunk.words_.size() * sizeof(std::uint64_t));
+        }
+        return ret;
+    }
+
+    void TimeSeries::DecodeValue(Cursor *source)
+    {
+        WriteGuard wg(latch_);
+        retention_ms_ = PeekBits<std::int64_t>(source);
+        total_ = PeekSize(source);
+        std::size_t n = PeekSize(source);
+        chunks_.clear();
+        for (std::size_t i = 0; i < n; i++)
+        {
+            Chunk chunk;
+            chunk.first_ts_ = PeekBits<std::int64_t>(source);
+            chunk.last_ts_ = PeekBits<std::int64_t>(source);
+            chunk.count_ = PeekSize(source);
+            chunk.last_delta_ = PeekBits<std::int64_t>(source);
+            chunk.last_value_ = PeekBits<std::uint64_t>(source);
+            chunk.leading_ = PeekBits<std::uint8_t>(source);
+            chunk.trailing_ = PeekBits<std::uint8_t>(source);
+            chunk.bits_ = PeekSize(source);
+            chunk.words_.resize(PeekSize(source));
+            std::string raw = PeekString(source, chunk.words_.size() * sizeof(std::uint64_t));
+            std::memcpy(chunk.words_.data(), raw.data(), raw.size());
+            chunks_.push_back(std::move(chunk));
+        }
+    }
+
+} // namespace rds
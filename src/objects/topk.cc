@@ -0,0 +1,278 @@
+#include <objects/topk.h>
+#include <database/rdb.h>
+#include <algorithm>
+#include <cmath>
+
+namespace rds
+{
+    namespace
+    {
+        constexpr std::uint64_t TOPK_SEED = 0x51ed270b27a8f3c5ULL;
+        constexpr std::uint32_t DECAY_TABLE_SIZE = 256;
+        /* the high bit of the stored k, the rng follows the heap */
+        constexpr std::uint32_t TOPK_WITH_RNG = std::uint32_t{1} << 31;
+
+        auto HeapGreater(const TopK::Item &a, const TopK::Item &b) -> bool
+        {
+            return a.second > b.second;
+        }
+
+        template <typename T>
+        auto PeekBits(Cursor *source) -> T
+        {
+            std::string raw = PeekString(source, sizeof(T));
+            T ret;
+            std::memcpy(&ret, raw.data(), sizeof(T));
+            return ret;
+        }
+    } // namespace
+
+    TopK::TopK(const TopK &lhs)
+    {
+        ReadGuard rg(lhs.ExposeLatch());
+        k_ = lhs.k_;
+        width_ = lhs.width_;
+        depth_ = lhs.depth_;
+        decay_ = lhs.decay_;
+        buckets_ = lhs.buckets_;
+        decay_table_ = lhs.decay_table_;
+        heap_ = lhs.heap_;
+        rng_ = lhs.rng_;
+    }
+
+    TopK::TopK(TopK &&rhs) noexcept
+    {
+        ReadGuard rg(rhs.ExposeLatch());
+        k_ = rhs.k_;
+        width_ = rhs.width_;
+        depth_ = rhs.depth_;
+        decay_ = rhs.decay_;
+        buckets_ = std::move(rhs.buckets_);
+        decay_table_ = std::move(rhs.decay_table_);
+        heap_ = std::move(rhs.heap_);
+        rng_ = rhs.rng_;
+    }
+
+    TopK &TopK::operator=(const TopK &lhs)
+    {
+        ReadGuard rg(lhs.ExposeLatch());
+        k_ = lhs.k_;
+        width_ = lhs.width_;
+        depth_ = lhs.depth_;
+        decay_ = lhs.decay_;
+        buckets_ = lhs.buckets_;
+        decay_table_ = lhs.decay_table_;
+        heap_ = lhs.heap_;
+        rng_ = lhs.rng_;
+        return *this;
+    }
+
+    TopK &TopK::operator=(TopK &&rhs) noexcept
+    {
+        ReadGuard rg(rhs.ExposeLatch());
+        k_ = rhs.k_;
+        width_ = rhs.width_;
+        depth_ = rhs.depth_;
+        decay_ = rhs.decay_;
+        buckets_ = std::move(rhs.buckets_);
+        decay_table_ = std::move(rhs.decay_table_);
+        heap_ = std::move(rhs.heap_);
+        rng_ = rhs.rng_;
+        return *this;
+    }
+
+    /* xorshift64*, uniform in [0, 1) */
+    auto TopK::Random() -> double
+    {
+        rng_ ^= rng_ >> 12;
+        rng_ ^= rng_ << 25;
+        rng_ ^= rng_ >> 27;
+        return ((rng_ * 0x2545f4914f6cdd1dULL) >> 11) * 0x1.0p-53;
+    }
+
+    auto TopK::DecayProbability(std::uint32_t count) const -> double
+    {
+        return count < decay_table_.size() ? decay_table_[count] : std::pow(decay_, count);
+    }
+
+    auto TopK::Insert(const std::string &item, std::uint64_t hash, std::uint32_t incr) -> std::optional<std::string>
+    {
+        auto fingerprint = static_cast<std::uint32_t>(hash >> 32);
+        std::uint32_t max_count = 0;
+        for (std::uint32_t row = 0; row < depth_; row++)
+        {
+            std::uint32_t h = static_cast<std::uint32_t>(hash) + row * (fingerprint | 1);
+            Bucket &b = buckets_[static_cast<std::size_t>(row) * width_ + ((static_cast<std::uint64_t>(h) * width_) >> 32)];
+            if (b.count_ == 0)
+            {
+                b.fingerprint_ = fingerprint;
+                b.count_ = incr;
+            }
+            else if (b.fingerprint_ == fingerprint)
+            {
+                b.count_ = static_cast<std::uint32_t>(std::min<std::uint64_t>(static_cast<std::uint64_t>(b.count_) + incr,
+                                                                              std::numeric_limits<std::uint32_t>::max()));
+            }
+            else
+            {
+                for (std::uint32_t n = 0; n < incr; n++)
+                {
+                    if (Random() < DecayProbability(b.count_) && --b.count_ == 0)
+                    {
+                        b.fingerprint_ = fingerprint;
+                        b.count_ = incr - n;
+                        break;
+                    }
+                }
+            }
+            if (b.fingerprint_ == fingerprint)
+            {
+                max_count = std::max(max_count, b.count_);
+            }
+        }
+
+        if (heap_.size() == k_ && max_count < heap_.front().second)
+        {
+            return {};
+        }
+        auto it = std::find_if(heap_.begin(), heap_.end(), [&item](const Item &e)
+                               { return e.first == item; });
+        if (it != heap_.end())
+        {
+            it->second = std::max(it->second, max_count);
+            std::make_heap(heap_.begin(), heap_.end(), HeapGreater);
+            return {};
+        }
+        if (heap_.size() < k_)
+        {
+            heap_.emplace_back(item, max_count);
+            std::push_heap(heap_.begin(), heap_.end(), HeapGreater);
+            return {};
+        }
+        if (max_count == heap_.front().second)
+        {
+            return {};
+        }
+        std::pop_heap(heap_.begin(), heap_.end(), HeapGreater);
+        std::string expelled = std::move(heap_.back().first);
+        heap_.back() = {item, max_count};
+        std::push_heap(heap_.begin(), heap_.end(), HeapGreater);
+        return expelled;
+    }
+
+    void TopK::Reserve(std::uint32_t k, std::uint32_t width, std::uint32_t depth, double decay)
+    {
+        WriteGuard wg(latch_);
+        k_ = k;
+        width_ = width;
+        depth_ = depth;
+        decay_ = decay;
+        buckets_.assign(static_cast<std::size_t>(width) * depth, Bucket{0, 0});
+        decay_table_.resize(DECAY_TABLE_SIZE);
+        for (std::uint32_t c = 0; c < DECAY_TABLE_SIZE; c++)
+        {
+            decay_table_[c] = std::pow(decay, c);
+        }
+        heap_.clear();
+    }
+
+    auto TopK::Add(const std::vector<std::string> &items) -> std::vector<std::optional<std::string>>
+    {
+        std::vector<std::uint64_t> hashes;
+        hashes.reserve(items.size());
+        for (auto &item : items)
+        {
+            hashes.push_back(MurmurHash64A(item.data(), item.size(), TOPK_SEED));
+        }
+        WriteGuard wg(latch_);
+        std::vector<std::optional<std::string>> ret;
+        ret.reserve(items.size());
+        for (std::size_t i = 0; i < items.size(); i++)
+        {
+            ret.push_back(Insert(items[i], hashes[i], 1));
+        }
+        return ret;
+    }
+
+    auto TopK::Query(const std::vector<std::string> &items) const -> std::vector<bool>
+    {
+        ReadGuard rg(latch_);
+        std::vector<bool> ret;
+        ret.reserve(items.size());
+        for (auto &item : items)
+        {
+            ret.push_back(std::any_of(heap_.begin(), heap_.end(), [&item](const Item &e)
+                                      { return e.first == item; }));
+        }
+        return ret;
+    }
+
+    auto TopK::List() const -> std::vector<Item>
+    {
+        ReadGuard rg(latch_);
+        std::vector<Item> ret = heap_;
+        std::sort(ret.begin(), ret.end(), HeapGreater);
+        return ret;
+    }
+
+    auto TopK::K() const -> std::uint32_t
+    {
+        ReadGuard rg(latch_);
+        return k_;
+    }
+
+    auto TopK::GetObjectType() const -> ObjectType
+    {
+        return ObjectType::TOPK;
+    }
+
+    /*
+    [uint32 k][uint32 width][uint32 depth][double decay][width * depth buckets]
+    [size_t heap]{[size_t len][item][uint32 count]}[uint64 rng]
+    the high bit of k marks the rng, written since decay replays need it:
+    without it TOPK.ADD from the aof decays other buckets than it did live
+     */
+    auto TopK::EncodeValue() const -> std::string
+    {
+        ReadGuard rg(latch_);
+        std::string ret;
+        ret.append(BitsToString(k_ | TOPK_WITH_RNG));
+        ret.append(BitsToString(width_));
+        ret.append(BitsToString(depth_));
+        ret.append(BitsToString(decay_));
+        ret.append(reinterpret_cast<const char *>(buckets_.data()), buckets_.size() * sizeof(Bucket));
+        ret.append(BitsToString(heap_.size()));
+        for (auto &[item, count] : heap_)
+        {
+            ret.append(BitsToString(item.size()));
+            ret.append(item);
+            ret.append(BitsToString(count));
+        }
+        ret.append(BitsToString(rng_));
+        return ret;
+    }
+
+    void TopK::DecodeValue(Cursor *source)
+    {
+        auto k = PeekBits<std::uint32_t>(source);
+        bool with_rng = (k & TOPK_WITH_RNG) != 0;
+        k &= ~TOPK_WITH_RNG;
+        auto width = PeekBits<std::uint32_t>(source);
+        auto depth = PeekBits<std::uint32_t>(source);
+        Reserve(k, width, depth, PeekBits<double>(source));
+        WriteGuard wg(latch_);
+        std::string raw = PeekString(source, buckets_.size() * sizeof(Bucket));
+        std::memcpy(buckets_.data(), raw.data(), raw.size());
+        std::size_t n = PeekSize(source);
+        for (std::size_t i = 0; i < n; i++)
+        {
+            std::string item = PeekString(source, PeekSize(source));
+            heap_.emplace_back(std::move(item), PeekBits<std::uint32_t>(source));
+        }
+        if (with_rng)
+        {
+            rng_ = PeekBits<std::uint64_t>(source);
+        }
+    }
+
+} // namespace rds
@@ -0,0 +1,187 @@
+#include <objects/vecops.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RDS_VECOPS_X86
+#endif
+
+namespace rds
+{
+    namespace
+    {
+        using DotF32Fn = float (*)(const float *, const float *, std::size_t);
+        using L2F32Fn = float (*)(const float *, const float *, std::size_t);
+        using DotI8Fn = std::int32_t (*)(const std::int8_t *, const std::int8_t *, std::size_t);
+
+        auto DotF32Generic(const float *a, const float *b, std::size_t dim) -> float
+        {
+            float ret = 0;
+            for (std::size_t i = 0; i < dim; i++)
+            {
+                ret += a[i] * b[i];
+            }
+            return ret;
+        }
+
+        auto L2F32Generic(const float *a, const float *b, std::size_t dim) -> float
+        {
+            float ret = 0;
+            for (std::size_t i = 0; i < dim; i++)
+            {
+                float d = a[i] - b[i];
+                ret += d * d;
+            }
+            return ret;
+        }
+
+        auto DotI8Generic(const std::int8_t *a, const std::int8_t *b, std::size_t dim) -> std::int32_t
+        {
+            std::int32_t ret = 0;
+            for (std::size_t i = 0; i < dim; i++)
+            {
+                ret += a[i] * b[i];
+            }
+            return ret;
+        }
+
+#ifdef RDS_VECOPS_X86
+        __attribute__((target("avx2,fma"))) inline auto HorizontalSum(__m256 v) -> float
+        {
+            __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+            s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+            s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+            return _mm_cvtss_f32(s);
+        }
+
+        __attribute__((target("avx2,fma"))) auto DotF32Avx2(const float *a, const float *b, std::size_t dim) -> float
+        {
+            __m256 acc0 = _mm256_setzero_ps();
+            __m256 acc1 = _mm256_setzero_ps();
+            std::size_t i = 0;
+            for (; i + 16 <= dim; i += 16)
+            {
+                acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+                acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+            }
+            for (; i + 8 <= dim; i += 8)
+            {
+                acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+            }
+            return HorizontalSum(_mm256_add_ps(acc0, acc1)) + DotF32Generic(a + i, b + i, dim - i);
+        }
+
+        __attribute__((target("avx2,fma"))) auto L2F32Avx2(const float *a, const float *b, std::size_t dim) -> float
+        {
+            __m256 acc = _mm256_setzero_ps();
+            std::size_t i = 0;
+            for (; i + 8 <= dim; i += 8)
+            {
+                __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+                acc = _mm256_fmadd_ps(d, d, acc);
+            }
+            return HorizontalSum(acc) + L2F32Generic(a + i, b + i, dim - i);
+        }
+
+        /* sign extend to 16 bits, vpmaddwd sums neighbouring products into 32 bit lanes */
+        __attribute__((target("avx2"))) auto DotI8Avx2(const std::int8_t *a, const std::int8_t *b, std::size_t dim) -> std::int32_t
+        {
+            __m256i acc = _mm256_setzero_si256();
+            std::size_t i = 0;
+            for (; i + 16 <= dim; i += 16)
+            {
+                __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)));
+                __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)));
+                acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+            }
+            __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+            s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+            s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+            return _mm_cvtsi128_si32(s) + DotI8Generic(a + i, b + i, dim - i);
+        }
+
+        __attribute__((target("avx512f"))) auto DotF32Avx512(const float *a, const float *b, std::size_t dim) -> float
+        {
+            __m512 acc = _mm512_setzero_ps();
+            std::size_t i = 0;
+            for (; i + 16 <= dim; i += 16)
+            {
+                acc = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc);
+            }
+            if (i < dim)
+            {
+                auto mask = static_cast<__mmask16>((1U << (dim - i)) - 1);
+                acc = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), acc);
+            }
+            return _mm512_reduce_add_ps(acc);
+        }
+
+        __attribute__((target("avx512f"))) auto L2F32Avx512(const float *a, const float *b, std::size_t dim) -> float
+        {
+            __m512 acc = _mm512_setzero_ps();
+            std::size_t i = 0;
+            for (; i + 16 <= dim; i += 16)
+            {
+                __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+                acc = _mm512_fmadd_ps(d, d, acc);
+            }
+            if (i < dim)
+            {
+                auto mask = static_cast<__mmask16>((1U << (dim - i)) - 1);
+                __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+                acc = _mm512_fmadd_ps(d, d, acc);
+            }
+            return _mm512_reduce_add_ps(acc);
+        }
+#endif
+
+        struct Kernels
+        {
+            DotF32Fn dot_f32_;
+            L2F32Fn l2_f32_;
+            DotI8Fn dot_i8_;
+            const char *name_;
+        };
+
+        auto GetKernels() -> const Kernels &
+        {
+            static const Kernels kernels = []() -> Kernels
+            {
+#ifdef RDS_VECOPS_X86
+                __builtin_cpu_init();
+                bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+                if (avx2 && __builtin_cpu_supports("avx512f"))
+                {
+                    return {DotF32Avx512, L2F32Avx512, DotI8Avx2, "avx512"};
+                }
+                if (avx2)
+                {
+                    return {DotF32Avx2, L2F32Avx2, DotI8Avx2, "avx2"};
+                }
+#endif
+                return {DotF32Generic, L2F32Generic, DotI8Generic, "generic"};
+            }();
+            return kernels;
+        }
+    } // namespace
+
+    auto DotF32(const float *a, const float *b, std::size_t dim) -> float
+    {
+        return GetKernels().dot_f32_(a, b, dim);
+    }
+
+    auto L2F32(const float *a, const float *b, std::size_t dim) -> float
+    {
+        return GetKernels().l2_f32_(a, b, dim);
+    }
+
+    auto DotI8(const std::int8_t *a, const std::int8_t *b, std::size_t dim) -> std::int32_t
+    {
+        return GetKernels().dot_i8_(a, b, dim);
+    }
+
+    auto VecOpsImplementation() -> const char *
+    {
+        return GetKernels().name_;
+    }
+
+} // namespace rds
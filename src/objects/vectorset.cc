@@ -0,0 +1,629 @@
+#include <objects/vectorset.h>
+#include <objects/vecops.h>
+#include <database/rdb.h>
+#include <algorithm>
+#include <cmath>
+#include <queue>
+
+namespace rds
+{
+    namespace
+    {
+        template <typename T>
+        auto PeekBits(Cursor *source) -> T
+        {
+            std::string raw = PeekString(source, sizeof(T));
+            T ret;
+            std::memcpy(&ret, raw.data(), sizeof(T));
+            return ret;
+        }
+    } // namespace
+
+    VectorSet::VectorSet(const VectorSet &lhs)
+    {
+        ReadGuard rg(lhs.ExposeLatch());
+        dim_ = lhs.dim_;
+        metric_ = lhs.metric_;
+        quant_ = lhs.quant_;
+        nodes_ = lhs.nodes_;
+        f32_ = lhs.f32_;
+        q8_ = lhs.q8_;
+        index_ = lhs.index_;
+        entry_ = lhs.entry_;
+        max_level_ = lhs.max_level_;
+        deleted_ = lhs.deleted_;
+        rng_ = lhs.rng_;
+    }
+
+    VectorSet::VectorSet(VectorSet &&rhs) noexcept
+    {
+        ReadGuard rg(rhs.ExposeLatch());
+        dim_ = rhs.dim_;
+        metric_ = rhs.metric_;
+        quant_ = rhs.quant_;
+        nodes_ = std::move(rhs.nodes_);
+        f32_ = std::move(rhs.f32_);
+        q8_ = std::move(rhs.q8_);
+        index_ = std::move(rhs.index_);
+        entry_ = rhs.entry_;
+        max_level_ = rhs.max_level_;
+        deleted_ = rhs.deleted_;
+        rng_ = rhs.rng_;
+    }
+
+    VectorSet &VectorSet::operator=(const VectorSet &lhs)
+    {
+        ReadGuard rg(lhs.ExposeLatch());
+        dim_ = lhs.dim_;
+        metric_ = lhs.metric_;
+        quant_ = lhs.quant_;
+        nodes_ = lhs.nodes_;
+        f32_ = lhs.f32_;
+        q8_ = lhs.q8_;
+        index_ = lhs.index_;
+        entry_ = lhs.entry_;
+        max_level_ = lhs.max_level_;
+        deleted_ = lhs.deleted_;
+        rng_ = lhs.rng_;
+        return *this;
+    }
+
+    VectorSet &VectorSet::operator=(VectorSet &&rhs) noexcept
+    {
+        ReadGuard rg(rhs.ExposeLatch());
+        dim_ = rhs.dim_;
+        metric_ = rhs.metric_;
+        quant_ = rhs.quant_;
+        nodes_ = std::move(rhs.nodes_);
+        f32_ = std::move(rhs.f32_);
+        q8_ = std::move(rhs.q8_);
+        index_ = std::move(rhs.index_);
+        entry_ = rhs.entry_;
+        max_level_ = rhs.max_level_;
+        deleted_ = rhs.deleted_;
+        rng_ = rhs.rng_;
+        return *this;
+    }
+
+    void VectorSet::Prepare(const std::vector<float> &vec, std::vector<float> *f32, std::vector<std::int8_t> *q8, float *scale, float *norm2) const
+    {
+        std::vector<float> v = vec;
+        if (metric_ == VectorMetric::COSINE)
+        {
+            float norm = std::sqrt(DotF32(v.data(), v.data(), v.size()));
+            if (norm > 0)
+            {
+                for (auto &x : v)
+                {
+                    x /= norm;
+                }
+            }
+        }
+        if (quant_ == VectorQuant::FP32)
+        {
+            *scale = 1;
+            *norm2 = DotF32(v.data(), v.data(), v.size());
+            *f32 = std::move(v);
+            return;
+        }
+        // symmetric per-vector scale, the largest component maps to 127
+        float max_abs = 0;
+        for (auto x : v)
+        {
+            max_abs = std::max(max_abs, std::fabs(x));
+        }
+        *scale = max_abs > 0 ? max_abs / 127 : 1;
+        q8->resize(v.size());
+        for (std::size_t i = 0; i < v.size(); i++)
+        {
+            (*q8)[i] = static_cast<std::int8_t>(std::clamp<long>(std::lround(v[i] / *scale), -127, 127));
+        }
+        *norm2 = DotI8(q8->data(), q8->data(), q8->size()) * *scale * *scale;
+    }
+
+    auto VectorSet::NodeProbe(std::uint32_t id) const -> Probe
+    {
+        const Node &node = nodes_[id];
+        if (quant_ == VectorQuant::FP32)
+        {
+            return {f32_.data() + static_cast<std::size_t>(id) * dim_, nullptr, node.scale_, node.norm2_};
+        }
+        return {nullptr, q8_.data() + static_cast<std::size_t>(id) * dim_, node.scale_, node.norm2_};
+    }
+
+    auto VectorSet::Distance(const Probe &probe, std::uint32_t id) const -> float
+    {
+        std::size_t offset = static_cast<std::size_t>(id) * dim_;
+        float dot;
+        if (quant_ == VectorQuant::FP32)
+        {
+            if (metric_ == VectorMetric::L2)
+            {
+                return L2F32(probe.f32_, f32_.data() + offset, dim_);
+            }
+            dot = DotF32(probe.f32_, f32_.data() + offset, dim_);
+        }
+        else
+        {
+            dot = DotI8(probe.q8_, q8_.data() + offset, dim_) * probe.scale_ * nodes_[id].scale_;
+            if (metric_ == VectorMetric::L2)
+            {
+                return probe.norm2_ + nodes_[id].norm2_ - 2 * dot;
+            }
+        }
+        return metric_ == VectorMetric::COSINE ? 1 - dot : -dot;
+    }
+
+    auto VectorSet::Score(float distance) const -> float
+    {
+        switch (metric_)
+        {
+        case VectorMetric::COSINE:
+            return 1 - distance;
+        case VectorMetric::IP:
+            return -distance;
+        default:
+            return std::sqrt(std::max(0.f, distance));
+        }
+    }
+
+    /* best first search of one level, the ef closest nodes in ascending order */
+    auto VectorSet::SearchLayer(const Probe &probe, std::uint32_t entry, std::size_t ef, int level) const -> std::vector<Candidate>
+    {
+        std::vector<bool> visited(nodes_.size());
+        std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> frontier;
+        std::priority_queue<Candidate> best;
+        float d = Distance(probe, entry);
+        frontier.push({d, entry});
+        best.push({d, entry});
+        visited[entry] = true;
+        while (!frontier.empty())
+        {
+            auto [cur_d, cur] = frontier.top();
+            if (best.size() >= ef && cur_d > best.top().first)
+            {
+                break;
+            }
+            frontier.pop();
+            for (auto n : nodes_[cur].links_[level])
+            {
+                if (visited[n])
+                {
+                    continue;
+                }
+                visited[n] = true;
+                float nd = Distance(probe, n);
+                if (best.size() < ef || nd < best.top().first)
+                {
+                    frontier.push({nd, n});
+                    best.push({nd, n});
+                    if (best.size() > ef)
+                    {
+                        best.pop();
+                    }
+                }
+            }
+        }
+        std::vector<Candidate> ret(best.size());
+        for (auto i = ret.size(); i > 0; i--)
+        {
+            ret[i - 1] = best.top();
+            best.pop();
+        }
+        return ret;
+    }
+
+    /* keeps a candidate only if it is closer to the new node than to every
+       neighbour already kept, so links spread out instead of clustering */
+    auto VectorSet::SelectNeighbors(const std::vector<Candidate> &candidates, std::size_t m) const -> std::vector<std::uint32_t>
+    {
+        std::vector<std::uint32_t> ret;
+        std::vector<std::uint32_t> pruned;
+        for (auto &[d, c] : candidates)
+        {
+            if (ret.size() >= m)
+            {
+                break;
+            }
+            auto probe = NodeProbe(c);
+            bool keep = std::none_of(ret.begin(), ret.end(), [&](std::uint32_t r)
+                                     { return Distance(probe, r) < d; });
+            (keep ? ret : pruned).push_back(c);
+        }
+        for (auto p : pruned)
+        {
+            if (ret.size() >= m)
+            {
+                break;
+            }
+            ret.push_back(p);
+        }
+        return ret;
+    }
+
+    void VectorSet::Link(std::uint32_t id)
+    {
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        int level = static_cast<int>(-std::log(1.0 - uniform(rng_)) / std::log(static_cast<double>(M)));
+        nodes_[id].links_.assign(level + 1, {});
+        if (max_level_ < 0)
+        {
+            entry_ = id;
+            max_level_ = level;
+            return;
+        }
+
+        auto probe = NodeProbe(id);
+        std::uint32_t cur = entry_;
+        float cur_d = Distance(probe, cur);
+        for (int l = max_level_; l > level; l--)
+        {
+            for (bool changed = true; changed;)
+            {
+                changed = false;
+                for (auto n : nodes_[cur].links_[l])
+                {
+                    float d = Distance(probe, n);
+                    if (d < cur_d)
+                    {
+                        cur_d = d;
+                        cur = n;
+                        changed = true;
+                    }
+                }
+            }
+        }
+        for (int l = std::min(level, max_level_); l >= 0; l--)
+        {
+            auto candidates = SearchLayer(probe, cur, EF_CONSTRUCTION, l);
+            auto neighbors = SelectNeighbors(candidates, M);
+            std::size_t max_links = l == 0 ? M0 : M;
+            for (auto n : neighbors)
+            {
+                nodes_[n].links_[l].push_back(id);
+                if (nodes_[n].links_[l].size() > max_links)
+                {
+                    auto n_probe = NodeProbe(n);
+                    std::vector<Candidate> links;
+                    for (auto x : nodes_[n].links_[l])
+                    {
+                        links.push_back({Distance(n_probe, x), x});
+                    }
+                    std::sort(links.begin(), links.end());
+                    nodes_[n].links_[l] = SelectNeighbors(links, max_links);
+                }
+            }
+            nodes_[id].links_[l] = std::move(neighbors);
+            cur = candidates.front().second;
+        }
+        if (level > max_level_)
+        {
+            max_level_ = level;
+            entry_ = id;
+        }
+    }
+
+    /* rebuilds the graph from the live elements */
+    void VectorSet::Compact()
+    {
+        auto nodes = std::move(nodes_);
+        auto f32 = std::move(f32_);
+        auto q8 = std::move(q8_);
+        nodes_.clear();
+        f32_.clear();
+        q8_.clear();
+        index_.clear();
+        entry_ = 0;
+        max_level_ = -1;
+        deleted_ = 0;
+        for (std::size_t i = 0; i < nodes.size(); i++)
+        {
+            if (nodes[i].deleted_)
+            {
+                continue;
+            }
+            auto id = static_cast<std::uint32_t>(nodes_.size());
+            Node node;
+            node.name_ = std::move(nodes[i].name_);
+            node.scale_ = nodes[i].scale_;
+            node.norm2_ = nodes[i].norm2_;
+            if (quant_ == VectorQuant::FP32)
+            {
+                f32_.insert(f32_.end(), f32.begin() + i * dim_, f32.begin() + (i + 1) * dim_);
+            }
+            else
+            {
+                q8_.insert(q8_.end(), q8.begin() + i * dim_, q8.begin() + (i + 1) * dim_);
+            }
+            index_[node.name_] = id;
+            nodes_.push_back(std::move(node));
+            Link(id);
+        }
+    }
+
+    void VectorSet::Configure(VectorMetric metric, VectorQuant quant)
+    {
+        WriteGuard wg(latch_);
+        if (nodes_.empty())
+        {
+            metric_ = metric;
+            quant_ = quant;
+        }
+    }
+
+    auto VectorSet::Add(const std::string &name, const std::vector<float> &vec) -> int
+    {
+        WriteGuard wg(latch_);
+        if (dim_ == 0)
+        {
+            dim_ = vec.size();
+        }
+        if (vec.empty() || vec.size() != dim_)
+        {
+            return -1;
+        }
+        int ret = 1;
+        auto it = index_.find(name);
+        if (it != index_.end())
+        {
+            nodes_[it->second].deleted_ = true;
+            deleted_++;
+            index_.erase(it);
+            ret = 0;
+        }
+        std::vector<float> f32;
+        std::vector<std::int8_t> q8;
+        Node node;
+        node.name_ = name;
+        Prepare(vec, &f32, &q8, &node.scale_, &node.norm2_);
+        auto id = static_cast<std::uint32_t>(nodes_.size());
+        nodes_.push_back(std::move(node));
+        f32_.insert(f32_.end(), f32.begin(), f32.end());
+        q8_.insert(q8_.end(), q8.begin(), q8.end());
+        index_[name] = id;
+        Link(id);
+        if (deleted_ > index_.size())
+        {
+            Compact();
+        }
+        return ret;
+    }
+
+    auto VectorSet::Remove(const std::string &name) -> bool
+    {
+        WriteGuard wg(latch_);
+        auto it = index_.find(name);
+        if (it == index_.end())
+        {
+            return false;
+        }
+        nodes_[it->second].deleted_ = true;
+        deleted_++;
+        index_.erase(it);
+        if (deleted_ > index_.size())
+        {
+            Compact();
+        }
+        return true;
+    }
+
+    auto VectorSet::SearchProbe(const Probe &probe, std::size_t k, std::size_t ef, bool exact) const -> std::vector<Result>
+    {
+        std::vector<Candidate> found;
+        if (exact || index_.size() <= BRUTE_FORCE_MAX)
+        {
+            for (std::uint32_t i = 0; i < nodes_.size(); i++)
+            {
+                if (!nodes_[i].deleted_)
+                {
+                    found.push_back({Distance(probe, i), i});
+                }
+            }
+            auto mid = found.begin() + std::min(k, found.size());
+            std::partial_sort(found.begin(), mid, found.end());
+            found.erase(mid, found.end());
+        }
+        else
+        {
+            std::uint32_t cur = entry_;
+            float cur_d = Distance(probe, cur);
+            for (int l = max_level_; l > 0; l--)
+            {
+                for (bool changed = true; changed;)
+                {
+                    changed = false;
+                    for (auto n : nodes_[cur].links_[l])
+                    {
+                        float d = Distance(probe, n);
+                        if (d < cur_d)
+                        {
+                            cur_d = d;
+                            cur = n;
+                            changed = true;
+                        }
+                    }
+                }
+            }
+            found = SearchLayer(probe, cur, std::max(ef, k), 0);
+        }
+        std::vector<Result> ret;
+        for (auto &[d, id] : found)
+        {
+            if (ret.size() == k)
+            {
+                break;
+            }
+            if (!nodes_[id].deleted_)
+            {
+                ret.emplace_back(nodes_[id].name_, Score(d));
+            }
+        }
+        return ret;
+    }
+
+    auto VectorSet::Search(const std::vector<float> &query, std::size_t k, std::size_t ef, bool exact) const -> std::vector<Result>
+    {
+        ReadGuard rg(latch_);
+        if (query.size() != dim_ || index_.empty())
+        {
+            return {};
+        }
+        std::vector<float> f32;
+        std::vector<std::int8_t> q8;
+        float scale;
+        float norm2;
+        Prepare(query, &f32, &q8, &scale, &norm2);
+        return SearchProbe({f32.data(), q8.data(), scale, norm2}, k, ef, exact);
+    }
+
+    auto VectorSet::SearchElement(const std::string &name, std::size_t k, std::size_t ef) const -> std::optional<std::vector<Result>>
+    {
+        ReadGuard rg(latch_);
+        auto it = index_.find(name);
+        if (it == index_.end())
+        {
+            return {};
+        }
+        return SearchProbe(NodeProbe(it->second), k, ef, false);
+    }
+
+    auto VectorSet::Card() const -> std::size_t
+    {
+        ReadGuard rg(latch_);
+        return index_.size();
+    }
+
+    auto VectorSet::Dim() const -> std::size_t
+    {
+        ReadGuard rg(latch_);
+        return dim_;
+    }
+
+    auto VectorSet::Metric() const -> VectorMetric
+    {
+        ReadGuard rg(latch_);
+        return metric_;
+    }
+
+    auto VectorSet::Quant() const -> VectorQuant
+    {
+        ReadGuard rg(latch_);
+        return quant_;
+    }
+
+    auto VectorSet::Bytes() const -> std::size_t
+    {
+        ReadGuard rg(latch_);
+        std::size_t ret = f32_.size() * sizeof(float) + q8_.size();
+        for (auto &node : nodes_)
+        {
+            for (auto &links : node.links_)
+            {
+                ret += links.size() * sizeof(std::uint32_t);
+            }
+        }
+        return ret;
+    }
+
+    auto VectorSet::GetObjectType() const -> ObjectType
+    {
+        return ObjectType::VECTORSET;
+    }
+
+    /*
+    [uint32 dim][char metric][char quant][uint32 entry][int max-level][size_t nodes]
+    {[size_t len][name][char deleted][float scale][float norm2][dim floats | dim bytes]
+     [size_t levels]{[size_t n][uint32 * n]}}
+     */
+    auto VectorSet::EncodeValue() const -> std::string
+    {
+        ReadGuard rg(latch_);
+        std::string ret;
+        ret.append(BitsToString(dim_));
+        ret.push_back(static_cast<char>(metric_));
+        ret.push_back(static_cast<char>(quant_));
+        ret.append(BitsToString(entry_));
+        ret.append(BitsToString(max_level_));
+        ret.append(BitsToString(nodes_.size()));
+        for (std::size_t i = 0; i < nodes_.size(); i++)
+        {
+            auto &node = nodes_[i];
+            ret.append(BitsToString(node.name_.size()));
+            ret.append(node.name_);
+            ret.push_back(node.deleted_ ? 1 : 0);
+            ret.append(BitsToString(node.scale_));
+            ret.append(BitsToString(node.norm2_));
+            if (quant_ == VectorQuant::FP32)
+            {
+                ret.append(reinterpret_cast<const char *>(f32_.data() + i * dim_), dim_ * sizeof(float));
+            }
+            else
+            {
+                ret.append(reinterpret_cast<const char *>(q8_.data() + i * dim_), dim_);
+            }
+            ret.append(BitsToString(node.links_.size()));
+            for (auto &links : node.links_)
+            {
+                ret.append(BitsToString(links.size()));
+                ret.append(reinterpret_cast<const char *>(links.data()), links.size() * sizeof(std::uint32_t));
+            }
+        }
+        return ret;
+    }
+
+    void VectorSet::DecodeValue(Cursor *source)
+    {
+        WriteGuard wg(latch_);
+        dim_ = PeekBits<std::uint32_t>(source);
+        metric_ = static_cast<VectorMetric>(source->front());
+        source->pop_front();
+        quant_ = static_cast<VectorQuant>(source->front());
+        source->pop_front();
+        entry_ = PeekBits<std::uint32_t>(source);
+        max_level_ = PeekInt(source);
+        std::size_t n = PeekSize(source);
+        nodes_.clear();
+        f32_.clear();
+        q8_.clear();
+        index_.clear();
+        deleted_ = 0;
+        nodes_.reserve(n);
+        for (std::size_t i = 0; i < n; i++)
+        {
+            Node node;
+            node.name_ = PeekString(source, PeekSize(source));
+            node.deleted_ = source->front() != 0;
+            source->pop_front();
+            node.scale_ = PeekBits<float>(source);
+            node.norm2_ = PeekBits<float>(source);
+            if (quant_ == VectorQuant::FP32)
+            {
+                std::string raw = PeekString(source, dim_ * sizeof(float));
+                f32_.resize(f32_.size() + dim_);
+                std::memcpy(f32_.data() + i * dim_, raw.data(), raw.size());
+            }
+            else
+            {
+                std::string raw = PeekString(source, dim_);
+                q8_.insert(q8_.end(), raw.begin(), raw.end());
+            }
+            node.links_.resize(PeekSize(source));
+            for (auto &links : node.links_)
+            {
+                links.resize(PeekSize(source));
+                std::string raw = PeekString(source, links.size() * sizeof(std::uint32_t));
+                std::memcpy(links.data(), raw.data(), raw.size());
+            }
+            if (node.deleted_)
+            {
+                deleted_++;
+            }
+            else
+            {
+                index_[node.name_] = i;
+            }
+            nodes_.push_back(std::move(node));
+        }
+    }
+
+} // namespace rds
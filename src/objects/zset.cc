@@ -1,86 +1,526 @@
 #include <objects/zset.h>
+#include <string_view>
+#include <limits>
 
 namespace rds
 {
+    ZSkipListNode::ZSkipListNode(int level, int score, const Str *member) : member_(member),
+                                                                            score_(score),
+                                                                            backward_(nullptr),
+                                                                            level_(level, {nullptr, 0})
+    {
+    }
+
+    static auto NodeLess(const ZSkipListNode *node, int score, const Str &member) -> bool
+    {
+        return node->score_ < score || (node->score_ == score && *(node->member_) < member);
+    }
+
+    ZSkipList::ZSkipList() : header_(new ZSkipListNode(MAX_LEVEL_, 0, nullptr)),
+                             tail_(nullptr),
+                             length_(0),
+                             level_(1)
+    {
+    }
+
+    ZSkipList::~ZSkipList()
+    {
+        Clear();
+        delete header_;
+    }
+
+    ZSkipList::ZSkipList(ZSkipList &&rhs) noexcept : ZSkipList()
+    {
+        std::swap(header_, rhs.header_);
+        std::swap(tail_, rhs.tail_);
+        std::swap(length_, rhs.length_);
+        std::swap(level_, rhs.level_);
+    }
+
+    ZSkipList &ZSkipList::operator=(ZSkipList &&rhs) noexcept
+    {
+        Clear();
+        std::swap(header_, rhs.header_);
+        std::swap(tail_, rhs.tail_);
+        std::swap(length_, rhs.length_);
+        std::swap(level_, rhs.level_);
+        return *this;
+    }
+
+    auto ZSkipList::RandomLevel() -> int
+    {
+        int level = 1;
+        while ((std::rand() & 0xffff) < 0xffff / 4 && level < MAX_LEVEL_)
+        {
+            level++;
+        }
+        return level;
+    }
+
+    void ZSkipList::Clear()
+    {
+        ZSkipListNode *node = header_->level_[0].forward_;
+        while (node)
+        {
+            ZSkipListNode *next = node->level_[0].forward_;
+            delete node;
+            node = next;
+        }
+        for (auto &lvl : header_->level_)
+        {
+            lvl = {nullptr, 0};
+        }
+        tail_ = nullptr;
+        length_ = 0;
+        level_ = 1;
+    }
+
+    auto ZSkipList::Insert(int score, const Str *member) -> ZSkipListNode *
+    {
+        ZSkipListNode *update[MAX_LEVEL_];
+        std::size_t rank[MAX_LEVEL_];
+        ZSkipListNode *x = header_;
+        for (int i = level_ - 1; i >= 0; i--)
+        {
+            rank[i] = (i == level_ - 1) ? 0 : rank[i + 1];
+            while (x->level_[i].forward_ && NodeLess(x->level_[i].forward_, score, *member))
+            {
+                rank[i] += x->level_[i].span_;
+                x = x->level_[i].forward_;
+            }
+            update[i] = x;
+        }
+
+        int level = RandomLevel();
+        if (level > level_)
+        {
+            for (int i = level_; i < level; i++)
+            {
+                rank[i] = 0;
+                update[i] = header_;
+                update[i]->level_[i].span_ = length_;
+            }
+            level_ = level;
+        }
+
+        x = new ZSkipListNode(level, score, member);
+        for (int i = 0; i < level; i++)
+        {
+            x->level_[i].forward_ = update[i]->level_[i].forward_;
+            update[i]->level_[i].forward_ = x;
+            x->level_[i].span_ = update[i]->level_[i].span_ - (rank[0] - rank[i]);
+            update[i]->level_[i].span_ = (rank[0] - rank[i]) + 1;
+        }
+        for (int i = level; i < level_; i++)
+        {
+            update[i]->level_[i].span_++;
+        }
+
+        x->backward_ = (update[0] == header_) ? nullptr : update[0];
+        if (x->level_[0].forward_)
+        {
+            x->level_[0].forward_->backward_ = x;
+        }
+        else
+        {
+            tail_ = x;
+        }
+        length_++;
+        return x;
+    }
+
+    auto ZSkipList::Delete(int score, const Str &member) -> bool
+    {
+        ZSkipListNode *update[MAX_LEVEL_];
+        ZSkipListNode *x = header_;
+        for (int i = level_ - 1; i >= 0; i--)
+        {
+            while (x->level_[i].forward_ && NodeLess(x->level_[i].forward_, score, member))
+            {
+                x = x->level_[i].forward_;
+            }
+            update[i] = x;
+        }
+        x = x->level_[0].forward_;
+        if (!x || x->score_ != score || !(*(x->member_) == member))
+        {
+            return false;
+        }
+
+        for (int i = 0; i < level_; i++)
+        {
+            if (update[i]->level_[i].forward_ == x)
+            {
+                update[i]->level_[i].span_ += x->level_[i].span_ - 1;
+                update[i]->level_[i].forward_ = x->level_[i].forward_;
+            }
+            else
+            {
+                update[i]->level_[i].span_--;
+            }
+        }
+        if (x->level_[0].forward_)
+        {
+            x->level_[0].forward_->backward_ = x->backward_;
+        }
+        else
+        {
+            tail_ = x->backward_;
+        }
+        while (level_ > 1 && header_->level_[level_ - 1].forward_ == nullptr)
+        {
+            level_--;
+        }
+        length_--;
+        delete x;
+        return true;
+    }
+
+    auto ZSkipList::Rank(int score, const Str &member) const -> std::size_t
+    {
+        std::size_t rank = 0;
+        ZSkipListNode *x = header_;
+        for (int i = level_ - 1; i >= 0; i--)
+        {
+            while (x->level_[i].forward_ &&
+                   (x->level_[i].forward_->score_ < score ||
+                    (x->level_[i].forward_->score_ == score && *(x->level_[i].forward_->member_) <= member)))
+            {
+                rank += x->level_[i].span_;
+                x = x->level_[i].forward_;
+            }
+            if (x != header_ && x->score_ == score && *(x->member_) == member)
+            {
+                return rank;
+            }
+        }
+        return 0;
+    }
+
+    auto ZSkipList::ByRank(std::size_t rank) const -> ZSkipListNode *
+    {
+        if (rank == 0 || rank > length_)
+        {
+            return nullptr;
+        }
+        std::size_t traversed = 0;
+        ZSkipListNode *x = header_;
+        for (int i = level_ - 1; i >= 0; i--)
+        {
+            while (x->level_[i].forward_ && traversed + x->level_[i].span_ <= rank)
+            {
+                traversed += x->level_[i].span_;
+                x = x->level_[i].forward_;
+            }
+            if (traversed == rank)
+            {
+                return x;
+            }
+        }
+        return nullptr;
+    }
+
+    auto ZSkipList::FirstGreaterEqual(int score) const -> ZSkipListNode *
+    {
+        ZSkipListNode *x = header_;
+        for (int i = level_ - 1; i >= 0; i--)
+        {
+            while (x->level_[i].forward_ && x->level_[i].forward_->score_ < score)
+            {
+                x = x->level_[i].forward_;
+            }
+        }
+        return x->level_[0].forward_;
+    }
+
+    auto ZSkipList::CountLess(int score) const -> std::size_t
+    {
+        std::size_t rank = 0;
+        ZSkipListNode *x = header_;
+        for (int i = level_ - 1; i >= 0; i--)
+        {
+            while (x->level_[i].forward_ && x->level_[i].forward_->score_ < score)
+            {
+                rank += x->level_[i].span_;
+                x = x->level_[i].forward_;
+            }
+        }
+        return rank;
+    }
+
+    auto ZSkipList::CountLessEqual(int score) const -> std::size_t
+    {
+        std::size_t rank = 0;
+        ZSkipListNode *x = header_;
+        for (int i = level_ - 1; i >= 0; i--)
+        {
+            while (x->level_[i].forward_ && x->level_[i].forward_->score_ <= score)
+            {
+                rank += x->level_[i].span_;
+                x = x->level_[i].forward_;
+            }
+        }
+        return rank;
+    }
+
+    auto ZSkipList::First() const -> ZSkipListNode *
+    {
+        return header_->level_[0].forward_;
+    }
+
+    auto ZSkipList::Last() const -> ZSkipListNode *
+    {
+        return tail_;
+    }
+
+    auto ZSkipList::Size() const -> std::size_t
+    {
+        return length_;
+    }
+
+    /*
+
+
+
+     */
+    static std::atomic_size_t __zset_array_max_entries{128};
+    static std::atomic_size_t __zset_array_max_value_len{64};
+
+    void SetZSetArrayLimit(std::size_t max_entries, std::size_t max_value_len)
+    {
+        __zset_array_max_entries.store(max_entries);
+        __zset_array_max_value_len.store(max_value_len);
+    }
+
+    auto ZSetArrayMaxEntries() -> std::size_t
+    {
+        return __zset_array_max_entries.load();
+    }
+
+    auto ZSetArrayMaxValueLen() -> std::size_t
+    {
+        return __zset_array_max_value_len.load();
+    }
+
+    static auto EntryLess(const ZArrayEntry &entry, int score, const std::string &member) -> bool
+    {
+        return entry.score_ < score || (entry.score_ == score && entry.member_ < member);
+    }
 
     ZSet::ZSet(const ZSet &lhs)
     {
         ReadGuard rg(lhs.ExposeLatch());
-        for (auto member : lhs.sequence_list_)
+        encoding_type_ = lhs.encoding_type_;
+        array_ = lhs.array_;
+        for (auto node = lhs.zsl_.First(); node; node = node->level_[0].forward_)
         {
-            Add(member.second, *(member.first));
+            LinkMember(node->score_, *(node->member_));
         }
     }
 
-    ZSet::ZSet(ZSet &&rhs)noexcept
+    ZSet::ZSet(ZSet &&rhs) noexcept
     {
         ReadGuard rg(rhs.ExposeLatch());
-        sequence_list_ = std::move(rhs.sequence_list_);
+        encoding_type_ = rhs.encoding_type_;
+        array_ = std::move(rhs.array_);
+        zsl_ = std::move(rhs.zsl_);
         member_map_ = std::move(rhs.member_map_);
-        rank_map_ = std::move(rhs.rank_map_);
+        lex_index_ = std::move(rhs.lex_index_);
+        rhs.InternalClear();
     }
 
     ZSet &ZSet::operator=(const ZSet &lhs)
     {
+        if (this == &lhs)
+        {
+            return *this;
+        }
         ReadGuard rg(lhs.ExposeLatch());
-        for (auto member : lhs.sequence_list_)
+        InternalClear();
+        encoding_type_ = lhs.encoding_type_;
+        array_ = lhs.array_;
+        for (auto node = lhs.zsl_.First(); node; node = node->level_[0].forward_)
         {
-            Add(member.second, *(member.first));
+            LinkMember(node->score_, *(node->member_));
         }
         return *this;
     }
 
     ZSet &ZSet::operator=(ZSet &&rhs) noexcept
     {
+        if (this == &rhs)
+        {
+            return *this;
+        }
         ReadGuard rg(rhs.ExposeLatch());
-        sequence_list_ = std::move(rhs.sequence_list_);
+        InternalClear();
+        encoding_type_ = rhs.encoding_type_;
+        array_ = std::move(rhs.array_);
+        zsl_ = std::move(rhs.zsl_);
         member_map_ = std::move(rhs.member_map_);
-        rank_map_ = std::move(rhs.rank_map_);
+        lex_index_ = std::move(rhs.lex_index_);
+        rhs.InternalClear();
         return *this;
     }
 
-    auto ZSet::Add(int score, Str member) -> bool
+    void ZSet::InternalClear()
     {
-        WriteGuard wg(latch_);
-        auto it = member_map_.insert({std::move(member), sequence_list_.end()});
-        if (!it.second)
+        encoding_type_ = EncodingType::ARRAY;
+        array_.clear();
+        zsl_.Clear();
+        lex_index_.clear();
+        member_map_.clear();
+    }
+
+    auto ZSet::FindInArray(const std::string &member) -> std::vector<ZArrayEntry>::iterator
+    {
+        return std::find_if(array_.begin(), array_.end(), [&member](const ZArrayEntry &e)
+                            { return e.member_ == member; });
+    }
+
+    auto ZSet::FindInArray(const std::string &member) const -> std::vector<ZArrayEntry>::const_iterator
+    {
+        return std::find_if(array_.cbegin(), array_.cend(), [&member](const ZArrayEntry &e)
+                            { return e.member_ == member; });
+    }
+
+    auto ZSet::FindInArray(int score, const std::string &member) -> std::vector<ZArrayEntry>::iterator
+    {
+        auto pos = std::lower_bound(array_.begin(), array_.end(), score,
+                                    [&member](const ZArrayEntry &e, int s)
+                                    { return EntryLess(e, s, member); });
+        if (pos == array_.end() || pos->score_ != score || pos->member_ != member)
         {
-            return false;
+            return array_.end();
         }
-        sequence_list_.push_back({&it.first->first, score});
-        auto pos = sequence_list_.end();
-        pos--;
-        it.first->second = pos;
-        rank_map_.insert({score, it.first});
-        return true;
+        return pos;
+    }
+
+    void ZSet::InsertIntoArray(int score, std::string member)
+    {
+        auto pos = std::lower_bound(array_.begin(), array_.end(), score,
+                                    [&member](const ZArrayEntry &e, int s)
+                                    { return EntryLess(e, s, member); });
+        array_.insert(pos, {score, std::move(member)});
+    }
+
+    /* array -> skiplist, entries are already ordered */
+    void ZSet::Promote()
+    {
+        if (encoding_type_ != EncodingType::ARRAY)
+        {
+            return;
+        }
+        member_map_.reserve(array_.size());
+        for (auto &e : array_)
+        {
+            LinkMember(e.score_, Str(std::move(e.member_)));
+        }
+        array_.clear();
+        array_.shrink_to_fit();
+        encoding_type_ = EncodingType::RBTREE;
+    }
+
+    void ZSet::InternalAdd(int score, Str member)
+    {
+        if (encoding_type_ == EncodingType::ARRAY)
+        {
+            auto raw = member.GetRaw();
+            if (raw.size() > ZSetArrayMaxValueLen())
+            {
+                Promote();
+            }
+            else
+            {
+                if (FindInArray(score, raw) != array_.end())
+                {
+                    return;
+                }
+                auto pos = FindInArray(raw);
+                if (pos != array_.end())
+                {
+                    array_.erase(pos);
+                }
+                InsertIntoArray(score, std::move(raw));
+                if (array_.size() > ZSetArrayMaxEntries())
+                {
+                    Promote();
+                }
+                return;
+            }
+        }
+
+        auto it = member_map_.find(member);
+        if (it == member_map_.end())
+        {
+            LinkMember(score, std::move(member));
+            return;
+        }
+        auto node = it->second;
+        if (node->score_ == score)
+        {
+            return;
+        }
+        zsl_.Delete(node->score_, it->first);
+        it->second = zsl_.Insert(score, &it->first);
+    }
+
+    void ZSet::LinkMember(int score, Str member)
+    {
+        auto it = member_map_.insert({std::move(member), nullptr}).first;
+        it->second = zsl_.Insert(score, &it->first);
+        lex_index_.insert(&it->first);
+    }
+
+    void ZSet::UnlinkMember(std::unordered_map<Str, ZSkipListNode *, decltype(&StrHash)>::iterator pos)
+    {
+        zsl_.Delete(pos->second->score_, pos->first);
+        lex_index_.erase(&pos->first);
+        member_map_.erase(pos);
+    }
+
+    auto ZSet::Add(int score, Str member) -> bool
+    {
+        WriteGuard wg(latch_);
+        std::size_t before = (encoding_type_ == EncodingType::ARRAY) ? array_.size() : member_map_.size();
+        InternalAdd(score, std::move(member));
+        std::size_t after = (encoding_type_ == EncodingType::ARRAY) ? array_.size() : member_map_.size();
+        return after != before;
     }
 
     auto ZSet::Card() const -> std::size_t
     {
         ReadGuard rg(latch_);
-        return sequence_list_.size();
+        if (encoding_type_ == EncodingType::ARRAY)
+        {
+            return array_.size();
+        }
+        return zsl_.Size();
     }
 
     auto ZSet::Rem(int score, const Str &member) -> bool
     {
         WriteGuard wg(latch_);
+        if (encoding_type_ == EncodingType::ARRAY)
+        {
+            auto pos = FindInArray(score, member.GetRaw());
+            if (pos == array_.end())
+            {
+                return false;
+            }
+            array_.erase(pos);
+            return true;
+        }
         auto pos = member_map_.find(member);
         if (pos == member_map_.end())
         {
             return false;
         }
-        if (pos->second->second != score)
+        if (pos->second->score_ != score)
         {
             return false;
         }
-        sequence_list_.erase(pos->second);
-        auto it = rank_map_.upper_bound(score - 1);
-        while (it->second != pos)
-        {
-            it++;
-        }
-        rank_map_.erase(it);
-        member_map_.erase(pos);
+        UnlinkMember(pos);
         return true;
     }
 
@@ -91,40 +531,59 @@ namespace rds
             return 0;
         }
         ReadGuard rg(latch_);
-        auto low = rank_map_.lower_bound(score_low);
-        auto high = rank_map_.upper_bound(score_high);
-        return std::distance(low, high);
+        if (encoding_type_ == EncodingType::ARRAY)
+        {
+            auto low = std::lower_bound(array_.cbegin(), array_.cend(), score_low, [](const ZArrayEntry &e, int s)
+                                        { return e.score_ < s; });
+            auto high = std::upper_bound(array_.cbegin(), array_.cend(), score_high, [](int s, const ZArrayEntry &e)
+                                         { return s < e.score_; });
+            return std::distance(low, high);
+        }
+        return zsl_.CountLessEqual(score_high) - zsl_.CountLess(score_low);
     }
 
     auto ZSet::LexCount(const Str &member_low, const Str &member_high) const -> std::size_t
     {
-        if (member_low < member_high)
+        if (member_low > member_high)
         {
             return 0;
         }
         ReadGuard rg(latch_);
-        auto low = member_map_.lower_bound(member_low);
-        auto high = member_map_.upper_bound(member_high);
-        return std::distance(low, high);
+        if (encoding_type_ == EncodingType::ARRAY)
+        {
+            auto low = member_low.GetRaw();
+            auto high = member_high.GetRaw();
+            return std::count_if(array_.cbegin(), array_.cend(), [&low, &high](const ZArrayEntry &e)
+                                 { return low <= e.member_ && e.member_ <= high; });
+        }
+        return std::distance(lex_index_.lower_bound(member_low), lex_index_.upper_bound(member_high));
     }
 
     auto ZSet::IncrBy(int delta_score, const Str &member) -> std::string
     {
         WriteGuard wg(latch_);
+        if (encoding_type_ == EncodingType::ARRAY)
+        {
+            auto pos = FindInArray(member.GetRaw());
+            if (pos == array_.end())
+            {
+                return {};
+            }
+            int score = pos->score_ + delta_score;
+            auto raw = std::move(pos->member_);
+            array_.erase(pos);
+            InsertIntoArray(score, std::move(raw));
+            return std::to_string(score);
+        }
         auto pos = member_map_.find(member);
         if (pos == member_map_.end())
         {
             return {};
         }
-        auto it = rank_map_.lower_bound(pos->second->second);
-        while (it->second != pos)
-        {
-            it++;
-        }
-        rank_map_.erase(it);
-        rank_map_.insert({pos->second->second + delta_score, pos});
-        pos->second->second += delta_score;
-        return std::to_string(pos->second->second);
+        int score = pos->second->score_ + delta_score;
+        zsl_.Delete(pos->second->score_, pos->first);
+        pos->second = zsl_.Insert(score, &pos->first);
+        return std::to_string(score);
     }
 
     auto ZSet::DecrBy(int delta_score, const Str &member) -> std::string
@@ -132,127 +591,544 @@ namespace rds
         return IncrBy(-delta_score, member);
     }
 
-    auto ZSet::Range(int beg, int end) const -> std::vector<std::pair<Str, int>>
+    auto ZSet::RankRange(int beg, int end, std::size_t *lbeg, std::size_t *lend) const -> bool
     {
-        ReadGuard rg(latch_);
-        if (sequence_list_.empty())
+        std::size_t size = (encoding_type_ == EncodingType::ARRAY) ? array_.size() : zsl_.Size();
+        if (size == 0)
         {
-            return {};
+            return false;
         }
-        auto legalRange = [size = sequence_list_.size()](int r) -> std::size_t
+        auto legalRange = [size](int r) -> std::size_t
         {
             if (r >= 0)
             {
                 return r % size;
             }
-            int _r = -r;
-            r += (_r / size + 1) * size;
-            return static_cast<std::size_t>(r);
+            std::size_t _r = static_cast<std::size_t>(-static_cast<long long>(r)) % size;
+            return _r == 0 ? 0 : size - _r;
         };
+        *lbeg = legalRange(beg);
+        *lend = legalRange(end);
+        return *lbeg <= *lend;
+    }
+
+    /* the skiplist keeps Str members, the array plain bytes */
+    static void VisitNode(const ZSkipListNode *node, const ZSetVisitor &f)
+    {
+        node->member_->Visit([&](std::string_view member)
+                             { f(member, node->score_); });
+    }
+
+    static auto CollectRange(const std::function<void(const ZSetVisitor &)> &range) -> std::vector<std::pair<Str, int>>
+    {
         std::vector<std::pair<Str, int>> ret;
-        std::size_t lbeg = legalRange(beg);
-        std::size_t lend = legalRange(end);
-        if (lbeg >= lend)
+        range([&ret](std::string_view member, int score)
+              { ret.push_back({Str(std::string(member)), score}); });
+        return ret;
+    }
+
+    void ZSet::VisitRanks(std::size_t lbeg, std::size_t lend, bool rev, const ZSetVisitor &f) const
+    {
+        if (encoding_type_ == EncodingType::ARRAY)
         {
-            return {};
+            for (std::size_t i = lbeg; i <= lend; i++)
+            {
+                auto &e = rev ? array_[array_.size() - 1 - i] : array_[i];
+                f(e.member_, e.score_);
+            }
+            return;
+        }
+        auto node = rev ? zsl_.ByRank(zsl_.Size() - lbeg) : zsl_.ByRank(lbeg + 1);
+        for (std::size_t i = lbeg; i <= lend && node; i++)
+        {
+            VisitNode(node, f);
+            node = rev ? node->backward_ : node->level_[0].forward_;
         }
-        auto b = sequence_list_.cbegin();
-        auto e = b;
-        std::advance(b, lbeg);
-        std::advance(e, lend + 1);
-        std::for_each(b, e, [&ret](const decltype(sequence_list_)::value_type &v)
-                      { ret.push_back({*(v.first), v.second}); });
-        return ret;
     }
 
-    auto ZSet::RangeByScore(int score_low, int score_high) const -> std::vector<std::pair<Str, int>>
+    void ZSet::Range(int beg, int end, const ZSetVisitor &f) const
     {
-        if (score_low > score_high)
+        ReadGuard rg(latch_);
+        std::size_t lbeg, lend;
+        if (RankRange(beg, end, &lbeg, &lend))
         {
-            return {};
+            VisitRanks(lbeg, lend, false, f);
         }
+    }
+
+    void ZSet::RevRange(int beg, int end, const ZSetVisitor &f) const
+    {
         ReadGuard rg(latch_);
-        auto low = rank_map_.lower_bound(score_low);
-        auto high = rank_map_.upper_bound(score_high);
-        std::vector<std::pair<Str, int>> ret;
-        std::for_each(low, high, [&ret](const decltype(rank_map_)::value_type &v) mutable
-                      { ret.push_back({v.second->first, v.first}); });
-        return ret;
+        std::size_t lbeg, lend;
+        if (RankRange(beg, end, &lbeg, &lend))
+        {
+            VisitRanks(lbeg, lend, true, f);
+        }
     }
 
-    auto ZSet::RangeByLex(const Str &member_low, const Str &member_high) const -> std::vector<std::pair<Str, int>>
+    auto ZSet::Ranks(int beg, int end) const -> std::optional<std::pair<std::size_t, std::size_t>>
     {
-        if (member_low > member_high)
+        ReadGuard rg(latch_);
+        std::size_t lbeg, lend;
+        if (!RankRange(beg, end, &lbeg, &lend))
         {
             return {};
         }
+        return std::make_pair(lbeg, lend);
+    }
+
+    auto ZSet::RangeByRank(std::size_t lbeg, std::size_t lend, bool rev, const ZSetVisitor &f) const -> std::size_t
+    {
         ReadGuard rg(latch_);
+        std::size_t size = (encoding_type_ == EncodingType::ARRAY) ? array_.size() : zsl_.Size();
+        if (lbeg >= size || lbeg > lend)
+        {
+            return 0;
+        }
+        lend = std::min(lend, size - 1);
+        VisitRanks(lbeg, lend, rev, f);
+        return lend - lbeg + 1;
+    }
+
+    void ZSet::RangeByScore(int score_low, int score_high, std::size_t offset, std::size_t count, const ZSetVisitor &f) const
+    {
+        if (score_low > score_high || count == 0)
+        {
+            return;
+        }
+        ReadGuard rg(latch_);
+        std::size_t visited = 0;
+        if (encoding_type_ == EncodingType::ARRAY)
+        {
+            auto it = std::lower_bound(array_.cbegin(), array_.cend(), score_low, [](const ZArrayEntry &e, int s)
+                                       { return e.score_ < s; });
+            if (static_cast<std::size_t>(std::distance(it, array_.cend())) <= offset)
+            {
+                return;
+            }
+            it += offset;
+            for (; it != array_.cend() && it->score_ <= score_high && visited < count; it++, visited++)
+            {
+                f(it->member_, it->score_);
+            }
+            return;
+        }
+        auto node = zsl_.FirstGreaterEqual(score_low);
+        if (offset != 0)
+        {
+            node = zsl_.ByRank(zsl_.CountLess(score_low) + offset + 1);
+        }
+        for (; node && node->score_ <= score_high && visited < count; node = node->level_[0].forward_, visited++)
+        {
+            VisitNode(node, f);
+        }
+    }
+
+    void ZSet::RangeByLex(const Str &member_low, const Str &member_high, std::size_t offset,
+                          std::size_t count, const ZSetVisitor &f) const
+    {
+        if (member_low > member_high || count == 0)
+        {
+            return;
+        }
+        ReadGuard rg(latch_);
+        if (encoding_type_ == EncodingType::ARRAY)
+        {
+            // ordered by score first, the matches are sorted; the array is small
+            auto low = member_low.GetRaw();
+            auto high = member_high.GetRaw();
+            std::vector<const ZArrayEntry *> matched;
+            for (auto &e : array_)
+            {
+                if (low <= e.member_ && e.member_ <= high)
+                {
+                    matched.push_back(&e);
+                }
+            }
+            if (matched.size() <= offset)
+            {
+                return;
+            }
+            std::size_t need = matched.size() - offset > count ? offset + count : matched.size();
+            std::partial_sort(matched.begin(), matched.begin() + need, matched.end(), [](const ZArrayEntry *a, const ZArrayEntry *b)
+                              { return a->member_ < b->member_; });
+            for (std::size_t i = offset; i < need; i++)
+            {
+                f(matched[i]->member_, matched[i]->score_);
+            }
+            return;
+        }
+        // the walk stops at high or once LIMIT is met
+        auto it = lex_index_.lower_bound(member_low);
+        for (std::size_t skipped = 0; skipped < offset && it != lex_index_.end(); skipped++)
+        {
+            it++;
+        }
+        for (std::size_t visited = 0; it != lex_index_.end() && **it <= member_high && visited < count; it++, visited++)
+        {
+            VisitNode(member_map_.find(**it)->second, f);
+        }
+    }
+
+    auto ZSet::Range(int beg, int end) const -> std::vector<std::pair<Str, int>>
+    {
+        return CollectRange([&](const ZSetVisitor &f)
+                            { Range(beg, end, f); });
+    }
+
+    auto ZSet::RevRange(int beg, int end) const -> std::vector<std::pair<Str, int>>
+    {
+        return CollectRange([&](const ZSetVisitor &f)
+                            { RevRange(beg, end, f); });
+    }
+
+    auto ZSet::RangeByScore(int score_low, int score_high, std::size_t offset,
+                            std::size_t count) const -> std::vector<std::pair<Str, int>>
+    {
+        return CollectRange([&](const ZSetVisitor &f)
+                            { RangeByScore(score_low, score_high, offset, count, f); });
+    }
+
+    auto ZSet::RangeByLex(const Str &member_low, const Str &member_high, std::size_t offset,
+                          std::size_t count) const -> std::vector<std::pair<Str, int>>
+    {
+        return CollectRange([&](const ZSetVisitor &f)
+                            { RangeByLex(member_low, member_high, offset, count, f); });
+    }
+
+    auto ZSet::PopMin(std::size_t count) -> std::vector<std::pair<Str, int>>
+    {
+        WriteGuard wg(latch_);
+        std::vector<std::pair<Str, int>> ret;
+        if (encoding_type_ == EncodingType::ARRAY)
+        {
+            std::size_t n = std::min(count, array_.size());
+            for (std::size_t i = 0; i < n; i++)
+            {
+                ret.push_back({std::move(array_[i].member_), array_[i].score_});
+            }
+            array_.erase(array_.begin(), array_.begin() + n);
+            return ret;
+        }
+        while (ret.size() < count && zsl_.First())
+        {
+            auto node = zsl_.First();
+            auto pos = member_map_.find(*(node->member_));
+            ret.push_back({pos->first, node->score_});
+            UnlinkMember(pos);
+        }
+        return ret;
+    }
+
+    auto ZSet::PopMax(std::size_t count) -> std::vector<std::pair<Str, int>>
+    {
+        WriteGuard wg(latch_);
         std::vector<std::pair<Str, int>> ret;
-        auto low = member_map_.lower_bound(member_low);
-        auto high = member_map_.upper_bound(member_high);
-        std::for_each(low, high, [&ret](const decltype(member_map_)::value_type &v) mutable
-                      { ret.push_back({v.first, v.second->second}); });
+        if (encoding_type_ == EncodingType::ARRAY)
+        {
+            std::size_t n = std::min(count, array_.size());
+            for (std::size_t i = 0; i < n; i++)
+            {
+                auto &e = array_[array_.size() - 1 - i];
+                ret.push_back({std::move(e.member_), e.score_});
+            }
+            array_.erase(array_.end() - n, array_.end());
+            return ret;
+        }
+        while (ret.size() < count && zsl_.Last())
+        {
+            auto node = zsl_.Last();
+            auto pos = member_map_.find(*(node->member_));
+            ret.push_back({pos->first, node->score_});
+            UnlinkMember(pos);
+        }
         return ret;
     }
 
+    auto ZSet::GetEncodingType() const -> EncodingType
+    {
+        ReadGuard rg(latch_);
+        return encoding_type_;
+    }
+
     auto ZSet::GetObjectType() const -> ObjectType
     {
         return ObjectType::ZSET;
     }
 
+    /*
+    char encoding-type
+    [size_t len]
+    ARRAY:  {[int score][size_t member_len][member]}...
+    RBTREE: {[int score][Str member]}...
+     */
     auto ZSet::EncodeValue() const -> std::string
     {
         ReadGuard rg(latch_);
-        std::string ret = BitsToString(sequence_list_.size());
-        std::for_each(std::cbegin(sequence_list_), std::cend(sequence_list_), [&ret](const decltype(sequence_list_)::value_type &v) mutable
-                      { ret.append(BitsToString(v.second));ret.append(v.first->EncodeValue()); });
+        std::string ret;
+        ret.push_back(EncodingTypeToChar(encoding_type_));
+        if (encoding_type_ == EncodingType::ARRAY)
+        {
+            ret.append(BitsToString(array_.size()));
+            for (auto &e : array_)
+            {
+                ret.append(BitsToString(e.score_));
+                ret.append(BitsToString(e.member_.size()));
+                ret.append(e.member_);
+            }
+            return ret;
+        }
+        ret.append(BitsToString(zsl_.Size()));
+        for (auto node = zsl_.First(); node; node = node->level_[0].forward_)
+        {
+            ret.append(BitsToString(node->score_));
+            ret.append(node->member_->EncodeValue());
+        }
         return ret;
     }
 
-    void ZSet::DecodeValue(std::deque<char> *source)
+    void ZSet::DecodeValue(Cursor *source)
     {
         WriteGuard wg(latch_);
-        member_map_.clear();
+        InternalClear();
+        EncodingType etyp = CharToEncodingType(source->front());
+        source->pop_front();
+
+        assert(etyp == EncodingType::ARRAY || etyp == EncodingType::RBTREE);
+
         std::size_t len = PeekSize(source);
+        if (etyp == EncodingType::ARRAY)
+        {
+            array_.reserve(len);
+            for (std::size_t i = 0; i < len; i++)
+            {
+                int r = PeekInt(source);
+                std::size_t member_len = PeekSize(source);
+                array_.push_back({r, PeekString(source, member_len)});
+            }
+            if (array_.size() > ZSetArrayMaxEntries() ||
+                std::any_of(array_.cbegin(), array_.cend(), [](const ZArrayEntry &e)
+                            { return e.member_.size() > ZSetArrayMaxValueLen(); }))
+            {
+                Promote();
+            }
+            return;
+        }
         for (std::size_t i = 0; i < len; i++)
         {
             Str s;
             int r;
             r = PeekInt(source);
             s.DecodeValue(source);
+            InternalAdd(r, std::move(s));
+        }
+    }
+
+    auto ZSet::Snapshot() const -> std::vector<ZArrayEntry>
+    {
+        ReadGuard rg(latch_);
+        if (encoding_type_ == EncodingType::ARRAY)
+        {
+            return array_;
+        }
+        std::vector<ZArrayEntry> ret;
+        ret.reserve(zsl_.Size());
+        for (auto node = zsl_.First(); node; node = node->level_[0].forward_)
+        {
+            ret.push_back({node->score_, node->member_->GetRaw()});
+        }
+        return ret;
+    }
+
+    void ZSet::BulkLoad(std::vector<ZArrayEntry> sorted_entries)
+    {
+        WriteGuard wg(latch_);
+        InternalClear();
+        array_ = std::move(sorted_entries);
+        if (array_.size() > ZSetArrayMaxEntries() ||
+            std::any_of(array_.cbegin(), array_.cend(), [](const ZArrayEntry &e)
+                        { return e.member_.size() > ZSetArrayMaxValueLen(); }))
+        {
+            Promote();
+        }
+    }
 
-            auto it = member_map_.insert({std::move(s), sequence_list_.end()});
-            if (!it.second)
+    /* inputs above this many entries are accumulated by several threads,
+       each owning the members that hash into its partition */
+    constexpr static std::size_t ZSET_PARALLEL_THRESHOLD = 1 << 16;
+
+    /* weighted and summed scores saturate at the int range instead of wrapping */
+    static auto ClampScore(std::int64_t score) -> int
+    {
+        return static_cast<int>(std::clamp<std::int64_t>(score, std::numeric_limits<int>::min(), std::numeric_limits<int>::max()));
+    }
+
+    auto ZSetCombine(ZStoreOp op, const std::vector<const ZSet *> &sources,
+                     const std::vector<int> &weights, ZAggregate aggregate) -> std::vector<ZArrayEntry>
+    {
+        std::vector<std::vector<ZArrayEntry>> inputs;
+        std::size_t total = 0;
+        for (auto src : sources)
+        {
+            inputs.push_back(src ? src->Snapshot() : std::vector<ZArrayEntry>{});
+            total += inputs.back().size();
+        }
+        if (inputs.empty())
+        {
+            return {};
+        }
+        if (op == ZStoreOp::INTER && std::any_of(inputs.cbegin(), inputs.cend(), [](const std::vector<ZArrayEntry> &in)
+                                                 { return in.empty(); }))
+        {
+            return {};
+        }
+        if (op == ZStoreOp::DIFF && inputs[0].empty())
+        {
+            return {};
+        }
+
+        std::size_t n_part = 1;
+        if (total >= ZSET_PARALLEL_THRESHOLD)
+        {
+            n_part = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        /* scatter: a member always lands in the same partition, in source order */
+        std::vector<std::vector<std::pair<std::size_t, const ZArrayEntry *>>> parts(n_part);
+        std::hash<std::string_view> hasher;
+        for (std::size_t i = 0; i < inputs.size(); i++)
+        {
+            for (auto &e : inputs[i])
             {
-                continue;
+                parts[n_part == 1 ? 0 : hasher(e.member_) % n_part].push_back({i, &e});
             }
-            sequence_list_.push_back({&it.first->first, r});
-            auto pos = sequence_list_.end();
-            pos--;
-            it.first->second = pos;
-            rank_map_.insert({r, it.first});
         }
+
+        struct Accumulator
+        {
+            int score_;
+            std::size_t seen_;
+            bool alive_;
+        };
+        auto accumulate = [&](std::size_t p, std::vector<ZArrayEntry> *out)
+        {
+            std::unordered_map<std::string_view, Accumulator> acc;
+            acc.reserve(parts[p].size());
+            for (auto &[i, e] : parts[p])
+            {
+                if (op == ZStoreOp::DIFF)
+                {
+                    if (i == 0)
+                    {
+                        acc.insert({e->member_, {e->score_, 1, true}});
+                        continue;
+                    }
+                    auto it = acc.find(e->member_);
+                    if (it != acc.end())
+                    {
+                        it->second.alive_ = false;
+                    }
+                    continue;
+                }
+                int score = ClampScore(static_cast<std::int64_t>(e->score_) * (i < weights.size() ? weights[i] : 1));
+                auto it = acc.insert({e->member_, {score, 0, true}});
+                auto &a = it.first->second;
+                a.seen_++;
+                if (it.second)
+                {
+                    continue;
+                }
+                switch (aggregate)
+                {
+                case ZAggregate::SUM:
+                    a.score_ = ClampScore(static_cast<std::int64_t>(a.score_) + score);
+                    break;
+                case ZAggregate::MIN:
+                    a.score_ = std::min(a.score_, score);
+                    break;
+                case ZAggregate::MAX:
+                    a.score_ = std::max(a.score_, score);
+                    break;
+                }
+            }
+            for (auto &[member, a] : acc)
+            {
+                if (!a.alive_ || (op == ZStoreOp::INTER && a.seen_ != inputs.size()))
+                {
+                    continue;
+                }
+                out->push_back({a.score_, std::string(member)});
+            }
+            std::sort(out->begin(), out->end(), [](const ZArrayEntry &a, const ZArrayEntry &b)
+                      { return EntryLess(a, b.score_, b.member_); });
+        };
+
+        std::vector<std::vector<ZArrayEntry>> outs(n_part);
+        if (n_part == 1)
+        {
+            accumulate(0, &outs[0]);
+        }
+        else
+        {
+            std::vector<std::thread> workers;
+            for (std::size_t p = 0; p < n_part; p++)
+            {
+                workers.emplace_back(accumulate, p, &outs[p]);
+            }
+            for (auto &w : workers)
+            {
+                w.join();
+            }
+        }
+
+        /* merge the sorted partitions */
+        std::vector<ZArrayEntry> ret = std::move(outs[0]);
+        for (std::size_t p = 1; p < n_part; p++)
+        {
+            std::size_t mid = ret.size();
+            std::move(outs[p].begin(), outs[p].end(), std::back_inserter(ret));
+            std::inplace_merge(ret.begin(), ret.begin() + mid, ret.end(), [](const ZArrayEntry &a, const ZArrayEntry &b)
+                               { return EntryLess(a, b.score_, b.member_); });
+        }
+        return ret;
     }
 
     auto ZSet::Rank(const Str &member) const -> std::string
     {
         ReadGuard rg(latch_);
+        if (encoding_type_ == EncodingType::ARRAY)
+        {
+            auto pos = FindInArray(member.GetRaw());
+            if (pos == array_.cend())
+            {
+                return {};
+            }
+            return std::to_string(std::distance(array_.cbegin(), pos));
+        }
         auto pos = member_map_.find(member);
         if (pos == member_map_.end())
         {
             return {};
         }
-        auto rank_pos = rank_map_.find(pos->second->second);
-        return std::to_string(std::distance(rank_map_.begin(), rank_pos));
+        return std::to_string(zsl_.Rank(pos->second->score_, pos->first) - 1);
     }
     auto ZSet::Score(const Str &member) const -> std::string
     {
         ReadGuard rg(latch_);
+        if (encoding_type_ == EncodingType::ARRAY)
+        {
+            auto pos = FindInArray(member.GetRaw());
+            if (pos == array_.cend())
+            {
+                return {};
+            }
+            return std::to_string(pos->score_);
+        }
         auto pos = member_map_.find(member);
         if (pos == member_map_.end())
         {
             return {};
         }
-        return std::to_string(pos->second->second);
+        return std::to_string(pos->second->score_);
     }
 } // namespace rds
@@ -3,9 +3,21 @@
 #include <objects/hash.h>
 #include <objects/set.h>
 #include <objects/zset.h>
+#include <objects/hyperloglog.h>
+#include <objects/bloom.h>
+#include <objects/stream.h>
+#include <objects/timeseries.h>
+#include <objects/vectorset.h>
+#include <objects/cms.h>
+#include <objects/topk.h>
 #include <server/server.h>
+#include <server/reply.h>
 #include <condition_variable>
 #include <server/loop.h>
+#include <cmath>
+#include <unordered_set>
+#include <cstdlib>
+#include <objects/bitops.h>
 
 namespace rds
 {
@@ -75,10 +87,45 @@ namespace rds
         {
             return ret;
         }
-        if (ret.command_ == "GET" || ret.command_ == "LEN")
+        if (ret.command_ == "GET" ||
+            ret.command_ == "LEN" ||
+            ret.command_ == "INCR" ||
+            ret.command_ == "DECR")
         {
             return ret;
         }
+        if (ret.command_ == "SETBIT" ||
+            ret.command_ == "GETBIT" ||
+            ret.command_ == "BITCOUNT" ||
+            ret.command_ == "BITPOS" ||
+            ret.command_ == "BITFIELD" ||
+            ret.command_ == "BITOP")
+        {
+            for (std::size_t i = 2; i < source.size(); i++)
+            {
+                ret.args_.push_back(source[i].string_value());
+            }
+            std::size_t n = ret.args_.size();
+            if (ret.command_ == "BITOP")
+            {
+                // BITOP op destkey srckey...: the destination is the key acted on
+                if (n < 2)
+                {
+                    ret.valid_ = false;
+                    return ret;
+                }
+                ret.value_ = ret.obj_name_;
+                ret.obj_name_ = ret.args_[0];
+                ret.args_.erase(ret.args_.begin());
+                return ret;
+            }
+            ret.valid_ = (ret.command_ == "SETBIT" && n == 2) ||
+                         (ret.command_ == "GETBIT" && n == 1) ||
+                         (ret.command_ == "BITCOUNT" && (n == 0 || n == 2 || n == 3)) ||
+                         (ret.command_ == "BITPOS" && n >= 1 && n <= 4) ||
+                         ret.command_ == "BITFIELD";
+            return ret;
+        }
         if (source.size() < 3)
         {
             ret.valid_ = false;
@@ -160,14 +207,40 @@ namespace rds
         {
             return ret;
         }
+        if (ret.command_ == "ZPOPMIN" || ret.command_ == "ZPOPMAX")
+        {
+            if (source.size() > 3)
+            {
+                ret.valid_ = false;
+                return ret;
+            }
+            for (std::size_t i = 2; i < source.size(); i++)
+            {
+                ret.values_.push_back({source[i].string_value()});
+            }
+            return ret;
+        }
         if (source.size() < 3)
         {
             ret.valid_ = false;
             return ret;
         }
-        if (source.size() % 2 != 0 &&
-            ret.command_ != "ZSCORE" &&
-            ret.command_ != "ZRANK")
+        if (ret.command_ == "ZRANGEBYSCORE" || ret.command_ == "ZRANGEBYLEX")
+        {
+            if (source.size() != 4 && source.size() != 7)
+            {
+                ret.valid_ = false;
+                return ret;
+            }
+        }
+        else if (source.size() % 2 != 0 &&
+                 ret.command_ != "ZSCORE" &&
+                 ret.command_ != "ZRANK" &&
+                 ret.command_ != "ZUNIONSTORE" &&
+                 ret.command_ != "ZINTERSTORE" &&
+                 ret.command_ != "ZDIFFSTORE" &&
+                 ret.command_ != "BZPOPMIN" &&
+                 ret.command_ != "BZPOPMAX")
         {
             ret.valid_ = false;
             return ret;
@@ -179,6 +252,138 @@ namespace rds
         return ret;
     }
 
+    auto JsonToHyperLogLogCommand(const json11::Json::array &source) -> HyperLogLogCommand
+    {
+        HyperLogLogCommand ret;
+        if (!JsonToBase(&ret, source))
+        {
+            return ret;
+        }
+        if (ret.command_ == "PFMERGE" && source.size() < 3)
+        {
+            ret.valid_ = false;
+            return ret;
+        }
+        for (std::size_t i = 2; i < source.size(); i++)
+        {
+            ret.values_.push_back(source[i].string_value());
+        }
+        return ret;
+    }
+
+    auto JsonToBloomCommand(const json11::Json::array &source) -> BloomCommand
+    {
+        BloomCommand ret;
+        if (!JsonToBase(&ret, source))
+        {
+            return ret;
+        }
+        std::size_t n = source.size() - 2;
+        ret.valid_ = (ret.command_ == "BF.RESERVE" && n >= 2) ||
+                     ((ret.command_ == "BF.ADD" || ret.command_ == "BF.EXISTS") && n == 1) ||
+                     ((ret.command_ == "BF.MADD" || ret.command_ == "BF.MEXISTS") && n >= 1);
+        for (std::size_t i = 2; i < source.size(); i++)
+        {
+            ret.values_.push_back(source[i].string_value());
+        }
+        return ret;
+    }
+
+    auto JsonToStreamCommand(const json11::Json::array &source) -> StreamCommand
+    {
+        StreamCommand ret;
+        if (!JsonToBase(&ret, source))
+        {
+            return ret;
+        }
+        std::size_t n = source.size() - 2;
+        ret.valid_ = (ret.command_ == "XADD" && n >= 3) ||
+                     (ret.command_ == "XLEN" && n == 0) ||
+                     ((ret.command_ == "XRANGE" || ret.command_ == "XREVRANGE") && (n == 2 || n == 4)) ||
+                     (ret.command_ == "XTRIM" && (n == 2 || n == 3)) ||
+                     (ret.command_ == "XREAD" && n >= 2);
+        for (std::size_t i = ret.command_ == "XREAD" ? 1 : 2; i < source.size(); i++)
+        {
+            ret.values_.push_back(source[i].string_value());
+        }
+        return ret;
+    }
+
+    auto JsonToTimeSeriesCommand(const json11::Json::array &source) -> TimeSeriesCommand
+    {
+        TimeSeriesCommand ret;
+        if (!JsonToBase(&ret, source))
+        {
+            return ret;
+        }
+        std::size_t n = source.size() - 2;
+        ret.valid_ = (ret.command_ == "TS.CREATE" && (n == 0 || n == 2)) ||
+                     (ret.command_ == "TS.ADD" && (n == 2 || n == 4)) ||
+                     (ret.command_ == "TS.MADD" && (n + 1) % 3 == 0) ||
+                     (ret.command_ == "TS.RANGE" && n >= 2);
+        for (std::size_t i = ret.command_ == "TS.MADD" ? 1 : 2; i < source.size(); i++)
+        {
+            ret.values_.push_back(source[i].string_value());
+        }
+        return ret;
+    }
+
+    auto JsonToVectorSetCommand(const json11::Json::array &source) -> VectorSetCommand
+    {
+        VectorSetCommand ret;
+        if (!JsonToBase(&ret, source))
+        {
+            return ret;
+        }
+        std::size_t n = source.size() - 2;
+        ret.valid_ = (ret.command_ == "VADD" && n >= 4) ||
+                     (ret.command_ == "VSIM" && n >= 2) ||
+                     (ret.command_ == "VREM" && n == 1) ||
+                     ((ret.command_ == "VCARD" || ret.command_ == "VDIM") && n == 0);
+        for (std::size_t i = 2; i < source.size(); i++)
+        {
+            ret.values_.push_back(source[i].string_value());
+        }
+        return ret;
+    }
+
+    auto JsonToCountMinSketchCommand(const json11::Json::array &source) -> CountMinSketchCommand
+    {
+        CountMinSketchCommand ret;
+        if (!JsonToBase(&ret, source))
+        {
+            return ret;
+        }
+        std::size_t n = source.size() - 2;
+        ret.valid_ = ((ret.command_ == "CMS.INITBYDIM" || ret.command_ == "CMS.INITBYPROB") && n == 2) ||
+                     (ret.command_ == "CMS.INCRBY" && n >= 2) ||
+                     (ret.command_ == "CMS.QUERY" && n >= 1) ||
+                     (ret.command_ == "CMS.MERGE" && n >= 2) ||
+                     (ret.command_ == "CMS.INFO" && n == 0);
+        for (std::size_t i = 2; i < source.size(); i++)
+        {
+            ret.values_.push_back(source[i].string_value());
+        }
+        return ret;
+    }
+
+    auto JsonToTopKCommand(const json11::Json::array &source) -> TopKCommand
+    {
+        TopKCommand ret;
+        if (!JsonToBase(&ret, source))
+        {
+            return ret;
+        }
+        std::size_t n = source.size() - 2;
+        ret.valid_ = ((ret.command_ == "TOPK.RESERVE" || ret.command_ == "TOPK.ADD" || ret.command_ == "TOPK.QUERY") && n >= 1) ||
+                     ret.command_ == "TOPK.LIST";
+        for (std::size_t i = 2; i < source.size(); i++)
+        {
+            ret.values_.push_back(source[i].string_value());
+        }
+        return ret;
+    }
+
     auto JsonToHashCommand(const json11::Json::array &source) -> HashCommand
     {
         HashCommand ret;
@@ -241,7 +446,12 @@ namespace rds
             return ret;
         }
         ret.command_ = source[0].string_value();
-        if (ret.command_ != "CREATE" && ret.command_ != "SHOW")
+        if (ret.command_ == "BGSAVE" || ret.command_ == "LASTSAVE" || ret.command_ == "SAVESTATUS" || ret.command_ == "AOFSTATUS" ||
+            ret.command_ == "BGREWRITEAOF")
+        {
+            ret.valid_ = true;
+        }
+        else if (ret.command_ != "CREATE" && ret.command_ != "SHOW")
         {
             if (source.size() < 2)
             {
@@ -263,6 +473,66 @@ namespace rds
 
      */
 
+    auto IsWriteCommand(const std::string &command) -> bool
+    {
+        static const std::unordered_set<std::string> writes = {
+            "CREATE", "DROP",
+            "DEL", "EXPIRE", "PEXPIREAT",
+            "SET", "APPEND", "INCR", "DECR", "INCRBY", "DECRBY", "INCRBYFLOAT", "SETBIT", "BITOP", "BITFIELD",
+            "LPUSHF", "LPUSHB", "LPOPF", "LPOPB", "LREM", "LTRIM", "LSET",
+            "SADD", "SPOP", "SREM",
+            "ZADD", "ZINCRBY", "ZDECRBY", "ZREM", "ZUNIONSTORE", "ZINTERSTORE", "ZDIFFSTORE",
+            "ZPOPMIN", "ZPOPMAX", "BZPOPMIN", "BZPOPMAX",
+            "HSET", "HDEL", "HINCRBY", "HDECRBY",
+            "PFADD", "PFMERGE",
+            "BF.RESERVE", "BF.ADD", "BF.MADD",
+            "XADD", "XTRIM",
+            "TS.CREATE", "TS.ADD", "TS.MADD",
+            "VADD", "VREM",
+            "CMS.INITBYDIM", "CMS.INITBYPROB", "CMS.INCRBY", "CMS.MERGE",
+            "TOPK.RESERVE", "TOPK.ADD"};
+        return writes.count(command) != 0;
+    }
+
+    void PropagateWrite(const CommandBase &cmd, const std::optional<json11::Json::array> &respond)
+    {
+        if (!cmd.valid_ || !IsWriteCommand(cmd.command_))
+        {
+            return;
+        }
+        // an error changed nothing, a blocked pop is recorded once it is served
+        if (!respond.has_value() || (respond->size() == 1 && respond->front() == " "))
+        {
+            return;
+        }
+        auto client = cmd.cli_.lock();
+        if (!client || client->GetDB() == nullptr)
+        {
+            return;
+        }
+        auto database = client->GetDB();
+        database->MarkDirty();
+        auto aof = GetGlobalAof();
+        auto &request = cmd.aof_request_.has_value() ? cmd.aof_request_.value() : cmd.request_;
+        if (aof != nullptr && !request.empty())
+        {
+            aof->FeedCommand(database->Number(), json11::Json(request).dump());
+        }
+    }
+
+    void CommandBase::RewriteArg(std::size_t i, std::string value)
+    {
+        if (request_.size() <= i)
+        {
+            return;
+        }
+        if (!aof_request_.has_value())
+        {
+            aof_request_ = request_;
+        }
+        aof_request_.value()[i] = std::move(value);
+    }
+
     auto RequestToCommandExec(std::shared_ptr<ClientInfo> client, json11::Json::array *request) -> std::unique_ptr<CommandBase>
     {
         json11::Json::array &req = *request;
@@ -271,12 +541,18 @@ namespace rds
             return (cmd == "SELECT" ||
                     // cmd == "DROP" ||
                     cmd == "CREATE" ||
-                    cmd == "SHOW");
+                    cmd == "SHOW" ||
+                    cmd == "BGSAVE" ||
+                    cmd == "LASTSAVE" ||
+                    cmd == "SAVESTATUS" ||
+                    cmd == "AOFSTATUS" ||
+                    cmd == "BGREWRITEAOF");
         };
         auto isDbCommand = [](const std::string &cmd)
         {
             return (cmd == "DEL" ||
                     cmd == "EXPIRE" ||
+                    cmd == "PEXPIREAT" ||
                     cmd == "WHEN");
         };
         auto isStrCommand = [](const std::string &cmd)
@@ -285,8 +561,17 @@ namespace rds
                     cmd == "GET" ||
                     cmd == "APPEND" ||
                     cmd == "LEN" ||
+                    cmd == "INCR" ||
+                    cmd == "DECR" ||
                     cmd == "INCRBY" ||
-                    cmd == "DECRBY");
+                    cmd == "DECRBY" ||
+                    cmd == "INCRBYFLOAT" ||
+                    cmd == "SETBIT" ||
+                    cmd == "GETBIT" ||
+                    cmd == "BITCOUNT" ||
+                    cmd == "BITPOS" ||
+                    cmd == "BITOP" ||
+                    cmd == "BITFIELD");
         };
         auto isListCommand = [](const std::string &cmd)
         {
@@ -322,10 +607,18 @@ namespace rds
                     cmd == "ZDECRBY" ||
                     cmd == "ZREM" ||
                     cmd == "ZRANGE" ||
+                    cmd == "ZREVRANGE" ||
                     cmd == "ZRANGEBYSCORE" ||
                     cmd == "ZRANGEBYLEX" ||
                     cmd == "ZRANK" ||
-                    cmd == "ZSCORE");
+                    cmd == "ZSCORE" ||
+                    cmd == "ZUNIONSTORE" ||
+                    cmd == "ZINTERSTORE" ||
+                    cmd == "ZDIFFSTORE" ||
+                    cmd == "ZPOPMIN" ||
+                    cmd == "ZPOPMAX" ||
+                    cmd == "BZPOPMIN" ||
+                    cmd == "BZPOPMAX");
         };
         auto isHashCommand = [](const std::string &cmd)
         {
@@ -338,6 +631,60 @@ namespace rds
                     cmd == "HINCRBY" ||
                     cmd == "HDECRBY");
         };
+        auto isHyperLogLogCommand = [](const std::string &cmd)
+        {
+            return (cmd == "PFADD" ||
+                    cmd == "PFCOUNT" ||
+                    cmd == "PFMERGE");
+        };
+        auto isBloomCommand = [](const std::string &cmd)
+        {
+            return (cmd == "BF.RESERVE" ||
+                    cmd == "BF.ADD" ||
+                    cmd == "BF.MADD" ||
+                    cmd == "BF.EXISTS" ||
+                    cmd == "BF.MEXISTS");
+        };
+        auto isStreamCommand = [](const std::string &cmd)
+        {
+            return (cmd == "XADD" ||
+                    cmd == "XRANGE" ||
+                    cmd == "XREVRANGE" ||
+                    cmd == "XLEN" ||
+                    cmd == "XTRIM" ||
+                    cmd == "XREAD");
+        };
+        auto isTimeSeriesCommand = [](const std::string &cmd)
+        {
+            return (cmd == "TS.CREATE" ||
+                    cmd == "TS.ADD" ||
+                    cmd == "TS.MADD" ||
+                    cmd == "TS.RANGE");
+        };
+        auto isVectorSetCommand = [](const std::string &cmd)
+        {
+            return (cmd == "VADD" ||
+                    cmd == "VSIM" ||
+                    cmd == "VREM" ||
+                    cmd == "VCARD" ||
+                    cmd == "VDIM");
+        };
+        auto isCountMinSketchCommand = [](const std::string &cmd)
+        {
+            return (cmd == "CMS.INITBYDIM" ||
+                    cmd == "CMS.INITBYPROB" ||
+                    cmd == "CMS.INCRBY" ||
+                    cmd == "CMS.QUERY" ||
+                    cmd == "CMS.MERGE" ||
+                    cmd == "CMS.INFO");
+        };
+        auto isTopKCommand = [](const std::string &cmd)
+        {
+            return (cmd == "TOPK.RESERVE" ||
+                    cmd == "TOPK.ADD" ||
+                    cmd == "TOPK.QUERY" ||
+                    cmd == "TOPK.LIST");
+        };
         if (req.empty())
         {
             return nullptr;
@@ -377,9 +724,41 @@ namespace rds
         {
             ret = std::make_unique<ZSetCommand>(JsonToZSetCommand(req));
         }
+        if (isHyperLogLogCommand(cmd))
+        {
+            ret = std::make_unique<HyperLogLogCommand>(JsonToHyperLogLogCommand(req));
+        }
+        if (isBloomCommand(cmd))
+        {
+            ret = std::make_unique<BloomCommand>(JsonToBloomCommand(req));
+        }
+        if (isStreamCommand(cmd))
+        {
+            ret = std::make_unique<StreamCommand>(JsonToStreamCommand(req));
+        }
+        if (isTimeSeriesCommand(cmd))
+        {
+            ret = std::make_unique<TimeSeriesCommand>(JsonToTimeSeriesCommand(req));
+        }
+        if (isVectorSetCommand(cmd))
+        {
+            ret = std::make_unique<VectorSetCommand>(JsonToVectorSetCommand(req));
+        }
+        if (isCountMinSketchCommand(cmd))
+        {
+            ret = std::make_unique<CountMinSketchCommand>(JsonToCountMinSketchCommand(req));
+        }
+        if (isTopKCommand(cmd))
+        {
+            ret = std::make_unique<TopKCommand>(JsonToTopKCommand(req));
+        }
         if (ret)
         {
             ret->cli_ = client;
+            if (GetGlobalAof() != nullptr && IsWriteCommand(cmd))
+            {
+                ret->request_ = req;
+            }
         }
         return ret;
     }
@@ -389,97 +768,171 @@ namespace rds
 
      */
 
-    auto StrCommand::Exec() -> std::optional<json11::Json::array>
+    enum class BitFieldOverflow
     {
-        if (!valid_)
-        {
-            return {{" "}};
-        }
+        WRAP,
+        SAT,
+        FAIL
+    };
 
-        auto client = cli_.lock();
-        if (!client)
+    struct BitFieldOp
+    {
+        char op_; // 'G'et, 'S'et, 'I'ncrby
+        bool signed_;
+        int width_;
+        std::size_t offset_;
+        std::int64_t value_;
+        BitFieldOverflow overflow_;
+    };
+
+    /* 2^32 bits, the same ceiling redis puts on SETBIT */
+    constexpr std::uint64_t BITMAP_MAX_BITS = 1ULL << 32;
+
+    static auto ParseBitOffset(const std::string &raw, int width) -> std::optional<std::size_t>
+    {
+        // "#n" addresses the n-th field of this width
+        bool scaled = !raw.empty() && raw[0] == '#';
+        auto intval = StringToInt64(scaled ? raw.substr(1) : raw);
+        if (!intval.has_value() || intval.value() < 0)
         {
             return {};
         }
-
-        obj_ = client->GetDB()->Get({obj_name_}).lock();
-        if (obj_ == nullptr)
+        auto offset = static_cast<std::uint64_t>(intval.value());
+        if (scaled)
         {
-            if (command_ != "SET")
+            if (offset > BITMAP_MAX_BITS / width)
             {
-                return {{" "}};
+                return {};
             }
-            obj_ = client->GetDB()->NewStr({obj_name_});
+            offset *= width;
         }
-        if (obj_->GetObjectType() != ObjectType::STR)
+        if (offset + width > BITMAP_MAX_BITS)
         {
-            return {{" "}};
+            return {};
         }
+        return offset;
+    }
 
-        auto str = reinterpret_cast<Str *>(obj_.get());
-
-        if (command_ == "SET")
-        {
-            str->Set(value_.value());
-        }
-        else if (command_ == "GET")
+    static auto ParseBitFieldOps(const std::vector<std::string> &args) -> std::optional<std::vector<BitFieldOp>>
+    {
+        std::vector<BitFieldOp> ret;
+        BitFieldOverflow overflow = BitFieldOverflow::WRAP;
+        for (std::size_t i = 0; i < args.size(); i++)
         {
-            auto ret = str->GetRaw();
-            if (ret.empty())
+            std::string sub = args[i];
+            std::transform(sub.begin(), sub.end(), sub.begin(), ::toupper);
+            if (sub == "OVERFLOW" && i + 1 < args.size())
             {
-                return {{"(nil)"}};
+                std::string mode = args[++i];
+                std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
+                if (mode == "WRAP")
+                {
+                    overflow = BitFieldOverflow::WRAP;
+                }
+                else if (mode == "SAT")
+                {
+                    overflow = BitFieldOverflow::SAT;
+                }
+                else if (mode == "FAIL")
+                {
+                    overflow = BitFieldOverflow::FAIL;
+                }
+                else
+                {
+                    return {};
+                }
+                continue;
             }
-            return {{"\"" + ret + "\""}};
-        }
-        else if (command_ == "INCRBY")
-        {
-            auto intval = RedisStrToInt(value_.value());
-            if (!intval.has_value())
+            std::size_t argc = sub == "GET" ? 2 : 3;
+            if ((sub != "GET" && sub != "SET" && sub != "INCRBY") || i + argc >= args.size())
             {
-                return {{" "}};
+                return {};
             }
-            auto ret = str->IncrBy(intval.value());
-            if (ret.empty())
+            const std::string &type = args[i + 1];
+            if (type.size() < 2 || (type[0] != 'i' && type[0] != 'u' && type[0] != 'I' && type[0] != 'U'))
             {
-                return {{" "}};
+                return {};
             }
-            return {{ret}};
-        }
-        else if (command_ == "DECRBY")
-        {
-            auto intval = RedisStrToInt(value_.value());
-            if (!intval.has_value())
+            BitFieldOp op;
+            op.op_ = sub[0];
+            op.signed_ = type[0] == 'i' || type[0] == 'I';
+            auto width = StringToInt64(type.substr(1));
+            if (!width.has_value() || width.value() < 1 || width.value() > (op.signed_ ? 64 : 63))
             {
-                return {{" "}};
+                return {};
             }
-            auto ret = str->DecrBy(intval.value());
-            if (ret.empty())
+            op.width_ = static_cast<int>(width.value());
+            auto offset = ParseBitOffset(args[i + 2], op.width_);
+            if (!offset.has_value())
             {
-                return {{" "}};
+                return {};
             }
-            return {{ret}};
+            op.offset_ = offset.value();
+            op.value_ = 0;
+            if (argc == 3)
+            {
+                auto value = StringToInt64(args[i + 3]);
+                if (!value.has_value())
+                {
+                    return {};
+                }
+                op.value_ = value.value();
+            }
+            op.overflow_ = overflow;
+            ret.push_back(op);
+            i += argc;
         }
-        else if (command_ == "APPEND")
+        return ret;
+    }
+
+    /* value + incr folded into a width-bit field, false when OVERFLOW FAIL rejects it */
+    static auto BitFieldApply(std::int64_t value, std::int64_t incr, const BitFieldOp &op, std::int64_t *result) -> bool
+    {
+        __int128 r = static_cast<__int128>(value) + incr;
+        __int128 min = op.signed_ ? -(static_cast<__int128>(1) << (op.width_ - 1)) : 0;
+        __int128 max = op.signed_ ? (static_cast<__int128>(1) << (op.width_ - 1)) - 1 : (static_cast<__int128>(1) << op.width_) - 1;
+        if (r >= min && r <= max)
         {
-            auto size = str->Append(std::move(value_.value()));
-            return {{std::to_string(size)}};
+            *result = static_cast<std::int64_t>(r);
+            return true;
         }
-        else if (command_ == "LEN")
+        if (op.overflow_ == BitFieldOverflow::SAT)
         {
-            return {{std::to_string(str->Len())}};
+            *result = static_cast<std::int64_t>(r < min ? min : max);
+            return true;
         }
-
-        return {{"OK"}};
+        if (op.overflow_ == BitFieldOverflow::FAIL)
+        {
+            return false;
+        }
+        auto bits = static_cast<std::uint64_t>(r);
+        if (op.width_ < 64)
+        {
+            bits &= (1ULL << op.width_) - 1;
+            if (op.signed_ && ((bits >> (op.width_ - 1)) & 1))
+            {
+                bits |= ~0ULL << op.width_;
+            }
+        }
+        *result = static_cast<std::int64_t>(bits);
+        return true;
     }
 
-    /*
-
-
-
-
-     */
+    /* BYTE (default) or BIT as the unit of a BITCOUNT/BITPOS range */
+    static auto ParseBitUnit(const std::vector<std::string> &args, std::size_t index, bool *bit_unit) -> bool
+    {
+        *bit_unit = false;
+        if (index >= args.size())
+        {
+            return true;
+        }
+        std::string unit = args[index];
+        std::transform(unit.begin(), unit.end(), unit.begin(), ::toupper);
+        *bit_unit = unit == "BIT";
+        return unit == "BIT" || unit == "BYTE";
+    }
 
-    auto ListCommand::Exec() -> std::optional<json11::Json::array>
+    auto StrCommand::Exec() -> std::optional<json11::Json::array>
     {
         if (!valid_)
         {
@@ -492,8 +945,339 @@ namespace rds
             return {};
         }
 
-        obj_ = client->GetDB()->Get({obj_name_}).lock();
-        if (obj_ == nullptr)
+        auto database = client->GetDB();
+        bool is_counter = command_ == "INCR" ||
+                          command_ == "DECR" ||
+                          command_ == "INCRBY" ||
+                          command_ == "DECRBY" ||
+                          command_ == "INCRBYFLOAT";
+        bool is_bitmap = command_ == "SETBIT" ||
+                         command_ == "GETBIT" ||
+                         command_ == "BITCOUNT" ||
+                         command_ == "BITPOS" ||
+                         command_ == "BITFIELD";
+
+        if (command_ == "BITOP")
+        {
+            std::string op = value_.value();
+            std::transform(op.begin(), op.end(), op.begin(), ::toupper);
+            BitOperation bitop;
+            if (op == "AND")
+            {
+                bitop = BitOperation::AND;
+            }
+            else if (op == "OR")
+            {
+                bitop = BitOperation::OR;
+            }
+            else if (op == "XOR")
+            {
+                bitop = BitOperation::XOR;
+            }
+            else if (op == "NOT" && args_.size() == 1)
+            {
+                bitop = BitOperation::NOT;
+            }
+            else
+            {
+                return {{" "}};
+            }
+            // hold the sources until the result is built, the destination may be one of them
+            std::vector<std::shared_ptr<Object>> holders;
+            std::vector<const Str *> sources;
+            for (auto &key : args_)
+            {
+                auto src = database->Get({key}).lock();
+                if (src != nullptr && src->GetObjectType() != ObjectType::STR)
+                {
+                    return {{" "}};
+                }
+                sources.push_back(reinterpret_cast<const Str *>(src.get()));
+                holders.push_back(std::move(src));
+            }
+            auto result = StrBitOp(bitop, sources);
+            auto len = result.size();
+            if (result.empty())
+            {
+                database->Del({obj_name_});
+            }
+            else
+            {
+                auto value = std::make_shared<Str>(std::move(result));
+                auto intval = value->GetInt();
+                auto shared = intval.has_value() ? SharedInteger(intval.value()) : nullptr;
+                database->SetValue({obj_name_}, shared ? std::move(shared) : std::move(value));
+            }
+            return {{std::to_string(len)}};
+        }
+
+        obj_ = database->Get({obj_name_}).lock();
+        if (obj_ == nullptr && command_ != "SET" && !is_counter && !is_bitmap)
+        {
+            return {{" "}};
+        }
+        if (obj_ != nullptr && obj_->GetObjectType() != ObjectType::STR)
+        {
+            return {{" "}};
+        }
+
+        auto str = reinterpret_cast<Str *>(obj_.get());
+
+        /* shared integers are immutable, a private copy is installed before anything is changed in place */
+        auto privateStr = [&](const char *init) -> Str *
+        {
+            if (str == nullptr || str->IsShared())
+            {
+                auto fresh = str == nullptr ? std::make_shared<Str>(std::string(init)) : std::make_shared<Str>(*str);
+                database->SetValue({obj_name_}, fresh);
+                obj_ = fresh;
+                str = fresh.get();
+            }
+            return str;
+        };
+        auto shareIfSmall = [&]()
+        {
+            auto intval = str->GetInt();
+            auto shared = intval.has_value() ? SharedInteger(intval.value()) : nullptr;
+            if (shared && shared.get() != str)
+            {
+                database->SetValue({obj_name_}, std::move(shared));
+            }
+        };
+
+        if (command_ == "SET")
+        {
+            auto intval = StringToInt64(value_.value());
+            auto shared = intval.has_value() ? SharedInteger(intval.value()) : nullptr;
+            if (shared)
+            {
+                database->SetValue({obj_name_}, std::move(shared));
+            }
+            else if (str == nullptr || str->IsShared())
+            {
+                database->SetValue({obj_name_}, std::make_shared<Str>(std::move(value_.value())));
+            }
+            else
+            {
+                str->Set(std::move(value_.value()));
+            }
+        }
+        else if (command_ == "GET")
+        {
+            auto ret = str->GetRaw();
+            if (ret.empty())
+            {
+                return {{"(nil)"}};
+            }
+            return {{"\"" + ret + "\""}};
+        }
+        else if (command_ == "INCRBYFLOAT")
+        {
+            char *end = nullptr;
+            const std::string &raw = value_.value();
+            long double delta = raw.empty() ? 0 : std::strtold(raw.c_str(), &end);
+            if (raw.empty() || end != raw.c_str() + raw.size() || std::isnan(delta) || std::isinf(delta))
+            {
+                return {{" "}};
+            }
+            auto ret = privateStr("0")->IncrByFloat(delta);
+            if (ret.empty())
+            {
+                return {{" "}};
+            }
+            shareIfSmall();
+            return {{ret}};
+        }
+        else if (is_counter)
+        {
+            std::int64_t delta = command_ == "DECR" ? -1 : 1;
+            if (command_ == "INCRBY" || command_ == "DECRBY")
+            {
+                auto intval = StringToInt64(value_.value());
+                if (!intval.has_value() ||
+                    (command_ == "DECRBY" && intval.value() == std::numeric_limits<std::int64_t>::min()))
+                {
+                    return {{" "}};
+                }
+                delta = command_ == "DECRBY" ? -intval.value() : intval.value();
+            }
+            if (str == nullptr || str->IsShared())
+            {
+                // counters below SHARED_INTEGERS move between shared objects without allocating
+                std::int64_t current = 0;
+                if (str != nullptr)
+                {
+                    current = str->GetInt().value();
+                }
+                std::int64_t result;
+                if (__builtin_add_overflow(current, delta, &result))
+                {
+                    return {{" "}};
+                }
+                auto shared = SharedInteger(result);
+                if (shared)
+                {
+                    database->SetValue({obj_name_}, std::move(shared));
+                }
+                else
+                {
+                    database->SetValue({obj_name_}, std::make_shared<Str>(std::to_string(result)));
+                }
+                return {{std::to_string(result)}};
+            }
+            auto ret = str->IncrBy(delta);
+            if (ret.empty())
+            {
+                return {{" "}};
+            }
+            shareIfSmall();
+            return {{ret}};
+        }
+        else if (command_ == "SETBIT")
+        {
+            auto offset = StringToInt64(args_[0]);
+            if (!offset.has_value() || offset.value() < 0 ||
+                static_cast<std::uint64_t>(offset.value()) >= BITMAP_MAX_BITS ||
+                (args_[1] != "0" && args_[1] != "1"))
+            {
+                return {{" "}};
+            }
+            int old = privateStr("")->SetBit(offset.value(), args_[1] == "1");
+            shareIfSmall();
+            return {{std::to_string(old)}};
+        }
+        else if (command_ == "GETBIT")
+        {
+            auto offset = StringToInt64(args_[0]);
+            if (!offset.has_value() || offset.value() < 0)
+            {
+                return {{" "}};
+            }
+            return {{std::to_string(str == nullptr ? 0 : str->GetBit(offset.value()))}};
+        }
+        else if (command_ == "BITCOUNT")
+        {
+            std::int64_t start = 0;
+            std::int64_t end = -1;
+            bool bit_unit = false;
+            if (!args_.empty())
+            {
+                auto s = StringToInt64(args_[0]);
+                auto e = StringToInt64(args_[1]);
+                if (!s.has_value() || !e.has_value() || !ParseBitUnit(args_, 2, &bit_unit))
+                {
+                    return {{" "}};
+                }
+                start = s.value();
+                end = e.value();
+            }
+            return {{std::to_string(str == nullptr ? 0 : str->BitCount(start, end, bit_unit))}};
+        }
+        else if (command_ == "BITPOS")
+        {
+            if (args_[0] != "0" && args_[0] != "1")
+            {
+                return {{" "}};
+            }
+            bool bit = args_[0] == "1";
+            std::int64_t start = 0;
+            std::optional<std::int64_t> end;
+            bool bit_unit = false;
+            if (args_.size() > 1)
+            {
+                auto s = StringToInt64(args_[1]);
+                if (!s.has_value())
+                {
+                    return {{" "}};
+                }
+                start = s.value();
+            }
+            if (args_.size() > 2)
+            {
+                end = StringToInt64(args_[2]);
+                if (!end.has_value() || !ParseBitUnit(args_, 3, &bit_unit))
+                {
+                    return {{" "}};
+                }
+            }
+            if (str == nullptr)
+            {
+                return {{bit ? "-1" : "0"}};
+            }
+            return {{std::to_string(str->BitPos(bit, start, end, bit_unit))}};
+        }
+        else if (command_ == "BITFIELD")
+        {
+            auto ops = ParseBitFieldOps(args_);
+            if (!ops.has_value())
+            {
+                return {{" "}};
+            }
+            bool writes = std::any_of(ops->begin(), ops->end(), [](const BitFieldOp &op)
+                                      { return op.op_ != 'G'; });
+            if (writes)
+            {
+                privateStr("");
+            }
+            json11::Json::array ret;
+            for (auto &op : ops.value())
+            {
+                std::int64_t old = str == nullptr ? 0 : str->GetBits(op.offset_, op.width_, op.signed_);
+                if (op.op_ == 'G')
+                {
+                    ret.push_back(std::to_string(old));
+                    continue;
+                }
+                std::int64_t value;
+                if (!BitFieldApply(op.op_ == 'S' ? 0 : old, op.value_, op, &value))
+                {
+                    ret.push_back("(nil)");
+                    continue;
+                }
+                str->SetBits(op.offset_, op.width_, static_cast<std::uint64_t>(value));
+                ret.push_back(std::to_string(op.op_ == 'S' ? old : value));
+            }
+            if (writes)
+            {
+                shareIfSmall();
+            }
+            return ret;
+        }
+        else if (command_ == "APPEND")
+        {
+            auto size = privateStr("")->Append(std::move(value_.value()));
+            return {{std::to_string(size)}};
+        }
+        else if (command_ == "LEN")
+        {
+            return {{std::to_string(str->Len())}};
+        }
+
+        return {{"OK"}};
+    }
+
+    /*
+
+
+
+
+     */
+
+    auto ListCommand::Exec() -> std::optional<json11::Json::array>
+    {
+        if (!valid_)
+        {
+            return {{" "}};
+        }
+
+        auto client = cli_.lock();
+        if (!client)
+        {
+            return {};
+        }
+
+        obj_ = client->GetDB()->Get({obj_name_}).lock();
+        if (obj_ == nullptr)
         {
             if (command_ != "LPUSHF" && command_ != "LPUSHB")
             {
@@ -702,18 +1486,15 @@ namespace rds
         }
         else if (command_ == "HGETALL")
         {
-            json11::Json::array ret;
-            auto all = tbl->GetAll();
-            for (auto &kv : all)
-            {
-                ret.push_back('\"' + kv.first.GetRaw() + '\"');
-                ret.push_back('\"' + kv.second.GetRaw() + '\"');
-            }
-            if (ret.empty())
-            {
-                return {{"(nil)"}};
-            }
-            return ret;
+            // no cursor into a hash, one step takes it all and what does not fit waits aside
+            ReplyStream::Start(client, [obj = obj_, tbl](ReplyStream *reply)
+                               {
+                tbl->ForEach([reply](std::string_view field, const Str &value)
+                             {
+                    reply->PushQuoted(field);
+                    reply->PushQuoted(value); });
+                return false; });
+            return {};
         }
         else if (command_ == "HINCRBY")
         {
@@ -819,17 +1600,13 @@ namespace rds
         }
         else if (command_ == "SMEMBERS")
         {
-            json11::Json::array ret;
-            auto m = st->Members();
-            for (auto &element : m)
-            {
-                ret.push_back('\"' + std::move(element.GetRaw()) + '\"');
-            }
-            if (ret.empty())
-            {
-                return {{"(nil)"}};
-            }
-            return ret;
+            // no cursor into a set, one step takes it all and what does not fit waits aside
+            ReplyStream::Start(client, [obj = obj_, st](ReplyStream *reply)
+                               {
+                st->ForEach([reply](const Str &element)
+                            { reply->PushQuoted(element); });
+                return false; });
+            return {};
         }
         else if (command_ == "SRANDMEMBER")
         {
@@ -850,6 +1627,7 @@ namespace rds
             {
                 return {{"(nil)"}};
             }
+            aof_request_ = json11::Json::array{"SREM", obj_name_, v};
             ret.push_back({'\"' + std::move(v) + '\"'});
             return ret;
         }
@@ -923,116 +1701,392 @@ namespace rds
 
 
      */
-    auto ZSetCommand::Exec() -> std::optional<json11::Json::array>
+    /* [dest] numkeys key ... [WEIGHTS w ...] [AGGREGATE SUM|MIN|MAX] */
+    static auto ZSetStore(ZSetCommand *cmd, Db *database) -> std::optional<json11::Json::array>
     {
-        if (!valid_)
+        auto &values = cmd->values_;
+        auto numkeys = RedisStrToInt(values[0]);
+        if (!numkeys.has_value() || numkeys.value() <= 0 ||
+            static_cast<std::size_t>(numkeys.value()) + 1 > values.size())
         {
             return {{" "}};
         }
-        auto client = cli_.lock();
-        if (!client)
-        {
-            return {};
-        }
-
-        obj_ = client->GetDB()->Get({obj_name_}).lock();
-        if (obj_ == nullptr)
+        std::size_t n = numkeys.value();
+        std::vector<std::shared_ptr<Object>> holders;
+        std::vector<const ZSet *> sources;
+        for (std::size_t i = 1; i <= n; i++)
         {
-            if (command_ != "ZADD")
+            auto obj = database->Get(values[i]).lock();
+            if (obj && obj->GetObjectType() != ObjectType::ZSET)
             {
                 return {{" "}};
             }
-            obj_ = client->GetDB()->NewZSet({obj_name_});
-        }
-        if (obj_->GetObjectType() != ObjectType::ZSET)
-        {
-            return {{" "}};
+            sources.push_back(reinterpret_cast<const ZSet *>(obj.get()));
+            holders.push_back(std::move(obj));
         }
 
-        auto zst = reinterpret_cast<ZSet *>(obj_.get());
-        if (command_ == "ZADD")
+        std::vector<int> weights(n, 1);
+        ZAggregate aggregate = ZAggregate::SUM;
+        for (std::size_t i = n + 1; i < values.size(); i++)
         {
-            int cnt = 0;
-            for (std::size_t i = 0; i < values_.size(); i += 2)
+            auto opt = values[i].GetRaw();
+            for (auto &c : opt)
             {
-                auto intval = RedisStrToInt(values_[i]);
-                if (!intval.has_value())
-                {
-                    continue;
-                }
-                auto ok = zst->Add(intval.value(), std::move(values_[i + 1]));
-                if (ok)
+                c = std::toupper(c);
+            }
+            if (opt == "WEIGHTS" && cmd->command_ != "ZDIFFSTORE" && i + n < values.size())
+            {
+                for (std::size_t j = 0; j < n; j++)
                 {
-                    cnt++;
+                    auto w = RedisStrToInt(values[++i]);
+                    if (!w.has_value())
+                    {
+                        return {{" "}};
+                    }
+                    weights[j] = w.value();
                 }
             }
-            return {{std::to_string(cnt)}};
-        }
-        else if (command_ == "ZCARD")
-        {
-            std::size_t cnt = zst->Card();
-            return {{std::to_string(cnt)}};
-        }
-        else if (command_ == "ZREM")
-        {
-            int cnt = 0;
-            for (std::size_t i = 0; i < values_.size(); i += 2)
+            else if (opt == "AGGREGATE" && cmd->command_ != "ZDIFFSTORE" && i + 1 < values.size())
             {
-                auto intval = RedisStrToInt(values_[i]);
-                if (!intval.has_value())
+                auto aggr = values[++i].GetRaw();
+                for (auto &c : aggr)
                 {
-                    continue;
+                    c = std::toupper(c);
                 }
-                bool ok = zst->Rem(intval.value(), std::move(values_[i + 1]));
-                if (ok)
+                if (aggr == "SUM")
                 {
-                    cnt++;
+                    aggregate = ZAggregate::SUM;
+                }
+                else if (aggr == "MIN")
+                {
+                    aggregate = ZAggregate::MIN;
+                }
+                else if (aggr == "MAX")
+                {
+                    aggregate = ZAggregate::MAX;
+                }
+                else
+                {
+                    return {{" "}};
                 }
             }
-            return {{std::to_string(cnt)}};
-        }
-        else if (command_ == "ZCOUNT")
-        {
-            auto intval1 = RedisStrToInt(values_[0]);
-            auto intval2 = RedisStrToInt(values_[1]);
-            if (!(intval1.has_value() && intval2.has_value()))
+            else
             {
                 return {{" "}};
             }
-            std::size_t cnt = zst->Count(intval1.value(), intval2.value());
+        }
+
+        ZStoreOp op = ZStoreOp::UNION;
+        if (cmd->command_ == "ZINTERSTORE")
+        {
+            op = ZStoreOp::INTER;
+        }
+        else if (cmd->command_ == "ZDIFFSTORE")
+        {
+            op = ZStoreOp::DIFF;
+        }
+        auto result = ZSetCombine(op, sources, weights, aggregate);
+        std::size_t card = result.size();
+
+        database->Del(cmd->obj_name_);
+        if (card != 0)
+        {
+            auto dest = database->NewZSet(cmd->obj_name_);
+            auto zst = reinterpret_cast<ZSet *>(dest.get());
+            zst->BulkLoad(std::move(result));
+            GetZPopWaitList().Serve(database, cmd->obj_name_, zst);
+        }
+        return {{std::to_string(card)}};
+    }
+
+    auto ZPopWaitList::Block(std::weak_ptr<ClientInfo> cli, Db *database, std::vector<std::string> keys, bool pop_max) -> std::size_t
+    {
+        std::lock_guard<std::mutex> lg(mtx_);
+        // clients that left while blocked forever are only dropped here and in Serve
+        waiters_.remove_if([](const Waiter &w)
+                           { return w.cli_.expired(); });
+        std::size_t id = next_id_++;
+        waiters_.push_back({id, std::move(cli), database, std::move(keys), pop_max});
+        return id;
+    }
+
+    void ZPopWaitList::Serve(Db *database, const std::string &key, ZSet *zset)
+    {
+        std::lock_guard<std::mutex> lg(mtx_);
+        for (auto it = waiters_.begin(); it != waiters_.end();)
+        {
+            if (it->cli_.expired())
+            {
+                it = waiters_.erase(it);
+                continue;
+            }
+            if (zset->Card() == 0 ||
+                it->database_ != database ||
+                std::find(it->keys_.cbegin(), it->keys_.cend(), key) == it->keys_.cend())
+            {
+                it++;
+                continue;
+            }
+            auto client = it->cli_.lock();
+            if (client)
+            {
+                auto res = it->pop_max_ ? zset->PopMax(1) : zset->PopMin(1);
+                served_.emplace_back(client, json11::Json::array{key, res[0].first.GetRaw(), std::to_string(res[0].second)});
+                database->MarkDirty();
+                if (GetGlobalAof() != nullptr)
+                {
+                    GetGlobalAof()->Feed(database->Number(), json11::Json(json11::Json::array{it->pop_max_ ? "ZPOPMAX" : "ZPOPMIN", key}).dump());
+                }
+            }
+            it = waiters_.erase(it);
+        }
+    }
+
+    auto ZPopWaitList::TakeServed() -> std::vector<std::pair<std::weak_ptr<ClientInfo>, json11::Json::array>>
+    {
+        std::lock_guard<std::mutex> lg(mtx_);
+        return std::exchange(served_, {});
+    }
+
+    void ZPopWaitList::Timeout(std::size_t id)
+    {
+        std::lock_guard<std::mutex> lg(mtx_);
+        auto it = std::find_if(waiters_.begin(), waiters_.end(), [id](const Waiter &w)
+                               { return w.id_ == id; });
+        if (it == waiters_.end())
+        {
+            return;
+        }
+        auto client = it->cli_.lock();
+        if (client)
+        {
+            client->Append({"(nil)"});
+            client->EnableSend();
+        }
+        waiters_.erase(it);
+    }
+
+    auto GetZPopWaitList() -> ZPopWaitList &
+    {
+        static ZPopWaitList wait_list;
+        return wait_list;
+    }
+
+    /* [key] ... [timeout-sec], blocks forever when timeout is 0 */
+    static auto ZSetBlockPop(ZSetCommand *cmd, std::shared_ptr<ClientInfo> client) -> std::optional<json11::Json::array>
+    {
+        auto timeout = RedisStrToInt(cmd->values_.back());
+        if (!timeout.has_value() || timeout.value() < 0)
+        {
+            return {{" "}};
+        }
+        bool pop_max = cmd->command_ == "BZPOPMAX";
+        std::vector<std::string> keys{cmd->obj_name_};
+        for (std::size_t i = 0; i + 1 < cmd->values_.size(); i++)
+        {
+            keys.push_back(cmd->values_[i].GetRaw());
+        }
+        for (auto &key : keys)
+        {
+            auto obj = client->GetDB()->Get(key).lock();
+            if (obj == nullptr)
+            {
+                continue;
+            }
+            if (obj->GetObjectType() != ObjectType::ZSET)
+            {
+                return {{" "}};
+            }
+            auto zst = reinterpret_cast<ZSet *>(obj.get());
+            auto res = pop_max ? zst->PopMax(1) : zst->PopMin(1);
+            if (!res.empty())
+            {
+                cmd->aof_request_ = json11::Json::array{pop_max ? "ZPOPMAX" : "ZPOPMIN", key};
+                return {{key, res[0].first.GetRaw(), std::to_string(res[0].second)}};
+            }
+        }
+
+        auto id = GetZPopWaitList().Block(client, client->GetDB(), std::move(keys), pop_max);
+        if (timeout.value() > 0)
+        {
+            auto tmr = std::make_unique<ZPopTimeoutTimer>();
+            tmr->waiter_id_ = id;
+            tmr->expire_time_us_ = UsTime() + static_cast<std::size_t>(timeout.value()) * 1000'000;
+            GetGlobalLoop().EncounterTimer(std::move(tmr));
+        }
+        return {};
+    }
+
+    /* ZRANGE* stream member, score pairs */
+    static auto ZSetPushMember(ReplyStream *reply) -> ZSetVisitor
+    {
+        return [reply](std::string_view member, int score)
+        {
+            reply->Push(member);
+            reply->Push(static_cast<std::int64_t>(score));
+        };
+    }
+
+    /* ZRANGE and ZREVRANGE, step by step from the rank they stopped at */
+    static void ZSetStreamRanks(const std::shared_ptr<ClientInfo> &client, std::shared_ptr<Object> obj,
+                                std::optional<std::pair<std::size_t, std::size_t>> ranks, bool rev)
+    {
+        auto zst = reinterpret_cast<const ZSet *>(obj.get());
+        auto [next, last] = ranks.value_or(std::make_pair(std::size_t{1}, std::size_t{0}));
+        ReplyStream::Start(client, [obj = std::move(obj), zst, next = next, last = last, rev](ReplyStream *reply) mutable
+                           {
+            if (next > last)
+            {
+                return false;
+            }
+            std::size_t end = std::min(last, next + ReplyStream::STEP_ELEMENTS - 1);
+            std::size_t visited = zst->RangeByRank(next, end, rev, ZSetPushMember(reply));
+            // fewer than asked, the set shrank meanwhile
+            bool whole = visited == end - next + 1;
+            next += visited;
+            return whole && next <= last; });
+    }
+
+    /* optional [LIMIT offset count] after min max, a negative count means all */
+    static auto ZSetParseLimit(const std::vector<Str> &values, std::size_t *offset, std::size_t *count) -> bool
+    {
+        *offset = 0;
+        *count = std::numeric_limits<std::size_t>::max();
+        if (values.size() == 2)
+        {
+            return true;
+        }
+        auto limit = values[2].GetRaw();
+        for (auto &c : limit)
+        {
+            c = std::toupper(c);
+        }
+        auto off = RedisStrToInt(values[3]);
+        auto cnt = RedisStrToInt(values[4]);
+        if (limit != "LIMIT" || !off.has_value() || !cnt.has_value() || off.value() < 0)
+        {
+            return false;
+        }
+        *offset = off.value();
+        if (cnt.value() >= 0)
+        {
+            *count = cnt.value();
+        }
+        return true;
+    }
+
+    auto ZSetCommand::Exec() -> std::optional<json11::Json::array>
+    {
+        if (!valid_)
+        {
+            return {{" "}};
+        }
+        auto client = cli_.lock();
+        if (!client)
+        {
+            return {};
+        }
+
+        if (command_ == "ZUNIONSTORE" ||
+            command_ == "ZINTERSTORE" ||
+            command_ == "ZDIFFSTORE")
+        {
+            return ZSetStore(this, client->GetDB());
+        }
+        if (command_ == "BZPOPMIN" || command_ == "BZPOPMAX")
+        {
+            return ZSetBlockPop(this, client);
+        }
+
+        obj_ = client->GetDB()->Get({obj_name_}).lock();
+        if (obj_ == nullptr)
+        {
+            if (command_ != "ZADD" && command_ != "ZINCRBY" && command_ != "ZDECRBY")
+            {
+                return {{" "}};
+            }
+            obj_ = client->GetDB()->NewZSet({obj_name_});
+        }
+        if (obj_->GetObjectType() != ObjectType::ZSET)
+        {
+            return {{" "}};
+        }
+
+        auto zst = reinterpret_cast<ZSet *>(obj_.get());
+        if (command_ == "ZADD")
+        {
+            int cnt = 0;
+            for (std::size_t i = 0; i < values_.size(); i += 2)
+            {
+                auto intval = RedisStrToInt(values_[i]);
+                if (!intval.has_value())
+                {
+                    continue;
+                }
+                auto ok = zst->Add(intval.value(), std::move(values_[i + 1]));
+                if (ok)
+                {
+                    cnt++;
+                }
+            }
+            GetZPopWaitList().Serve(client->GetDB(), obj_name_, zst);
             return {{std::to_string(cnt)}};
         }
-        else if (command_ == "ZLEXCOUNT")
+        else if (command_ == "ZCARD")
         {
-            std::size_t cnt = zst->LexCount(values_[0], values_[1]);
+            std::size_t cnt = zst->Card();
             return {{std::to_string(cnt)}};
         }
-        else if (command_ == "ZINCRBY")
+        else if (command_ == "ZREM")
         {
-            auto intval = RedisStrToInt(values_[0]);
-            if (!intval.has_value())
+            int cnt = 0;
+            for (std::size_t i = 0; i < values_.size(); i += 2)
             {
-                return {{" "}};
+                auto intval = RedisStrToInt(values_[i]);
+                if (!intval.has_value())
+                {
+                    continue;
+                }
+                bool ok = zst->Rem(intval.value(), std::move(values_[i + 1]));
+                if (ok)
+                {
+                    cnt++;
+                }
             }
-            auto val = zst->IncrBy(intval.value(), values_[1]);
-            if (val.empty())
+            return {{std::to_string(cnt)}};
+        }
+        else if (command_ == "ZCOUNT")
+        {
+            auto intval1 = RedisStrToInt(values_[0]);
+            auto intval2 = RedisStrToInt(values_[1]);
+            if (!(intval1.has_value() && intval2.has_value()))
             {
                 return {{" "}};
             }
-            return {{val}};
+            std::size_t cnt = zst->Count(intval1.value(), intval2.value());
+            return {{std::to_string(cnt)}};
+        }
+        else if (command_ == "ZLEXCOUNT")
+        {
+            std::size_t cnt = zst->LexCount(values_[0], values_[1]);
+            return {{std::to_string(cnt)}};
         }
-        else if (command_ == "ZDECRBY")
+        else if (command_ == "ZINCRBY" || command_ == "ZDECRBY")
         {
             auto intval = RedisStrToInt(values_[0]);
             if (!intval.has_value())
             {
                 return {{" "}};
             }
-            auto val = zst->DecrBy(intval.has_value(), values_[1]);
+            int delta = command_ == "ZINCRBY" ? intval.value() : -intval.value();
+            auto val = zst->IncrBy(delta, values_[1]);
             if (val.empty())
             {
-                return {{" "}};
+                // a missing member starts from 0, as with ZADD
+                zst->Add(delta, values_[1]);
+                val = std::to_string(delta);
             }
+            GetZPopWaitList().Serve(client->GetDB(), obj_name_, zst);
             return {{val}};
         }
         else if (command_ == "ZRANGE")
@@ -1043,18 +2097,19 @@ namespace rds
             {
                 return {{" "}};
             }
-            auto res = zst->Range(intval1.value(), intval2.value());
-            if (res.empty())
-            {
-                return {{"(nil)"}};
-            }
-            json11::Json::array ret;
-            for (auto kv : res)
+            ZSetStreamRanks(client, obj_, zst->Ranks(intval1.value(), intval2.value()), false);
+            return {};
+        }
+        else if (command_ == "ZREVRANGE")
+        {
+            auto intval1 = RedisStrToInt(values_[0]);
+            auto intval2 = RedisStrToInt(values_[1]);
+            if (!(intval1.has_value() && intval2.has_value()))
             {
-                ret.push_back(kv.first.GetRaw());
-                ret.push_back(std::to_string(kv.second));
+                return {{" "}};
             }
-            return ret;
+            ZSetStreamRanks(client, obj_, zst->Ranks(intval1.value(), intval2.value()), true);
+            return {};
         }
         else if (command_ == "ZRANGEBYSCORE")
         {
@@ -1064,28 +2119,67 @@ namespace rds
             {
                 return {{" "}};
             }
-            auto res = zst->RangeByScore(intval1.value(), intval2.value());
-            if (res.empty())
+            std::size_t offset, count;
+            if (!ZSetParseLimit(values_, &offset, &count))
             {
-                return {{"(nil)"}};
+                return {{" "}};
             }
-            json11::Json::array ret;
-            for (auto kv : res)
+            // goes on from the rank it stopped at
+            ReplyStream::Start(client, [obj = obj_, zst, low = intval1.value(), high = intval2.value(), offset, count](ReplyStream *reply) mutable
+                               {
+                std::size_t step = std::min(count, ReplyStream::STEP_ELEMENTS);
+                std::size_t before = reply->Count();
+                zst->RangeByScore(low, high, offset, step, ZSetPushMember(reply));
+                std::size_t visited = (reply->Count() - before) / 2;
+                offset += visited;
+                count -= visited;
+                return visited == step && count != 0; });
+            return {};
+        }
+        else if (command_ == "ZRANGEBYLEX")
+        {
+            std::size_t offset, count;
+            if (!ZSetParseLimit(values_, &offset, &count))
             {
-                ret.push_back(kv.first.GetRaw());
-                ret.push_back(std::to_string(kv.second));
+                return {{" "}};
             }
-            return ret;
+            // goes on past the last member, the next string up is it with a 0 byte appended
+            ReplyStream::Start(client, [obj = obj_, zst, low = values_[0], high = values_[1], offset, count](ReplyStream *reply) mutable
+                               {
+                std::size_t step = std::min(count, ReplyStream::STEP_ELEMENTS);
+                std::string last;
+                std::size_t visited = 0;
+                zst->RangeByLex(low, high, offset, step, [reply, &last, &visited](std::string_view member, int score)
+                                {
+                    reply->Push(member);
+                    reply->Push(static_cast<std::int64_t>(score));
+                    last = member;
+                    visited++; });
+                low = Str(last + '\0');
+                offset = 0;
+                count -= visited;
+                return visited == step && count != 0; });
+            return {};
         }
-        else if (command_ == "ZRANGEBYLEX")
+        else if (command_ == "ZPOPMIN" || command_ == "ZPOPMAX")
         {
-            auto res = zst->RangeByLex(values_[0], values_[1]);
+            std::size_t count = 1;
+            if (!values_.empty())
+            {
+                auto intval = RedisStrToInt(values_[0]);
+                if (!intval.has_value() || intval.value() <= 0)
+                {
+                    return {{" "}};
+                }
+                count = intval.value();
+            }
+            auto res = command_ == "ZPOPMIN" ? zst->PopMin(count) : zst->PopMax(count);
             if (res.empty())
             {
                 return {{"(nil)"}};
             }
             json11::Json::array ret;
-            for (auto kv : res)
+            for (auto &kv : res)
             {
                 ret.push_back(kv.first.GetRaw());
                 ret.push_back(std::to_string(kv.second));
@@ -1145,6 +2239,29 @@ namespace rds
             }
             std::size_t usec = sec.value() * 1000'000;
             auto tmr = client->GetDB()->Expire(obj_name_, usec);
+            // a replay must not push the deadline further
+            aof_request_ = json11::Json::array{};
+            if (tmr)
+            {
+                aof_request_ = json11::Json::array{"PEXPIREAT", obj_name_, std::to_string(tmr->expire_time_us_ / 1000)};
+                GetGlobalLoop().EncounterTimer(std::move(tmr));
+            }
+        }
+        else if (command_ == "PEXPIREAT")
+        {
+            auto ms = StringToInt64(value_.value());
+            if (!ms.has_value() || ms.value() < 0)
+            {
+                return {{" "}};
+            }
+            std::size_t at_us = static_cast<std::size_t>(ms.value()) * 1000;
+            std::size_t now_us = UsTime();
+            if (at_us <= now_us)
+            {
+                client->GetDB()->Del(obj_name_);
+                return {{"OK"}};
+            }
+            auto tmr = client->GetDB()->Expire(obj_name_, at_us - now_us);
             if (tmr)
             {
                 GetGlobalLoop().EncounterTimer(std::move(tmr));
@@ -1210,9 +2327,1296 @@ namespace rds
             {
                 return {{" "}};
             }
+            // numbers are not reused, replay makes the very same database
+            aof_request_ = json11::Json::array{"CREATE", std::to_string(new_db_num)};
             return {{std::to_string(new_db_num)}};
         }
+        else if (command_ == "BGSAVE" || command_ == "LASTSAVE" || command_ == "SAVESTATUS")
+        {
+            auto saver = GetGlobalLoop().Saver();
+            if (saver == nullptr)
+            {
+                return {{" "}};
+            }
+            if (command_ == "BGSAVE")
+            {
+                return {{saver->Request() ? "Background saving started" : "Background save already in progress"}};
+            }
+            if (command_ == "LASTSAVE")
+            {
+                return {{std::to_string(saver->LastSave())}};
+            }
+            return {{"in_progress", saver->InProgress() ? "1" : "0",
+                     "last_status", saver->LastOk() ? "ok" : "err",
+                     "last_save", std::to_string(saver->LastSave()),
+                     "last_duration_ms", std::to_string(saver->LastDurationMs()),
+                     "saves", std::to_string(saver->Saves()),
+                     "changes_since_save", std::to_string(saver->Changes())}};
+        }
+        else if (command_ == "AOFSTATUS" || command_ == "BGREWRITEAOF")
+        {
+            auto aof = GetGlobalAof();
+            auto rewriter = GetGlobalLoop().Rewriter();
+            if (aof == nullptr || rewriter == nullptr)
+            {
+                return {{" "}};
+            }
+            if (command_ == "BGREWRITEAOF")
+            {
+                return {{rewriter->Request() ? "Background append only file rewriting started"
+                                             : "Background append only file rewriting already in progress"}};
+            }
+            const char *policy = aof->Policy() == AppendFsync::ALWAYS     ? "always"
+                                 : aof->Policy() == AppendFsync::EVERYSEC ? "everysec"
+                                                                          : "no";
+            return {{"appendfsync", policy,
+                     "aof_size", std::to_string(aof->Size()),
+                     "aof_synced", std::to_string(aof->Synced()),
+                     "fsyncs", std::to_string(aof->Fsyncs()),
+                     "aof_last_write_status", aof->Healthy() ? "ok" : "err",
+                     "aof_base_size", std::to_string(rewriter->BaseSize()),
+                     "rewrite_in_progress", rewriter->InProgress() ? "1" : "0",
+                     "last_rewrite_status", rewriter->LastOk() ? "ok" : "err",
+                     "last_rewrite_duration_ms", std::to_string(rewriter->LastDurationMs()),
+                     "rewrites", std::to_string(rewriter->Rewrites())}};
+        }
 
         return {{"OK"}};
     }
+
+    /*
+
+
+
+
+     */
+
+    auto HyperLogLogCommand::Exec() -> std::optional<json11::Json::array>
+    {
+        if (!valid_)
+        {
+            return {{" "}};
+        }
+        auto client = cli_.lock();
+        if (!client)
+        {
+            return {};
+        }
+        auto database = client->GetDB();
+
+        // PFCOUNT and PFMERGE read the union of every named key
+        std::vector<std::string> keys{obj_name_};
+        if (command_ != "PFADD")
+        {
+            keys.insert(keys.end(), values_.begin(), values_.end());
+        }
+        std::vector<std::shared_ptr<Object>> holders;
+        std::vector<const HyperLogLog *> sources;
+        for (auto &key : keys)
+        {
+            auto obj = database->Get({key}).lock();
+            if (obj != nullptr && obj->GetObjectType() != ObjectType::HYPERLOGLOG)
+            {
+                return {{" "}};
+            }
+            sources.push_back(reinterpret_cast<const HyperLogLog *>(obj.get()));
+            holders.push_back(std::move(obj));
+        }
+
+        if (command_ == "PFADD")
+        {
+            obj_ = holders[0];
+            bool created = obj_ == nullptr;
+            if (created)
+            {
+                obj_ = database->NewHyperLogLog({obj_name_});
+            }
+            auto hll = reinterpret_cast<HyperLogLog *>(obj_.get());
+            bool changed = created;
+            for (auto &element : values_)
+            {
+                changed = hll->Add(element) || changed;
+            }
+            return {{changed ? "1" : "0"}};
+        }
+        else if (command_ == "PFCOUNT")
+        {
+            if (sources.size() == 1)
+            {
+                return {{std::to_string(sources[0] == nullptr ? 0 : sources[0]->Count())}};
+            }
+            return {{std::to_string(HyperLogLogCount(sources))}};
+        }
+        else if (command_ == "PFMERGE")
+        {
+            HyperLogLog::Registers registers{};
+            for (auto hll : sources)
+            {
+                if (hll != nullptr)
+                {
+                    hll->MergeInto(&registers);
+                }
+            }
+            obj_ = holders[0];
+            if (obj_ == nullptr)
+            {
+                obj_ = database->NewHyperLogLog({obj_name_});
+            }
+            reinterpret_cast<HyperLogLog *>(obj_.get())->Import(registers);
+        }
+        return {{"OK"}};
+    }
+
+    /*
+
+
+
+
+     */
+
+    auto BloomCommand::Exec() -> std::optional<json11::Json::array>
+    {
+        if (!valid_)
+        {
+            return {{" "}};
+        }
+        auto client = cli_.lock();
+        if (!client)
+        {
+            return {};
+        }
+        auto database = client->GetDB();
+
+        obj_ = database->Get({obj_name_}).lock();
+        if (obj_ != nullptr && obj_->GetObjectType() != ObjectType::BLOOM)
+        {
+            return {{" "}};
+        }
+
+        if (command_ == "BF.RESERVE")
+        {
+            if (obj_ != nullptr)
+            {
+                return {{" "}};
+            }
+            char *end = nullptr;
+            double error_rate = std::strtod(values_[0].c_str(), &end);
+            auto capacity = StringToInt64(values_[1]);
+            if (end != values_[0].c_str() + values_[0].size() || !(error_rate > 0 && error_rate < 1) ||
+                !capacity.has_value() || capacity.value() < 1)
+            {
+                return {{" "}};
+            }
+            std::uint32_t expansion = BloomFilter::DEFAULT_EXPANSION;
+            bool scaling = true;
+            for (std::size_t i = 2; i < values_.size(); i++)
+            {
+                std::string opt = values_[i];
+                std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+                if (opt == "NONSCALING")
+                {
+                    scaling = false;
+                    continue;
+                }
+                auto n = i + 1 < values_.size() ? StringToInt64(values_[i + 1]) : std::nullopt;
+                if (opt != "EXPANSION" || !n.has_value() || n.value() < 1 || n.value() > 0xffff)
+                {
+                    return {{" "}};
+                }
+                expansion = static_cast<std::uint32_t>(n.value());
+                i++;
+            }
+            obj_ = database->NewBloom({obj_name_});
+            reinterpret_cast<BloomFilter *>(obj_.get())->Reserve(error_rate, capacity.value(), expansion, scaling);
+            return {{"OK"}};
+        }
+
+        if (command_ == "BF.ADD" || command_ == "BF.MADD")
+        {
+            if (obj_ == nullptr)
+            {
+                obj_ = database->NewBloom({obj_name_});
+            }
+            auto added = reinterpret_cast<BloomFilter *>(obj_.get())->Add(values_);
+            json11::Json::array ret;
+            for (auto a : added)
+            {
+                ret.push_back(a < 0 ? "(full)" : std::to_string(a));
+            }
+            return ret;
+        }
+
+        // BF.EXISTS / BF.MEXISTS, a missing key holds nothing
+        json11::Json::array ret;
+        if (obj_ == nullptr)
+        {
+            ret.assign(values_.size(), "0");
+            return ret;
+        }
+        auto exists = reinterpret_cast<BloomFilter *>(obj_.get())->Exists(values_);
+        for (bool e : exists)
+        {
+            ret.push_back(e ? "1" : "0");
+        }
+        return ret;
+    }
+
+    /*
+
+
+
+     */
+
+    /* the id right after or before the given one, none at the ends of the id space */
+    static auto StreamIDAfter(const StreamID &id) -> std::optional<StreamID>
+    {
+        if (id.seq_ != std::numeric_limits<std::uint64_t>::max())
+        {
+            return StreamID{id.ms_, id.seq_ + 1};
+        }
+        if (id.ms_ != std::numeric_limits<std::uint64_t>::max())
+        {
+            return StreamID{id.ms_ + 1, 0};
+        }
+        return {};
+    }
+
+    static auto StreamIDBefore(const StreamID &id) -> std::optional<StreamID>
+    {
+        if (id.seq_ != 0)
+        {
+            return StreamID{id.ms_, id.seq_ - 1};
+        }
+        if (id.ms_ != 0)
+        {
+            return StreamID{id.ms_ - 1, std::numeric_limits<std::uint64_t>::max()};
+        }
+        return {};
+    }
+
+    /* "-", "+", an id, or "(id" for an exclusive bound */
+    static auto ParseStreamBound(const std::string &raw, bool range_end) -> std::optional<StreamID>
+    {
+        if (raw == "-")
+        {
+            return StreamID{};
+        }
+        if (raw == "+")
+        {
+            return StreamID::Max();
+        }
+        if (!raw.empty() && raw[0] == '(')
+        {
+            auto id = StreamID::Parse(raw.substr(1), range_end);
+            if (!id.has_value())
+            {
+                return {};
+            }
+            return range_end ? StreamIDBefore(id.value()) : StreamIDAfter(id.value());
+        }
+        return StreamID::Parse(raw, range_end);
+    }
+
+    /* MAXLEN [=|~] n starting at values[*i], *i is left on n */
+    static auto ParseStreamMaxLen(const std::vector<std::string> &values, std::size_t *i, std::size_t *max_len, bool *approx) -> bool
+    {
+        std::string opt = values[*i];
+        std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+        if (opt != "MAXLEN")
+        {
+            return false;
+        }
+        *approx = false;
+        if (*i + 1 < values.size() && (values[*i + 1] == "=" || values[*i + 1] == "~"))
+        {
+            *approx = values[*i + 1] == "~";
+            (*i)++;
+        }
+        if (*i + 1 >= values.size())
+        {
+            return false;
+        }
+        auto n = StringToInt64(values[++(*i)]);
+        if (!n.has_value() || n.value() < 0)
+        {
+            return false;
+        }
+        *max_len = static_cast<std::size_t>(n.value());
+        return true;
+    }
+
+    /* [[id, [field, value, ...]], ...] */
+    static auto StreamEntriesToJson(const std::vector<StreamEntry> &entries) -> json11::Json::array
+    {
+        json11::Json::array ret;
+        ret.reserve(entries.size());
+        for (auto &e : entries)
+        {
+            json11::Json::array fields(e.fields_.begin(), e.fields_.end());
+            ret.push_back(json11::Json::array{e.id_.ToString(), std::move(fields)});
+        }
+        return ret;
+    }
+
+    auto XReadWaitList::Block(std::weak_ptr<ClientInfo> cli, Db *database, std::vector<std::string> keys,
+                              std::vector<StreamID> after, std::size_t count) -> std::size_t
+    {
+        std::lock_guard<std::mutex> lg(mtx_);
+        // clients that left while blocked forever are only dropped here and in Serve
+        waiters_.remove_if([](const Waiter &w)
+                           { return w.cli_.expired(); });
+        std::size_t id = next_id_++;
+        waiters_.push_back({id, std::move(cli), database, std::move(keys), std::move(after), count});
+        return id;
+    }
+
+    void XReadWaitList::Serve(Db *database, const std::string &key, const Stream *stream)
+    {
+        std::lock_guard<std::mutex> lg(mtx_);
+        for (auto it = waiters_.begin(); it != waiters_.end();)
+        {
+            if (it->cli_.expired())
+            {
+                it = waiters_.erase(it);
+                continue;
+            }
+            auto k = std::find(it->keys_.cbegin(), it->keys_.cend(), key);
+            if (it->database_ != database || k == it->keys_.cend())
+            {
+                it++;
+                continue;
+            }
+            auto from = StreamIDAfter(it->after_[k - it->keys_.cbegin()]);
+            auto entries = from.has_value() ? stream->Range(from.value(), StreamID::Max(), it->count_) : std::vector<StreamEntry>{};
+            if (entries.empty())
+            {
+                it++;
+                continue;
+            }
+            auto client = it->cli_.lock();
+            if (client)
+            {
+                served_.emplace_back(client, json11::Json::array{json11::Json::array{key, StreamEntriesToJson(entries)}});
+            }
+            it = waiters_.erase(it);
+        }
+    }
+
+    auto XReadWaitList::TakeServed() -> std::vector<std::pair<std::weak_ptr<ClientInfo>, json11::Json::array>>
+    {
+        std::lock_guard<std::mutex> lg(mtx_);
+        return std::exchange(served_, {});
+    }
+
+    void XReadWaitList::Timeout(std::size_t id)
+    {
+        std::lock_guard<std::mutex> lg(mtx_);
+        auto it = std::find_if(waiters_.begin(), waiters_.end(), [id](const Waiter &w)
+                               { return w.id_ == id; });
+        if (it == waiters_.end())
+        {
+            return;
+        }
+        auto client = it->cli_.lock();
+        if (client)
+        {
+            client->Append({"(nil)"});
+            client->EnableSend();
+        }
+        waiters_.erase(it);
+    }
+
+    auto GetXReadWaitList() -> XReadWaitList &
+    {
+        static XReadWaitList wait_list;
+        return wait_list;
+    }
+
+    /* [COUNT n] [BLOCK ms] STREAMS key ... id ..., "$" stands for the last id of the stream */
+    static auto StreamRead(StreamCommand *cmd, std::shared_ptr<ClientInfo> client) -> std::optional<json11::Json::array>
+    {
+        auto &values = cmd->values_;
+        std::size_t count = std::numeric_limits<std::size_t>::max();
+        std::optional<std::size_t> block_ms;
+        std::size_t i = 0;
+        for (; i < values.size(); i++)
+        {
+            std::string opt = values[i];
+            std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+            if (opt == "STREAMS")
+            {
+                break;
+            }
+            auto n = i + 1 < values.size() ? StringToInt64(values[i + 1]) : std::nullopt;
+            if ((opt != "COUNT" && opt != "BLOCK") || !n.has_value() || n.value() < 0)
+            {
+                return {{" "}};
+            }
+            (opt == "COUNT" ? count : block_ms.emplace()) = static_cast<std::size_t>(n.value());
+            i++;
+        }
+        if (i == values.size() || (values.size() - i - 1) % 2 != 0 || values.size() - i - 1 == 0)
+        {
+            return {{" "}};
+        }
+        std::size_t n = (values.size() - i - 1) / 2;
+        std::vector<std::string> keys(values.begin() + i + 1, values.begin() + i + 1 + n);
+        std::vector<StreamID> after;
+        json11::Json::array ret;
+        auto database = client->GetDB();
+        for (std::size_t k = 0; k < n; k++)
+        {
+            auto obj = database->Get(keys[k]).lock();
+            if (obj != nullptr && obj->GetObjectType() != ObjectType::STREAM)
+            {
+                return {{" "}};
+            }
+            auto stream = reinterpret_cast<Stream *>(obj.get());
+            const auto &raw = values[i + 1 + n + k];
+            auto id = raw == "$" ? (stream != nullptr ? stream->LastID() : StreamID{}) : StreamID::Parse(raw, false);
+            if (!id.has_value())
+            {
+                return {{" "}};
+            }
+            after.push_back(id.value());
+            auto from = StreamIDAfter(id.value());
+            if (stream == nullptr || !from.has_value())
+            {
+                continue;
+            }
+            auto entries = stream->Range(from.value(), StreamID::Max(), count);
+            if (!entries.empty())
+            {
+                ret.push_back(json11::Json::array{keys[k], StreamEntriesToJson(entries)});
+            }
+        }
+        if (!ret.empty())
+        {
+            return ret;
+        }
+        if (!block_ms.has_value())
+        {
+            return {{"(nil)"}};
+        }
+
+        auto id = GetXReadWaitList().Block(client, database, std::move(keys), std::move(after), count);
+        if (block_ms.value() > 0)
+        {
+            auto tmr = std::make_unique<XReadTimeoutTimer>();
+            tmr->waiter_id_ = id;
+            tmr->expire_time_us_ = UsTime() + block_ms.value() * 1000;
+            GetGlobalLoop().EncounterTimer(std::move(tmr));
+        }
+        return {};
+    }
+
+    auto StreamCommand::Exec() -> std::optional<json11::Json::array>
+    {
+        if (!valid_)
+        {
+            return {{" "}};
+        }
+        auto client = cli_.lock();
+        if (!client)
+        {
+            return {};
+        }
+        auto database = client->GetDB();
+
+        if (command_ == "XREAD")
+        {
+            return StreamRead(this, client);
+        }
+
+        obj_ = database->Get({obj_name_}).lock();
+        if (obj_ != nullptr && obj_->GetObjectType() != ObjectType::STREAM)
+        {
+            return {{" "}};
+        }
+        auto stream = reinterpret_cast<Stream *>(obj_.get());
+
+        if (command_ == "XADD")
+        {
+            // [MAXLEN [=|~] n] id field value [field value ...]
+            std::size_t i = 0;
+            std::size_t max_len = 0;
+            bool approx = false;
+            bool trim = ParseStreamMaxLen(values_, &i, &max_len, &approx);
+            i = trim ? i + 1 : 0;
+            if (values_.size() < i + 3 || (values_.size() - i - 1) % 2 != 0)
+            {
+                return {{" "}};
+            }
+            StreamID last = stream != nullptr ? stream->LastID() : StreamID{};
+            std::optional<StreamID> id;
+            const std::string &raw = values_[i];
+            if (raw.size() > 2 && raw.compare(raw.size() - 2, 2, "-*") == 0)
+            {
+                std::string ms_raw = raw.substr(0, raw.size() - 2);
+                auto ms = StreamID::Parse(ms_raw, false);
+                if (!ms.has_value() || ms_raw.find('-') != std::string::npos || ms.value().ms_ < last.ms_)
+                {
+                    return {{" "}};
+                }
+                id = ms.value().ms_ == last.ms_ ? StreamIDAfter(last) : ms;
+                if (!id.has_value())
+                {
+                    return {{" "}};
+                }
+            }
+            else if (raw != "*")
+            {
+                id = StreamID::Parse(raw, false);
+                if (!id.has_value() || id.value() <= last)
+                {
+                    return {{" "}};
+                }
+            }
+            if (stream == nullptr)
+            {
+                obj_ = database->NewStream({obj_name_});
+                stream = reinterpret_cast<Stream *>(obj_.get());
+            }
+            auto added = stream->Add(id, std::vector<std::string>(values_.begin() + i + 1, values_.end()));
+            if (!added.has_value())
+            {
+                return {{" "}};
+            }
+            if (trim)
+            {
+                stream->Trim(max_len, approx);
+            }
+            GetXReadWaitList().Serve(database, obj_name_, stream);
+            // the id given to "*" or "ms-*" is recorded as it was taken
+            RewriteArg(i + 2, added.value().ToString());
+            return {{added.value().ToString()}};
+        }
+
+        if (command_ == "XLEN")
+        {
+            return {{std::to_string(stream != nullptr ? stream->Len() : 0)}};
+        }
+
+        if (command_ == "XTRIM")
+        {
+            std::size_t i = 0;
+            std::size_t max_len = 0;
+            bool approx = false;
+            if (!ParseStreamMaxLen(values_, &i, &max_len, &approx) || i + 1 != values_.size())
+            {
+                return {{" "}};
+            }
+            return {{std::to_string(stream != nullptr ? stream->Trim(max_len, approx) : 0)}};
+        }
+
+        // XRANGE key start end / XREVRANGE key end start, optional COUNT n
+        std::size_t count = std::numeric_limits<std::size_t>::max();
+        if (values_.size() == 4)
+        {
+            std::string opt = values_[2];
+            std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+            auto n = StringToInt64(values_[3]);
+            if (opt != "COUNT" || !n.has_value() || n.value() < 0)
+            {
+                return {{" "}};
+            }
+            count = static_cast<std::size_t>(n.value());
+        }
+        bool rev = command_ == "XREVRANGE";
+        auto start = ParseStreamBound(values_[rev ? 1 : 0], false);
+        auto end = ParseStreamBound(values_[rev ? 0 : 1], true);
+        if (!start.has_value() || !end.has_value())
+        {
+            return {{" "}};
+        }
+        if (stream == nullptr)
+        {
+            return json11::Json::array{};
+        }
+        auto entries = rev ? stream->RevRange(end.value(), start.value(), count)
+                           : stream->Range(start.value(), end.value(), count);
+        return StreamEntriesToJson(entries);
+    }
+
+    /*
+
+
+
+     */
+
+    /* "*" takes the server clock */
+    static auto ParseSampleTimestamp(const std::string &raw) -> std::optional<std::int64_t>
+    {
+        if (raw == "*")
+        {
+            return static_cast<std::int64_t>(MsTime());
+        }
+        auto ts = StringToInt64(raw);
+        if (!ts.has_value() || ts.value() < 0)
+        {
+            return {};
+        }
+        return ts;
+    }
+
+    static auto ParseSampleValue(const std::string &raw) -> std::optional<double>
+    {
+        char *end = nullptr;
+        double ret = std::strtod(raw.c_str(), &end);
+        if (raw.empty() || end != raw.c_str() + raw.size() || std::isnan(ret))
+        {
+            return {};
+        }
+        return ret;
+    }
+
+    static auto FormatSampleValue(double value) -> std::string
+    {
+        char buf[32];
+        int len = std::snprintf(buf, sizeof(buf), "%.17g", value);
+        return {buf, static_cast<std::size_t>(len)};
+    }
+
+    /* "(key) ts value", adds to the series under key, creating it when missing */
+    static auto TimeSeriesAdd(Db *database, const std::string &key, const std::string &ts_raw, const std::string &value_raw,
+                              std::optional<std::int64_t> retention) -> std::optional<std::int64_t>
+    {
+        auto ts = ParseSampleTimestamp(ts_raw);
+        auto value = ParseSampleValue(value_raw);
+        if (!ts.has_value() || !value.has_value())
+        {
+            return {};
+        }
+        auto obj = database->Get({key}).lock();
+        if (obj != nullptr && obj->GetObjectType() != ObjectType::TIMESERIES)
+        {
+            return {};
+        }
+        if (obj == nullptr)
+        {
+            obj = database->NewTimeSeries({key});
+        }
+        auto series = reinterpret_cast<TimeSeries *>(obj.get());
+        if (retention.has_value())
+        {
+            series->SetRetention(retention.value());
+        }
+        if (!series->Add(ts.value(), value.value()))
+        {
+            return {};
+        }
+        return ts;
+    }
+
+    auto TimeSeriesCommand::Exec() -> std::optional<json11::Json::array>
+    {
+        if (!valid_)
+        {
+            return {{" "}};
+        }
+        auto client = cli_.lock();
+        if (!client)
+        {
+            return {};
+        }
+        auto database = client->GetDB();
+
+        if (command_ == "TS.MADD")
+        {
+            json11::Json::array ret;
+            for (std::size_t i = 0; i < values_.size(); i += 3)
+            {
+                auto ts = TimeSeriesAdd(database, values_[i], values_[i + 1], values_[i + 2], std::nullopt);
+                ret.push_back(ts.has_value() ? std::to_string(ts.value()) : " ");
+                if (ts.has_value())
+                {
+                    RewriteArg(i + 2, std::to_string(ts.value()));
+                }
+            }
+            return ret;
+        }
+
+        // [RETENTION ms] at values_[i]
+        auto parseRetention = [this](std::size_t i) -> std::optional<std::int64_t>
+        {
+            std::string opt = values_[i];
+            std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+            auto ms = StringToInt64(values_[i + 1]);
+            if (opt != "RETENTION" || !ms.has_value() || ms.value() < 0)
+            {
+                return {};
+            }
+            return ms;
+        };
+
+        if (command_ == "TS.CREATE")
+        {
+            std::optional<std::int64_t> retention = 0;
+            if (values_.size() == 2)
+            {
+                retention = parseRetention(0);
+            }
+            if (!retention.has_value() || database->Get({obj_name_}).lock() != nullptr)
+            {
+                return {{" "}};
+            }
+            obj_ = database->NewTimeSeries({obj_name_});
+            reinterpret_cast<TimeSeries *>(obj_.get())->SetRetention(retention.value());
+            return {{"OK"}};
+        }
+
+        if (command_ == "TS.ADD")
+        {
+            std::optional<std::int64_t> retention;
+            if (values_.size() == 4)
+            {
+                retention = parseRetention(2);
+                if (!retention.has_value())
+                {
+                    return {{" "}};
+                }
+            }
+            auto ts = TimeSeriesAdd(database, obj_name_, values_[0], values_[1], retention);
+            if (!ts.has_value())
+            {
+                return {{" "}};
+            }
+            RewriteArg(2, std::to_string(ts.value()));
+            return {{std::to_string(ts.value())}};
+        }
+
+        // TS.RANGE key from to [COUNT n] [AGGREGATION avg|min|max|sum bucket-ms]
+        auto from = values_[0] == "-" ? std::numeric_limits<std::int64_t>::min() : StringToInt64(values_[0]);
+        auto to = values_[1] == "+" ? std::numeric_limits<std::int64_t>::max() : StringToInt64(values_[1]);
+        if (!from.has_value() || !to.has_value())
+        {
+            return {{" "}};
+        }
+        std::size_t count = std::numeric_limits<std::size_t>::max();
+        std::optional<Aggregation> agg;
+        std::int64_t bucket_ms = 0;
+        for (std::size_t i = 2; i < values_.size(); i++)
+        {
+            std::string opt = values_[i];
+            std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+            if (opt == "COUNT" && i + 1 < values_.size())
+            {
+                auto n = StringToInt64(values_[++i]);
+                if (!n.has_value() || n.value() < 0)
+                {
+                    return {{" "}};
+                }
+                count = static_cast<std::size_t>(n.value());
+                continue;
+            }
+            if (opt != "AGGREGATION" || i + 2 >= values_.size())
+            {
+                return {{" "}};
+            }
+            std::string type = values_[++i];
+            std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+            auto bucket = StringToInt64(values_[++i]);
+            if (!bucket.has_value() || bucket.value() <= 0)
+            {
+                return {{" "}};
+            }
+            bucket_ms = bucket.value();
+            if (type == "avg")
+            {
+                agg = Aggregation::AVG;
+            }
+            else if (type == "min")
+            {
+                agg = Aggregation::MIN;
+            }
+            else if (type == "max")
+            {
+                agg = Aggregation::MAX;
+            }
+            else if (type == "sum")
+            {
+                agg = Aggregation::SUM;
+            }
+            else
+            {
+                return {{" "}};
+            }
+        }
+
+        obj_ = database->Get({obj_name_}).lock();
+        if (obj_ == nullptr || obj_->GetObjectType() != ObjectType::TIMESERIES)
+        {
+            return {{" "}};
+        }
+        auto series = reinterpret_cast<TimeSeries *>(obj_.get());
+        auto samples = agg.has_value() ? series->Aggregate(from.value(), to.value(), agg.value(), bucket_ms)
+                                       : series->Range(from.value(), to.value());
+        json11::Json::array ret;
+        for (std::size_t i = 0; i < samples.size() && i < count; i++)
+        {
+            ret.push_back(json11::Json::array{std::to_string(samples[i].first), FormatSampleValue(samples[i].second)});
+        }
+        return ret;
+    }
+
+    /*
+
+
+
+     */
+
+    /* VALUES n v1 ... vn starting at values[*i], *i is left after the last component */
+    static auto ParseVectorValues(const std::vector<std::string> &values, std::size_t *i, std::vector<float> *vec) -> bool
+    {
+        std::string opt = values[*i];
+        std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+        auto n = *i + 1 < values.size() ? StringToInt64(values[*i + 1]) : std::nullopt;
+        if (opt != "VALUES" || !n.has_value() || n.value() < 1 || static_cast<std::size_t>(n.value()) > values.size() - *i - 2)
+        {
+            return false;
+        }
+        *i += 2;
+        for (std::int64_t k = 0; k < n.value(); k++, (*i)++)
+        {
+            char *end = nullptr;
+            float x = std::strtof(values[*i].c_str(), &end);
+            if (values[*i].empty() || end != values[*i].c_str() + values[*i].size() || !std::isfinite(x))
+            {
+                return false;
+            }
+            vec->push_back(x);
+        }
+        return true;
+    }
+
+    auto VectorSetCommand::Exec() -> std::optional<json11::Json::array>
+    {
+        if (!valid_)
+        {
+            return {{" "}};
+        }
+        auto client = cli_.lock();
+        if (!client)
+        {
+            return {};
+        }
+        auto database = client->GetDB();
+
+        obj_ = database->Get({obj_name_}).lock();
+        if (obj_ != nullptr && obj_->GetObjectType() != ObjectType::VECTORSET)
+        {
+            return {{" "}};
+        }
+        auto vset = reinterpret_cast<VectorSet *>(obj_.get());
+
+        if (command_ == "VADD")
+        {
+            // VALUES n v1 ... vn element [NOQUANT|Q8] [METRIC COSINE|L2|IP]
+            std::size_t i = 0;
+            std::vector<float> vec;
+            if (!ParseVectorValues(values_, &i, &vec) || i >= values_.size())
+            {
+                return {{" "}};
+            }
+            const std::string &element = values_[i++];
+            std::optional<VectorQuant> quant;
+            std::optional<VectorMetric> metric;
+            for (; i < values_.size(); i++)
+            {
+                std::string opt = values_[i];
+                std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+                if (opt == "NOQUANT" || opt == "Q8")
+                {
+                    quant = opt == "Q8" ? VectorQuant::Q8 : VectorQuant::FP32;
+                    continue;
+                }
+                std::string type = i + 1 < values_.size() ? values_[i + 1] : "";
+                std::transform(type.begin(), type.end(), type.begin(), ::toupper);
+                if (opt != "METRIC" || (type != "COSINE" && type != "L2" && type != "IP"))
+                {
+                    return {{" "}};
+                }
+                metric = type == "COSINE" ? VectorMetric::COSINE : type == "L2" ? VectorMetric::L2
+                                                                                : VectorMetric::IP;
+                i++;
+            }
+            if (vset != nullptr)
+            {
+                // the layout is fixed once the set exists
+                if ((quant.has_value() && quant.value() != vset->Quant()) ||
+                    (metric.has_value() && metric.value() != vset->Metric()) ||
+                    vec.size() != vset->Dim())
+                {
+                    return {{" "}};
+                }
+            }
+            else
+            {
+                obj_ = database->NewVectorSet({obj_name_});
+                vset = reinterpret_cast<VectorSet *>(obj_.get());
+                vset->Configure(metric.value_or(VectorMetric::COSINE), quant.value_or(VectorQuant::Q8));
+            }
+            return {{std::to_string(vset->Add(element, vec))}};
+        }
+
+        if (command_ == "VREM")
+        {
+            if (vset == nullptr || !vset->Remove(values_[0]))
+            {
+                return {{"0"}};
+            }
+            if (vset->Card() == 0)
+            {
+                database->Del({obj_name_});
+            }
+            return {{"1"}};
+        }
+
+        if (command_ == "VCARD" || command_ == "VDIM")
+        {
+            if (vset == nullptr)
+            {
+                return {{"0"}};
+            }
+            return {{std::to_string(command_ == "VCARD" ? vset->Card() : vset->Dim())}};
+        }
+
+        // VSIM key (VALUES n v1 ... vn | ELE element) [COUNT k] [EF ef] [WITHSCORES] [TRUTH]
+        std::size_t i = 0;
+        std::vector<float> vec;
+        std::optional<std::string> element;
+        std::string opt = values_[0];
+        std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+        if (opt == "ELE" && values_.size() >= 2)
+        {
+            element = values_[1];
+            i = 2;
+        }
+        else if (!ParseVectorValues(values_, &i, &vec))
+        {
+            return {{" "}};
+        }
+        std::size_t count = 10;
+        std::size_t ef = VectorSet::EF_SEARCH;
+        bool with_scores = false;
+        bool truth = false;
+        for (; i < values_.size(); i++)
+        {
+            opt = values_[i];
+            std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+            if (opt == "WITHSCORES" || opt == "TRUTH")
+            {
+                (opt == "TRUTH" ? truth : with_scores) = true;
+                continue;
+            }
+            auto n = i + 1 < values_.size() ? StringToInt64(values_[i + 1]) : std::nullopt;
+            if ((opt != "COUNT" && opt != "EF") || !n.has_value() || n.value() < 1)
+            {
+                return {{" "}};
+            }
+            (opt == "COUNT" ? count : ef) = static_cast<std::size_t>(n.value());
+            i++;
+        }
+        if (vset == nullptr)
+        {
+            return json11::Json::array{};
+        }
+        std::vector<VectorSet::Result> found;
+        if (element.has_value())
+        {
+            auto res = vset->SearchElement(element.value(), count, ef);
+            if (!res.has_value())
+            {
+                return {{" "}};
+            }
+            found = std::move(res.value());
+        }
+        else
+        {
+            if (vec.size() != vset->Dim())
+            {
+                return {{" "}};
+            }
+            found = vset->Search(vec, count, ef, truth);
+        }
+        json11::Json::array ret;
+        for (auto &[name, score] : found)
+        {
+            ret.push_back(name);
+            if (with_scores)
+            {
+                ret.push_back(std::to_string(score));
+            }
+        }
+        return ret;
+    }
+
+    /*
+
+
+
+     */
+
+    auto CountMinSketchCommand::Exec() -> std::optional<json11::Json::array>
+    {
+        if (!valid_)
+        {
+            return {{" "}};
+        }
+        auto client = cli_.lock();
+        if (!client)
+        {
+            return {};
+        }
+        auto database = client->GetDB();
+
+        obj_ = database->Get({obj_name_}).lock();
+        if (obj_ != nullptr && obj_->GetObjectType() != ObjectType::CMS)
+        {
+            return {{" "}};
+        }
+
+        if (command_ == "CMS.INITBYDIM" || command_ == "CMS.INITBYPROB")
+        {
+            if (obj_ != nullptr)
+            {
+                return {{" "}};
+            }
+            if (command_ == "CMS.INITBYDIM")
+            {
+                auto width = StringToInt64(values_[0]);
+                auto depth = StringToInt64(values_[1]);
+                if (!width.has_value() || !depth.has_value() || width.value() < 1 || depth.value() < 1 ||
+                    width.value() * depth.value() > std::numeric_limits<std::uint32_t>::max())
+                {
+                    return {{" "}};
+                }
+                obj_ = database->NewCountMinSketch({obj_name_});
+                reinterpret_cast<CountMinSketch *>(obj_.get())->InitByDim(width.value(), depth.value());
+                return {{"OK"}};
+            }
+            char *end = nullptr;
+            double error = std::strtod(values_[0].c_str(), &end);
+            bool ok = end == values_[0].c_str() + values_[0].size();
+            double probability = std::strtod(values_[1].c_str(), &end);
+            ok = ok && end == values_[1].c_str() + values_[1].size();
+            if (!ok || !(error > 1e-9 && error < 1) || !(probability > 0 && probability < 1))
+            {
+                return {{" "}};
+            }
+            obj_ = database->NewCountMinSketch({obj_name_});
+            reinterpret_cast<CountMinSketch *>(obj_.get())->InitByProb(error, probability);
+            return {{"OK"}};
+        }
+
+        if (command_ == "CMS.MERGE")
+        {
+            // CMS.MERGE dest numkeys src ... [WEIGHTS w ...]
+            auto numkeys = StringToInt64(values_[0]);
+            if (!numkeys.has_value() || numkeys.value() < 1 || static_cast<std::size_t>(numkeys.value()) + 1 > values_.size())
+            {
+                return {{" "}};
+            }
+            std::size_t n = numkeys.value();
+            std::vector<std::int64_t> weights(n, 1);
+            if (values_.size() != n + 1)
+            {
+                std::string opt = values_[n + 1];
+                std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+                if (opt != "WEIGHTS" || values_.size() != 2 * n + 2)
+                {
+                    return {{" "}};
+                }
+                for (std::size_t i = 0; i < n; i++)
+                {
+                    auto w = StringToInt64(values_[n + 2 + i]);
+                    if (!w.has_value())
+                    {
+                        return {{" "}};
+                    }
+                    weights[i] = w.value();
+                }
+            }
+            std::vector<std::shared_ptr<Object>> holders;
+            std::vector<const CountMinSketch *> sources;
+            for (std::size_t i = 1; i <= n; i++)
+            {
+                auto src = database->Get({values_[i]}).lock();
+                if (src == nullptr || src->GetObjectType() != ObjectType::CMS)
+                {
+                    return {{" "}};
+                }
+                sources.push_back(reinterpret_cast<const CountMinSketch *>(src.get()));
+                holders.push_back(std::move(src));
+            }
+            auto dest = obj_ != nullptr ? obj_ : std::make_shared<CountMinSketch>();
+            if (!reinterpret_cast<CountMinSketch *>(dest.get())->Merge(sources, weights))
+            {
+                return {{" "}};
+            }
+            if (obj_ == nullptr)
+            {
+                database->SetValue({obj_name_}, dest);
+            }
+            return {{"OK"}};
+        }
+
+        if (obj_ == nullptr)
+        {
+            return {{" "}};
+        }
+        auto cms = reinterpret_cast<CountMinSketch *>(obj_.get());
+
+        if (command_ == "CMS.INCRBY")
+        {
+            if (values_.size() % 2 != 0)
+            {
+                return {{" "}};
+            }
+            std::vector<std::pair<std::string, std::uint32_t>> items;
+            for (std::size_t i = 0; i < values_.size(); i += 2)
+            {
+                auto incr = StringToInt64(values_[i + 1]);
+                if (!incr.has_value() || incr.value() < 0 || incr.value() > std::numeric_limits<std::uint32_t>::max())
+                {
+                    return {{" "}};
+                }
+                items.emplace_back(values_[i], incr.value());
+            }
+            json11::Json::array ret;
+            for (auto estimate : cms->IncrBy(items))
+            {
+                ret.push_back(std::to_string(estimate));
+            }
+            return ret;
+        }
+
+        if (command_ == "CMS.QUERY")
+        {
+            json11::Json::array ret;
+            for (auto estimate : cms->Query(values_))
+            {
+                ret.push_back(std::to_string(estimate));
+            }
+            return ret;
+        }
+
+        // CMS.INFO
+        return {{"width", std::to_string(cms->Width()), "depth", std::to_string(cms->Depth()),
+                 "count", std::to_string(cms->Total())}};
+    }
+
+    /*
+
+
+
+     */
+
+    auto TopKCommand::Exec() -> std::optional<json11::Json::array>
+    {
+        if (!valid_)
+        {
+            return {{" "}};
+        }
+        auto client = cli_.lock();
+        if (!client)
+        {
+            return {};
+        }
+        auto database = client->GetDB();
+
+        obj_ = database->Get({obj_name_}).lock();
+        if (obj_ != nullptr && obj_->GetObjectType() != ObjectType::TOPK)
+        {
+            return {{" "}};
+        }
+
+        if (command_ == "TOPK.RESERVE")
+        {
+            // TOPK.RESERVE key k [width depth decay]
+            if (obj_ != nullptr || (values_.size() != 1 && values_.size() != 4))
+            {
+                return {{" "}};
+            }
+            auto k = StringToInt64(values_[0]);
+            std::optional<std::int64_t> width = TopK::DEFAULT_WIDTH;
+            std::optional<std::int64_t> depth = TopK::DEFAULT_DEPTH;
+            double decay = TopK::DEFAULT_DECAY;
+            if (values_.size() == 4)
+            {
+                width = StringToInt64(values_[1]);
+                depth = StringToInt64(values_[2]);
+                char *end = nullptr;
+                decay = std::strtod(values_[3].c_str(), &end);
+                if (end != values_[3].c_str() + values_[3].size() || !(decay > 0 && decay <= 1))
+                {
+                    return {{" "}};
+                }
+            }
+            if (!k.has_value() || !width.has_value() || !depth.has_value() ||
+                k.value() < 1 || width.value() < 1 || depth.value() < 1 ||
+                k.value() > TopK::MAX_K ||
+                width.value() * depth.value() > std::numeric_limits<std::uint32_t>::max())
+            {
+                return {{" "}};
+            }
+            if (values_.size() == 1)
+            {
+                // scale the default width with k like the reference implementation
+                width = std::max<std::int64_t>(width.value(), k.value() * std::log(k.value()) + 1);
+            }
+            obj_ = database->NewTopK({obj_name_});
+            reinterpret_cast<TopK *>(obj_.get())->Reserve(k.value(), width.value(), depth.value(), decay);
+            return {{"OK"}};
+        }
+
+        if (obj_ == nullptr)
+        {
+            return {{" "}};
+        }
+        auto topk = reinterpret_cast<TopK *>(obj_.get());
+
+        if (command_ == "TOPK.ADD")
+        {
+            json11::Json::array ret;
+            for (auto &expelled : topk->Add(values_))
+            {
+                ret.push_back(expelled.value_or("(nil)"));
+            }
+            return ret;
+        }
+
+        if (command_ == "TOPK.QUERY")
+        {
+            json11::Json::array ret;
+            for (bool in : topk->Query(values_))
+            {
+                ret.push_back(in ? "1" : "0");
+            }
+            return ret;
+        }
+
+        // TOPK.LIST key [WITHCOUNT]
+        bool with_count = false;
+        if (!values_.empty())
+        {
+            std::string opt = values_[0];
+            std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+            if (opt != "WITHCOUNT" || values_.size() != 1)
+            {
+                return {{" "}};
+            }
+            with_count = true;
+        }
+        json11::Json::array ret;
+        for (auto &[item, count] : topk->List())
+        {
+            ret.push_back(item);
+            if (with_count)
+            {
+                ret.push_back(std::to_string(count));
+            }
+        }
+        return ret;
+    }
 };
\ No newline at end of file
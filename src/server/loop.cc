@@ -1,5 +1,8 @@
 #include <server/loop.h>
 #include <database/rdb.h>
+#include <database/aof.h>
+#include <objects/zset.h>
+#include <unistd.h>
 namespace rds
 {
     MainLoop::MainLoop(const RedisConf &conf) : conf_(conf),
@@ -8,14 +11,40 @@ namespace rds
                                                 file_manager_(conf.file_name_)
     {
         Log("Loading databases...");
-        auto dbfile = file_manager_.LoadAndExport();
-        file_manager_.Truncate();
 
         SetGlobalLoop(this);
+        SetZSetArrayLimit(conf_.zset_array_.max_entries_, conf_.zset_array_.max_value_len_);
 
         if (conf.enable_aof_)
         {
-            // databases_ = Aof::Load(&dbfile);
+            std::size_t size = 0;
+            std::size_t good = 0;
+            {
+                MappedFile aoffile(conf_.aof_file_name_);
+                size = aoffile.Bytes().size();
+                Cursor source(aoffile.Bytes());
+                // records are run as requests of a client without a socket
+                auto replay = std::make_shared<ClientInfo>(nullptr, -1);
+                good = AOFLoad(&source, &databases_, [this, &replay](int number, std::string_view record)
+                               { this->Replay(replay, number, record); });
+            }
+            Assert(good != 0 || size < 3, "aof file is not an aof");
+            if (good < size)
+            {
+                // the writer appends after the last whole record
+                Assert(truncate(conf_.aof_file_name_.c_str(), good) == 0, "truncate aof");
+            }
+            aof_ = std::make_unique<AofWriter>(conf_.aof_file_name_, conf_.aof_fsync_);
+            SetGlobalAof(aof_.get());
+            rewriter_ = std::make_unique<AofRewriter>([this](const ByteSink &out)
+                                                      { this->DatabaseFork(out); },
+                                                      aof_.get(), conf_.aof_rewrite_.min_size_, conf_.aof_rewrite_.percent_);
+            AofRewriteTimer timer;
+            timer.rewriter_ = rewriter_.get();
+            timer.expire_time_us_ = UsTime() + 1000'000;
+            timer.hdlr_ = &handler_;
+            timer.after_ = 1000'000;
+            handler_.Handle(std::make_unique<AofRewriteTimer>(timer));
         }
         else
         {
@@ -23,16 +52,28 @@ namespace rds
             {
                 EnCompress();
             }
+            {
+                // decoded straight from the mapping, unmapped before the first save replaces the file
+                auto dbfile = file_manager_.Map();
+                Cursor source(dbfile->Bytes());
+                bool ok;
+                databases_ = RDBLoad(&source, &ok);
+                // a save would replace the only copy of the databases
+                Assert(ok, "rdb file is corrupted, move it away to start with empty databases");
+            }
+            saver_ = std::make_unique<RdbSaver>([this](const ByteSink &out)
+                                                { this->DatabaseFork(out); },
+                                                [this]()
+                                                { return this->Dirty(); },
+                                                &file_manager_, conf_.save_rules_);
+            // checks the save rules, saves only when one of them is met
             RdbTimer timer;
-            timer.generator_ = [this]()
-            { return this->DatabaseFork(); };
+            timer.saver_ = saver_.get();
             timer.expire_time_us_ = UsTime() + 1000'000;
-            timer.fm_ = &file_manager_;
             timer.hdlr_ = &handler_;
-            timer.after_ = conf.frequence_.every_n_sec_ * 1000'000 / conf.frequence_.save_n_times_;
+            timer.after_ = 1000'000;
 
             handler_.Handle(std::make_unique<RdbTimer>(timer));
-            databases_ = RDBLoad(&dbfile);
         }
 
         if (databases_.empty())
@@ -40,6 +81,22 @@ namespace rds
             Log("Create a default database");
             databases_.push_back(std::make_unique<Db>());
         }
+
+        if (conf_.str_compress_.min_len_ > 0)
+        {
+            StrCompressTimer timer;
+            timer.sweep_ = [this]()
+            {
+                for (auto &db : databases_)
+                {
+                    db->CompressIdle(conf_.str_compress_.min_len_, conf_.str_compress_.idle_sec_);
+                }
+            };
+            timer.expire_time_us_ = UsTime() + 1000'000;
+            timer.hdlr_ = &handler_;
+            timer.after_ = 1000'000;
+            handler_.Handle(std::make_unique<StrCompressTimer>(timer));
+        }
         handler_.Run();
 #ifndef NDEBUG
         // handler_.Run();
@@ -64,13 +121,82 @@ namespace rds
         }
     }
 
-    auto MainLoop::DatabaseFork() const -> std::vector<std::string>
+    auto MainLoop::ReplayDB(int number) -> Db *
+    {
+        for (auto &db : databases_)
+        {
+            if (db->Number() == number)
+            {
+                return db.get();
+            }
+        }
+        auto db = std::make_unique<Db>();
+        db->Adopt(number, 0, {});
+        databases_.push_back(std::move(db));
+        return databases_.back().get();
+    }
+
+    void MainLoop::Replay(const std::shared_ptr<ClientInfo> &replay, int number, std::string_view record)
     {
-        std::vector<std::string> ret;
+        replay->SetDB(ReplayDB(number));
+        std::string err;
+        auto request = json11::Json::parse(std::string(record), err).array_items();
+        if (!err.empty() || request.empty())
+        {
+            Log("Skip a broken aof record");
+            return;
+        }
+        // recorded with the number of the database they made or dropped
+        auto command = request[0].string_value();
+        if (command == "CREATE" || command == "DROP")
+        {
+            auto target = request.size() < 2 ? std::nullopt : RedisStrToInt(Str(request[1].string_value()));
+            if (!target.has_value())
+            {
+                Log("Skip a broken aof record");
+            }
+            else if (command == "CREATE")
+            {
+                ReplayDB(target.value());
+            }
+            else
+            {
+                DropDB(target.value());
+            }
+            return;
+        }
+        auto cmd = RequestToCommandExec(replay, &request);
+        if (cmd != nullptr)
+        {
+            cmd->Exec();
+        }
+    }
+
+    void MainLoop::DatabaseFork(const ByteSink &out) const
+    {
+        for (auto &db : databases_)
+        {
+            db->Save(out);
+        }
+    }
+
+    auto MainLoop::Saver() -> RdbSaver *
+    {
+        return saver_.get();
+    }
+
+    auto MainLoop::Rewriter() -> AofRewriter *
+    {
+        return rewriter_.get();
+    }
+
+    auto MainLoop::Dirty() -> std::size_t
+    {
+        std::lock_guard lg(db_mtx_);
+        std::size_t ret = dirty_dropped_;
         for (auto &db : databases_)
         {
-            auto source = db->Save();
-            ret.push_back(std::move(source));
+            ret += db->Dirty();
         }
         return ret;
     }
@@ -112,6 +238,7 @@ namespace rds
         {
             if ((*it)->Number() == db_number)
             {
+                dirty_dropped_ += (*it)->Dirty() + 1;
                 databases_.erase(it);
                 return true;
             }
@@ -0,0 +1,210 @@
+#include <server/reply.h>
+#include <server/server.h>
+#include <objects/str.h>
+#include <charconv>
+#include <cstdio>
+
+namespace rds
+{
+    ReplyStream::ReplyStream(std::weak_ptr<ClientInfo> client, Producer producer)
+        : client_(std::move(client)), producer_(std::move(producer))
+    {
+        chunk_.reserve(CHUNK_BYTES + 64);
+        chunk_.push_back('[');
+    }
+
+    /* the escaping rules of json11::dump, without the enclosing quotes */
+    void ReplyStream::Escape(std::string_view value)
+    {
+        for (std::size_t i = 0; i < value.size(); i++)
+        {
+            const char ch = value[i];
+            if (ch == '\\')
+            {
+                chunk_.append("\\\\");
+            }
+            else if (ch == '"')
+            {
+                chunk_.append("\\\"");
+            }
+            else if (ch == '\b')
+            {
+                chunk_.append("\\b");
+            }
+            else if (ch == '\f')
+            {
+                chunk_.append("\\f");
+            }
+            else if (ch == '\n')
+            {
+                chunk_.append("\\n");
+            }
+            else if (ch == '\r')
+            {
+                chunk_.append("\\r");
+            }
+            else if (ch == '\t')
+            {
+                chunk_.append("\\t");
+            }
+            else if (static_cast<std::uint8_t>(ch) <= 0x1f)
+            {
+                char buf[8];
+                std::snprintf(buf, sizeof buf, "\\u%04x", ch);
+                chunk_.append(buf);
+            }
+            else if (static_cast<std::uint8_t>(ch) == 0xe2 && i + 2 < value.size() &&
+                     static_cast<std::uint8_t>(value[i + 1]) == 0x80 &&
+                     (static_cast<std::uint8_t>(value[i + 2]) == 0xa8 || static_cast<std::uint8_t>(value[i + 2]) == 0xa9))
+            {
+                chunk_.append(static_cast<std::uint8_t>(value[i + 2]) == 0xa8 ? "\\u2028" : "\\u2029");
+                i += 2;
+            }
+            else
+            {
+                chunk_.push_back(ch);
+            }
+        }
+    }
+
+    void ReplyStream::Next()
+    {
+        if (elements_++ > 0)
+        {
+            chunk_.append(", ");
+        }
+    }
+
+    void ReplyStream::HandOver(std::string bytes)
+    {
+        auto client = client_.lock();
+        if (client)
+        {
+            queued_ = client->AppendStreamed(std::move(bytes));
+        }
+    }
+
+    void ReplyStream::Flush()
+    {
+        if (chunk_.size() < CHUNK_BYTES)
+        {
+            return;
+        }
+        if (Full())
+        {
+            aside_.append(chunk_);
+            chunk_.clear();
+            return;
+        }
+        std::string full;
+        full.reserve(CHUNK_BYTES + 64);
+        full.swap(chunk_);
+        HandOver(std::move(full));
+    }
+
+    void ReplyStream::Push(std::string_view element)
+    {
+        Next();
+        chunk_.push_back('"');
+        Escape(element);
+        chunk_.push_back('"');
+        Flush();
+    }
+
+    void ReplyStream::Push(const Str &element)
+    {
+        Next();
+        chunk_.push_back('"');
+        element.Visit([this](std::string_view v)
+                      { Escape(v); });
+        chunk_.push_back('"');
+        Flush();
+    }
+
+    void ReplyStream::Push(std::int64_t element)
+    {
+        char buf[24];
+        auto [ptr, ec] = std::to_chars(buf, buf + sizeof(buf), element);
+        Push(std::string_view(buf, ptr - buf));
+    }
+
+    void ReplyStream::PushQuoted(const Str &element)
+    {
+        Next();
+        chunk_.append("\"\\\"");
+        element.Visit([this](std::string_view v)
+                      { Escape(v); });
+        chunk_.append("\\\"\"");
+        Flush();
+    }
+
+    void ReplyStream::PushQuoted(std::string_view element)
+    {
+        Next();
+        chunk_.append("\"\\\"");
+        Escape(element);
+        chunk_.append("\\\"\"");
+        Flush();
+    }
+
+    auto ReplyStream::Count() const -> std::size_t
+    {
+        return elements_;
+    }
+
+    auto ReplyStream::Full() const -> bool
+    {
+        return queued_ >= SEND_HIGH_WATER || aside_sent_ < aside_.size();
+    }
+
+    auto ReplyStream::Run() -> bool
+    {
+        auto client = client_.lock();
+        if (!client)
+        {
+            return true;
+        }
+        queued_ = client->SendBytes();
+        while (aside_sent_ < aside_.size() && queued_ < SEND_HIGH_WATER)
+        {
+            std::size_t n = std::min(CHUNK_BYTES, aside_.size() - aside_sent_);
+            HandOver(aside_.substr(aside_sent_, n));
+            aside_sent_ += n;
+        }
+        if (aside_sent_ == aside_.size())
+        {
+            aside_.clear();
+            aside_sent_ = 0;
+        }
+        while (!produced_ && !Full())
+        {
+            produced_ = !producer_(this);
+        }
+        if (!produced_ || Full())
+        {
+            return false;
+        }
+        if (elements_ == 0)
+        {
+            chunk_ = "[\"(nil)\"]";
+        }
+        else
+        {
+            chunk_.push_back(']');
+        }
+        HandOver(std::move(chunk_));
+        return true;
+    }
+
+    void ReplyStream::Start(const std::shared_ptr<ClientInfo> &client, Producer producer)
+    {
+        auto stream = std::make_shared<ReplyStream>(client, std::move(producer));
+        // a reply still parked goes first, this one is resumed after it
+        if (client->Queue(stream) && !stream->Run())
+        {
+            client->Park(std::move(stream));
+        }
+        client->EnableSend();
+    }
+
+} // namespace rds
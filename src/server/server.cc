@@ -1,10 +1,13 @@
 #include <server/server.h>
+#include <server/reply.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <sys/uio.h>
+#include <array>
 #include <thread>
 #include <condition_variable>
 
@@ -153,21 +156,82 @@ namespace rds
 
     void Handler::ExecCommand(Handler *hdlr)
     {
+        auto reply = [](const std::weak_ptr<ClientInfo> &cli, json11::Json::array respond)
+        {
+            auto client = cli.lock();
+            if (!client)
+            {
+                return;
+            }
+            client->Append(std::move(respond));
+            client->EnableSend();
+        };
+        // replies of writes wait until their records are in the aof, a run of
+        // writes in one batch shares a single write and fsync. When the aof
+        // can not take them the writes are answered with an error: they are
+        // in memory and their records stay buffered, but nothing promises
+        // they survive a restart
+        std::vector<std::pair<std::weak_ptr<ClientInfo>, json11::Json::array>> held;
+        auto release = [&held, &reply](AofWriter *aof)
+        {
+            bool ok = aof == nullptr || aof->Commit();
+            for (auto &[cli, respond] : held)
+            {
+                reply(cli, ok ? std::move(respond) : json11::Json::array{" "});
+            }
+            held.clear();
+        };
         while (hdlr->running_)
         {
-            auto cmd = hdlr->cmd_que_.BlockPop();
-            auto respond = cmd->Exec();
-            if (!respond.has_value())
+            auto cmds = hdlr->cmd_que_.BlockPopBatch(COMMAND_BATCH);
+            auto aof = GetGlobalAof();
+            for (auto &cmd : cmds)
             {
-                continue;
+                bool write = aof != nullptr && IsWriteCommand(cmd->command_);
+                if ((!write && !held.empty()) || (write && !aof->Healthy()))
+                {
+                    // nothing may overtake a held reply, a failing aof is tried again
+                    release(aof);
+                }
+                if (write && !aof->Healthy())
+                {
+                    // refused as long as the aof can not keep it
+                    reply(cmd->cli_, {" "});
+                    continue;
+                }
+                std::optional<json11::Json::array> respond;
+                {
+                    ReadGuard fence(ForkFence());
+                    if (aof != nullptr)
+                    {
+                        aof->Begin();
+                    }
+                    respond = cmd->Exec();
+                    PropagateWrite(*cmd, respond);
+                }
+                // pops served to blocked clients were fed as writes of their own,
+                // reads served by XADD only show what its record holds
+                auto served = GetZPopWaitList().TakeServed();
+                auto read = GetXReadWaitList().TakeServed();
+                std::move(read.begin(), read.end(), std::back_inserter(served));
+                if (respond.has_value())
+                {
+                    served.emplace(served.begin(), cmd->cli_, std::move(respond.value()));
+                }
+                for (auto &[cli, out] : served)
+                {
+                    if (write)
+                    {
+                        held.emplace_back(std::move(cli), std::move(out));
+                        continue;
+                    }
+                    reply(cli, std::move(out));
+                }
             }
-            auto client = cmd->cli_.lock();
-            if (!client)
+            if (aof != nullptr && (aof->Pending() || !held.empty()))
             {
-                continue;
+                release(aof);
             }
-            client->Append(std::move(respond.value()));
-            client->EnableSend();
         }
     }
 
@@ -176,6 +240,7 @@ namespace rds
         while (hdlr->running_)
         {
             auto tmr = hdlr->tmr_que_.BlockPop();
+            ReadGuard fence(ForkFence());
             tmr->Exec();
         }
     }
@@ -210,14 +275,21 @@ namespace rds
                 if (cli_evt.second == EPOLLOUT)
                 {
                     int nwrite = client->Send();
-                    if (nwrite == -1)
+                    if (nwrite == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
                     {
                         client->Logout();
+                        continue;
                     }
-                    if (client->IsSendOut() && errno != EAGAIN)
+                    client->Resume();
+                    if (client->IsSendOut() && !client->IsParked())
                     {
                         client->EnableRead();
                     }
+                    else
+                    {
+                        // edge triggered, armed again for what is left
+                        client->EnableSend();
+                    }
                 }
                 else
                 {
@@ -305,35 +377,144 @@ namespace rds
     auto ClientInfo::Send() -> int
     {
         WriteGuard wg(latch_);
-        if (send_buffer_.empty())
+        if (send_chunks_.empty())
         {
             return 0;
         }
-        std::vector<char> buf;
-        buf.reserve(send_buffer_.size() + 10);
-        std::copy(send_buffer_.cbegin(), send_buffer_.cend(), std::back_inserter(buf));
-        int n;
-        n = send(fd_, buf.data(), buf.size(), 0);
+        std::array<iovec, 64> iov;
+        std::size_t cnt = 0;
+        for (auto it = send_chunks_.begin(); it != send_chunks_.end() && cnt < iov.size(); it++, cnt++)
+        {
+            std::size_t skip = cnt == 0 ? send_offset_ : 0;
+            iov[cnt].iov_base = it->data() + skip;
+            iov[cnt].iov_len = it->size() - skip;
+        }
+        msghdr msg{};
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = cnt;
+        // a peer gone mid-reply is an EPIPE here, not a SIGPIPE for the server
+        ssize_t n = sendmsg(fd_, &msg, MSG_NOSIGNAL);
         if (n == 0 || n == -1)
         {
             return n;
         }
-        send_buffer_.erase(send_buffer_.begin(), send_buffer_.begin() + n);
+        send_bytes_ -= n;
+        std::size_t left = n;
+        while (left > 0 && left >= send_chunks_.front().size() - send_offset_)
+        {
+            left -= send_chunks_.front().size() - send_offset_;
+            send_offset_ = 0;
+            send_chunks_.pop_front();
+        }
+        send_offset_ += left;
         return n;
     }
 
     void ClientInfo::Append(json11::Json::array to_send_message)
     {
-        WriteGuard wg(latch_);
         json11::Json obj(std::move(to_send_message));
-        auto str = obj.dump();
-        std::copy(str.cbegin(), str.cend(), std::back_inserter(send_buffer_));
+        AppendChunk(obj.dump());
+    }
+
+    auto ClientInfo::AppendChunk(std::string chunk) -> std::size_t
+    {
+        WriteGuard wg(latch_);
+        if (parked_ != nullptr)
+        {
+            if (!chunk.empty())
+            {
+                backlog_.emplace_back(std::move(chunk));
+            }
+            return send_bytes_;
+        }
+        send_bytes_ += chunk.size();
+        if (!chunk.empty())
+        {
+            send_chunks_.push_back(std::move(chunk));
+        }
+        return send_bytes_;
+    }
+
+    auto ClientInfo::AppendStreamed(std::string chunk) -> std::size_t
+    {
+        WriteGuard wg(latch_);
+        send_bytes_ += chunk.size();
+        if (!chunk.empty())
+        {
+            send_chunks_.push_back(std::move(chunk));
+        }
+        return send_bytes_;
+    }
+
+    auto ClientInfo::SendBytes() -> std::size_t
+    {
+        ReadGuard rg(latch_);
+        return send_bytes_;
+    }
+
+    auto ClientInfo::Queue(std::shared_ptr<ReplyStream> stream) -> bool
+    {
+        WriteGuard wg(latch_);
+        if (parked_ == nullptr)
+        {
+            return true;
+        }
+        backlog_.emplace_back(std::move(stream));
+        return false;
+    }
+
+    void ClientInfo::Park(std::shared_ptr<ReplyStream> stream)
+    {
+        WriteGuard wg(latch_);
+        parked_ = std::move(stream);
+    }
+
+    auto ClientInfo::IsParked() -> bool
+    {
+        ReadGuard rg(latch_);
+        return parked_ != nullptr;
+    }
+
+    void ClientInfo::Resume()
+    {
+        while (true)
+        {
+            std::shared_ptr<ReplyStream> stream;
+            {
+                ReadGuard rg(latch_);
+                if (parked_ == nullptr || send_bytes_ > ReplyStream::SEND_LOW_WATER)
+                {
+                    return;
+                }
+                stream = parked_;
+            }
+            // produced without the latch, the stream hands its bytes over itself
+            if (!stream->Run())
+            {
+                return;
+            }
+            WriteGuard wg(latch_);
+            parked_.reset();
+            while (!backlog_.empty() && parked_ == nullptr)
+            {
+                if (auto chunk = std::get_if<std::string>(&backlog_.front()))
+                {
+                    send_bytes_ += chunk->size();
+                    send_chunks_.push_back(std::move(*chunk));
+                }
+                else
+                {
+                    parked_ = std::move(std::get<std::shared_ptr<ReplyStream>>(backlog_.front()));
+                }
+                backlog_.pop_front();
+            }
+        }
     }
 
     auto ClientInfo::IsSendOut() -> bool
     {
         ReadGuard rg(latch_);
-        return send_buffer_.empty();
+        return send_chunks_.empty();
     }
 
     auto ClientInfo::ExportMessages() -> std::vector<json11::Json::array>
@@ -380,6 +561,10 @@ namespace rds
 
     void ClientInfo::EnableSend()
     {
+        if (server_ == nullptr)
+        {
+            return; // replaying the aof, nobody to send to
+        }
         decltype(this) ths;
         {
             ReadGuard rg(latch_);
@@ -390,11 +575,19 @@ namespace rds
 
     void ClientInfo::Logout()
     {
+        if (server_ == nullptr)
+        {
+            return;
+        }
         server_->RemoveCli(GetFD());
     }
 
     void ClientInfo::EnableRead()
     {
+        if (server_ == nullptr)
+        {
+            return;
+        }
         decltype(this) ths;
         {
             ReadGuard rg(latch_);
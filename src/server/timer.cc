@@ -5,17 +5,49 @@ namespace rds
 {
     void DbExpireTimer::Exec()
     {
-        database_->Del({obj_name_});
+        if (database_->Del({obj_name_}) != 0)
+        {
+            database_->MarkDirty();
+        }
+    }
+
+    void ZPopTimeoutTimer::Exec()
+    {
+        GetZPopWaitList().Timeout(waiter_id_);
+    }
+
+    void XReadTimeoutTimer::Exec()
+    {
+        GetXReadWaitList().Timeout(waiter_id_);
     }
 
     void RdbTimer::Exec()
     {
-        auto src = generator_();
-        RDBSave(std::move(src), fm_);
+        if (saver_->Due())
+        {
+            saver_->Request();
+        }
         expire_time_us_ = UsTime() + after_;
         hdlr_->Handle(std::make_unique<RdbTimer>(*this));
     }
 
+    void AofRewriteTimer::Exec()
+    {
+        if (rewriter_->Due())
+        {
+            rewriter_->Request();
+        }
+        expire_time_us_ = UsTime() + after_;
+        hdlr_->Handle(std::make_unique<AofRewriteTimer>(*this));
+    }
+
+    void StrCompressTimer::Exec()
+    {
+        sweep_();
+        expire_time_us_ = UsTime() + after_;
+        hdlr_->Handle(std::make_unique<StrCompressTimer>(*this));
+    }
+
     void TimerQue::Push(std::unique_ptr<Timer> timer)
     {
         std::lock_guard<std::mutex> lg(mtx_);
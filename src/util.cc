@@ -1,12 +1,20 @@
 #include <util.h>
 #include <fstream>
-#include <lzfse.h>
 #include <cstdlib>
+#include <charconv>
+#include <array>
+#include <limits>
 #include <objects/str.h>
 #include <json11.hpp>
 
 namespace rds
 {
+    auto ForkFence() -> std::shared_mutex &
+    {
+        static std::shared_mutex fence;
+        return fence;
+    }
+
     auto UsTime(void) -> std::size_t
     {
         struct timeval tv;
@@ -23,78 +31,40 @@ namespace rds
         return UsTime() / 1000;
     }
 
-    auto PeekInt(std::deque<char> *source) -> int
+    auto PeekInt(Cursor *source) -> int
     {
         int ret;
-        char *p = reinterpret_cast<char *>(&ret);
-        for (std::size_t i = 0; i < sizeof(int); i++)
-        {
-            *p = source->at(i);
-            p++;
-        }
-        source->erase(source->cbegin(), source->cbegin() + sizeof(int));
+        std::memcpy(&ret, source->Take(sizeof(int)), sizeof(int));
         return ret;
     }
 
-    auto PeekSize(std::deque<char> *source) -> std::size_t
+    auto PeekSize(Cursor *source) -> std::size_t
     {
         std::size_t ret;
-        char *p = reinterpret_cast<char *>(&ret);
-        for (std::size_t i = 0; i < sizeof(std::size_t); i++)
-        {
-            *p = source->at(i);
-            p++;
-        }
-        source->erase(source->cbegin(), source->cbegin() + sizeof(std::size_t));
+        std::memcpy(&ret, source->Take(sizeof(std::size_t)), sizeof(std::size_t));
         return ret;
     }
 
-    auto PeekString(std::deque<char> *source, std::size_t size) -> std::string
+    auto PeekString(Cursor *source, std::size_t size) -> std::string
     {
-        std::string ret;
-        ret.append(source->cbegin(), source->cbegin() + size);
-        source->erase(source->cbegin(), source->cbegin() + size);
-        return ret;
+        return std::string(source->Take(size), size);
     }
 
-    auto Compress(const std::string &data) -> std::string
+    auto PeekVarint(Cursor *source) -> std::uint64_t
     {
-        uint8_t *src = reinterpret_cast<uint8_t *>(const_cast<char *>(data.data()));
-        uint8_t *dst = reinterpret_cast<uint8_t *>(malloc(data.size()));
-        std::size_t len = lzfse_encode_buffer(dst, data.size(), src, data.size(), 0);
-        std::string ret;
-        ret.reserve(len);
-        for (std::size_t i = 0; i < len; i++)
+        std::uint64_t ret = 0;
+        int shift = 0;
+        while (shift < 64)
         {
-            ret.push_back(static_cast<char>(dst[i]));
-        }
-        free(dst);
-        return ret;
-    }
-
-    auto Decompress(const std::string &data) -> std::string
-    {
-        uint8_t *src = reinterpret_cast<uint8_t *>(const_cast<char *>(data.data()));
-        const size_t dst_size = data.size() * 2;
-        uint8_t *dst = reinterpret_cast<uint8_t *>(malloc(dst_size));
-
-        std::size_t len = 0;
-        std::string ret;
-        ret.reserve(dst_size);
-
-        do
-        {
-            len = lzfse_decode_buffer(dst, dst_size, src, data.size(), 0);
-            for (std::size_t i = 0; i < len; i++)
+            auto b = static_cast<std::uint8_t>(*source->Take(1));
+            ret |= static_cast<std::uint64_t>(b & 0x7f) << shift;
+            if (!(b & 0x80))
             {
-                ret.push_back(static_cast<char>(dst[i]));
+                return ret;
             }
-        } while (len == dst_size);
-
-        free(dst);
-
-        ret.shrink_to_fit();
-        return ret;
+            shift += 7;
+        }
+        throw std::out_of_range("varint too long");
     }
 
     static std::atomic_bool __compress{false};
@@ -114,40 +84,155 @@ namespace rds
         __compress.store(false);
     }
 
-    auto RedisStrToInt(const Str &value) -> std::optional<int>
+    /* MurmurHash64A, Austin Appleby */
+    auto MurmurHash64A(const void *key, std::size_t len, std::uint64_t seed) -> std::uint64_t
     {
-        auto raw = value.GetRaw();
-        if (raw.empty())
+        const std::uint64_t m = 0xc6a4a7935bd1e995ULL;
+        const int r = 47;
+        std::uint64_t h = seed ^ (len * m);
+        auto data = static_cast<const std::uint8_t *>(key);
+        const std::uint8_t *end = data + (len - (len & 7));
+
+        while (data != end)
         {
-            return {};
+            std::uint64_t k;
+            std::memcpy(&k, data, sizeof(k));
+            k *= m;
+            k ^= k >> r;
+            k *= m;
+            h ^= k;
+            h *= m;
+            data += 8;
+        }
+
+        switch (len & 7)
+        {
+        case 7:
+            h ^= static_cast<std::uint64_t>(data[6]) << 48;
+            [[fallthrough]];
+        case 6:
+            h ^= static_cast<std::uint64_t>(data[5]) << 40;
+            [[fallthrough]];
+        case 5:
+            h ^= static_cast<std::uint64_t>(data[4]) << 32;
+            [[fallthrough]];
+        case 4:
+            h ^= static_cast<std::uint64_t>(data[3]) << 24;
+            [[fallthrough]];
+        case 3:
+            h ^= static_cast<std::uint64_t>(data[2]) << 16;
+            [[fallthrough]];
+        case 2:
+            h ^= static_cast<std::uint64_t>(data[1]) << 8;
+            [[fallthrough]];
+        case 1:
+            h ^= static_cast<std::uint64_t>(data[0]);
+            h *= m;
         }
-        if (raw[0] != '-')
+
+        h ^= h >> r;
+        h *= m;
+        h ^= h >> r;
+        return h;
+    }
+
+    auto Crc64(std::uint64_t crc, const void *data, std::size_t len) -> std::uint64_t
+    {
+        // slicing by 8: table[k][b] is the crc of b followed by k zero bytes
+        static const auto table = []()
         {
-            for (auto c : raw)
+            std::array<std::array<std::uint64_t, 256>, 8> t;
+            for (std::uint64_t b = 0; b < 256; b++)
             {
-                if (c < '0' || c > '9')
+                std::uint64_t c = b;
+                for (int i = 0; i < 8; i++)
                 {
-                    return {};
+                    c = (c >> 1) ^ ((c & 1) ? 0xc96c5795d7870f42ULL : 0);
+                }
+                t[0][b] = c;
+            }
+            for (std::size_t k = 1; k < 8; k++)
+            {
+                for (std::size_t b = 0; b < 256; b++)
+                {
+                    t[k][b] = (t[k - 1][b] >> 8) ^ t[0][t[k - 1][b] & 0xff];
                 }
             }
-            return std::stoi(raw);
+            return t;
+        }();
+
+        auto p = static_cast<const std::uint8_t *>(data);
+        crc = ~crc;
+        while (len >= 8)
+        {
+            std::uint64_t v;
+            std::memcpy(&v, p, 8);
+            v ^= crc;
+            crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^ table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff] ^
+                  table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^ table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+            p += 8;
+            len -= 8;
         }
-        else
+        while (len-- > 0)
         {
-            std::string abs(raw.begin() + 1, raw.end());
-            if (abs.empty())
+            crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+        }
+        return ~crc;
+    }
+
+    auto StringToInt64(const std::string &raw) -> std::optional<std::int64_t>
+    {
+        // only the canonical form, so that GetRaw gives back the same bytes
+        if (raw.empty() || raw.size() > 20 || raw == "-0" || raw == "-")
+        {
+            return {};
+        }
+        std::size_t digits = raw[0] == '-' ? 1 : 0;
+        if (raw[digits] == '0' && raw.size() > digits + 1)
+        {
+            return {};
+        }
+        std::int64_t ret;
+        auto [ptr, ec] = std::from_chars(raw.data(), raw.data() + raw.size(), ret);
+        if (ec != std::errc() || ptr != raw.data() + raw.size())
+        {
+            return {};
+        }
+        return ret;
+    }
+
+    auto RedisStrToInt(const Str &value) -> std::optional<int>
+    {
+        std::optional<std::int64_t> intval = value.GetInt();
+        if (!intval.has_value())
+        {
+            // leading zeros and "-0" are still accepted as arguments
+            auto raw = value.GetRaw();
+            std::size_t sign = (!raw.empty() && raw[0] == '-') ? 1 : 0;
+            if (raw.size() == sign)
             {
                 return {};
             }
-            for (auto c : abs)
+            for (std::size_t i = sign; i < raw.size(); i++)
             {
-                if (c < '0' || c > '9')
+                if (raw[i] < '0' || raw[i] > '9')
                 {
                     return {};
                 }
             }
-            return -std::stoi(abs);
+            std::int64_t parsed;
+            auto [ptr, ec] = std::from_chars(raw.data(), raw.data() + raw.size(), parsed);
+            if (ec != std::errc() || ptr != raw.data() + raw.size())
+            {
+                return {};
+            }
+            intval = parsed;
+        }
+        if (intval.value() > std::numeric_limits<int>::max() || intval.value() < std::numeric_limits<int>::min())
+        {
+            return {};
         }
+        return static_cast<int>(intval.value());
     }
 
     auto LoadConf() -> std::optional<RedisConf>
@@ -170,20 +255,102 @@ namespace rds
         {
             return {};
         }
-        RedisConf conf;
+        // a key left out keeps its DefaultConf value
+        RedisConf conf = DefaultConf();
         auto obj_value = conf_obj.object_items();
-        conf.file_name_ = obj_value["dbfile"].string_value();
-        conf.ip_ = obj_value["ip"].string_value();
-        conf.port_ = obj_value["port"].int_value();
-        conf.compress_ = obj_value["compress"].bool_value();
-        conf.enable_aof_ = obj_value["aof"].bool_value();
-        conf.frequence_.every_n_sec_ = obj_value["sec"].int_value();
-        conf.frequence_.save_n_times_ = obj_value["time"].int_value();
-        conf.mem_size_mbytes_ = obj_value["memsiz"].int_value();
-        conf.cpu_num_ = obj_value["cpu"].int_value();
+        auto has = [&obj_value](const char *key)
+        {
+            return obj_value.count(key) != 0;
+        };
+        if (has("dbfile"))
+        {
+            conf.file_name_ = obj_value["dbfile"].string_value();
+        }
+        if (has("ip"))
+        {
+            conf.ip_ = obj_value["ip"].string_value();
+        }
+        if (has("port"))
+        {
+            conf.port_ = obj_value["port"].int_value();
+        }
+        if (has("compress"))
+        {
+            conf.compress_ = obj_value["compress"].bool_value();
+        }
+        if (has("aof"))
+        {
+            conf.enable_aof_ = obj_value["aof"].bool_value();
+        }
+        if (has("aoffile") && !obj_value["aoffile"].string_value().empty())
+        {
+            conf.aof_file_name_ = obj_value["aoffile"].string_value();
+        }
+        if (has("appendfsync"))
+        {
+            conf.aof_fsync_ = ParseAppendFsync(obj_value["appendfsync"].string_value()).value_or(AppendFsync::EVERYSEC);
+        }
+        if (has("aofrewritepercent"))
+        {
+            conf.aof_rewrite_.percent_ = obj_value["aofrewritepercent"].int_value();
+        }
+        if (has("aofrewriteminsize"))
+        {
+            conf.aof_rewrite_.min_size_ = obj_value["aofrewriteminsize"].int_value();
+        }
+        if (has("save"))
+        {
+            // an empty list is kept, it saves only on BGSAVE
+            conf.save_rules_.clear();
+            for (auto &rule : obj_value["save"].array_items())
+            {
+                conf.save_rules_.emplace_back(rule[0].int_value(), rule[1].int_value());
+            }
+        }
+        if (has("memsiz"))
+        {
+            conf.mem_size_mbytes_ = obj_value["memsiz"].int_value();
+        }
+        if (has("cpu"))
+        {
+            conf.cpu_num_ = obj_value["cpu"].int_value();
+        }
+        if (has("zsetentries"))
+        {
+            conf.zset_array_.max_entries_ = obj_value["zsetentries"].int_value();
+        }
+        if (has("zsetvalue"))
+        {
+            conf.zset_array_.max_value_len_ = obj_value["zsetvalue"].int_value();
+        }
+        if (has("strcompressmin"))
+        {
+            conf.str_compress_.min_len_ = obj_value["strcompressmin"].int_value();
+        }
+        if (has("strcompressidle"))
+        {
+            conf.str_compress_.idle_sec_ = obj_value["strcompressidle"].int_value();
+        }
         return conf;
     }
 
+    auto ParseAppendFsync(const std::string &raw) -> std::optional<AppendFsync>
+    {
+        if (raw == "always")
+        {
+            return AppendFsync::ALWAYS;
+        }
+        if (raw == "everysec")
+        {
+            return AppendFsync::EVERYSEC;
+        }
+        if (raw == "no")
+        {
+            return AppendFsync::NO;
+        }
+        return {};
+    }
+
     auto DefaultConf() -> RedisConf
     {
         RedisConf conf;
@@ -192,10 +359,17 @@ namespace rds
         conf.port_ = 8080;
         conf.compress_ = false;
         conf.enable_aof_ = false;
-        conf.frequence_.every_n_sec_ = 1;
-        conf.frequence_.save_n_times_ = 1;
+        conf.aof_file_name_ = "appendonly.aof";
+        conf.aof_fsync_ = AppendFsync::EVERYSEC;
+        conf.aof_rewrite_.percent_ = 100;
+        conf.aof_rewrite_.min_size_ = 64 << 20;
+        conf.save_rules_ = {{3600, 1}, {300, 100}, {60, 10000}};
         conf.mem_size_mbytes_ = 4096;
         conf.cpu_num_ = 2;
+        conf.zset_array_.max_entries_ = 128;
+        conf.zset_array_.max_value_len_ = 64;
+        conf.str_compress_.min_len_ = 0;
+        conf.str_compress_.idle_sec_ = 60;
         return conf;
     }
 }
\ No newline at end of file
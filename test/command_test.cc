@@ -1,6 +1,13 @@
 #include <gtest/gtest.h>
 #include <server/command.h>
 #include <server/server.h>
+#include <server/reply.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <atomic>
+#include <thread>
 #include <list>
 using std::cout;
 using std::endl;
@@ -67,3 +74,262 @@ TEST(Command, Str)
 
 suit_t list_cli_commands;
 suit_t list_commands{"LPUSHF", "LPOPF", "LPUSHB", "LPOPB", "LLEN", "LTRIM", "LINDEX", "LREM", "LTRIM"};
+
+static auto exec(std::shared_ptr<rds::ClientInfo> client, json11::Json::array req) -> std::optional<json11::Json::array>
+{
+    auto cmd = rds::RequestToCommandExec(std::move(client), &req);
+    if (cmd == nullptr)
+    {
+        return {{" "}};
+    }
+    return cmd->Exec();
+}
+
+TEST(Command, BlockingZPop)
+{
+    auto &wait_list = rds::GetZPopWaitList();
+    auto a = std::make_shared<rds::ClientInfo>();
+    auto b = std::make_shared<rds::ClientInfo>();
+    auto c = std::make_shared<rds::ClientInfo>();
+    a->SetDB(&database);
+    b->SetDB(&database);
+    c->SetDB(&database);
+
+    // an element already there is popped without blocking
+    ASSERT_EQ(exec(c, {"ZADD", "bz1", "1", "m1"}).value()[0], "1");
+    auto ret = exec(a, {"BZPOPMIN", "bz1", "0"});
+    ASSERT_TRUE(ret.has_value());
+    ASSERT_EQ(ret.value(), (json11::Json::array{"bz1", "m1", "1"}));
+    ASSERT_TRUE(wait_list.TakeServed().empty());
+
+    // ZADD serves the waiters in the order they blocked, one element each
+    ASSERT_FALSE(exec(a, {"BZPOPMIN", "bz1", "bz2", "0"}).has_value());
+    ASSERT_FALSE(exec(b, {"BZPOPMAX", "bz2", "0"}).has_value());
+    exec(c, {"ZADD", "bz2", "1", "low", "9", "high"});
+    auto served = wait_list.TakeServed();
+    ASSERT_EQ(served.size(), 2);
+    ASSERT_EQ(served[0].first.lock(), a);
+    ASSERT_EQ(served[0].second, (json11::Json::array{"bz2", "low", "1"}));
+    ASSERT_EQ(served[1].first.lock(), b);
+    ASSERT_EQ(served[1].second, (json11::Json::array{"bz2", "high", "9"}));
+
+    // ZINCRBY adds a missing member, it refills a set emptied by the pops
+    ASSERT_FALSE(exec(a, {"BZPOPMAX", "bz2", "0"}).has_value());
+    ASSERT_EQ(exec(c, {"ZINCRBY", "bz2", "5", "m2"}).value()[0], "5");
+    served = wait_list.TakeServed();
+    ASSERT_EQ(served.size(), 1);
+    ASSERT_EQ(served[0].second, (json11::Json::array{"bz2", "m2", "5"}));
+    ASSERT_FALSE(exec(a, {"BZPOPMIN", "bz4", "0"}).has_value());
+    ASSERT_EQ(exec(c, {"ZDECRBY", "bz4", "2", "m4"}).value()[0], "-2");
+    served = wait_list.TakeServed();
+    ASSERT_EQ(served.size(), 1);
+    ASSERT_EQ(served[0].second, (json11::Json::array{"bz4", "m4", "-2"}));
+
+    // so do the stores, on their destination
+    exec(c, {"ZADD", "src1", "3", "s1", "4", "s2"});
+    for (auto store : {"ZUNIONSTORE", "ZINTERSTORE", "ZDIFFSTORE"})
+    {
+        ASSERT_FALSE(exec(a, {"BZPOPMIN", "bzdest", "0"}).has_value());
+        ASSERT_EQ(exec(c, {store, "bzdest", "1", "src1"}).value()[0], "2") << store;
+        served = wait_list.TakeServed();
+        ASSERT_EQ(served.size(), 1) << store;
+        ASSERT_EQ(served[0].second, (json11::Json::array{"bzdest", "s1", "3"})) << store;
+        ASSERT_TRUE(exec(c, {"ZPOPMIN", "bzdest"}).has_value());
+    }
+
+    // a client gone while blocked forever is dropped, not served
+    auto gone = std::make_shared<rds::ClientInfo>();
+    gone->SetDB(&database);
+    ASSERT_FALSE(exec(gone, {"BZPOPMIN", "bz3", "0"}).has_value());
+    ASSERT_FALSE(exec(b, {"BZPOPMIN", "bz3", "0"}).has_value());
+    gone.reset();
+    exec(c, {"ZADD", "bz3", "1", "only"});
+    served = wait_list.TakeServed();
+    ASSERT_EQ(served.size(), 1);
+    ASSERT_EQ(served[0].first.lock(), b);
+    ASSERT_EQ(served[0].second, (json11::Json::array{"bz3", "only", "1"}));
+
+    // and nothing is left waiting on a key
+    exec(c, {"ZADD", "bz1", "1", "x", "2", "y"});
+    exec(c, {"ZADD", "bz3", "1", "z"});
+    ASSERT_TRUE(wait_list.TakeServed().empty());
+    ASSERT_EQ(exec(c, {"ZCARD", "bz1"}).value()[0], "2");
+}
+
+/* a client whose replies go to a socket pair, the peer end is returned */
+static auto socket_client(std::shared_ptr<rds::ClientInfo> *client) -> int
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    {
+        return -1;
+    }
+    int sndbuf = 64 * 1024;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+    *client = std::make_shared<rds::ClientInfo>(nullptr, fds[0]);
+    (*client)->SetDB(&database);
+    return fds[1];
+}
+
+/* what the sender does on EPOLLOUT, until every reply left or the peer is gone */
+static auto pump(const std::shared_ptr<rds::ClientInfo> &client) -> bool
+{
+    while (!client->IsSendOut() || client->IsParked())
+    {
+        if (client->Send() == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                return false;
+            }
+            pollfd pfd{client->GetFD(), POLLOUT, 0};
+            poll(&pfd, 1, 100);
+        }
+        client->Resume();
+    }
+    return true;
+}
+
+TEST(Command, StreamedReplies)
+{
+    constexpr int n = 30000;
+    std::shared_ptr<rds::ClientInfo> client;
+    int peer = socket_client(&client);
+    ASSERT_NE(peer, -1);
+    auto member = [](int i)
+    { return "member-" + std::string(96, 'x') + std::to_string(i); };
+    for (int i = 0; i < n; i++)
+    {
+        exec(client, {"ZADD", "bigrange", std::to_string(i), member(i)});
+        exec(client, {"HSET", "bighash", "field" + std::to_string(i), std::string(96, 'v')});
+    }
+    for (int i = 0; i < 1000; i++)
+    {
+        exec(client, {"ZADD", "lexrange", "0", "m" + std::to_string(1000 + i)});
+    }
+    constexpr std::size_t bound = rds::ReplyStream::SEND_HIGH_WATER + rds::ReplyStream::CHUNK_BYTES +
+                                  rds::ReplyStream::STEP_ELEMENTS * 160;
+
+    // nobody reads yet: the executor stops at the high water and goes on,
+    // the replies after a parked one wait behind it in order
+    ASSERT_FALSE(exec(client, {"ZRANGE", "bigrange", "0", "-1"}).has_value());
+    ASSERT_TRUE(client->IsParked());
+    ASSERT_LE(client->SendBytes(), bound);
+    ASSERT_FALSE(exec(client, {"ZREVRANGE", "bigrange", "0", "-1"}).has_value());
+    ASSERT_FALSE(exec(client, {"ZRANGEBYSCORE", "bigrange", "100", "100000", "LIMIT", "5", "20000"}).has_value());
+    ASSERT_FALSE(exec(client, {"ZRANGEBYLEX", "lexrange", "m1100", "m1999", "LIMIT", "10", "600"}).has_value());
+    ASSERT_FALSE(exec(client, {"HGETALL", "bighash"}).has_value());
+    auto missing = exec(client, {"ZRANGE", "nosuchkey", "0", "-1"});
+    client->Append(missing.value());
+    auto card = exec(client, {"ZCARD", "bigrange"});
+    client->Append(card.value());
+    ASSERT_LE(client->SendBytes(), bound);
+
+    // a slow reader, sampling how much is queued meanwhile
+    std::atomic_bool done{false};
+    std::atomic<std::size_t> peak{0};
+    std::string received;
+    std::thread reader([&]()
+                       {
+        char buf[16 * 1024];
+        while (true)
+        {
+            pollfd pfd{peer, POLLIN, 0};
+            if (poll(&pfd, 1, 100) == 0)
+            {
+                if (done)
+                {
+                    break;
+                }
+                continue;
+            }
+            auto r = read(peer, buf, sizeof buf);
+            if (r <= 0)
+            {
+                break;
+            }
+            received.append(buf, r);
+            peak = std::max(peak.load(), client->SendBytes());
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        } });
+    bool sent = pump(client);
+    done = true;
+    reader.join();
+    close(peer);
+    ASSERT_TRUE(sent);
+    ASSERT_LE(peak, bound);
+
+    std::string::size_type stop = 0;
+    std::string err;
+    auto replies = json11::Json::parse_multi(received, stop, err);
+    ASSERT_TRUE(err.empty()) << err;
+    ASSERT_EQ(replies.size(), 7);
+    auto &range = replies[0].array_items();
+    ASSERT_EQ(range.size(), 2 * n);
+    for (int i = 0; i < n; i++)
+    {
+        ASSERT_EQ(range[2 * i].string_value(), member(i));
+        ASSERT_EQ(range[2 * i + 1].string_value(), std::to_string(i));
+    }
+    auto &rev = replies[1].array_items();
+    ASSERT_EQ(rev.size(), 2 * n);
+    ASSERT_EQ(rev[0].string_value(), member(n - 1));
+    ASSERT_EQ(rev[2 * n - 2].string_value(), member(0));
+    auto &by_score = replies[2].array_items();
+    ASSERT_EQ(by_score.size(), 2 * 20000);
+    ASSERT_EQ(by_score[0].string_value(), member(105));
+    ASSERT_EQ(by_score.back().string_value(), std::to_string(105 + 20000 - 1));
+    auto &by_lex = replies[3].array_items();
+    ASSERT_EQ(by_lex.size(), 2 * 600);
+    ASSERT_EQ(by_lex[0].string_value(), "m1110");
+    ASSERT_EQ(by_lex[2 * 599].string_value(), "m1709");
+    ASSERT_EQ(replies[4].array_items().size(), 2 * n);
+    ASSERT_EQ(replies[5], json11::Json(json11::Json::array{" "}));
+    ASSERT_EQ(replies[6], json11::Json(json11::Json::array{std::to_string(n)}));
+}
+
+TEST(Command, StreamedReplyPeerGone)
+{
+    constexpr int n = 30000;
+    std::shared_ptr<rds::ClientInfo> client;
+    int peer = socket_client(&client);
+    ASSERT_NE(peer, -1);
+    for (int i = 0; i < n; i++)
+    {
+        exec(client, {"ZADD", "gonerange", std::to_string(i), "member-" + std::string(96, 'y') + std::to_string(i)});
+    }
+    close(peer);
+
+    // nothing waits on the socket, and the sender gives the client up
+    ASSERT_FALSE(exec(client, {"ZRANGE", "gonerange", "0", "-1"}).has_value());
+    ASSERT_LE(client->SendBytes(), rds::ReplyStream::SEND_HIGH_WATER + rds::ReplyStream::CHUNK_BYTES +
+                                       rds::ReplyStream::STEP_ELEMENTS * 160);
+    ASSERT_FALSE(pump(client));
+}
+
+TEST(Command, BlockingXRead)
+{
+    auto a = std::make_shared<rds::ClientInfo>();
+    auto c = std::make_shared<rds::ClientInfo>();
+    a->SetDB(&database);
+    c->SetDB(&database);
+
+    // a client gone while blocked forever is dropped, the others are served
+    auto gone = std::make_shared<rds::ClientInfo>();
+    gone->SetDB(&database);
+    ASSERT_FALSE(exec(gone, {"XREAD", "BLOCK", "0", "STREAMS", "xs1", "$"}).has_value());
+    ASSERT_FALSE(exec(a, {"XREAD", "BLOCK", "0", "STREAMS", "xs1", "$"}).has_value());
+    gone.reset();
+    auto id = exec(c, {"XADD", "xs1", "1-1", "f", "v"});
+    ASSERT_EQ(id.value()[0], "1-1");
+    auto served = rds::GetXReadWaitList().TakeServed();
+    ASSERT_EQ(served.size(), 1);
+    ASSERT_EQ(served[0].first.lock(), a);
+    ASSERT_EQ(json11::Json(served[0].second).dump(), R"([["xs1", [["1-1", ["f", "v"]]]]])");
+
+    // the reply is held for the executor, nothing was written to the client
+    ASSERT_EQ(a->AppendChunk({}), 0);
+    exec(c, {"XADD", "xs1", "1-2", "f", "w"});
+    ASSERT_TRUE(rds::GetXReadWaitList().TakeServed().empty());
+}
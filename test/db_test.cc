@@ -38,9 +38,8 @@ TEST(KeyValue, kv)
     KeyValue kv(key, std::move(v));
     kv.MakeExpireAt(100);
 
-    std::deque<char> src;
     std::string code = kv.Encode();
-    std::copy(code.cbegin(), code.cend(), std::back_inserter(src));
+    Cursor src(code);
 
     KeyValue kv2;
     kv2.Decode(&src);
@@ -82,8 +81,7 @@ TEST(Database, Db)
 
     auto dbfile = db.Save();
     print("dbfilesize: ", dbfile.size());
-    std::deque<char> cache;
-    std::copy(dbfile.cbegin(), dbfile.cend(), std::back_inserter(cache));
+    Cursor cache(dbfile);
 
     Db db2;
     db2.Load(&cache);
@@ -95,7 +93,177 @@ TEST(Database, Db)
         auto pos = db.key_value_map_.find(kv.first);
         ASSERT_NE(pos, db.key_value_map_.end());
     }
-    ASSERT_EQ(db.key_value_map_.size(), db2.key_value_map_.size());
+    // keys past their expire time are dropped while decoding
+    auto alive = std::count_if(db.key_value_map_.cbegin(), db.key_value_map_.cend(), [](auto &kv)
+                               { return !kv.second->IsExpire(); });
+    ASSERT_EQ(alive, db2.key_value_map_.size());
+}
+
+TEST(Database, ChunkedLoad)
+{
+    using namespace rds;
+
+    Db d1, d2;
+    for (std::size_t i = 0; i < 3 * Db::CHUNK_KEYS_ + 5; i++)
+    {
+        auto key = "key:" + std::to_string(i);
+        std::static_pointer_cast<Str>(d1.NewStr(Str(key)))->Set("value:" + std::to_string(i));
+    }
+    std::static_pointer_cast<Hash>(d2.NewHash(Str("user")))->Set(Str("name"), Str("rds"));
+
+    // a database saved before the chunk index, read with the same loader
+    std::string legacy;
+    legacy.push_back(Db::SELECT_DB_);
+    legacy.append(BitsToString(d2.Number()));
+    legacy.append(BitsToString(d2.key_value_map_.size()));
+    for (auto &kv : d2.key_value_map_)
+    {
+        legacy.append(kv.second->Encode());
+    }
+
+    std::string dbfile = "RDB" + d1.Save() + legacy;
+    Cursor source(dbfile);
+    auto loaded = RDBLoad(&source);
+    ASSERT_EQ(loaded.size(), 2);
+    auto &l1 = *loaded.front();
+    auto &l2 = *loaded.back();
+    ASSERT_EQ(l1.Number(), d1.Number());
+    ASSERT_EQ(l1.key_value_map_.size(), d1.key_value_map_.size());
+    for (auto &kv : d1.key_value_map_)
+    {
+        auto value = std::static_pointer_cast<Str>(l1.Get(kv.first).lock());
+        ASSERT_NE(value, nullptr);
+        ASSERT_EQ(value->GetRaw(), std::static_pointer_cast<Str>(kv.second->GetValue().lock())->GetRaw());
+    }
+    auto user = std::static_pointer_cast<Hash>(l2.Get(Str("user")).lock());
+    ASSERT_EQ(user->Get(Str("name")).GetRaw(), "rds");
+
+    // a cut through a chunk fails the whole load
+    std::string cut = dbfile.substr(0, dbfile.size() / 2);
+    Cursor broken(cut);
+    ASSERT_TRUE(RDBLoad(&broken).empty());
+}
+
+TEST(Database, RdbV2)
+{
+    using namespace rds;
+
+    Db d1;
+    for (std::size_t i = 0; i < 2 * Db::CHUNK_KEYS_; i++)
+    {
+        auto key = "key:" + std::to_string(i);
+        std::static_pointer_cast<Str>(d1.NewStr(Str(key)))->Set("value:" + std::to_string(i));
+    }
+    std::string v2;
+    RDBWrite([&v2](std::string_view bytes)
+             { v2.append(bytes); },
+             [&d1](const ByteSink &out)
+             { d1.Save(out); });
+    std::string v1 = "RDB" + d1.Save();
+    ASSERT_EQ(v2[3], RDB_VERSION);
+    ASSERT_LT(v2.size(), v1.size() / 2);
+
+    for (auto *file : {&v1, &v2})
+    {
+        Cursor source(*file);
+        auto loaded = RDBLoad(&source);
+        ASSERT_EQ(loaded.size(), 1);
+        ASSERT_EQ(loaded.front()->Number(), d1.Number());
+        ASSERT_EQ(loaded.front()->key_value_map_.size(), d1.key_value_map_.size());
+        auto value = std::static_pointer_cast<Str>(loaded.front()->Get(Str("key:77")).lock());
+        ASSERT_EQ(value->GetRaw(), "value:77");
+    }
+
+    // a section with the fixed width header of the first chunked rdb
+    std::string chunk;
+    for (auto &kv : d1.key_value_map_)
+    {
+        chunk.append(kv.second->Encode());
+    }
+    std::string fixed = "RDB";
+    fixed.push_back(Db::SELECT_DB_CHUNKED_);
+    fixed.append(BitsToString(d1.Number()));
+    fixed.append(BitsToString(d1.key_value_map_.size()));
+    fixed.append(BitsToString(std::size_t{1}));
+    fixed.append(BitsToString(d1.key_value_map_.size()));
+    fixed.append(BitsToString(chunk.size()));
+    fixed.append(chunk);
+    Cursor old_source(fixed);
+    auto old_loaded = RDBLoad(&old_source);
+    ASSERT_EQ(old_loaded.size(), 1);
+    ASSERT_EQ(old_loaded.front()->key_value_map_.size(), d1.key_value_map_.size());
+
+    // a flipped byte or a missing end fails the load instead of giving less
+    std::string flipped = v2;
+    flipped[flipped.size() / 2] ^= 0x20;
+    Cursor flipped_source(flipped);
+    bool ok = true;
+    ASSERT_TRUE(RDBLoad(&flipped_source, &ok).empty());
+    ASSERT_FALSE(ok);
+    Cursor cut_source(std::string_view(v2).substr(0, v2.size() - 1));
+    ASSERT_TRUE(RDBLoad(&cut_source, &ok).empty());
+    ASSERT_FALSE(ok);
+    Cursor empty_source;
+    ASSERT_TRUE(RDBLoad(&empty_source, &ok).empty());
+    ASSERT_TRUE(ok);
+
+    // more blocks than one batch of the reader and more chunk bytes than one
+    // decode batch, a payload that is never inflated whole
+    Db d2;
+    std::string filler(200, 'f');
+    for (std::size_t i = 0; i < 100'000; i++)
+    {
+        auto key = "big:" + std::to_string(i);
+        std::static_pointer_cast<Str>(d2.NewStr(Str(key)))->Set(filler + std::to_string(i));
+    }
+    std::string big;
+    RDBWrite([&big](std::string_view bytes)
+             { big.append(bytes); },
+             [&d1, &d2](const ByteSink &out)
+             { d1.Save(out); d2.Save(out); });
+    Cursor big_source(big);
+    auto big_loaded = RDBLoad(&big_source, &ok);
+    ASSERT_TRUE(ok);
+    ASSERT_EQ(big_loaded.size(), 2);
+    ASSERT_EQ(big_loaded.back()->key_value_map_.size(), d2.key_value_map_.size());
+    auto value = std::static_pointer_cast<Str>(big_loaded.back()->Get(Str("big:99999")).lock());
+    ASSERT_EQ(value->GetRaw(), filler + "99999");
+}
+
+TEST(Database, CompressIdleIncremental)
+{
+    using namespace rds;
+
+    Db d;
+    std::string filler;
+    for (int i = 0; filler.size() < 4096; i++)
+    {
+        filler.append("field-" + std::to_string(i % 50) + ",");
+    }
+    constexpr std::size_t n = 10 * Db::COMPRESS_SCAN_KEYS;
+    for (std::size_t i = 0; i < n; i++)
+    {
+        std::static_pointer_cast<Str>(d.NewStr(Str("cold:" + std::to_string(i))))->Set(filler + std::to_string(i));
+    }
+
+    // each call looks at about a budget of keys, the sweep goes on where it stopped
+    std::size_t total = 0;
+    std::size_t calls = 0;
+    while (total < n)
+    {
+        auto done = d.CompressIdle(1024, 0, Db::COMPRESS_SCAN_KEYS);
+        ASSERT_LE(done, Db::COMPRESS_SCAN_KEYS + 64);
+        total += done;
+        ASSERT_LT(++calls, 2 * n / Db::COMPRESS_SCAN_KEYS);
+    }
+    ASSERT_EQ(total, n);
+    ASSERT_EQ(d.CompressIdle(1024, 0, n), 0);
+    for (auto &kv : d.key_value_map_)
+    {
+        auto value = std::static_pointer_cast<Str>(kv.second->GetValue().lock());
+        ASSERT_EQ(value->GetEncodingType(), EncodingType::STR_COMPRESS);
+        ASSERT_EQ(value->GetRaw(), filler + kv.first.GetRaw().substr(5));
+    }
 }
 
 #endif
\ No newline at end of file
@@ -2,17 +2,301 @@
 #include <database/disk.h>
 #include <database/db.h>
 #include <database/rdb.h>
+#include <database/aof.h>
 #include <objects/list.h>
 #include <objects/set.h>
 #include <objects/zset.h>
 #include <objects/hash.h>
 #include "util4test.h"
+#include <filesystem>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <chrono>
 using namespace rds;
 
 TEST(Disk, FileManager)
 {
+    std::string name = "manager_test.db";
+    std::filesystem::remove(name);
+    FileManager fm(name);
+    ASSERT_EQ(fm.Size(), 0);
+    for (int i = 0; i < 100; i++)
+    {
+        fm.Write("record" + std::to_string(i) + "\n");
+    }
+    fm.Sync();
+    auto mapped = fm.Map();
+    ASSERT_EQ(mapped->Bytes().substr(0, 8), "record0\n");
+    ASSERT_EQ(fm.Size(), mapped->Bytes().size());
+
+    // the descriptor follows the file
+    fm.Change("manager_test2.db");
+    fm.Write("other");
+    ASSERT_EQ(fm.Size(), 5);
+    std::filesystem::remove(name);
+    std::filesystem::remove("manager_test2.db");
+}
+
+TEST(Disk, FileWriter)
+{
+    std::string name = "writer_test.db";
+    FileManager fm(name);
+    fm.Write("old contents");
+
+    // an abandoned writer leaves the file as it was
+    {
+        auto out = fm.Rewrite();
+        out->Append("partial");
+        ASSERT_TRUE(std::filesystem::exists(name + ".tmp"));
+    }
+    ASSERT_FALSE(std::filesystem::exists(name + ".tmp"));
+    ASSERT_EQ(fm.Size(), std::string("old contents").size());
+
+    std::string big(3 << 20, 'x');
+    auto out = fm.Rewrite();
+    out->Append("head");
+    out->Append(big);
+    out->Append("tail");
+    ASSERT_EQ(out->Written(), big.size() + 8);
+    out->Sync();
+    ASSERT_EQ(std::filesystem::file_size(name + ".tmp"), big.size() + 8);
+    out->Commit();
+    ASSERT_FALSE(std::filesystem::exists(name + ".tmp"));
+    auto stats = out->Stats();
+    ASSERT_EQ(stats.bytes_, big.size() + 8);
+    ASSERT_EQ(stats.flushes_, 4);
+    ASSERT_EQ(stats.syncs_, 2);
+    ASSERT_GT(stats.Throughput(), 0);
+
+    auto mapped = fm.Map();
+    ASSERT_EQ(mapped->Bytes(), "head" + big + "tail");
+    std::filesystem::remove(name);
 }
 
 TEST(Disk, Rdb)
 {
-}
\ No newline at end of file
+}
+
+TEST(Disk, BackgroundSave)
+{
+    std::string name = "bgsave_test.db";
+    FileManager fm(name);
+    std::string payload(1 << 16, 'p');
+    std::size_t dirty = 0;
+    RdbSaver saver([&payload](const ByteSink &out)
+                   { out(payload); },
+                   [&dirty]()
+                   { return dirty; },
+                   &fm, {{0, 3}});
+    ASSERT_FALSE(saver.Due());
+    dirty = 3;
+    ASSERT_TRUE(saver.Due());
+    ASSERT_EQ(saver.Changes(), 3);
+    auto before = saver.LastSave();
+    ASSERT_TRUE(saver.Request());
+    for (int i = 0; i < 500 && saver.Saves() == 0; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_EQ(saver.Saves(), 1);
+    ASSERT_TRUE(saver.LastOk());
+    ASSERT_GE(saver.LastSave(), before);
+    ASSERT_EQ(saver.Changes(), 0);
+    ASSERT_FALSE(saver.Due());
+
+    // the child wrote its copy, the file is complete
+    auto mapped = fm.Map();
+    Cursor source(mapped->Bytes());
+    ASSERT_EQ(PeekString(&source, 3), "RDB");
+    ASSERT_EQ(source.front(), RDB_VERSION);
+    source.pop_front();
+    ASSERT_EQ(RDBReadBlocks(&source), payload);
+    ASSERT_TRUE(source.empty());
+    std::filesystem::remove(name);
+}
+TEST(Disk, Aof)
+{
+    std::string name = "aof_test.aof";
+    std::filesystem::remove(name);
+    {
+        AofWriter aof(name, AppendFsync::ALWAYS);
+        aof.Begin();
+        aof.Feed(0, R"(["ZPOPMIN","z"])");
+        aof.FeedCommand(0, R"(["SET","a","1"])"); // goes ahead of what its command fed
+        aof.Begin();
+        aof.FeedCommand(2, R"(["SADD","s","x"])");
+        ASSERT_TRUE(aof.Pending());
+        ASSERT_TRUE(aof.Commit());
+        ASSERT_FALSE(aof.Pending());
+        ASSERT_EQ(aof.Size(), std::filesystem::file_size(name));
+        ASSERT_EQ(aof.Synced(), aof.Size());
+    }
+
+    std::vector<std::pair<int, std::string>> records;
+    auto apply = [&records](int db, std::string_view request)
+    {
+        records.emplace_back(db, std::string(request));
+    };
+    auto size = std::filesystem::file_size(name);
+    {
+        MappedFile mapped(name);
+        Cursor source(mapped.Bytes());
+        std::list<std::unique_ptr<Db>> databases;
+        ASSERT_EQ(AOFLoad(&source, &databases, apply), size);
+        ASSERT_TRUE(databases.empty());
+    }
+    ASSERT_EQ(records.size(), 3);
+    ASSERT_EQ(records[0], std::make_pair(0, std::string(R"(["SET","a","1"])")));
+    ASSERT_EQ(records[1], std::make_pair(0, std::string(R"(["ZPOPMIN","z"])")));
+    ASSERT_EQ(records[2], std::make_pair(2, std::string(R"(["SADD","s","x"])")));
+
+    // a crash in the middle of the last record
+    std::filesystem::resize_file(name, size - 3);
+    records.clear();
+    {
+        MappedFile mapped(name);
+        Cursor source(mapped.Bytes());
+        std::list<std::unique_ptr<Db>> databases;
+        auto good = AOFLoad(&source, &databases, apply);
+        ASSERT_EQ(records.size(), 2);
+        ASSERT_EQ(good, size - 2 - std::string(R"(["SADD","s","x"])").size());
+    }
+    std::filesystem::remove(name);
+
+    // a full disk: nothing is acknowledged, the records wait for the next Commit
+    if (std::filesystem::exists("/dev/full"))
+    {
+        AofWriter full("/dev/full", AppendFsync::NO);
+        ASSERT_FALSE(full.Healthy());
+        full.Begin();
+        full.FeedCommand(0, R"(["SET","a","1"])");
+        ASSERT_FALSE(full.Commit());
+        ASSERT_TRUE(full.Pending());
+        ASSERT_FALSE(full.Healthy());
+    }
+}
+
+TEST(Disk, AofRewrite)
+{
+    std::string name = "aof_rewrite_test.aof";
+    std::string path = name + ".rewrite";
+    std::filesystem::remove(name);
+    auto load = [&name](std::list<std::unique_ptr<Db>> *databases)
+    {
+        std::vector<std::string> records;
+        MappedFile mapped(name);
+        Cursor source(mapped.Bytes());
+        auto good = AOFLoad(&source, databases, [&records](int, std::string_view request)
+                            { records.emplace_back(request); });
+        EXPECT_EQ(good, mapped.Bytes().size());
+        return records;
+    };
+
+    {
+        AofWriter aof(name, AppendFsync::NO);
+        aof.Begin();
+        aof.Feed(0, "A"); // in the snapshot, not yet in the aof
+        aof.StartRewrite();
+        aof.Begin();
+        aof.Feed(0, "B");
+        aof.Commit();
+
+        std::string preamble = "AOP"; // as written before rdb v2
+        PutVarint(&preamble, 0);
+        FileWriter child(path);
+        child.Append(preamble);
+        child.Commit();
+        int fd = open(path.c_str(), O_WRONLY | O_APPEND);
+        ASSERT_NE(fd, -1);
+
+        aof.Begin();
+        aof.Feed(0, "C");
+        aof.Commit();
+        auto kept = aof.TakeRewriteBuffer();
+        ASSERT_EQ(write(fd, kept.data(), kept.size()), kept.size());
+        aof.Begin();
+        aof.Feed(0, "D");
+        aof.Commit();
+        ASSERT_TRUE(aof.FinishRewrite(fd, path));
+        ASSERT_FALSE(std::filesystem::exists(path));
+        aof.Begin();
+        aof.Feed(0, "E"); // goes to the new file
+        aof.Commit();
+        ASSERT_EQ(aof.Size(), std::filesystem::file_size(name));
+    }
+    std::list<std::unique_ptr<Db>> databases;
+    ASSERT_EQ(load(&databases), std::vector<std::string>({"B", "C", "D", "E"}));
+
+    // the whole way through a forked child
+    Db db;
+    std::static_pointer_cast<Str>(db.NewStr(Str("key")))->Set("value");
+    {
+        AofWriter aof(name, AppendFsync::ALWAYS);
+        AofRewriter rewriter([&db](const ByteSink &out)
+                             { db.Save(out); },
+                             &aof, 0, 100);
+        ASSERT_FALSE(rewriter.Due());
+        for (int i = 0; i < 10; i++)
+        {
+            aof.Begin();
+            aof.Feed(db.Number(), R"(["SET","key","value"])");
+            aof.Commit();
+        }
+        ASSERT_TRUE(rewriter.Due());
+        ASSERT_TRUE(rewriter.Request());
+        for (int i = 0; i < 500 && rewriter.Rewrites() == 0; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        ASSERT_EQ(rewriter.Rewrites(), 1);
+        ASSERT_TRUE(rewriter.LastOk());
+        ASSERT_EQ(rewriter.BaseSize(), aof.Size());
+        ASSERT_FALSE(rewriter.Due());
+    }
+    databases.clear();
+    ASSERT_TRUE(load(&databases).empty());
+    ASSERT_EQ(databases.size(), 1);
+    auto value = std::static_pointer_cast<Str>(databases.front()->Get(Str("key")).lock());
+    ASSERT_NE(value, nullptr);
+    ASSERT_EQ(value->GetRaw(), "value");
+    std::filesystem::remove(name);
+}
+
+TEST(Disk, ConfDefaults)
+{
+    using namespace rds;
+    auto defaults = DefaultConf();
+    auto load = [](const std::string &json)
+    {
+        {
+            std::ofstream out("redis-conf.json", std::ios::trunc);
+            out << json;
+        }
+        auto conf = LoadConf();
+        std::filesystem::remove("redis-conf.json");
+        return conf;
+    };
+
+    // keys left out keep their defaults
+    auto conf = load(R"({"port": 9000, "aofrewritepercent": 0, "save": []})");
+    ASSERT_TRUE(conf.has_value());
+    ASSERT_EQ(conf->port_, 9000);
+    ASSERT_EQ(conf->ip_, defaults.ip_);
+    ASSERT_EQ(conf->zset_array_.max_entries_, defaults.zset_array_.max_entries_);
+    ASSERT_EQ(conf->zset_array_.max_value_len_, defaults.zset_array_.max_value_len_);
+    ASSERT_EQ(conf->aof_rewrite_.min_size_, defaults.aof_rewrite_.min_size_);
+    ASSERT_EQ(conf->str_compress_.idle_sec_, defaults.str_compress_.idle_sec_);
+    // while the ones given, even 0 or empty, are taken
+    ASSERT_EQ(conf->aof_rewrite_.percent_, 0);
+    ASSERT_TRUE(conf->save_rules_.empty());
+
+    conf = load(R"({"zsetentries": 16, "save": [[10, 1]]})");
+    ASSERT_TRUE(conf.has_value());
+    ASSERT_EQ(conf->zset_array_.max_entries_, 16);
+    ASSERT_EQ(conf->zset_array_.max_value_len_, defaults.zset_array_.max_value_len_);
+    ASSERT_EQ(conf->aof_rewrite_.percent_, defaults.aof_rewrite_.percent_);
+    ASSERT_EQ(conf->save_rules_.size(), 1);
+    ASSERT_EQ(conf->save_rules_[0], std::make_pair(std::size_t{10}, std::size_t{1}));
+}
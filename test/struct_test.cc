@@ -2,17 +2,28 @@
 #include <gtest/gtest.h>
 #include <vector>
 #include <util.h>
+#include <codec.h>
 #include <objects/list.h>
 #include <objects/set.h>
 #include <objects/zset.h>
 #include <objects/hash.h>
+#include <objects/hyperloglog.h>
+#include <objects/bloom.h>
+#include <objects/stream.h>
+#include <objects/timeseries.h>
+#include <objects/vectorset.h>
+#include <objects/vecops.h>
+#include <objects/cms.h>
+#include <objects/topk.h>
+#include <random>
+#include <thread>
 
 void CheckWhat(const std::string &what)
 {
     std::cout << "check: " << what << std::endl;
 }
 
-void EncodeInt(const std::string &int_str, std::deque<char> &int_cache)
+void EncodeInt(const std::string &int_str, std::string &int_cache)
 {
     using namespace rds;
 
@@ -24,10 +35,10 @@ void EncodeInt(const std::string &int_str, std::deque<char> &int_cache)
 
     ASSERT_EQ(int_encode.size(), sizeof(int) + sizeof(char));
 
-    int_cache.insert(int_cache.end(), int_encode.cbegin(), int_encode.cend());
+    int_cache.append(int_encode);
 }
 
-void EncodeRaw(const std::string &raw_str, std::deque<char> &str_cache)
+void EncodeRaw(const std::string &raw_str, std::string &str_cache)
 {
     using namespace rds;
 
@@ -42,10 +53,10 @@ void EncodeRaw(const std::string &raw_str, std::deque<char> &str_cache)
         ASSERT_EQ(str_encode.size(), raw_str.size() + sizeof(size_t) + sizeof(char));
     }
 
-    str_cache.insert(str_cache.end(), str_encode.cbegin(), str_encode.cend());
+    str_cache.append(str_encode);
 }
 
-void Decode(const std::string &data, std::deque<char> &str_cache, rds::EncodingType etyp)
+void Decode(const std::string &data, rds::Cursor &str_cache, rds::EncodingType etyp)
 {
     using namespace rds;
 
@@ -96,11 +107,33 @@ auto RandIntArr(int num) -> std::vector<std::string>
 TEST(Structs, CompressAndDecompress)
 {
     std::string raw{"flkjdhsalkfhdaskljhfdlkjsahfkdhafkjdhlakjshflkjsaflkjdhsalkfhdaskljhfdlkjsahfkdhafkjdhlakjshflkjsa"};
-    std::string cmprs = rds::Compress(raw);
+    std::string cmprs = rds::Compress(raw).value();
     std::cout << "after compress:" << cmprs.size() << std::endl;
-    std::string dcmprs = rds::Decompress(cmprs);
+    std::string dcmprs = rds::Decompress(cmprs, raw.size()).value();
     ASSERT_NE(dcmprs, cmprs);
     ASSERT_EQ(raw, dcmprs) << "dcprs size:" << dcmprs.size();
+    ASSERT_FALSE(rds::Decompress(cmprs, raw.size() - 1).has_value());
+    ASSERT_FALSE(rds::Decompress(cmprs, raw.size() + 1).has_value());
+
+    // thresholds: too small, not shrinking enough, not shrinking at all
+    ASSERT_FALSE(rds::Compress(raw, {raw.size() + 1}).has_value());
+    ASSERT_FALSE(rds::Compress(raw, {1, 0.01}).has_value());
+    std::mt19937_64 gen(7);
+    std::string noise(4096, '\0');
+    for (auto &c : noise)
+    {
+        c = static_cast<char>(gen());
+    }
+    ASSERT_FALSE(rds::Compress(noise).has_value());
+
+    // scratch buffers are reused, not allocated per call
+    for (int i = 0; i < 100; i++)
+    {
+        ASSERT_EQ(rds::Decompress(rds::Compress(raw).value(), raw.size()).value(), raw);
+    }
+    auto none = rds::GetCodec(rds::CodecId::NONE);
+    ASSERT_STREQ(none->Name(), "none");
+    ASSERT_EQ(rds::Decompress(raw, raw.size(), rds::CodecId::NONE).value(), raw);
 
     CheckWhat("third-lzf");
     CheckWhat("\n");
@@ -110,21 +143,23 @@ TEST(Structs, Str)
 {
     using namespace rds;
     EnCompress();
-    std::deque<char> cache;
+    std::string encoded;
 
     auto raw_str_src = RandStrArr(100);
     auto int_str_src = RandIntArr(100);
 
     for (auto &s : raw_str_src)
     {
-        EncodeRaw(s, cache);
+        EncodeRaw(s, encoded);
     }
 
     for (auto &s : int_str_src)
     {
-        EncodeInt(s, cache);
+        EncodeInt(s, encoded);
     }
 
+    Cursor cache(encoded);
+
     for (auto &s : raw_str_src)
     {
         Decode(s, cache, EncodingType::STR_RAW);
@@ -138,6 +173,192 @@ TEST(Structs, Str)
     CheckWhat("\n");
 }
 
+TEST(Structs, StrInt)
+{
+    using namespace rds;
+    DisCompress();
+
+    // only canonical integers are kept native
+    ASSERT_EQ(Str(std::string("007")).GetEncodingType(), EncodingType::STR_RAW);
+    ASSERT_EQ(Str(std::string("-0")).GetEncodingType(), EncodingType::STR_RAW);
+    ASSERT_EQ(Str(std::string("")).GetEncodingType(), EncodingType::STR_RAW);
+    ASSERT_EQ(Str(std::string("99999999999999999999")).GetEncodingType(), EncodingType::STR_RAW);
+    ASSERT_EQ(Str(std::string("-42")).GetInt().value(), -42);
+
+    // past int32 the value is written as digits and comes back native
+    Str big(std::string("9223372036854775807"));
+    ASSERT_EQ(big.GetEncodingType(), EncodingType::INT);
+    ASSERT_EQ(big.Len(), 19);
+    std::string ev = big.EncodeValue();
+    Cursor cache(ev);
+    Str dcd;
+    dcd.DecodeValue(&cache);
+    ASSERT_EQ(dcd, big);
+    ASSERT_TRUE(big.IncrBy(1).empty());
+    ASSERT_EQ(big.IncrBy(-7), "9223372036854775800");
+
+    // ordering stays lexicographic
+    ASSERT_TRUE(Str(std::string("10")) < Str(std::string("9")));
+    ASSERT_TRUE(Str(std::string("10")) < Str(std::string("a")));
+
+    Str s(std::string("41"));
+    ASSERT_EQ(s.IncrBy(1), "42");
+    ASSERT_EQ(s.Append("1"), 3);
+    ASSERT_EQ(s.GetInt().value(), 421);
+    ASSERT_EQ(s.IncrByFloat(0.5), "421.5");
+    ASSERT_EQ(s.GetEncodingType(), EncodingType::STR_RAW);
+    ASSERT_EQ(s.IncrByFloat(-0.5), "421");
+    ASSERT_EQ(s.GetEncodingType(), EncodingType::INT);
+
+    auto shared = SharedInteger(9999);
+    ASSERT_TRUE(shared->IsShared());
+    ASSERT_EQ(shared, SharedInteger(9999));
+    ASSERT_EQ(SharedInteger(SHARED_INTEGERS), nullptr);
+    ASSERT_FALSE(Str(*shared).IsShared());
+}
+
+TEST(Structs, StrCompressInMemory)
+{
+    using namespace rds;
+    DisCompress();
+
+    std::string raw;
+    for (int i = 0; raw.size() < 64 * 1024; i++)
+    {
+        raw.append("field-" + std::to_string(i % 100) + ",");
+    }
+    Str s(raw);
+    Str plain(raw);
+    ASSERT_FALSE(s.CompressInPlace(raw.size() + 1));
+    ASSERT_TRUE(s.CompressInPlace(1024));
+    ASSERT_EQ(s.GetEncodingType(), EncodingType::STR_COMPRESS);
+    ASSERT_FALSE(s.CompressInPlace(1024));
+    ASSERT_LT(s.EncodeValue().size(), raw.size() / 4);
+
+    // reads see the original bytes, equal values hash alike
+    ASSERT_EQ(s.GetRaw(), raw);
+    ASSERT_EQ(s.Len(), raw.size());
+    ASSERT_EQ(s, plain);
+    ASSERT_EQ(StrHash(s), StrHash(plain));
+    ASSERT_EQ(s.BitCount(0, -1, false), plain.BitCount(0, -1, false));
+    ASSERT_EQ(s.GetBit(9), plain.GetBit(9));
+
+    std::string ev = s.EncodeValue();
+    Cursor cache(ev);
+    Str dcd;
+    dcd.DecodeValue(&cache);
+    ASSERT_EQ(dcd.GetEncodingType(), EncodingType::STR_RAW);
+    ASSERT_EQ(dcd.GetRaw(), raw);
+
+    // a write inflates it again
+    ASSERT_EQ(s.Append("tail"), raw.size() + 4);
+    ASSERT_EQ(s.GetEncodingType(), EncodingType::STR_RAW);
+    ASSERT_EQ(s.GetRaw(), raw + "tail");
+
+    std::mt19937 gen(7);
+    std::string noise(8192, '\0');
+    for (auto &c : noise)
+    {
+        c = static_cast<char>(gen());
+    }
+    Str random(noise);
+    ASSERT_FALSE(random.CompressInPlace(1024));
+    ASSERT_EQ(random.GetEncodingType(), EncodingType::STR_RAW);
+}
+
+TEST(Structs, CursorTruncated)
+{
+    using namespace rds;
+    EnCompress();
+
+    Hash h;
+    h.Set(Str("name"), Str(std::string(4096, 'a')));
+    h.Set(Str("count"), Str("42"));
+    std::string ev = h.EncodeValue();
+
+    Cursor whole(ev);
+    Hash dcd;
+    dcd.DecodeValue(&whole);
+    ASSERT_TRUE(whole.empty());
+    ASSERT_EQ(dcd.Get(Str("count")).GetRaw(), "42");
+
+    // every cut of the encoding is refused instead of read past its end
+    for (std::size_t cut = 0; cut < ev.size(); cut += 7)
+    {
+        Cursor part(std::string_view(ev).substr(0, cut));
+        Hash broken;
+        ASSERT_THROW(broken.DecodeValue(&part), std::out_of_range);
+    }
+    DisCompress();
+}
+
+TEST(Structs, Bitmap)
+{
+    using namespace rds;
+
+    std::string raw(100003, '\0');
+    for (auto &c : raw)
+    {
+        c = static_cast<char>(rand());
+    }
+    Str bm(raw);
+    auto naiveBit = [&raw](std::size_t i)
+    { return (static_cast<unsigned char>(raw[i / 8]) >> (7 - i % 8)) & 1; };
+
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < raw.size() * 8; i++)
+    {
+        total += naiveBit(i);
+    }
+    ASSERT_EQ(bm.BitCount(0, -1, false), total);
+    ASSERT_EQ(bm.BitCount(0, -1, true), total);
+
+    std::size_t partial = 0;
+    for (std::size_t i = 13; i <= 77777; i++)
+    {
+        partial += naiveBit(i);
+    }
+    ASSERT_EQ(bm.BitCount(13, 77777, true), partial);
+    ASSERT_EQ(bm.BitCount(-1, -2, false), 0);
+
+    // a single set bit far into a zero string
+    Str sparse;
+    sparse.SetBit(800001, true);
+    ASSERT_EQ(sparse.GetBit(800001), 1);
+    ASSERT_EQ(sparse.GetBit(800000), 0);
+    ASSERT_EQ(sparse.BitPos(true, 0, {}, false), 800001);
+    ASSERT_EQ(sparse.BitPos(true, 800002, {}, true), -1);
+    ASSERT_EQ(sparse.BitPos(false, 0, {}, false), 0);
+    ASSERT_EQ(sparse.SetBit(800001, false), 1);
+
+    Str ones(std::string(4096, '\xff'));
+    ASSERT_EQ(ones.BitPos(false, 0, {}, false), 4096 * 8);
+    ASSERT_EQ(ones.BitPos(false, 0, -1, false), -1);
+
+    Str field;
+    field.SetBits(5, 12, 0xabc);
+    ASSERT_EQ(field.GetBits(5, 12, false), 0xabc);
+    ASSERT_EQ(field.GetBits(5, 12, true), 0xabc - 0x1000);
+    field.SetBits(64, 64, static_cast<std::uint64_t>(-3));
+    ASSERT_EQ(field.GetBits(64, 64, true), -3);
+
+    std::string other(777, '\x0f');
+    Str b(other);
+    auto land = StrBitOp(BitOperation::AND, {&bm, &b});
+    auto lor = StrBitOp(BitOperation::OR, {&bm, &b, nullptr});
+    auto lnot = StrBitOp(BitOperation::NOT, {&b});
+    ASSERT_EQ(land.size(), raw.size());
+    ASSERT_EQ(lor.size(), raw.size());
+    for (std::size_t i = 0; i < raw.size(); i++)
+    {
+        char o = i < other.size() ? other[i] : 0;
+        ASSERT_EQ(land[i], static_cast<char>(raw[i] & o));
+        ASSERT_EQ(lor[i], static_cast<char>(raw[i] | o));
+    }
+    ASSERT_EQ(lnot, std::string(777, '\xf0'));
+    CheckWhat(std::string("bitops: ") + BitOpsImplementation());
+}
+
 TEST(Structs, List)
 {
     using namespace rds;
@@ -150,8 +371,7 @@ TEST(Structs, List)
     }
 
     std::string s = l.EncodeValue();
-    std::deque<char> cache;
-    std::copy(std::cbegin(s), std::cend(s), std::back_inserter(cache));
+    Cursor cache(s);
 
     List l2;
     l2.DecodeValue(&cache);
@@ -198,8 +418,7 @@ TEST(Structs, Set)
         s.Add(str);
     }
     std::string ev = s.EncodeValue();
-    std::deque<char> cache;
-    std::copy(std::cbegin(ev), std::cend(ev), std::back_inserter(cache));
+    Cursor cache(ev);
 
     Set s2;
     s2.DecodeValue(&cache);
@@ -263,8 +482,7 @@ TEST(Structs, ZSet)
         s.Add(i, str);
     }
     std::string ev = s.EncodeValue();
-    std::deque<char> cache;
-    std::copy(std::cbegin(ev), std::cend(ev), std::back_inserter(cache));
+    Cursor cache(ev);
     Log("zset construct");
 
     ZSet s2;
@@ -335,6 +553,609 @@ TEST(Structs, ZSet)
     CheckWhat("\n");
 }
 
+TEST(Structs, ZSetRank)
+{
+    using namespace rds;
+    ZSet s;
+    for (int i = 999; i >= 0; i--)
+    {
+        s.Add(i * 2, {std::to_string(i)});
+    }
+    for (int i = 0; i < 1000; i++)
+    {
+        ASSERT_EQ(s.Rank({std::to_string(i)}), std::to_string(i));
+    }
+    CheckWhat("zset rank");
+
+    ASSERT_EQ(s.Count(10, 20), 6);
+    ASSERT_EQ(s.Count(11, 11), 0);
+    auto first = s.Range(0, 0);
+    ASSERT_EQ(first.size(), 1);
+    ASSERT_EQ(first[0].second, 0);
+    auto rev = s.RevRange(0, 9);
+    ASSERT_EQ(rev.size(), 10);
+    for (int i = 0; i < 10; i++)
+    {
+        ASSERT_EQ(rev[i].second, (999 - i) * 2);
+    }
+    CheckWhat("zset range by rank");
+
+    for (int i = 0; i < 1000; i += 2)
+    {
+        ASSERT_TRUE(s.Rem(i * 2, {std::to_string(i)}));
+    }
+    ASSERT_EQ(s.Card(), 500);
+    for (int i = 1; i < 1000; i += 2)
+    {
+        ASSERT_EQ(s.Rank({std::to_string(i)}), std::to_string(i / 2));
+    }
+    s.Add(-1, {std::to_string(999)});
+    ASSERT_EQ(s.Rank({std::to_string(999)}), "0");
+    ASSERT_EQ(s.Card(), 500);
+    CheckWhat("zset rem and update");
+    CheckWhat("\n");
+}
+
+TEST(Structs, ZSetArray)
+{
+    using namespace rds;
+    ZSet s;
+    std::size_t n = ZSetArrayMaxEntries();
+    for (std::size_t i = 0; i < n; i++)
+    {
+        s.Add(static_cast<int>(n - i), {std::to_string(i)});
+    }
+    ASSERT_EQ(s.GetEncodingType(), EncodingType::ARRAY);
+    ASSERT_EQ(s.Rank({std::to_string(n - 1)}), "0");
+    ASSERT_EQ(s.Count(1, 10), 10);
+    ASSERT_EQ(s.IncrBy(static_cast<int>(n), {std::to_string(n - 1)}), std::to_string(n + 1));
+    ASSERT_EQ(s.RevRange(0, 0)[0].first, Str(std::to_string(n - 1)));
+
+    std::string ev = s.EncodeValue();
+    Cursor cache(ev);
+    ZSet s2;
+    s2.DecodeValue(&cache);
+    ASSERT_EQ(s2.GetEncodingType(), EncodingType::ARRAY);
+    ASSERT_EQ(s2.Card(), n);
+    ASSERT_TRUE(cache.empty());
+    CheckWhat("zset array en-de-code");
+
+    s.Add(0, {std::to_string(n)});
+    ASSERT_EQ(s.GetEncodingType(), EncodingType::RBTREE);
+    ASSERT_EQ(s.Card(), n + 1);
+    ASSERT_EQ(s.Rank({std::to_string(n)}), "0");
+    ASSERT_EQ(s.Range(-1, -1)[0].first, Str(std::to_string(n - 1)));
+
+    s2.Add(0, {std::string(ZSetArrayMaxValueLen() + 1, 'a')});
+    ASSERT_EQ(s2.GetEncodingType(), EncodingType::RBTREE);
+    ASSERT_EQ(s2.Card(), n + 1);
+    CheckWhat("zset array promote");
+    CheckWhat("\n");
+}
+
+TEST(Structs, ZSetCombine)
+{
+    using namespace rds;
+    ZSet a, b;
+    for (int i = 0; i < 50000; i++)
+    {
+        a.Add(i, {std::to_string(i)});
+    }
+    for (int i = 25000; i < 75000; i++)
+    {
+        b.Add(1, {std::to_string(i)});
+    }
+
+    auto uni = ZSetCombine(ZStoreOp::UNION, {&a, &b, nullptr}, {2, 3}, ZAggregate::SUM);
+    ASSERT_EQ(uni.size(), 75000);
+    ASSERT_TRUE(std::is_sorted(uni.cbegin(), uni.cend(), [](const ZArrayEntry &x, const ZArrayEntry &y)
+                               { return x.score_ < y.score_; }));
+    for (auto &e : uni)
+    {
+        int i = std::stoi(e.member_);
+        int expect = (i < 50000 ? i * 2 : 0) + (i >= 25000 ? 3 : 0);
+        ASSERT_EQ(e.score_, expect) << e.member_;
+    }
+    CheckWhat("zset union");
+
+    auto inter = ZSetCombine(ZStoreOp::INTER, {&a, &b}, {}, ZAggregate::MAX);
+    ASSERT_EQ(inter.size(), 25000);
+    for (auto &e : inter)
+    {
+        ASSERT_EQ(e.score_, std::max(std::stoi(e.member_), 1));
+    }
+    CheckWhat("zset inter");
+
+    auto diff = ZSetCombine(ZStoreOp::DIFF, {&a, &b}, {}, ZAggregate::SUM);
+    ASSERT_EQ(diff.size(), 25000);
+    for (std::size_t i = 0; i < diff.size(); i++)
+    {
+        ASSERT_EQ(diff[i].score_, static_cast<int>(i));
+    }
+    CheckWhat("zset diff");
+
+    // weights and sums saturate at the int range
+    ZSet big, neg;
+    big.Add(100000, {std::string("m")});
+    big.Add(std::numeric_limits<int>::max() - 1, {std::string("top")});
+    neg.Add(-100000, {std::string("m")});
+    auto weighted = ZSetCombine(ZStoreOp::UNION, {&big}, {100000}, ZAggregate::SUM);
+    ASSERT_EQ(weighted.size(), 2);
+    ASSERT_EQ(weighted[0].score_, std::numeric_limits<int>::max());
+    ASSERT_EQ(weighted[1].score_, std::numeric_limits<int>::max());
+    auto summed = ZSetCombine(ZStoreOp::UNION, {&big, &big}, {}, ZAggregate::SUM);
+    ASSERT_EQ(summed[0].score_, 200000);
+    ASSERT_EQ(summed[1].score_, std::numeric_limits<int>::max());
+    auto low = ZSetCombine(ZStoreOp::UNION, {&neg, &neg, &neg}, {100000, 100000, 100000}, ZAggregate::SUM);
+    ASSERT_EQ(low[0].score_, std::numeric_limits<int>::min());
+    CheckWhat("zset saturated scores");
+
+    ZSet c;
+    c.BulkLoad(std::move(inter));
+    ASSERT_EQ(c.Card(), 25000);
+    ASSERT_EQ(c.Rank({std::to_string(25000)}), "0");
+    CheckWhat("zset bulk load");
+    CheckWhat("\n");
+}
+
+TEST(Structs, ZSetPopAndLimit)
+{
+    using namespace rds;
+    for (int n : {10, 1000})
+    {
+        ZSet s;
+        for (int i = 0; i < n; i++)
+        {
+            s.Add(i, {std::to_string(i)});
+        }
+        auto lim = s.RangeByScore(2, n, 3, 4);
+        ASSERT_EQ(lim.size(), 4);
+        ASSERT_EQ(lim[0].second, 5);
+        ASSERT_EQ(lim[3].second, 8);
+        ASSERT_TRUE(s.RangeByScore(0, n, n, 1).empty());
+        auto lex = s.RangeByLex({std::string("0")}, {std::string("9")}, 1, 2);
+        ASSERT_EQ(lex.size(), 2);
+        ASSERT_EQ(lex[0].first, Str(std::string("1")));
+
+        auto mins = s.PopMin(3);
+        ASSERT_EQ(mins.size(), 3);
+        ASSERT_EQ(mins[2].second, 2);
+        auto maxs = s.PopMax(2);
+        ASSERT_EQ(maxs.size(), 2);
+        ASSERT_EQ(maxs[0].second, n - 1);
+        ASSERT_EQ(maxs[1].second, n - 2);
+        ASSERT_EQ(s.Card(), static_cast<std::size_t>(n - 5));
+        ASSERT_EQ(s.Rank({std::to_string(3)}), "0");
+
+        // lex ranges follow pops, score changes, copies and moves
+        ASSERT_EQ(s.LexCount({std::string("1")}, {std::string("1")}), 0);
+        ASSERT_EQ(s.LexCount({std::string("3")}, {std::string("3")}), 1);
+        s.IncrBy(100000, {std::string("5")});
+        ZSet copy(s);
+        ZSet moved(std::move(copy));
+        for (auto *z : {&s, &moved})
+        {
+            ASSERT_EQ(z->LexCount({std::string("3")}, {std::string("5")}), n == 10 ? 3 : 223);
+            auto page = z->RangeByLex({std::string("4")}, {std::string("7~")}, 1, 3);
+            ASSERT_EQ(page.size(), 3);
+            ASSERT_EQ(page[0].first, Str(std::string(n == 10 ? "5" : "40")));
+            ASSERT_EQ(page[2].second, n == 10 ? 7 : 401);
+        }
+        ASSERT_EQ(s.PopMin(n).size(), static_cast<std::size_t>(n - 5));
+        ASSERT_EQ(s.Card(), 0);
+    }
+    CheckWhat("zset pop and limit");
+    CheckWhat("\n");
+}
+
+TEST(Structs, HyperLogLog)
+{
+    using namespace rds;
+
+    HyperLogLog a;
+    HyperLogLog b;
+    for (int i = 0; i < 300; i++)
+    {
+        a.Add("user:" + std::to_string(i));
+    }
+    ASSERT_EQ(a.GetEncodingType(), EncodingType::HLL_SPARSE);
+    ASSERT_FALSE(a.Add("user:7"));
+    ASSERT_NEAR(a.Count(), 300, 300 * 0.02);
+
+    for (int i = 0; i < 100000; i++)
+    {
+        a.Add("user:" + std::to_string(i));
+        b.Add("user:" + std::to_string(i + 50000));
+    }
+    ASSERT_EQ(a.GetEncodingType(), EncodingType::HLL_DENSE);
+    ASSERT_NEAR(a.Count(), 100000, 100000 * 0.02);
+    ASSERT_NEAR(HyperLogLogCount({&a, &b, nullptr}), 150000, 150000 * 0.02);
+
+    std::string ev = a.EncodeValue();
+    ASSERT_EQ(ev.size(), HyperLogLog::DENSE_BYTES + 1);
+    Cursor cache(ev);
+    HyperLogLog dcd;
+    dcd.DecodeValue(&cache);
+    ASSERT_TRUE(cache.empty());
+    ASSERT_EQ(dcd.Count(), a.Count());
+
+    // a merge that stays small is kept sparse
+    HyperLogLog small;
+    small.Add("x");
+    HyperLogLog::Registers registers{};
+    small.MergeInto(&registers);
+    HyperLogLog merged;
+    merged.Import(registers);
+    ASSERT_EQ(merged.GetEncodingType(), EncodingType::HLL_SPARSE);
+    ASSERT_EQ(merged.Count(), 1);
+    ev = merged.EncodeValue();
+    cache = Cursor(ev);
+    dcd.DecodeValue(&cache);
+    ASSERT_EQ(dcd.GetEncodingType(), EncodingType::HLL_SPARSE);
+    ASSERT_EQ(dcd.Count(), 1);
+}
+
+TEST(Structs, Bloom)
+{
+    using namespace rds;
+
+    BloomFilter bf;
+    ASSERT_TRUE(bf.Reserve(0.01, 10000, 2, true));
+    std::vector<std::string> members;
+    std::vector<std::string> others;
+    for (int i = 0; i < 10000; i++)
+    {
+        members.push_back("member:" + std::to_string(i));
+        others.push_back("other:" + std::to_string(i));
+    }
+    auto added = bf.Add(members);
+    ASSERT_EQ(bf.Layers(), 1);
+    ASSERT_FALSE(bf.Reserve(0.1, 10, 2, true));
+
+    auto hit = bf.Exists(members);
+    ASSERT_EQ(std::count(hit.begin(), hit.end(), true), 10000);
+    auto miss = bf.Exists(others);
+    auto false_positive = std::count(miss.begin(), miss.end(), true);
+    std::cout << "bloom false positive: " << false_positive << "/10000, " << bf.Bytes() << " bytes" << std::endl;
+    ASSERT_LT(false_positive, 150);
+
+    // growing past the capacity stacks layers without losing members
+    for (int i = 0; i < 50000; i++)
+    {
+        others[i % 10000] = "grow:" + std::to_string(i);
+        if (i % 10000 == 9999)
+        {
+            bf.Add(others);
+        }
+    }
+    ASSERT_GT(bf.Layers(), 1);
+    hit = bf.Exists(members);
+    ASSERT_EQ(std::count(hit.begin(), hit.end(), true), 10000);
+
+    std::string ev = bf.EncodeValue();
+    Cursor cache(ev);
+    BloomFilter dcd;
+    dcd.DecodeValue(&cache);
+    ASSERT_TRUE(cache.empty());
+    ASSERT_EQ(dcd.Layers(), bf.Layers());
+    ASSERT_EQ(dcd.Size(), bf.Size());
+    ASSERT_EQ(dcd.Exists(members), hit);
+
+    BloomFilter fixed;
+    fixed.Reserve(0.01, 2, 2, false);
+    ASSERT_EQ(fixed.Add({"a", "b", "c"}), (std::vector<int>{1, 1, -1}));
+}
+
+TEST(Structs, Stream)
+{
+    using namespace rds;
+
+    Stream st;
+    for (std::uint64_t i = 1; i <= 1000; i++)
+    {
+        auto id = st.Add(StreamID{i / 10, i % 10}, {"field", std::to_string(i)});
+        ASSERT_TRUE(id.has_value());
+    }
+    ASSERT_FALSE(st.Add(StreamID{5, 0}, {"f", "v"}).has_value());
+    ASSERT_EQ(st.Len(), 1000);
+    ASSERT_EQ(st.LastID(), (StreamID{100, 0}));
+    ASSERT_GT(st.Blocks(), 1);
+
+    auto range = st.Range({20, 5}, {30, 4});
+    ASSERT_EQ(range.size(), 100);
+    ASSERT_EQ(range.front().id_, (StreamID{20, 5}));
+    ASSERT_EQ(range.back().fields_[1], "304");
+    auto rev = st.RevRange(StreamID::Max(), {}, 3);
+    ASSERT_EQ(rev.size(), 3);
+    ASSERT_EQ(rev[2].id_, (StreamID{99, 8}));
+    ASSERT_EQ(st.Range(*StreamID::Parse("7", false), *StreamID::Parse("7", true)).size(), 10);
+
+    // approximate trimming only drops whole blocks
+    auto removed = st.Trim(900, true);
+    ASSERT_EQ(st.Len(), 1000 - removed);
+    ASSERT_GE(st.Len(), 900);
+    ASSERT_EQ(st.Trim(900, false) + removed, 100);
+    ASSERT_EQ(st.Len(), 900);
+    ASSERT_EQ(st.Range({}, StreamID::Max(), 1)[0].id_, (StreamID{10, 1}));
+
+    std::string ev = st.EncodeValue();
+    Cursor cache(ev);
+    Stream dcd;
+    dcd.DecodeValue(&cache);
+    ASSERT_TRUE(cache.empty());
+    ASSERT_EQ(dcd.Len(), 900);
+    ASSERT_EQ(dcd.LastID(), st.LastID());
+    ASSERT_EQ(dcd.RevRange(StreamID::Max(), {}).size(), 900);
+    ASSERT_FALSE(dcd.Add(StreamID{100, 0}, {"f", "v"}).has_value());
+}
+
+TEST(Structs, TimeSeries)
+{
+    using namespace rds;
+
+    TimeSeries ts;
+    std::vector<TimeSeries::Sample> samples;
+    std::int64_t t = 1'600'000'000'000;
+    for (int i = 0; i < 10000; i++)
+    {
+        t += i % 100 == 0 ? 1000 + i % 7 : 1000; // mostly regular with some jitter
+        double v = i % 3 == 0 ? 42.0 : 20.0 + (i % 50) * 0.25;
+        samples.emplace_back(t, v);
+        ASSERT_TRUE(ts.Add(t, v));
+    }
+    ASSERT_FALSE(ts.Add(t, 1.0));
+    ASSERT_FALSE(ts.Add(t - 1, 1.0));
+    ASSERT_EQ(ts.Size(), 10000);
+    ASSERT_EQ(ts.Range(std::numeric_limits<std::int64_t>::min(), std::numeric_limits<std::int64_t>::max()), samples);
+    std::cout << "timeseries: 10000 samples in " << ts.Bytes() << " bytes, " << ts.Chunks() << " chunks" << std::endl;
+    ASSERT_LT(ts.Bytes(), 10000 * 4);
+
+    auto part = ts.Range(samples[5000].first, samples[5009].first);
+    ASSERT_EQ(part.size(), 10);
+    ASSERT_EQ(part[0], samples[5000]);
+
+    // 10 second buckets over regular 1 second samples
+    TimeSeries reg;
+    for (int i = 0; i < 100; i++)
+    {
+        reg.Add(i * 1000, i);
+    }
+    auto avg = reg.Aggregate(0, 99'999, Aggregation::AVG, 10'000);
+    ASSERT_EQ(avg.size(), 10);
+    ASSERT_EQ(avg[1], (TimeSeries::Sample{10'000, 14.5}));
+    ASSERT_EQ(reg.Aggregate(0, 99'999, Aggregation::MAX, 10'000)[2].second, 29);
+    ASSERT_EQ(reg.Aggregate(0, 99'999, Aggregation::MIN, 10'000)[2].second, 20);
+    ASSERT_EQ(reg.Aggregate(5'000, 14'999, Aggregation::SUM, 10'000),
+              (std::vector<TimeSeries::Sample>{{0, 5 + 6 + 7 + 8 + 9}, {10'000, 10 + 11 + 12 + 13 + 14}}));
+
+    std::string ev = ts.EncodeValue();
+    Cursor cache(ev);
+    TimeSeries dcd;
+    dcd.DecodeValue(&cache);
+    ASSERT_TRUE(cache.empty());
+    ASSERT_EQ(dcd.Size(), 10000);
+    ASSERT_TRUE(dcd.Add(t + 1000, 7.5));
+    samples.emplace_back(t + 1000, 7.5);
+    ASSERT_EQ(dcd.Range(0, std::numeric_limits<std::int64_t>::max()), samples);
+
+    // retention drops whole chunks and hides older samples
+    dcd.SetRetention(1000 * 1000);
+    ASSERT_LT(dcd.Size(), 10001);
+    auto kept = dcd.Range(0, std::numeric_limits<std::int64_t>::max());
+    ASSERT_GE(kept.front().first, t + 1000 - 1000 * 1000);
+    ASSERT_GT(kept.size(), 990);
+    ASSERT_EQ(kept.back(), samples.back());
+}
+
+TEST(Structs, VectorSet)
+{
+    using namespace rds;
+
+    std::mt19937 gen(7);
+    std::normal_distribution<float> normal;
+    auto randomVector = [&](std::size_t dim)
+    {
+        std::vector<float> v(dim);
+        for (auto &x : v)
+        {
+            x = normal(gen);
+        }
+        return v;
+    };
+
+    CheckWhat(std::string("vector kernels: ") + VecOpsImplementation());
+    auto a = randomVector(37);
+    auto b = randomVector(37);
+    float dot = 0;
+    float l2 = 0;
+    for (int i = 0; i < 37; i++)
+    {
+        dot += a[i] * b[i];
+        l2 += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+    ASSERT_NEAR(DotF32(a.data(), b.data(), 37), dot, 1e-4);
+    ASSERT_NEAR(L2F32(a.data(), b.data(), 37), l2, 1e-4);
+    std::vector<std::int8_t> qa(37);
+    std::vector<std::int8_t> qb(37);
+    std::int32_t qdot = 0;
+    for (int i = 0; i < 37; i++)
+    {
+        qa[i] = static_cast<std::int8_t>(i * 7 - 127);
+        qb[i] = static_cast<std::int8_t>(127 - i * 5);
+        qdot += qa[i] * qb[i];
+    }
+    ASSERT_EQ(DotI8(qa.data(), qb.data(), 37), qdot);
+
+    // the graph against a brute force scan
+    VectorSet vs;
+    vs.Configure(VectorMetric::L2, VectorQuant::FP32);
+    const std::size_t n = 1200;
+    for (std::size_t i = 0; i < n; i++)
+    {
+        ASSERT_EQ(vs.Add("v" + std::to_string(i), randomVector(16)), 1);
+    }
+    ASSERT_EQ(vs.Add("v0", randomVector(16)), 0);
+    ASSERT_EQ(vs.Add("bad", randomVector(15)), -1);
+    ASSERT_EQ(vs.Card(), n);
+    std::size_t hits = 0;
+    for (int q = 0; q < 50; q++)
+    {
+        auto query = randomVector(16);
+        auto approx = vs.Search(query, 10);
+        auto exact = vs.Search(query, 10, VectorSet::EF_SEARCH, true);
+        ASSERT_EQ(exact.size(), 10);
+        for (auto &r : approx)
+        {
+            hits += std::count_if(exact.begin(), exact.end(), [&r](const VectorSet::Result &e)
+                                  { return e.first == r.first; });
+        }
+    }
+    std::cout << "hnsw recall@10: " << hits / 500.0 << std::endl;
+    ASSERT_GT(hits, 450);
+
+    for (std::size_t i = 0; i < n; i += 2)
+    {
+        ASSERT_TRUE(vs.Remove("v" + std::to_string(i)));
+    }
+    ASSERT_FALSE(vs.Remove("v0"));
+    ASSERT_EQ(vs.Card(), n / 2);
+    auto res = vs.SearchElement("v1", 5);
+    ASSERT_TRUE(res.has_value());
+    ASSERT_EQ(res.value()[0].first, "v1");
+    ASSERT_FLOAT_EQ(res.value()[0].second, 0);
+
+    std::string ev = vs.EncodeValue();
+    Cursor cache(ev);
+    VectorSet dcd;
+    dcd.DecodeValue(&cache);
+    ASSERT_TRUE(cache.empty());
+    ASSERT_EQ(dcd.Card(), n / 2);
+    auto query = randomVector(16);
+    ASSERT_EQ(dcd.Search(query, 10), vs.Search(query, 10));
+
+    // quantized cosine keeps the order of clearly separated neighbours
+    VectorSet q8;
+    ASSERT_EQ(q8.Add("x", {1, 0, 0, 0}), 1);
+    ASSERT_EQ(q8.Add("xy", {1, 1, 0, 0}), 1);
+    ASSERT_EQ(q8.Add("y", {0, 3, 0, 0}), 1);
+    ASSERT_EQ(q8.Add("-x", {-2, 0, 0, 0}), 1);
+    auto sim = q8.Search({5, 0.5, 0, 0}, 4);
+    ASSERT_EQ(sim.size(), 4);
+    ASSERT_EQ(sim[0].first, "x");
+    ASSERT_EQ(sim[1].first, "xy");
+    ASSERT_EQ(sim[3].first, "-x");
+    ASSERT_NEAR(sim[3].second, -0.995, 0.01);
+}
+
+TEST(Structs, Sketches)
+{
+    using namespace rds;
+
+    // item i shows up 1000 / (i + 1) times
+    std::vector<std::pair<std::string, std::uint32_t>> batch;
+    std::vector<std::string> stream;
+    std::uint64_t total = 0;
+    for (int i = 0; i < 2000; i++)
+    {
+        std::uint32_t n = 1000 / (i + 1) + 1;
+        batch.emplace_back("item:" + std::to_string(i), n);
+        total += n;
+        for (std::uint32_t j = 0; j < n; j++)
+        {
+            stream.push_back(batch.back().first);
+        }
+    }
+    std::shuffle(stream.begin(), stream.end(), std::mt19937(11));
+
+    CountMinSketch cms;
+    cms.InitByProb(0.001, 0.01);
+    ASSERT_EQ(cms.Width(), 2719);
+    ASSERT_EQ(cms.Depth(), 5);
+    cms.IncrBy(batch);
+    ASSERT_EQ(cms.Total(), total);
+    std::vector<std::string> items;
+    for (auto &b : batch)
+    {
+        items.push_back(b.first);
+    }
+    auto estimates = cms.Query(items);
+    std::size_t over_bound = 0;
+    for (std::size_t i = 0; i < batch.size(); i++)
+    {
+        ASSERT_GE(estimates[i], batch[i].second);
+        over_bound += estimates[i] - batch[i].second > 0.001 * total;
+    }
+    ASSERT_LE(over_bound, 20);
+
+    CountMinSketch doubled;
+    doubled.InitByDim(cms.Width(), cms.Depth());
+    ASSERT_TRUE(doubled.Merge({&cms, &cms}, {3, -1}));
+    auto twice = doubled.Query(items);
+    for (std::size_t i = 0; i < items.size(); i++)
+    {
+        ASSERT_EQ(twice[i], 2 * estimates[i]);
+    }
+    CountMinSketch narrow;
+    narrow.InitByDim(10, 5);
+    ASSERT_FALSE(narrow.Merge({&cms}, {1}));
+
+    std::string ev = cms.EncodeValue();
+    Cursor cache(ev);
+    CountMinSketch cms_dcd;
+    cms_dcd.DecodeValue(&cache);
+    ASSERT_TRUE(cache.empty());
+    ASSERT_EQ(cms_dcd.Query(items), estimates);
+
+    // the heavy hitters of the same stream
+    TopK topk;
+    topk.Reserve(10, 100, 5, 0.9);
+    std::size_t expelled = 0;
+    for (std::size_t i = 0; i < stream.size(); i += 1000)
+    {
+        std::vector<std::string> part(stream.begin() + i, stream.begin() + std::min(stream.size(), i + 1000));
+        for (auto &e : topk.Add(part))
+        {
+            expelled += e.has_value();
+        }
+    }
+    auto list = topk.List();
+    ASSERT_EQ(list.size(), 10);
+    std::size_t found = 0;
+    for (int i = 0; i < 10; i++)
+    {
+        found += std::count_if(list.begin(), list.end(), [i](const TopK::Item &e)
+                               { return e.first == "item:" + std::to_string(i); });
+    }
+    std::cout << "topk: " << found << "/10 heavy hitters, " << expelled << " expelled" << std::endl;
+    ASSERT_GE(found, 9);
+    ASSERT_EQ(list[0].first, "item:0");
+    ASSERT_EQ(topk.Query({"item:0", "item:1999"}), (std::vector<bool>{true, false}));
+
+    ev = topk.EncodeValue();
+    cache = Cursor(ev);
+    TopK topk_dcd;
+    topk_dcd.DecodeValue(&cache);
+    ASSERT_TRUE(cache.empty());
+    ASSERT_EQ(topk_dcd.List(), list);
+
+    // the decay draws go on where they were, a replay after a load matches the live state
+    std::vector<std::string> more(stream.begin(), stream.begin() + std::min<std::size_t>(stream.size(), 5000));
+    ASSERT_EQ(topk.Add(more), topk_dcd.Add(more));
+    ASSERT_EQ(topk.EncodeValue(), topk_dcd.EncodeValue());
+
+    // written before the rng was kept
+    std::uint32_t k = 0;
+    std::memcpy(&k, ev.data(), sizeof(k));
+    k &= ~(std::uint32_t{1} << 31);
+    std::string legacy = ev.substr(0, ev.size() - sizeof(std::uint64_t));
+    std::memcpy(legacy.data(), &k, sizeof(k));
+    cache = Cursor(legacy);
+    TopK topk_old;
+    topk_old.DecodeValue(&cache);
+    ASSERT_TRUE(cache.empty());
+    ASSERT_EQ(topk_old.List(), list);
+}
+
 TEST(Structs, Hash)
 {
     using namespace rds;
@@ -345,8 +1166,7 @@ TEST(Structs, Hash)
         s.Set(str, str);
     }
     std::string ev = s.EncodeValue();
-    std::deque<char> cache;
-    std::copy(std::cbegin(ev), std::cend(ev), std::back_inserter(cache));
+    Cursor cache(ev);
 
     Hash s2;
     s2.DecodeValue(&cache);
@@ -365,4 +1185,122 @@ TEST(Structs, Hash)
     }
     CheckWhat("hash en-de-code");
     CheckWhat("\n");
-}
\ No newline at end of file
+}
+
+TEST(Structs, HashSharedFields)
+{
+    using namespace rds;
+    std::size_t names = FieldRef::Names();
+    std::vector<std::string> fields{"name", "email", "age", "city"};
+    std::vector<Hash> profiles(100);
+    for (std::size_t i = 0; i < profiles.size(); i++)
+    {
+        for (auto &f : fields)
+        {
+            profiles[i].Set(Str(f), Str(f + std::to_string(i)));
+        }
+    }
+    ASSERT_EQ(FieldRef::Names(), names + fields.size());
+    ASSERT_EQ(profiles[7].SharedFields(), fields.size());
+    ASSERT_EQ(profiles[7].Get(Str(std::string("city"))).GetRaw(), "city7");
+    ASSERT_EQ(profiles[7].IncrBy(Str(std::string("age")), 1), "");
+
+    // long names and fields past the limit stay plain
+    Hash wide;
+    wide.Set(Str(std::string(FIELD_NAME_MAX_LEN + 1, 'x')), Str(std::string("long")));
+    for (std::size_t i = 0; i < Hash::SHARED_FIELDS_MAX + 10; i++)
+    {
+        wide.Set(Str("f" + std::to_string(i)), Str(std::to_string(i)));
+    }
+    ASSERT_EQ(wide.SharedFields(), Hash::SHARED_FIELDS_MAX);
+    ASSERT_EQ(wide.Len(), Hash::SHARED_FIELDS_MAX + 11);
+    ASSERT_EQ(wide.IncrBy(Str(std::string("f70")), 5), "75");
+    wide.Del(Str(std::string("f3")));
+    ASSERT_FALSE(wide.Exist(Str(std::string("f3"))));
+    ASSERT_EQ(wide.Len(), Hash::SHARED_FIELDS_MAX + 10);
+
+    // inside a session every name is written once
+    std::string first, second;
+    {
+        HashFieldSession session;
+        first = profiles[0].EncodeValue();
+        second = profiles[1].EncodeValue();
+    }
+    ASSERT_LT(second.size() + 4 * 4, first.size());
+    std::string both = first + second;
+    Cursor cache(both);
+    Hash d0, d1;
+    {
+        HashFieldSession session;
+        d0.DecodeValue(&cache);
+        d1.DecodeValue(&cache);
+    }
+    ASSERT_TRUE(cache.empty());
+    ASSERT_EQ(d1.SharedFields(), fields.size());
+    ASSERT_EQ(d1.Get(Str(std::string("email"))).GetRaw(), "email1");
+
+    std::string ev = wide.EncodeValue();
+    cache = Cursor(ev);
+    Hash dwide;
+    dwide.DecodeValue(&cache);
+    auto a = wide.GetAll(), b = dwide.GetAll();
+    std::sort(a.begin(), a.end());
+    std::sort(b.begin(), b.end());
+    ASSERT_EQ(a, b);
+
+    // the encoding before shared names still loads
+    std::string legacy = BitsToString(std::size_t{1});
+    legacy.append(Str(std::string("name")).EncodeValue());
+    legacy.append(Str(std::string("old")).EncodeValue());
+    cache = Cursor(legacy);
+    Hash old;
+    old.DecodeValue(&cache);
+    ASSERT_EQ(old.Get(Str(std::string("name"))).GetRaw(), "old");
+
+    profiles.clear();
+    d0 = Hash();
+    d1 = Hash();
+    old = Hash();
+    ASSERT_EQ(FieldRef::Names(), names + wide.SharedFields());
+}
+
+TEST(Structs, HashFieldNamesConcurrent)
+{
+    using namespace rds;
+    std::size_t names = FieldRef::Names();
+    // names taken and dropped at once by many threads, the last release racing an Intern
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++)
+    {
+        threads.emplace_back([t]()
+                             {
+                                 for (int i = 0; i < 20000; i++)
+                                 {
+                                     auto ref = FieldRef::Intern("stress" + std::to_string((i + t) % 4));
+                                     ASSERT_TRUE(ref.has_value());
+                                     FieldRef copy = ref.value();
+                                     ASSERT_EQ(copy.Name().substr(0, 6), "stress");
+                                 } });
+    }
+    for (auto &th : threads)
+    {
+        th.join();
+    }
+    ASSERT_EQ(FieldRef::Names(), names);
+}
+
+TEST(Structs, Crc64)
+{
+    using namespace rds;
+    std::string check = "123456789";
+    ASSERT_EQ(Crc64(0, check.data(), check.size()), 0x995dc9bbdf1939faULL);
+    ASSERT_EQ(Crc64(0, nullptr, 0), 0);
+    // fed in pieces it is the same, whatever the alignment
+    std::string text(1000, '\0');
+    for (std::size_t i = 0; i < text.size(); i++)
+    {
+        text[i] = static_cast<char>(i * 131 + 7);
+    }
+    auto whole = Crc64(0, text.data(), text.size());
+    ASSERT_EQ(Crc64(Crc64(0, text.data(), 333), text.data() + 333, text.size() - 333), whole);
+}
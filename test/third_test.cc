@@ -6,6 +6,8 @@
 #include <gtest/gtest.h>
 #include <server/command.h>
 #include <util.h>
+#include <codec.h>
+#include <random>
 using std::cout;
 using std::endl;
 
@@ -38,3 +40,54 @@ TEST(Third, stoi)
         ASSERT_EQ(val, -i);
     }
 }
+
+TEST(Third, CodecBenchmark)
+{
+    using namespace rds;
+    std::mt19937_64 gen(42);
+    std::string text;
+    while (text.size() < (1 << 20))
+    {
+        text.append("user:" + std::to_string(gen() % 100000) + " name=" + std::to_string(gen() % 1000) + " lzfse field value\n");
+    }
+    std::string repeat(1 << 20, 'a');
+    std::string noise(1 << 20, '\0');
+    for (auto &c : noise)
+    {
+        c = static_cast<char>(gen());
+    }
+    std::vector<std::pair<const char *, const std::string *>> shapes{{"text", &text}, {"repeat", &repeat}, {"random", &noise}};
+    for (auto [name, data] : shapes)
+    {
+        for (std::size_t block : {std::size_t(256), std::size_t(4096), std::size_t(1 << 16)})
+        {
+            std::size_t in = 0;
+            std::size_t out = 0;
+            std::int64_t encode_us = 0;
+            std::int64_t decode_us = 0;
+            for (std::size_t at = 0; at + block <= data->size(); at += block)
+            {
+                std::string_view raw(data->data() + at, block);
+                auto start = UsTime();
+                auto cprs = Compress(raw);
+                encode_us += UsTime() - start;
+                in += block;
+                if (!cprs.has_value())
+                {
+                    out += block;
+                    continue;
+                }
+                out += cprs->size();
+                start = UsTime();
+                auto back = Decompress(cprs.value(), block);
+                decode_us += UsTime() - start;
+                ASSERT_TRUE(back.has_value());
+                ASSERT_EQ(back.value(), raw);
+            }
+            auto mbs = [in](std::int64_t us)
+            { return us == 0 ? 0.0 : double(in) / double(us); };
+            printf("%-6s %6zu B blocks: ratio %.3f, compress %.1f MB/s, decompress %.1f MB/s\n",
+                   name, block, double(out) / double(in), mbs(encode_us), mbs(decode_us));
+        }
+    }
+}